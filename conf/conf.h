@@ -44,6 +44,7 @@ struct config {
   int cli_debug;			/* Tracing of CLI connections and commands */
   int latency_debug;			/* I/O loop tracks duration of each event */
   u32 latency_limit;			/* Events with longer duration are logged (us) */
+  int filter_profile;			/* Filters account executions and time of instructions */
   u32 watchdog_warning;			/* I/O loop watchdog limit for warning (us) */
   u32 watchdog_timeout;			/* Watchdog timeout (in seconds, 0 = disabled) */
   char *err_msg;			/* Parser error message */
@@ -13,7 +13,7 @@
  * You can find sources of the filter language in |filter/|
  * directory. File |filter/config.Y| contains filter grammar and basically translates
  * the source from user into a tree of &f_inst structures. These trees are
- * later interpreted using code in |filter/filter.c|.
+ * compiled to linear code and later executed using code in |filter/filter.c|.
  *
  * A filter is represented by a tree of &f_inst structures, one structure per
  * "instruction". Each &f_inst contains @code, @aux value which is
@@ -21,6 +21,11 @@
  * arguments (@a1, @a2). Some instructions contain pointer(s) to other
  * instructions in their (@a1, @a2) fields.
  *
+ * Before use, the tree is compiled by f_compile() to a linear sequence of
+ * &f_op instructions of a simple stack machine. Arguments are evaluated first
+ * and their values are pushed to a value stack, control structures and
+ * function calls are translated to jumps with precomputed targets.
+ *
  * Filters use a &f_val structure for their data. Each &f_val
  * contains type and value (types are constants prefixed with %T_). Few
  * of the types are special; %T_RETURN can be or-ed with a type to indicate
@@ -33,7 +38,11 @@
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
+#include "lib/buffer.h"
+#include "lib/hash.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/socket.h"
@@ -42,6 +51,7 @@
 #include "nest/route.h"
 #include "nest/protocol.h"
 #include "nest/iface.h"
+#include "nest/cli.h"
 #include "nest/attrs.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
@@ -84,7 +94,7 @@ pm_format(struct f_path_mask *p, buffer *buf)
       break;
 
     case PM_ASN_EXPR:
-      buffer_print(buf, "%u ", f_eval_asn((struct f_inst *) p->val));
+      buffer_print(buf, "%u ", p->val);
       break;
     }
 
@@ -186,7 +196,7 @@ pm_same(struct f_path_mask *m1, struct f_path_mask *m2)
 
     if (m1->kind == PM_ASN_EXPR)
     {
-      if (!i_same((struct f_inst *) m1->val, (struct f_inst *) m2->val))
+      if (!i_same((struct f_inst *) m1->val2, (struct f_inst *) m2->val2))
 	return 0;
     }
     else
@@ -286,7 +296,7 @@ lclist_set_type(struct f_tree *set)
 { return set->from.type == T_LC; }
 
 static int
-clist_match_set(struct adata *clist, struct f_tree *set)
+clist_match_set(struct adata *clist, struct f_tree *set, struct f_set_index *idx)
 {
   if (!clist)
     return 0;
@@ -300,14 +310,14 @@ clist_match_set(struct adata *clist, struct f_tree *set)
 
   while (l < end) {
     v.val.i = *l++;
-    if (find_tree(set, v))
+    if (idx ? set_index_find(idx, v) : !!find_tree(set, v))
       return 1;
   }
   return 0;
 }
 
 static int
-eclist_match_set(struct adata *list, struct f_tree *set)
+eclist_match_set(struct adata *list, struct f_tree *set, struct f_set_index *idx)
 {
   if (!list)
     return 0;
@@ -323,7 +333,7 @@ eclist_match_set(struct adata *list, struct f_tree *set)
   v.type = T_EC;
   for (i = 0; i < len; i += 2) {
     v.val.ec = ec_get(l, i);
-    if (find_tree(set, v))
+    if (idx ? set_index_find(idx, v) : !!find_tree(set, v))
       return 1;
   }
 
@@ -331,7 +341,7 @@ eclist_match_set(struct adata *list, struct f_tree *set)
 }
 
 static int
-lclist_match_set(struct adata *list, struct f_tree *set)
+lclist_match_set(struct adata *list, struct f_tree *set, struct f_set_index *idx)
 {
   if (!list)
     return 0;
@@ -347,7 +357,7 @@ lclist_match_set(struct adata *list, struct f_tree *set)
   v.type = T_LC;
   for (i = 0; i < len; i += 3) {
     v.val.lc = lc_get(l, i);
-    if (find_tree(set, v))
+    if (idx ? set_index_find(idx, v) : !!find_tree(set, v))
       return 1;
   }
 
@@ -355,7 +365,7 @@ lclist_match_set(struct adata *list, struct f_tree *set)
 }
 
 static struct adata *
-clist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos)
+clist_filter(struct linpool *pool, struct adata *list, struct f_val set, struct f_set_index *idx, int pos)
 {
   if (!list)
     return NULL;
@@ -376,7 +386,7 @@ clist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos
   while (l < end) {
     v.val.i = *l++;
     /* pos && member(val, set) || !pos && !member(val, set),  member() depends on tree */
-    if ((tree ? !!find_tree(set.val.t, v) : int_set_contains(set.val.ad, v.val.i)) == pos)
+    if ((tree ? (idx ? set_index_find(idx, v) : !!find_tree(set.val.t, v)) : int_set_contains(set.val.ad, v.val.i)) == pos)
       *k++ = v.val.i;
   }
 
@@ -390,7 +400,7 @@ clist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos
 }
 
 static struct adata *
-eclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos)
+eclist_filter(struct linpool *pool, struct adata *list, struct f_val set, struct f_set_index *idx, int pos)
 {
   if (!list)
     return NULL;
@@ -408,7 +418,7 @@ eclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
   for (i = 0; i < len; i += 2) {
     v.val.ec = ec_get(l, i);
     /* pos && member(val, set) || !pos && !member(val, set),  member() depends on tree */
-    if ((tree ? !!find_tree(set.val.t, v) : ec_set_contains(set.val.ad, v.val.ec)) == pos) {
+    if ((tree ? (idx ? set_index_find(idx, v) : !!find_tree(set.val.t, v)) : ec_set_contains(set.val.ad, v.val.ec)) == pos) {
       *k++ = l[i];
       *k++ = l[i+1];
     }
@@ -424,7 +434,7 @@ eclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
 }
 
 static struct adata *
-lclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos)
+lclist_filter(struct linpool *pool, struct adata *list, struct f_val set, struct f_set_index *idx, int pos)
 {
   if (!list)
     return NULL;
@@ -442,7 +452,7 @@ lclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
   for (i = 0; i < len; i += 3) {
     v.val.lc = lc_get(l, i);
     /* pos && member(val, set) || !pos && !member(val, set),  member() depends on tree */
-    if ((tree ? !!find_tree(set.val.t, v) : lc_set_contains(set.val.ad, v.val.lc)) == pos)
+    if ((tree ? (idx ? set_index_find(idx, v) : !!find_tree(set.val.t, v)) : lc_set_contains(set.val.ad, v.val.lc)) == pos)
       k = lc_copy(k, l+i);
   }
 
@@ -506,13 +516,13 @@ val_in_range(struct f_val v1, struct f_val v2)
     return !!find_tree(v2.val.t, v1);
 
   if (v1.type == T_CLIST)
-    return clist_match_set(v1.val.ad, v2.val.t);
+    return clist_match_set(v1.val.ad, v2.val.t, NULL);
 
   if (v1.type == T_ECLIST)
-    return eclist_match_set(v1.val.ad, v2.val.t);
+    return eclist_match_set(v1.val.ad, v2.val.t, NULL);
 
   if (v1.type == T_LCLIST)
-    return lclist_match_set(v1.val.ad, v2.val.t);
+    return lclist_match_set(v1.val.ad, v2.val.t, NULL);
 
   if (v1.type == T_PATH)
     return as_path_match_set(v1.val.ad, v2.val.t);
@@ -551,309 +561,1711 @@ val_format(struct f_val v, buffer *buf)
   }
 }
 
-static struct rte **f_rte;
-static struct rta *f_old_rta;
-static struct ea_list **f_tmp_attrs;
-static struct linpool *f_pool;
-static struct buffer f_buf;
-static int f_flags;
+#define F_EDITS 4			/* Max number of lists edited at once */
+
+struct f_edit {				/* List attribute edited in place, see f_edit_get() */
+  struct f_inst *what;			/* FI_EA_EDIT instruction, with attribute code and type */
+  struct adata *ad;			/* Sorted elements, without duplicates */
+  uint size;				/* Allocated words */
+  u8 width;				/* Words per element */
+  u8 changed;				/* Elements differ from the attribute value */
+  u8 found;				/* Attribute was defined */
+};
+
+/*
+ * Filter execution state, there are no global variables so several filters
+ * may run concurrently (or nested, see FI_PATHMASK).
+ */
+struct filter_state {
+  struct rte **rte;			/* Route being filtered */
+  struct rta *old_rta;			/* Cached rta replaced by f_rta_cow() */
+  struct ea_list **tmp_attrs;		/* Temporary attributes */
+  struct linpool *pool;			/* Pool for all filter allocations */
+  struct buffer buf;			/* Buffer for print statements */
+  int flags;				/* FF_* flags */
+  struct f_code *prof_code;		/* Code being profiled */
+  struct f_prof *prof_last;		/* Profile of the last executed instruction */
+  u64 prof_time;			/* Time the last instruction started */
+  struct f_edit edits[F_EDITS];		/* Pending edits of list attributes */
+  uint edit_count;
+};
+
+/* Charge the time elapsed since the last instruction started to it */
+static inline void
+f_prof_charge(struct filter_state *fs, struct f_prof *next)
+{
+  u64 now_ticks = f_prof_ticks();
+
+  if (fs->prof_last)
+    fs->prof_last->ticks += now_ticks - fs->prof_time;
+
+  fs->prof_last = next;
+  fs->prof_time = now_ticks;
+}
 
-static inline void f_rte_cow(void)
+static inline void f_rte_cow(struct filter_state *fs)
 {
-  *f_rte = rte_cow(*f_rte);
+  *fs->rte = rte_cow(*fs->rte);
 }
 
 /*
  * rta_cow - prepare rta for modification by filter
  */
 static void
-f_rta_cow(void)
+f_rta_cow(struct filter_state *fs)
 {
-  if (!rta_is_cached((*f_rte)->attrs))
+  if (!rta_is_cached((*fs->rte)->attrs))
     return;
 
   /* Prepare to modify rte */
-  f_rte_cow();
+  f_rte_cow(fs);
 
   /* Store old rta to free it later, it stores reference from rte_cow() */
-  f_old_rta = (*f_rte)->attrs;
+  fs->old_rta = (*fs->rte)->attrs;
 
   /*
    * Get shallow copy of rta. Fields eattrs and nexthops of rta are shared
-   * with f_old_rta (they will be copied when the cached rta will be obtained
+   * with fs->old_rta (they will be copied when the cached rta will be obtained
    * at the end of f_run()), also the lock of hostentry is inherited (we
    * suppose hostentry is not changed by filters).
    */
-  (*f_rte)->attrs = rta_do_cow((*f_rte)->attrs, f_pool);
+  (*fs->rte)->attrs = rta_do_cow((*fs->rte)->attrs, fs->pool);
 }
 
-static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
+/*
+ *	Filter compilation
+ */
 
-#define runtime(x) do { \
-    log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", what->lineno, x); \
-    res.type = T_RETURN; \
-    res.val.i = F_ERROR; \
-    return res; \
-  } while(0)
+/* Internal instructions of compiled code */
+#define FI_VOID		P('f','v')	/* Push void value */
+#define FI_DROP		P('f','d')	/* Drop value from stack */
+#define FI_JUMP		P('j','m')	/* Jump to arg */
+#define FI_JUMP_FALSE	P('j','f')	/* Pop bool, jump to arg if false */
+#define FI_AND		P('j','a')	/* Jump to arg if top is false, pop otherwise */
+#define FI_OR		P('j','o')	/* Jump to arg if top is true, pop otherwise */
+#define FI_BOOL		P('j','b')	/* Check that top is bool */
+#define FI_CONST_BOOL	P('f','b')	/* Push bool arg */
+#define FI_LEAVE	P('f','l')	/* Pop result, return from function */
+#define FI_END		P('f','e')	/* Pop result, finish filter */
+#define FI_PATHMASK	P('f','m')	/* Push path mask with evaluated expressions */
+#define FI_CMP_INT	P('o','c')	/* Relation arg with integer constant in a1 */
+#define FI_MATCH_SET	P('o','m')	/* Match arg with set constant in a1 */
+#define FI_FILTER_SET	P('o','f')	/* Delete or filter clist by set constant in a1 */
+#define FI_EA_CACHED	P('o','e')	/* Read of attribute cached in slot arg */
+#define FI_EA_EDIT	P('o','E')	/* Edit list attribute in place by operation arg */
+
+#define F_FOLD_MAX	3		/* Max number of arguments of folded instruction */
+#define FF_SILENT	0x100		/* Do not log runtime errors, for constant folding */
+
+struct f_block {
+  struct f_inst *body;			/* Function body (or filter root) */
+  uint entry;				/* Offset of compiled body */
+  uint params;				/* Number of parameters, at the frame base */
+  uint depth;				/* Stack depth used by the body itself */
+  uint stack, frames;			/* Stack depth and call nesting including called functions */
+};
+
+struct f_call {
+  uint block, callee;			/* Indexes to blocks */
+  uint depth;				/* Stack depth at the call */
+};
+
+struct f_case {
+  struct f_inst *data;			/* Case body */
+  uint entry;				/* Offset of compiled case body */
+};
+
+struct f_compiler {
+  BUFFER(struct f_op) ops;
+  BUFFER(struct f_block) blocks;
+  BUFFER(struct f_call) calls;
+  BUFFER(struct f_case) cases;		/* Case bodies of switches being compiled */
+  uint block;				/* Block being compiled */
+  uint depth, max_depth;		/* Value stack depth in current block */
+  uint optimized;			/* Number of optimized instructions */
+  uint slots;				/* Number of attribute cache slots */
+  linpool *pool;
+};
+
+#define F_NO_LABEL (~0U)
+
+static void f_compile_chain(struct f_compiler *c, struct f_inst *what, int want);
+static struct f_val f_exec(struct f_code *code, struct filter_state *fs, struct f_val *vars);
+
+static uint
+f_emit(struct f_compiler *c, uint code, struct f_inst *what, uint pop, uint push)
+{
+  BUFFER_PUSH(c->ops) = (struct f_op) { .code = code, .push = push, .i = what };
 
-#define ARG(x,y) \
-	x = interpret(what->y); \
-	if (x.type & T_RETURN) \
-		return x;
+  c->depth = c->depth - pop + push;
+  c->max_depth = MAX(c->max_depth, c->depth);
 
-#define ONEARG ARG(v1, a1.p)
-#define TWOARGS ARG(v1, a1.p) \
-		ARG(v2, a2.p)
-#define TWOARGS_C TWOARGS \
-                  if (v1.type != v2.type) \
-		    runtime( "Can't operate with values of incompatible types" );
-#define ACCESS_RTE \
-  do { if (!f_rte) runtime("No route to access"); } while (0)
+  return c->ops.used - 1;
+}
 
-#define BITFIELD_MASK(what) \
-  (1u << (what->a2.i >> 24))
+static inline void
+f_emit_bool(struct f_compiler *c, struct f_inst *what, uint val)
+{
+  uint j = f_emit(c, FI_CONST_BOOL, what, 0, 1);
+  c->ops.data[j].arg = val;
+}
 
-/**
- * interpret
- * @what: filter to interpret
- *
- * Interpret given tree of filter instructions. This is core function
- * of filter system and does all the hard work.
- *
- * Each instruction has 4 fields: code (which is instruction code),
- * aux (which is extension to instruction code, typically type),
- * arg1 and arg2 - arguments. Depending on instruction, arguments
- * are either integers, or pointers to instruction trees. Common
- * instructions like +, that have two expressions as arguments use
- * TWOARGS macro to get both of them evaluated.
- *
- * &f_val structures are copied around, so there are no problems with
- * memory managment.
- */
-static struct f_val
-interpret(struct f_inst *what)
+static inline void
+f_label(struct f_compiler *c, uint jump)
 {
-  struct symbol *sym;
-  struct f_val v1, v2, res, *vp;
-  unsigned u1, u2;
-  int i;
-  u32 as;
+  c->ops.data[jump].arg = c->ops.used;
+}
 
-  res.type = T_VOID;
-  if (!what)
-    return res;
+static uint
+f_function(struct f_compiler *c, struct f_inst *body)
+{
+  uint i;
 
-  switch(what->code) {
-  case ',':
-    TWOARGS;
-    break;
+  /* Block 0 is the filter root */
+  for (i = 1; i < c->blocks.used; i++)
+    if (c->blocks.data[i].body == body)
+      return i;
 
-/* Binary operators */
-  case '+':
-    TWOARGS_C;
-    switch (res.type = v1.type) {
-    case T_VOID: runtime( "Can't operate with values of type void" );
-    case T_INT: res.val.i = v1.val.i + v2.val.i; break;
-    default: runtime( "Usage of unknown type" );
-    }
-    break;
-  case '-':
-    TWOARGS_C;
-    switch (res.type = v1.type) {
-    case T_VOID: runtime( "Can't operate with values of type void" );
-    case T_INT: res.val.i = v1.val.i - v2.val.i; break;
-    default: runtime( "Usage of unknown type" );
-    }
-    break;
-  case '*':
-    TWOARGS_C;
-    switch (res.type = v1.type) {
-    case T_VOID: runtime( "Can't operate with values of type void" );
-    case T_INT: res.val.i = v1.val.i * v2.val.i; break;
-    default: runtime( "Usage of unknown type" );
-    }
-    break;
-  case '/':
-    TWOARGS_C;
-    switch (res.type = v1.type) {
-    case T_VOID: runtime( "Can't operate with values of type void" );
-    case T_INT: if (v2.val.i == 0) runtime( "Mother told me not to divide by 0" );
-      	        res.val.i = v1.val.i / v2.val.i; break;
-    default: runtime( "Usage of unknown type" );
-    }
-    break;
+  BUFFER_PUSH(c->blocks) = (struct f_block) { .body = body };
+  return i;
+}
 
-  case '&':
-  case '|':
-    ARG(v1, a1.p);
-    if (v1.type != T_BOOL)
-      runtime( "Can't do boolean operation on non-booleans" );
-    if (v1.val.i == (what->code == '|')) {
-      res.type = T_BOOL;
-      res.val.i = v1.val.i;
-      break;
-    }
+static struct f_tree *
+f_compile_cases(struct f_compiler *c, struct f_tree *t, uint base, uint *ends)
+{
+  struct f_tree *n;
+  uint i, j;
 
-    ARG(v2, a2.p);
-    if (v2.type != T_BOOL)
-      runtime( "Can't do boolean operation on non-booleans" );
-    res.type = T_BOOL;
-    res.val.i = v2.val.i;
-    break;
+  if (!t)
+    return NULL;
 
-  case P('m','p'):
-    TWOARGS;
-    if ((v1.type != T_INT) || (v2.type != T_INT))
-      runtime( "Can't operate with value of non-integer type in pair constructor" );
-    u1 = v1.val.i;
-    u2 = v2.val.i;
-    if ((u1 > 0xFFFF) || (u2 > 0xFFFF))
-      runtime( "Can't operate with value out of bounds in pair constructor" );
-    res.val.i = (u1 << 16) | u2;
-    res.type = T_PAIR;
-    break;
+  n = lp_alloc(c->pool, sizeof(struct f_tree));
+  *n = *t;
+  n->left = f_compile_cases(c, t->left, base, ends);
 
-  case P('m','c'):
-    {
-      TWOARGS;
+  /* Bodies are shared by all values of one case item */
+  for (i = base; i < c->cases.used; i++)
+    if (c->cases.data[i].data == t->data)
+      break;
 
-      int check, ipv4_used;
-      u32 key, val;
+  if (i == c->cases.used)
+  {
+    BUFFER_PUSH(c->cases) = (struct f_case) { .data = t->data, .entry = c->ops.used };
+    f_compile_chain(c, t->data, 0);
 
-      if (v1.type == T_INT) {
-	ipv4_used = 0; key = v1.val.i;
-      }
-      else if (v1.type == T_QUAD) {
-	ipv4_used = 1; key = v1.val.i;
-      }
-#ifndef IPV6
-      /* IP->Quad implicit conversion */
-      else if (v1.type == T_IP) {
-	ipv4_used = 1; key = ipa_to_u32(v1.val.px.ip);
-      }
-#endif
-      else
-	runtime("Can't operate with key of non-integer/IPv4 type in EC constructor");
+    /* Chain jumps to the end of switch through their args */
+    j = f_emit(c, FI_JUMP, NULL, 0, 0);
+    c->ops.data[j].arg = *ends;
+    *ends = j;
+  }
 
-      if (v2.type != T_INT)
-	runtime("Can't operate with value of non-integer type in EC constructor");
-      val = v2.val.i;
+  n->data = (void *) (uintptr_t) c->cases.data[i].entry;
+  n->right = f_compile_cases(c, t->right, base, ends);
+  return n;
+}
 
-      /* XXXX */
-      res.type = T_EC;
+static inline int
+f_pm_has_expr(struct f_inst *what)
+{
+  struct f_val *v = what->a1.p;
+  struct f_path_mask *m;
 
-      if (what->aux == EC_GENERIC) {
-	check = 0; res.val.ec = ec_generic(key, val);
-      }
-      else if (ipv4_used) {
-	check = 1; res.val.ec = ec_ip4(what->aux, key, val);
-      }
-      else if (key < 0x10000) {
-	check = 0; res.val.ec = ec_as2(what->aux, key, val);
-      }
-      else {
-	check = 1; res.val.ec = ec_as4(what->aux, key, val);
-      }
+  if (v->type == T_PATH_MASK)
+    for (m = v->val.path_mask; m; m = m->next)
+      if (m->kind == PM_ASN_EXPR)
+	return 1;
 
-      if (check && (val > 0xFFFF))
-	runtime("Can't operate with value out of bounds in EC constructor");
+  return 0;
+}
 
-      break;
-    }
+/*
+ * Path mask expressions (in val2) are compiled separately and evaluated by
+ * FI_PATHMASK instruction, which gets a copy of the mask in a1 with compiled
+ * code in val. The instruction pushes another copy with values in val.
+ */
+static struct f_inst *
+f_compile_pm(struct f_compiler *c, struct f_inst *what)
+{
+  struct f_inst *pm = lp_alloc(c->pool, sizeof(struct f_inst));
+  struct f_path_mask *m, **last = (struct f_path_mask **) &pm->a1.p;
 
-  case P('m','l'):
-    {
-      TWOARGS;
+  *pm = *what;
+  pm->next = NULL;
 
-      /* Third argument hack */
-      struct f_val v3 = interpret(INST3(what).p);
-      if (v3.type & T_RETURN)
-	return v3;
+  for (m = ((struct f_val *) what->a1.p)->val.path_mask; m; m = m->next)
+  {
+    struct f_path_mask *n = lp_alloc(c->pool, sizeof(struct f_path_mask));
+    *n = *m;
 
-      if ((v1.type != T_INT) || (v2.type != T_INT) || (v3.type != T_INT))
-	runtime( "Can't operate with value of non-integer type in LC constructor" );
+    if (m->kind == PM_ASN_EXPR)
+      n->val = (uintptr_t) f_compile((struct f_inst *) m->val2, c->pool);
 
-      res.type = T_LC;
-      res.val.lc = (lcomm) { v1.val.i, v2.val.i, v3.val.i };
+    *last = n;
+    last = &n->next;
+  }
+  *last = NULL;
 
-      break;
-    }
+  return pm;
+}
 
-/* Relational operators */
+/*
+ * Optimizations done during compilation: Pure instructions with constant
+ * arguments are evaluated (folded) to constants, conditions on constants
+ * remove dead branches and relations with an integer constant or match
+ * with a constant set use specialized instructions with the constant inlined
+ * and a fast path for the expected type. Constant sets of communities and
+ * other plain values used for matching or deleting from community lists are
+ * indexed, see build_set_index(), and constant path masks are compiled, see
+ * as_path_compile(). Repeated reads of attributes not modified
+ * by the filter are cached, see f_cache_ea(). Additions to and deletions
+ * from community list attributes are done in place, see f_edit_get().
+ */
 
-#define COMPARE(x) \
-    TWOARGS; \
-    i = val_compare(v1, v2); \
-    if (i==CMP_ERROR) \
-      runtime( "Can't compare values of incompatible types" ); \
-    res.type = T_BOOL; \
-    res.val.i = (x); \
-    break;
+static inline int
+f_pure(uint code)
+{
+  switch (code)
+  {
+  case '+': case '-': case '*': case '/':
+  case P('m','p'): case P('m','c'): case P('m','l'):
+  case P('!','='): case P('=','='): case '<': case P('<','='):
+  case '!': case '~': case P('!','~'): case P('d','e'):
+  case 'L': case P('c','p'): case P('i','M'):
+  case P('a','f'): case P('a','l'): case P('a','L'):
+    return 1;
 
-#define SAME(x) \
-    TWOARGS; \
-    i = val_same(v1, v2); \
-    res.type = T_BOOL; \
-    res.val.i = (x); \
-    break;
+  default:
+    return 0;
+  }
+}
 
-  case P('!','='): SAME(!i);
-  case P('=','='): SAME(i);
-  case '<': COMPARE(i==-1);
-  case P('<','='): COMPARE(i!=1);
+/* Evaluate a piece of constant code, returns 0 on runtime error */
+static int
+f_eval_ops(struct f_compiler *c, struct f_op *ops, uint n, struct f_val *res)
+{
+  struct {
+    struct f_code code;
+    struct f_op ops[F_FOLD_MAX + 2];
+  } fc = { .code = { .len = n + 1, .stack = n } };
 
-  case '!':
-    ONEARG;
-    if (v1.type != T_BOOL)
-      runtime( "Not applied to non-boolean" );
-    res = v1;
-    res.val.i = !res.val.i;
-    break;
+  struct filter_state fs = { .pool = c->pool, .flags = FF_SILENT };
 
-  case '~':
-    TWOARGS;
-    res.type = T_BOOL;
-    res.val.i = val_in_range(v1, v2);
-    if (res.val.i == CMP_ERROR)
-      runtime( "~ applied on unknown type pair" );
-    res.val.i = !!res.val.i;
-    break;
+  memcpy(fc.ops, ops, n * sizeof(struct f_op));
+  fc.ops[n] = (struct f_op) { .code = FI_END };
 
-  case P('!','~'):
-    TWOARGS;
-    res.type = T_BOOL;
-    res.val.i = val_in_range(v1, v2);
-    if (res.val.i == CMP_ERROR)
-      runtime( "!~ applied on unknown type pair" );
-    res.val.i = !res.val.i;
-    break;
+  *res = f_exec(&fc.code, &fs, NULL);
+  return !(res->type & T_RETURN);
+}
 
-  case P('d','e'):
-    ONEARG;
-    res.type = T_BOOL;
-    res.val.i = (v1.type != T_VOID);
-    break;
+/* Value of constant instruction at @pos, which must be the only one up to @end */
+static int
+f_const(struct f_compiler *c, uint pos, uint end, struct f_val *v)
+{
+  struct f_op *op = &c->ops.data[pos];
 
-  /* Set to indirect value, a1 = variable, a2 = value */
-  case 's':
-    ARG(v2, a2.p);
-    sym = what->a1.p;
-    vp = sym->def;
-    if ((sym->class != (SYM_VARIABLE | v2.type)) && (v2.type != T_VOID)) {
-#ifndef IPV6
-      /* IP->Quad implicit conversion */
-      if ((sym->class == (SYM_VARIABLE | T_QUAD)) && (v2.type == T_IP)) {
-	vp->type = T_QUAD;
-	vp->val.i = ipa_to_u32(v2.val.px.ip);
-	break;
-      }
-#endif
-      runtime( "Assigning to variable of incompatible type" );
-    }
-    *vp = v2;
-    break;
+  if ((end != pos + 1) || !op->push || ((op->code != 'c') && (op->code != 'C')))
+    return 0;
 
-    /* some constants have value in a2, some in *a1.p, strange. */
+  return f_eval_ops(c, op, 1, v);
+}
+
+/* Returns value of bool constant compiled from @pos, or -1 */
+static int
+f_const_bool(struct f_compiler *c, uint pos)
+{
+  struct f_val v;
+
+  if (!f_const(c, pos, c->ops.used, &v) || (v.type != T_BOOL))
+    return -1;
+
+  return !!v.val.i;
+}
+
+static inline void
+f_drop_last(struct f_compiler *c)
+{
+  c->ops.used--;
+  c->depth--;
+}
+
+static struct f_inst *
+f_new_const(struct f_compiler *c, struct f_inst *what, struct f_val *v)
+{
+  struct f_inst *i = lp_alloc(c->pool, sizeof(struct f_inst));
+  struct f_val *val = lp_alloc(c->pool, sizeof(struct f_val));
+
+  *val = *v;
+  *i = (struct f_inst) { .code = 'C', .a1 = { .p = val }, .lineno = what->lineno };
+
+  return i;
+}
+
+/* Replace pure instruction with all @n arguments constant by its value */
+static int
+f_fold(struct f_compiler *c, struct f_inst *what, uint mark, uint n, int want)
+{
+  struct f_op ops[F_FOLD_MAX + 1];
+  struct f_val v;
+  uint i;
+
+  if (!f_pure(what->code) || (c->ops.used - mark != n))
+    return 0;
+
+  for (i = 0; i < n; i++)
+  {
+    ops[i] = c->ops.data[mark + i];
+    if (!ops[i].push || ((ops[i].code != 'c') && (ops[i].code != 'C')))
+      return 0;
+  }
+
+  /* Errors are left for runtime */
+  ops[n] = (struct f_op) { .code = what->code, .push = 1, .i = what };
+  if (!f_eval_ops(c, ops, n + 1, &v))
+    return 0;
+
+  c->ops.used = mark;
+  c->depth -= n;
+  c->optimized++;
+
+  if (want)
+    f_emit(c, 'C', f_new_const(c, what, &v), 0, 1);
+
+  return 1;
+}
+
+/* Inline constant operand of relation or match to a specialized instruction */
+static int
+f_specialize(struct f_compiler *c, struct f_inst *what, uint left, uint right, int want)
+{
+  struct f_inst *sp;
+  struct f_val v;
+  uint code, first, j;
+  void *data;
+
+  switch (what->code)
+  {
+  case P('!','='): case P('=','='): case '<': case P('<','='):
+    code = FI_CMP_INT;
+    break;
+
+  case '~': case P('!','~'):
+    code = FI_MATCH_SET;
+    break;
+
+  case P('C','a'):
+    if (what->aux == 'a')
+      return 0;
+    code = FI_FILTER_SET;
+    break;
+
+  default:
+    return 0;
+  }
+
+  /* Relations with constant on the left side are common, as A > B is B < A */
+  if (f_const(c, right, c->ops.used, &v))
+    first = 0;
+  else if ((code == FI_CMP_INT) && (c->ops.used == right + 1) && f_const(c, left, right, &v))
+    first = 1;
+  else
+    return 0;
+
+  if ((code == FI_CMP_INT) ? (v.type != T_INT) :
+      (code == FI_FILTER_SET) ? (v.type != T_SET) :
+      ((v.type != T_SET) && (v.type != T_PREFIX_SET) && (v.type != T_PATH_MASK)))
+    return 0;
+
+  /* Index of set or compiled path mask */
+  switch (v.type)
+  {
+  case T_SET:		data = build_set_index(v.val.t, c->pool); break;
+  case T_PATH_MASK:	data = as_path_compile(v.val.path_mask, c->pool); break;
+  default:		data = NULL;
+  }
+
+  if ((code == FI_FILTER_SET) && !data)
+    return 0;
+
+  /* Remove the constant, the other operand is just one instruction */
+  if (first)
+    c->ops.data[left] = c->ops.data[right];
+  f_drop_last(c);
+
+  sp = f_new_const(c, what, &v);
+  sp->code = code;
+  sp->aux = (code == FI_FILTER_SET) ? what->aux : first;
+  sp->a2.p = data;
+
+  j = f_emit(c, code, sp, 1, want);
+  c->ops.data[j].arg = what->code;
+  c->optimized++;
+  return 1;
+}
+
+/* Compile A = A.add(x) (or delete, filter) on list attribute A as in-place edit */
+static int
+f_compile_edit(struct f_compiler *c, struct f_inst *what, int want)
+{
+  struct f_inst *ca = what->a1.p, *ea, *ed;
+  struct f_val v;
+  uint mark, j;
+
+  switch (what->aux & EAF_TYPE_MASK)
+  {
+  case EAF_TYPE_INT_SET:
+  case EAF_TYPE_EC_SET:
+  case EAF_TYPE_LC_SET:
+    break;
+
+  default:
+    return 0;
+  }
+
+  /* Edited lists are sorted, protocol marks lists where order is significant */
+  if (what->aux & F_EA_ORDERED)
+    return 0;
+
+  if (!ca || ca->next || (ca->code != P('C','a')))
+    return 0;
+
+  ea = ca->a1.p;
+  if (!ea || ea->next || (ea->code != P('e','a')) || (ea->aux != what->aux) ||
+      ((u16) ea->a2.i != (u16) what->a2.i))
+    return 0;
+
+  mark = c->ops.used;
+  f_compile_chain(c, ca->a2.p, 1);
+
+  ed = lp_alloc(c->pool, sizeof(struct f_inst));
+  *ed = *what;
+  ed->code = FI_EA_EDIT;
+  ed->next = NULL;
+  ed->a1.p = (f_const(c, mark, c->ops.used, &v) && (v.type == T_SET)) ?
+    build_set_index(v.val.t, c->pool) : NULL;
+
+  j = f_emit(c, FI_EA_EDIT, ed, 1, want);
+  c->ops.data[j].arg = ca->aux;
+  c->optimized++;
+  return 1;
+}
+
+static void
+f_compile_inst(struct f_compiler *c, struct f_inst *what, int want)
+{
+  struct f_inst *cond, *par;
+  struct symbol *sym;
+  uint j, k, mark, right;
+  int b;
+
+  switch (what->code) {
+  /* Two arguments */
+  case ',':
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case P('m','p'):
+  case P('m','c'):
+  case P('!','='):
+  case P('=','='):
+  case '<':
+  case P('<','='):
+  case '~':
+  case P('!','~'):
+  case P('i','M'):
+  case P('A','p'):
+  case P('C','a'):
+    mark = c->ops.used;
+    f_compile_chain(c, what->a1.p, 1);
+    right = c->ops.used;
+    f_compile_chain(c, what->a2.p, 1);
+
+    if (f_fold(c, what, mark, 2, want) || f_specialize(c, what, mark, right, want))
+      break;
+
+    f_emit(c, what->code, what, 2, want);
+    break;
+
+  /* One argument */
+  case '!':
+  case P('d','e'):
+  case 'p':
+  case 'L':
+  case P('c','p'):
+  case P('a','f'):
+  case P('a','l'):
+  case P('a','L'):
+  case P('P','S'):
+  case P('a','S'):
+  case P('e','S'):
+  case 'r':
+    if ((what->code == P('e','S')) && f_compile_edit(c, what, want))
+      break;
+
+    mark = c->ops.used;
+    f_compile_chain(c, what->a1.p, 1);
+
+    if (f_fold(c, what, mark, 1, want))
+      break;
+
+    f_emit(c, what->code, what, 1, want);
+    break;
+
+  case 'C':
+    if (f_pm_has_expr(what))
+    {
+      f_emit(c, FI_PATHMASK, f_compile_pm(c, what), 0, want);
+      break;
+    }
+    /* fall through */
+
+  /* No argument */
+  case 'c':
+  case '0':
+  case 'a':
+  case 'P':
+  case P('e','a'):
+  case 'E':
+    f_emit(c, what->code, what, 0, want);
+    break;
+
+  case 'V':
+    /* Arg is the frame slot of the variable */
+    j = f_emit(c, what->code, what, 0, want);
+    c->ops.data[j].arg = ((struct symbol *) what->a1.p)->aux;
+    break;
+
+  case P('c','v'):
+    /* Local variables are allocated on the stack, right after parameters */
+    f_emit(c, what->code, what, 0, 0);
+    for (sym = what->a1.p; sym; sym = sym->aux2)
+      c->depth++;
+    c->max_depth = MAX(c->max_depth, c->depth);
+
+    if (want)
+      f_emit(c, FI_VOID, what, 0, 1);
+    break;
+
+  case P('m','l'):
+    mark = c->ops.used;
+    f_compile_chain(c, what->a1.p, 1);
+    f_compile_chain(c, what->a2.p, 1);
+    f_compile_chain(c, INST3(what).p, 1);
+
+    if (f_fold(c, what, mark, 3, want))
+      break;
+
+    f_emit(c, what->code, what, 3, want);
+    break;
+
+  case 's':
+    f_compile_chain(c, what->a2.p, 1);
+    j = f_emit(c, what->code, what, 1, want);
+    c->ops.data[j].arg = ((struct symbol *) what->a1.p)->aux;
+    break;
+
+  case P('p',','):
+    /* Print list is evaluated just for its side effects */
+    f_compile_chain(c, what->a1.p, 0);
+    f_emit(c, what->code, what, 0, want);
+    break;
+
+  case P('R','C'):
+    if (what->arg1)
+    {
+      f_compile_chain(c, what->a1.p, 1);
+      f_compile_chain(c, what->a2.p, 1);
+      f_emit(c, what->code, what, 2, want);
+    }
+    else
+      f_emit(c, what->code, what, 0, want);
+    break;
+
+  case '&':
+  case '|':
+    mark = c->ops.used;
+    f_compile_chain(c, what->a1.p, 1);
+
+    if ((b = f_const_bool(c, mark)) >= 0)
+    {
+      /* Constant decides, otherwise the result is the second argument */
+      if (b == (what->code == '|'))
+      {
+	if (!want)
+	  f_drop_last(c);
+	break;
+      }
+
+      f_drop_last(c);
+      mark = c->ops.used;
+      f_compile_chain(c, what->a2.p, 1);
+      if (f_const_bool(c, mark) < 0)
+	f_emit(c, FI_BOOL, what, 0, 0);
+      if (!want)
+	f_emit(c, FI_DROP, what, 1, 0);
+      break;
+    }
+
+    j = f_emit(c, (what->code == '&') ? FI_AND : FI_OR, what, 1, 0);
+    f_compile_chain(c, what->a2.p, 1);
+    f_emit(c, FI_BOOL, what, 0, 0);
+    f_label(c, j);
+
+    if (!want)
+      f_emit(c, FI_DROP, what, 1, 0);
+    break;
+
+  case '?':
+    cond = what->a1.p;
+    if (cond && (cond->code == '?') && !cond->next)
+    {
+      /*
+       * IF-THEN-ELSE is represented by nested '?', see config.Y. The value of
+       * the inner '?' is just a flag whether the else-branch should be run.
+       */
+      mark = c->ops.used;
+      f_compile_chain(c, cond->a1.p, 1);
+
+      if ((b = f_const_bool(c, mark)) >= 0)
+      {
+	f_drop_last(c);
+	f_compile_chain(c, b ? cond->a2.p : what->a2.p, 0);
+	if (want)
+	  f_emit_bool(c, what, b);
+	break;
+      }
+
+      j = f_emit(c, FI_JUMP_FALSE, cond, 1, 0);
+      f_compile_chain(c, cond->a2.p, 0);
+      if (want)
+	f_emit_bool(c, what, 1);
+      k = f_emit(c, FI_JUMP, what, 0, 0);
+      c->depth -= !!want;
+
+      f_label(c, j);
+      f_compile_chain(c, what->a2.p, 0);
+      if (want)
+	f_emit_bool(c, what, 0);
+      f_label(c, k);
+      break;
+    }
+
+    mark = c->ops.used;
+    f_compile_chain(c, cond, 1);
+
+    if ((b = f_const_bool(c, mark)) >= 0)
+    {
+      f_drop_last(c);
+      if (b)
+	f_compile_chain(c, what->a2.p, 0);
+      if (want)
+	f_emit_bool(c, what, !b);
+      break;
+    }
+
+    j = f_emit(c, FI_JUMP_FALSE, what, 1, 0);
+    f_compile_chain(c, what->a2.p, 0);
+    if (want)
+    {
+      f_emit_bool(c, what, 0);
+      k = f_emit(c, FI_JUMP, what, 0, 0);
+      c->depth--;
+
+      f_label(c, j);
+      f_emit_bool(c, what, 1);
+      f_label(c, k);
+    }
+    else
+      f_label(c, j);
+    break;
+
+  case P('c','a'):
+    /* Arguments are pushed to become parameters at the base of the callee frame */
+    for (par = what->a1.p; par; par = par->next)
+      f_compile_chain(c, par->a2.p, 1);
+
+    k = f_function(c, what->a2.p);
+    c->blocks.data[k].params = what->aux;
+
+    BUFFER_PUSH(c->calls) = (struct f_call) {
+      .block = c->block,
+      .callee = k,
+      .depth = c->depth - what->aux
+    };
+
+    /* Arg is resolved to function entry in f_compile() */
+    j = f_emit(c, what->code, what, what->aux, want);
+    c->ops.data[j].arg = c->calls.data[c->calls.used - 1].callee;
+    break;
+
+  case P('S','W'):
+    {
+      uint base = c->cases.used;
+      uint ends = F_NO_LABEL;
+
+      f_compile_chain(c, what->a1.p, 1);
+
+      /* Private copy of the instruction with case tree pointing to the code */
+      struct f_inst *sw = lp_alloc(c->pool, sizeof(struct f_inst));
+      *sw = *what;
+      sw->next = NULL;
+      j = f_emit(c, what->code, sw, 1, 0);
+
+      sw->a2.p = f_compile_cases(c, what->a2.p, base, &ends);
+      c->cases.used = base;
+
+      f_label(c, j);
+      for (; ends != F_NO_LABEL; ends = k)
+      {
+	k = c->ops.data[ends].arg;
+	f_label(c, ends);
+      }
+
+      if (want)
+	f_emit(c, FI_VOID, what, 0, 1);
+      break;
+    }
+
+  default:
+    bug( "Unknown instruction %d in compile (%c)", what->code, what->code & 0xff);
+  }
+}
+
+static void
+f_compile_chain(struct f_compiler *c, struct f_inst *what, int want)
+{
+  /* Value of the chain is the value of its last instruction */
+  if (!what)
+  {
+    if (want)
+      f_emit(c, FI_VOID, NULL, 0, 1);
+    return;
+  }
+
+  for (; what; what = what->next)
+    f_compile_inst(c, what, want && !what->next);
+}
+
+static void
+f_block_stack(struct f_compiler *c, uint b)
+{
+  struct f_block *blk = &c->blocks.data[b];
+  uint i;
+
+  if (blk->stack)
+    return;
+
+  /* Functions cannot call themselves, so call graph is acyclic */
+  blk->stack = blk->depth;
+  blk->frames = 0;
+
+  for (i = 0; i < c->calls.used; i++)
+    if (c->calls.data[i].block == b)
+    {
+      struct f_call *call = &c->calls.data[i];
+      struct f_block *fn = &c->blocks.data[call->callee];
+
+      f_block_stack(c, call->callee);
+      blk->stack = MAX(blk->stack, call->depth + fn->stack);
+      blk->frames = MAX(blk->frames, fn->frames + 1);
+    }
+}
+
+struct f_ea_read {
+  int code;				/* Attribute code with bitfield bit */
+  u16 type;
+  uint count, slot;
+};
+
+/*
+ * Attributes are modified only by 'eS' and FI_EA_EDIT instructions. If there is none for an
+ * attribute in the code (including called functions), its value is invariant
+ * during the filter run and repeated reads use a cache slot, which is filled
+ * by the first executed read.
+ */
+static void
+f_cache_ea(struct f_compiler *c)
+{
+  BUFFER(struct f_ea_read) reads;
+  struct f_op *op;
+  uint i, j;
+
+  BUFFER_INIT(reads, &root_pool, 4);
+
+  for (op = c->ops.data; op < c->ops.data + c->ops.used; op++)
+    if (op->code == P('e','a'))
+    {
+      for (j = 0; j < reads.used; j++)
+	if ((reads.data[j].code == op->i->a2.i) && (reads.data[j].type == op->i->aux))
+	  break;
+
+      if (j == reads.used)
+	BUFFER_PUSH(reads) = (struct f_ea_read) { .code = op->i->a2.i, .type = op->i->aux };
+
+      reads.data[j].count++;
+    }
+
+  for (op = c->ops.data; op < c->ops.data + c->ops.used; op++)
+    if ((op->code == P('e','S')) || (op->code == FI_EA_EDIT))
+      for (j = 0; j < reads.used; j++)
+	if ((u16) reads.data[j].code == (u16) op->i->a2.i)
+	  reads.data[j].count = 0;
+
+  for (j = 0; j < reads.used; j++)
+    if (reads.data[j].count > 1)
+      reads.data[j].slot = c->slots++;
+
+  for (i = 0; i < c->ops.used; i++)
+  {
+    op = &c->ops.data[i];
+    if (op->code != P('e','a'))
+      continue;
+
+    for (j = 0; j < reads.used; j++)
+      if ((reads.data[j].code == op->i->a2.i) && (reads.data[j].type == op->i->aux))
+	break;
+
+    if (reads.data[j].count > 1)
+    {
+      op->code = FI_EA_CACHED;
+      op->arg = reads.data[j].slot;
+      c->optimized++;
+    }
+  }
+
+  mb_free(reads.data);
+}
+
+/*
+ * Dependency summary of the code tells what parts of the route are read by
+ * the code and whether the route is modified, so the core may e.g. reuse the
+ * result for routes with the same attributes. Branches removed by compilation
+ * and functions that are never called are not counted.
+ */
+static uint
+f_deps(struct f_compiler *c)
+{
+  struct f_op *op;
+  struct f_path_mask *m;
+  uint deps = 0;
+
+  for (op = c->ops.data; op < c->ops.data + c->ops.used; op++)
+    switch (op->code)
+    {
+    case 'a':
+      switch (op->i->a2.i)
+      {
+      case SA_NET:	deps |= FD_NET; break;
+      case SA_PROTO:
+      case SA_SOURCE:	deps |= FD_SOURCE; break;
+      default:		deps |= FD_ATTRS;
+      }
+      break;
+
+    case P('e','a'):
+    case FI_EA_CACHED:
+      deps |= (op->i->aux & EAF_TEMP) ? FD_RTE : FD_ATTRS;
+      break;
+
+    case 'P':
+      deps |= FD_RTE;
+      break;
+
+    case P('a','S'):
+    case P('P','S'):
+      deps |= FD_WRITE;
+      break;
+
+    case P('e','S'):
+    case FI_EA_EDIT:
+      /* Bitfields and edited lists are based on the old value */
+      deps |= FD_WRITE | ((op->i->aux & EAF_TEMP) ? FD_RTE : FD_ATTRS);
+      break;
+
+    case P('R','C'):
+      /* Without arguments, roa_check() uses the net and the AS path */
+      deps |= FD_EXTERNAL | (op->i->arg1 ? 0 : FD_NET | FD_ATTRS);
+      break;
+
+    case 'p':
+      deps |= FD_OUTPUT;
+      break;
+
+    case P('p',','):
+      /* Plain accept and reject do not print anything */
+      if (op->i->a1.p || ((op->i->a2.i != F_ACCEPT) && (op->i->a2.i != F_REJECT) && (op->i->a2.i != F_ERROR)))
+	deps |= FD_OUTPUT;
+      break;
+
+    case FI_PATHMASK:
+      for (m = op->i->a1.p; m; m = m->next)
+	if (m->kind == PM_ASN_EXPR)
+	  deps |= ((struct f_code *) m->val)->deps;
+      break;
+    }
+
+  return deps;
+}
+
+/**
+ * f_compile - compile filter code
+ * @what: filter instructions
+ * @pool: pool for compiled code
+ *
+ * Translates the tree of filter instructions to a linear sequence of &f_op
+ * instructions operating on a value stack, which is executed by f_exec().
+ * Arguments of each instruction are compiled before the instruction itself,
+ * control structures are replaced by jumps with precomputed targets. Bodies
+ * of called functions are compiled once, after the main code.
+ *
+ * The code is optimized on the way: constant expressions are evaluated,
+ * branches on constant conditions are dropped, relations and matches with
+ * constants use specialized instructions, repeated reads of attributes
+ * not modified by the filter are cached and community list attributes are
+ * edited in place.
+ *
+ * The tree is left intact, it is still used for comparison of filters.
+ * The compiled code gets a summary of its dependencies, see f_deps().
+ */
+struct f_code *
+f_compile(struct f_inst *what, linpool *pool)
+{
+  struct f_compiler c = { .pool = pool };
+  struct f_code *code;
+  uint i, size;
+
+  BUFFER_INIT(c.ops, &root_pool, 32);
+  BUFFER_INIT(c.blocks, &root_pool, 4);
+  BUFFER_INIT(c.calls, &root_pool, 4);
+  BUFFER_INIT(c.cases, &root_pool, 4);
+
+  BUFFER_PUSH(c.blocks) = (struct f_block) { .body = what };
+
+  /* The list of blocks grows as function calls are found */
+  for (c.block = 0; c.block < c.blocks.used; c.block++)
+  {
+    c.depth = c.max_depth = c.blocks.data[c.block].params;
+    c.blocks.data[c.block].entry = c.ops.used;
+    f_compile_chain(&c, c.blocks.data[c.block].body, 1);
+    f_emit(&c, c.block ? FI_LEAVE : FI_END, NULL, 1, 0);
+    c.blocks.data[c.block].depth = c.max_depth;
+  }
+
+  for (i = 0; i < c.ops.used; i++)
+    if (c.ops.data[i].code == P('c','a'))
+      c.ops.data[i].arg = c.blocks.data[c.ops.data[i].arg].entry;
+
+  f_cache_ea(&c);
+  f_block_stack(&c, 0);
+
+  size = c.ops.used * sizeof(struct f_op);
+  code = lp_alloc(pool, sizeof(struct f_code) + size);
+  code->len = c.ops.used;
+  code->stack = c.blocks.data[0].stack;
+  code->frames = c.blocks.data[0].frames;
+  code->slots = c.slots;
+  code->optimized = c.optimized;
+  code->deps = f_deps(&c);
+  code->pool = pool;
+  code->prof = NULL;
+  memcpy(code->ops, c.ops.data, size);
+
+  mb_free(c.ops.data);
+  mb_free(c.blocks.data);
+  mb_free(c.calls.data);
+  mb_free(c.cases.data);
+
+  return code;
+}
+
+/* Profile is allocated when the code is first run with profiling enabled */
+static struct f_code *
+f_prof_init(struct f_code *code)
+{
+  if (!code->prof)
+    code->prof = lp_allocz(code->pool, code->len * sizeof(struct f_prof));
+
+  return code;
+}
+
+static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
+
+#define runtime(x) do { \
+    if (!(fs->flags & FF_SILENT)) \
+      log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", what->lineno, x); \
+    res.type = T_RETURN; \
+    res.val.i = F_ERROR; \
+    return res; \
+  } while(0)
+
+/* Arguments are evaluated in advance and pushed on the stack */
+#define POP(x) x = stack[--sp]
+
+#define ONEARG POP(v1)
+#define TWOARGS POP(v2); \
+		POP(v1)
+#define TWOARGS_C TWOARGS; \
+                  if (v1.type != v2.type) \
+		    runtime( "Can't operate with values of incompatible types" );
+#define ACCESS_RTE \
+  do { if (!fs->rte) runtime("No route to access"); } while (0)
+
+#define BITFIELD_MASK(what) \
+  (1u << (what->a2.i >> 24))
+
+/* Find dynamic attribute in the route or in temporary attributes */
+static eattr *
+f_find_ea(struct filter_state *fs, u16 code)
+{
+  eattr *e = NULL;
+
+  if (!(fs->flags & FF_FORCE_TMPATTR))
+    e = ea_find((*fs->rte)->attrs->eattrs, code);
+  if (!e)
+    e = ea_find((*fs->tmp_attrs), code);
+  if ((!e) && (fs->flags & FF_FORCE_TMPATTR))
+    e = ea_find((*fs->rte)->attrs->eattrs, code);
+
+  return e;
+}
+
+/* Prepare attribute list with one attribute to be set by instruction @what */
+static struct ea_list *
+f_new_ea(struct filter_state *fs, struct f_inst *what)
+{
+  struct ea_list *l = lp_alloc(fs->pool, sizeof(struct ea_list) + sizeof(eattr));
+
+  l->next = NULL;
+  l->flags = EALF_SORTED;
+  l->count = 1;
+  l->attrs[0].id = what->a2.i;
+  l->attrs[0].flags = 0;
+  l->attrs[0].type = (what->aux & ~F_EA_ORDERED) | EAF_ORIGINATED;
+
+  return l;
+}
+
+/* Add attribute list @l to the route, or to temporary attributes */
+static void
+f_store_ea(struct filter_state *fs, struct f_inst *what, struct ea_list *l)
+{
+  if (!(what->aux & EAF_TEMP) && (!(fs->flags & FF_FORCE_TMPATTR))) {
+    f_rta_cow(fs);
+    l->next = (*fs->rte)->attrs->eattrs;
+    (*fs->rte)->attrs->eattrs = l;
+  } else {
+    l->next = (*fs->tmp_attrs);
+    (*fs->tmp_attrs) = l;
+  }
+}
+
+/*
+ * In-place edits of list attributes
+ *
+ * Statements like bgp_community.add(x) are compiled to FI_EA_EDIT, as reading
+ * the attribute, computing a new list and setting it again would copy the
+ * list and add another &ea_list to the route for each such statement. The
+ * list is copied to a scratch buffer by the first edit in a filter run, kept
+ * sorted and without duplicates, and edited there. The attribute is set just
+ * once by f_edit_flush(), when it is read again or when the run is finished.
+ * If no element was changed, the attribute is left intact.
+ */
+
+static inline int
+f_edit_cmp(const u32 *a, const u32 *b, uint w)
+{
+  uint i;
+
+  for (i = 0; i < w; i++)
+    if (a[i] != b[i])
+      return (a[i] > b[i]) ? 1 : -1;
+
+  return 0;
+}
+
+static int f_edit_cmp1(const void *a, const void *b) { return f_edit_cmp(a, b, 1); }
+static int f_edit_cmp2(const void *a, const void *b) { return f_edit_cmp(a, b, 2); }
+static int f_edit_cmp3(const void *a, const void *b) { return f_edit_cmp(a, b, 3); }
+
+static inline u32 *
+f_edit_data(struct f_edit *ed)
+{
+  return (u32 *) ed->ad->data;
+}
+
+static inline uint
+f_edit_len(struct f_edit *ed)
+{
+  return ed->ad->length / sizeof(u32);
+}
+
+static void
+f_edit_alloc(struct filter_state *fs, struct f_edit *ed, uint size)
+{
+  struct adata *ad = lp_alloc(fs->pool, sizeof(struct adata) + size * sizeof(u32));
+
+  ad->length = ed->ad ? ed->ad->length : 0;
+  if (ad->length)
+    memcpy(ad->data, ed->ad->data, ad->length);
+
+  ed->ad = ad;
+  ed->size = size;
+}
+
+/* Set the edited attribute and finish the edit */
+static void
+f_edit_flush(struct filter_state *fs, struct f_edit *ed)
+{
+  if (ed->changed || !ed->found)
+  {
+    struct ea_list *l = f_new_ea(fs, ed->what);
+    l->attrs[0].u.ptr = ed->ad;
+    f_store_ea(fs, ed->what, l);
+  }
+
+  *ed = fs->edits[--fs->edit_count];
+}
+
+/* Finish pending edit of attribute @code, as it is read or set */
+static void
+f_edit_sync(struct filter_state *fs, u16 code, int flush)
+{
+  uint i;
+
+  for (i = 0; i < fs->edit_count; i++)
+    if ((u16) fs->edits[i].what->a2.i == code)
+    {
+      if (flush)
+	f_edit_flush(fs, &fs->edits[i]);
+      else
+	fs->edits[i] = fs->edits[--fs->edit_count];
+      return;
+    }
+}
+
+/* Finish all pending edits at the end of filter run */
+static inline void
+f_edit_finish(struct filter_state *fs)
+{
+  while (fs->edit_count)
+    f_edit_flush(fs, &fs->edits[0]);
+}
+
+/* Find or start edit of list attribute set by instruction @what */
+static struct f_edit *
+f_edit_get(struct filter_state *fs, struct f_inst *what)
+{
+  struct f_edit *ed;
+  u16 code = what->a2.i;
+  uint i, j, w, len;
+
+  for (i = 0; i < fs->edit_count; i++)
+    if ((u16) fs->edits[i].what->a2.i == code)
+      return &fs->edits[i];
+
+  if (fs->edit_count == F_EDITS)
+    f_edit_flush(fs, &fs->edits[0]);
+
+  eattr *e = f_find_ea(fs, code);
+  struct adata *ad = e ? e->u.ptr : NULL;
+
+  switch (what->aux & EAF_TYPE_MASK)
+  {
+  case EAF_TYPE_INT_SET: w = 1; break;
+  case EAF_TYPE_EC_SET: w = 2; break;
+  case EAF_TYPE_LC_SET: w = 3; break;
+  default: bug("Invalid list attribute type");
+  }
+
+  ed = &fs->edits[fs->edit_count++];
+  *ed = (struct f_edit) { .what = what, .ad = ad, .width = w, .found = !!e };
+
+  /* Leave room for some additions */
+  len = ad ? ad->length / sizeof(u32) : 0;
+  f_edit_alloc(fs, ed, len + 8 * w);
+
+  if (len <= w)
+    return ed;
+
+  u32 *data = f_edit_data(ed);
+  qsort(data, len / w, w * sizeof(u32), (w == 1) ? f_edit_cmp1 : (w == 2) ? f_edit_cmp2 : f_edit_cmp3);
+
+  /* Remove duplicates */
+  for (i = j = w; i < len; i += w)
+    if (f_edit_cmp(data + i, data + j - w, w))
+    {
+      memmove(data + j, data + i, w * sizeof(u32));
+      j += w;
+    }
+
+  ed->ad->length = j * sizeof(u32);
+  return ed;
+}
+
+/* Position of element @x in edited list, or position where it would be inserted */
+static uint
+f_edit_find(struct f_edit *ed, const u32 *x, int *found)
+{
+  u32 *data = f_edit_data(ed);
+  uint w = ed->width, lo = 0, hi = f_edit_len(ed) / w;
+
+  while (lo < hi)
+  {
+    uint mid = (lo + hi) / 2;
+    int cmp = f_edit_cmp(data + mid * w, x, w);
+
+    if (!cmp)
+    {
+      *found = 1;
+      return mid * w;
+    }
+
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *found = 0;
+  return lo * w;
+}
+
+static void
+f_edit_add(struct filter_state *fs, struct f_edit *ed, const u32 *x)
+{
+  uint w = ed->width, len = f_edit_len(ed);
+  int found;
+  uint pos = f_edit_find(ed, x, &found);
+
+  if (found)
+    return;
+
+  if (len + w > ed->size)
+    f_edit_alloc(fs, ed, 2 * ed->size);
+
+  u32 *data = f_edit_data(ed);
+  memmove(data + pos + w, data + pos, (len - pos) * sizeof(u32));
+  memcpy(data + pos, x, w * sizeof(u32));
+  ed->ad->length += w * sizeof(u32);
+  ed->changed = 1;
+}
+
+static void
+f_edit_del(struct f_edit *ed, const u32 *x)
+{
+  uint w = ed->width, len = f_edit_len(ed);
+  int found;
+  uint pos = f_edit_find(ed, x, &found);
+
+  if (!found)
+    return;
+
+  u32 *data = f_edit_data(ed);
+  memmove(data + pos, data + pos + w, (len - pos - w) * sizeof(u32));
+  ed->ad->length -= w * sizeof(u32);
+  ed->changed = 1;
+}
+
+/* Keep elements which are (@pos = 1) or are not (@pos = 0) in @set */
+static void
+f_edit_filter(struct f_edit *ed, struct f_val set, struct f_set_index *idx, int pos)
+{
+  u32 *data = f_edit_data(ed);
+  uint w = ed->width, len = f_edit_len(ed);
+  int tree = (set.type == T_SET);	/* 1 -> set is T_SET, 0 -> set is a list */
+  uint i, j;
+  struct f_val v;
+  int member;
+
+  if (w == 1)
+  {
+    if (!tree || !clist_set_type(set.val.t, &v))
+      v.type = T_PAIR;
+  }
+  else
+    v.type = (w == 2) ? T_EC : T_LC;
+
+  for (i = j = 0; i < len; i += w)
+  {
+    u32 *x = data + i;
+
+    switch (w)
+    {
+    case 1: v.val.i = x[0]; break;
+    case 2: v.val.ec = ec_get(x, 0); break;
+    case 3: v.val.lc = lc_get(x, 0); break;
+    }
+
+    if (tree)
+      member = idx ? set_index_find(idx, v) : !!find_tree(set.val.t, v);
+    else
+      member = (w == 1) ? int_set_contains(set.val.ad, v.val.i) :
+	(w == 2) ? ec_set_contains(set.val.ad, v.val.ec) : lc_set_contains(set.val.ad, v.val.lc);
+
+    if (member == pos)
+    {
+      memmove(data + j, x, w * sizeof(u32));
+      j += w;
+    }
+  }
+
+  if (j != len)
+  {
+    ed->ad->length = j * sizeof(u32);
+    ed->changed = 1;
+  }
+}
+
+/* Read dynamic attribute, see FI_EA_CACHED */
+static struct f_val
+f_get_ea(struct filter_state *fs, struct f_inst *what)
+{
+  struct f_val res;
+  u16 code = what->a2.i;
+
+  if (fs->edit_count)
+    f_edit_sync(fs, code, 1);
+
+  eattr *e = f_find_ea(fs, code);
+
+  if (!e) {
+    /* A special case: undefined int_set looks like empty int_set */
+    if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) {
+      res.type = T_CLIST;
+      res.val.ad = adata_empty(fs->pool, 0);
+      return res;
+    }
+
+    /* The same special case for ec_set */
+    if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) {
+      res.type = T_ECLIST;
+      res.val.ad = adata_empty(fs->pool, 0);
+      return res;
+    }
+
+    /* The same special case for lc_set */
+    if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_LC_SET) {
+      res.type = T_LCLIST;
+      res.val.ad = adata_empty(fs->pool, 0);
+      return res;
+    }
+
+    /* Undefined value */
+    res.type = T_VOID;
+    return res;
+  }
+
+  switch (what->aux & EAF_TYPE_MASK) {
+  case EAF_TYPE_INT:
+    res.type = T_INT;
+    res.val.i = e->u.data;
+    break;
+  case EAF_TYPE_ROUTER_ID:
+    res.type = T_QUAD;
+    res.val.i = e->u.data;
+    break;
+  case EAF_TYPE_OPAQUE:
+    res.type = T_ENUM_EMPTY;
+    res.val.i = 0;
+    break;
+  case EAF_TYPE_IP_ADDRESS:
+    res.type = T_IP;
+    struct adata * ad = e->u.ptr;
+    res.val.px.ip = * (ip_addr *) ad->data;
+    break;
+  case EAF_TYPE_AS_PATH:
+    res.type = T_PATH;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_BITFIELD:
+    res.type = T_BOOL;
+    res.val.i = !!(e->u.data & BITFIELD_MASK(what));
+    break;
+  case EAF_TYPE_INT_SET:
+    res.type = T_CLIST;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_EC_SET:
+    res.type = T_ECLIST;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_LC_SET:
+    res.type = T_LCLIST;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_UNDEF:
+    res.type = T_VOID;
+    break;
+  default:
+    bug("Unknown type in e,a");
+  }
+
+  return res;
+}
+
+struct f_frame {
+  uint pc;				/* Return address */
+  uint sp;				/* Stack depth at the call, without arguments */
+  uint push;				/* Push the result */
+  struct f_val *vars;			/* Variables of the caller */
+};
+
+/**
+ * f_exec - execute compiled filter code
+ * @code: code from f_compile()
+ * @fs: filter execution state
+ * @vars: variables of the enclosing code for nested execution, or %NULL
+ *
+ * Execute given compiled filter code. This is core function
+ * of filter system and does all the hard work.
+ *
+ * Instructions are executed in a loop, each one takes its arguments
+ * from the value stack (they were computed by preceding instructions)
+ * and optionally pushes its result. Function calls save the return
+ * address to a separate stack of frames, so nothing in the filter
+ * execution recurses. Both stacks are allocated on the C stack with
+ * sizes computed by f_compile().
+ *
+ * Variables live in the value stack, too. Each filter run and each function
+ * call has its frame of variables, starting with function parameters (pushed
+ * as arguments by the caller), followed by local variables (pushed by the
+ * 'cv' instruction). Instructions address variables by their frame slot, so
+ * no run writes to the shared configuration.
+ *
+ * Each instruction has a code and points to the source &f_inst with
+ * remaining immediate arguments (aux value, typically type, and arg1,
+ * arg2 fields which are not instruction trees).
+ *
+ * &f_val structures are copied around, so there are no problems with
+ * memory managment.
+ */
+static struct f_val
+f_exec(struct f_code *code, struct filter_state *fs, struct f_val *vars)
+{
+  struct f_val stack[code->stack];
+  struct f_frame frames[code->frames + 1];
+  struct f_val ea_cache[code->slots + 1];
+  byte ea_valid[code->slots + 1];
+  uint pc = 0, sp = 0, fp = 0;
+  struct f_inst *what;
+  struct f_op *op;
+  struct f_set_index *idx;
+  struct f_prof *prof = (code == fs->prof_code) ? code->prof : NULL;
+
+  struct symbol *sym;
+  struct f_val v1, v2, res, *vp;
+  unsigned u1, u2;
+  int i;
+  u32 as;
+
+  memset(ea_valid, 0, code->slots);
+
+  if (!vars)
+    vars = stack;
+
+  for (;;)
+  {
+  if (prof)
+  {
+    prof[pc].count++;
+    f_prof_charge(fs, &prof[pc]);
+  }
+
+  op = &code->ops[pc++];
+  what = op->i;
+  res.type = T_VOID;
+
+  switch(op->code) {
+  case ',':
+    TWOARGS;
+    break;
+
+/* Binary operators */
+  case '+':
+    TWOARGS_C;
+    switch (res.type = v1.type) {
+    case T_VOID: runtime( "Can't operate with values of type void" );
+    case T_INT: res.val.i = v1.val.i + v2.val.i; break;
+    default: runtime( "Usage of unknown type" );
+    }
+    break;
+  case '-':
+    TWOARGS_C;
+    switch (res.type = v1.type) {
+    case T_VOID: runtime( "Can't operate with values of type void" );
+    case T_INT: res.val.i = v1.val.i - v2.val.i; break;
+    default: runtime( "Usage of unknown type" );
+    }
+    break;
+  case '*':
+    TWOARGS_C;
+    switch (res.type = v1.type) {
+    case T_VOID: runtime( "Can't operate with values of type void" );
+    case T_INT: res.val.i = v1.val.i * v2.val.i; break;
+    default: runtime( "Usage of unknown type" );
+    }
+    break;
+  case '/':
+    TWOARGS_C;
+    switch (res.type = v1.type) {
+    case T_VOID: runtime( "Can't operate with values of type void" );
+    case T_INT: if (v2.val.i == 0) runtime( "Mother told me not to divide by 0" );
+      	        res.val.i = v1.val.i / v2.val.i; break;
+    default: runtime( "Usage of unknown type" );
+    }
+    break;
+
+  case P('m','p'):
+    TWOARGS;
+    if ((v1.type != T_INT) || (v2.type != T_INT))
+      runtime( "Can't operate with value of non-integer type in pair constructor" );
+    u1 = v1.val.i;
+    u2 = v2.val.i;
+    if ((u1 > 0xFFFF) || (u2 > 0xFFFF))
+      runtime( "Can't operate with value out of bounds in pair constructor" );
+    res.val.i = (u1 << 16) | u2;
+    res.type = T_PAIR;
+    break;
+
+  case P('m','c'):
+    {
+      TWOARGS;
+
+      int check, ipv4_used;
+      u32 key, val;
+
+      if (v1.type == T_INT) {
+	ipv4_used = 0; key = v1.val.i;
+      }
+      else if (v1.type == T_QUAD) {
+	ipv4_used = 1; key = v1.val.i;
+      }
+#ifndef IPV6
+      /* IP->Quad implicit conversion */
+      else if (v1.type == T_IP) {
+	ipv4_used = 1; key = ipa_to_u32(v1.val.px.ip);
+      }
+#endif
+      else
+	runtime("Can't operate with key of non-integer/IPv4 type in EC constructor");
+
+      if (v2.type != T_INT)
+	runtime("Can't operate with value of non-integer type in EC constructor");
+      val = v2.val.i;
+
+      /* XXXX */
+      res.type = T_EC;
+
+      if (what->aux == EC_GENERIC) {
+	check = 0; res.val.ec = ec_generic(key, val);
+      }
+      else if (ipv4_used) {
+	check = 1; res.val.ec = ec_ip4(what->aux, key, val);
+      }
+      else if (key < 0x10000) {
+	check = 0; res.val.ec = ec_as2(what->aux, key, val);
+      }
+      else {
+	check = 1; res.val.ec = ec_as4(what->aux, key, val);
+      }
+
+      if (check && (val > 0xFFFF))
+	runtime("Can't operate with value out of bounds in EC constructor");
+
+      break;
+    }
+
+  case P('m','l'):
+    {
+      /* Third argument hack */
+      struct f_val v3;
+      POP(v3);
+      TWOARGS;
+
+      if ((v1.type != T_INT) || (v2.type != T_INT) || (v3.type != T_INT))
+	runtime( "Can't operate with value of non-integer type in LC constructor" );
+
+      res.type = T_LC;
+      res.val.lc = (lcomm) { v1.val.i, v2.val.i, v3.val.i };
+
+      break;
+    }
+
+/* Relational operators */
+
+#define COMPARE(x) \
+    TWOARGS; \
+    i = val_compare(v1, v2); \
+    if (i==CMP_ERROR) \
+      runtime( "Can't compare values of incompatible types" ); \
+    res.type = T_BOOL; \
+    res.val.i = (x); \
+    break;
+
+#define SAME(x) \
+    TWOARGS; \
+    i = val_same(v1, v2); \
+    res.type = T_BOOL; \
+    res.val.i = (x); \
+    break;
+
+  case P('!','='): SAME(!i);
+  case P('=','='): SAME(i);
+  case '<': COMPARE(i==-1);
+  case P('<','='): COMPARE(i!=1);
+
+  case '!':
+    ONEARG;
+    if (v1.type != T_BOOL)
+      runtime( "Not applied to non-boolean" );
+    res = v1;
+    res.val.i = !res.val.i;
+    break;
+
+  case '~':
+    TWOARGS;
+    res.type = T_BOOL;
+    res.val.i = val_in_range(v1, v2);
+    if (res.val.i == CMP_ERROR)
+      runtime( "~ applied on unknown type pair" );
+    res.val.i = !!res.val.i;
+    break;
+
+  case P('!','~'):
+    TWOARGS;
+    res.type = T_BOOL;
+    res.val.i = val_in_range(v1, v2);
+    if (res.val.i == CMP_ERROR)
+      runtime( "!~ applied on unknown type pair" );
+    res.val.i = !res.val.i;
+    break;
+
+  case P('d','e'):
+    ONEARG;
+    res.type = T_BOOL;
+    res.val.i = (v1.type != T_VOID);
+    break;
+
+  /* Set to indirect value, a1 = variable, a2 = value, arg = frame slot */
+  case 's':
+    POP(v2);
+    sym = what->a1.p;
+    vp = &vars[op->arg];
+    if ((sym->class != (SYM_VARIABLE | v2.type)) && (v2.type != T_VOID)) {
+#ifndef IPV6
+      /* IP->Quad implicit conversion */
+      if ((sym->class == (SYM_VARIABLE | T_QUAD)) && (v2.type == T_IP)) {
+	vp->type = T_QUAD;
+	vp->val.i = ipa_to_u32(v2.val.px.ip);
+	break;
+      }
+#endif
+      runtime( "Assigning to variable of incompatible type" );
+    }
+    *vp = v2;
+    break;
+
+    /* some constants have value in a2, some in *a1.p, strange. */
   case 'c':	/* integer (or simple type) constant, string, set, or prefix_set */
     res.type = what->aux;
 
@@ -867,30 +2279,21 @@ interpret(struct f_inst *what)
       res.val.i = what->a2.i;
     break;
   case 'V':
+    res = vars[op->arg];
+    break;
   case 'C':
     res = * ((struct f_val *) what->a1.p);
     break;
   case 'p':
     ONEARG;
-    val_format(v1, &f_buf);
-    break;
-  case '?':	/* ? has really strange error value, so we can implement if ... else nicely :-) */
-    ONEARG;
-    if (v1.type != T_BOOL)
-      runtime( "If requires boolean expression" );
-    if (v1.val.i) {
-      ARG(res,a2.p);
-      res.val.i = 0;
-    } else res.val.i = 1;
-    res.type = T_BOOL;
+    val_format(v1, &fs->buf);
     break;
   case '0':
     debug( "No operation\n" );
     break;
-  case P('p',','):
-    ONEARG;
+  case P('p',','):	/* Print list was already evaluated */
     if (what->a2.i == F_NOP || (what->a2.i != F_NONL && what->a1.p))
-      log_commit(*L_INFO, &f_buf);
+      log_commit(*L_INFO, &fs->buf);
 
     switch (what->a2.i) {
     case F_QUITBIRD:
@@ -912,15 +2315,15 @@ interpret(struct f_inst *what)
   case 'a':	/* rta access */
     {
       ACCESS_RTE;
-      struct rta *rta = (*f_rte)->attrs;
+      struct rta *rta = (*fs->rte)->attrs;
       res.type = what->aux;
 
       switch (what->a2.i)
       {
       case SA_FROM:	res.val.px.ip = rta->from; break;
       case SA_GW:	res.val.px.ip = rta->gw; break;
-      case SA_NET:	res.val.px.ip = (*f_rte)->net->n.prefix;
-			res.val.px.len = (*f_rte)->net->n.pxlen; break;
+      case SA_NET:	res.val.px.ip = (*fs->rte)->net->n.prefix;
+			res.val.px.len = (*fs->rte)->net->n.pxlen; break;
       case SA_PROTO:	res.val.s = rta->src->proto->name; break;
       case SA_SOURCE:	res.val.i = rta->source; break;
       case SA_SCOPE:	res.val.i = rta->scope; break;
@@ -940,9 +2343,9 @@ interpret(struct f_inst *what)
     if (what->aux != v1.type)
       runtime( "Attempt to set static attribute to incompatible type" );
 
-    f_rta_cow();
+    f_rta_cow(fs);
     {
-      struct rta *rta = (*f_rte)->attrs;
+      struct rta *rta = (*fs->rte)->attrs;
 
       switch (what->a2.i)
       {
@@ -953,138 +2356,62 @@ interpret(struct f_inst *what)
       case SA_GW:
 	{
 	  ip_addr ip = v1.val.px.ip;
-	  neighbor *n = neigh_find(rta->src->proto, &ip, 0);
-	  if (!n || (n->scope == SCOPE_HOST))
-	    runtime( "Invalid gw address" );
-
-	  rta->dest = RTD_ROUTER;
-	  rta->gw = ip;
-	  rta->iface = n->iface;
-	  rta->nexthops = NULL;
-	  rta->hostentry = NULL;
-	}
-	break;
-
-      case SA_SCOPE:
-	rta->scope = v1.val.i;
-	break;
-
-      case SA_DEST:
-	i = v1.val.i;
-	if ((i != RTD_BLACKHOLE) && (i != RTD_UNREACHABLE) && (i != RTD_PROHIBIT))
-	  runtime( "Destination can be changed only to blackhole, unreachable or prohibit" );
-
-	rta->dest = i;
-	rta->gw = IPA_NONE;
-	rta->iface = NULL;
-	rta->nexthops = NULL;
-	rta->hostentry = NULL;
-	break;
-
-      default:
-	bug("Invalid static attribute access (%x)", res.type);
-      }
-    }
-    break;
-  case P('e','a'):	/* Access to extended attributes */
-    ACCESS_RTE;
-    {
-      eattr *e = NULL;
-      u16 code = what->a2.i;
-
-      if (!(f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
-      if (!e)
-	e = ea_find((*f_tmp_attrs), code);
-      if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
-
-      if (!e) {
-	/* A special case: undefined int_set looks like empty int_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) {
-	  res.type = T_CLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* The same special case for ec_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) {
-	  res.type = T_ECLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* The same special case for lc_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_LC_SET) {
-	  res.type = T_LCLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* Undefined value */
-	res.type = T_VOID;
-	break;
-      }
-
-      switch (what->aux & EAF_TYPE_MASK) {
-      case EAF_TYPE_INT:
-	res.type = T_INT;
-	res.val.i = e->u.data;
-	break;
-      case EAF_TYPE_ROUTER_ID:
-	res.type = T_QUAD;
-	res.val.i = e->u.data;
-	break;
-      case EAF_TYPE_OPAQUE:
-	res.type = T_ENUM_EMPTY;
-	res.val.i = 0;
-	break;
-      case EAF_TYPE_IP_ADDRESS:
-	res.type = T_IP;
-	struct adata * ad = e->u.ptr;
-	res.val.px.ip = * (ip_addr *) ad->data;
-	break;
-      case EAF_TYPE_AS_PATH:
-        res.type = T_PATH;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_BITFIELD:
-	res.type = T_BOOL;
-	res.val.i = !!(e->u.data & BITFIELD_MASK(what));
-	break;
-      case EAF_TYPE_INT_SET:
-	res.type = T_CLIST;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_EC_SET:
-	res.type = T_ECLIST;
-	res.val.ad = e->u.ptr;
+	  neighbor *n = neigh_find(rta->src->proto, &ip, 0);
+	  if (!n || (n->scope == SCOPE_HOST))
+	    runtime( "Invalid gw address" );
+
+	  rta->dest = RTD_ROUTER;
+	  rta->gw = ip;
+	  rta->iface = n->iface;
+	  rta->nexthops = NULL;
+	  rta->hostentry = NULL;
+	}
 	break;
-      case EAF_TYPE_LC_SET:
-	res.type = T_LCLIST;
-	res.val.ad = e->u.ptr;
+
+      case SA_SCOPE:
+	rta->scope = v1.val.i;
 	break;
-      case EAF_TYPE_UNDEF:
-	res.type = T_VOID;
+
+      case SA_DEST:
+	i = v1.val.i;
+	if ((i != RTD_BLACKHOLE) && (i != RTD_UNREACHABLE) && (i != RTD_PROHIBIT))
+	  runtime( "Destination can be changed only to blackhole, unreachable or prohibit" );
+
+	rta->dest = i;
+	rta->gw = IPA_NONE;
+	rta->iface = NULL;
+	rta->nexthops = NULL;
+	rta->hostentry = NULL;
 	break;
+
       default:
-	bug("Unknown type in e,a");
+	bug("Invalid static attribute access (%x)", res.type);
       }
     }
     break;
+  case P('e','a'):	/* Access to extended attributes */
+    ACCESS_RTE;
+    res = f_get_ea(fs, what);
+    break;
+  case FI_EA_CACHED:
+    ACCESS_RTE;
+    if (!ea_valid[op->arg])
+    {
+      ea_cache[op->arg] = f_get_ea(fs, what);
+      ea_valid[op->arg] = 1;
+    }
+    res = ea_cache[op->arg];
+    break;
   case P('e','S'):
     ACCESS_RTE;
     ONEARG;
     {
-      struct ea_list *l = lp_alloc(f_pool, sizeof(struct ea_list) + sizeof(eattr));
+      struct ea_list *l = f_new_ea(fs, what);
       u16 code = what->a2.i;
 
-      l->next = NULL;
-      l->flags = EALF_SORTED;
-      l->count = 1;
-      l->attrs[0].id = code;
-      l->attrs[0].flags = 0;
-      l->attrs[0].type = what->aux | EAF_ORIGINATED;
+      /* Pending edit of the attribute is overwritten */
+      if (fs->edit_count)
+	f_edit_sync(fs, code, 0);
 
       switch (what->aux & EAF_TYPE_MASK) {
       case EAF_TYPE_INT:
@@ -1115,7 +2442,7 @@ interpret(struct f_inst *what)
 	if (v1.type != T_IP)
 	  runtime( "Setting ip attribute to non-ip value" );
 	int len = sizeof(ip_addr);
-	struct adata *ad = lp_alloc(f_pool, sizeof(struct adata) + len);
+	struct adata *ad = lp_alloc(fs->pool, sizeof(struct adata) + len);
 	ad->length = len;
 	(* (ip_addr *) ad->data) = v1.val.px.ip;
 	l->attrs[0].u.ptr = ad;
@@ -1130,13 +2457,7 @@ interpret(struct f_inst *what)
 	  runtime( "Setting bit in bitfield attribute to non-bool value" );
 	{
 	  /* First, we have to find the old value */
-	  eattr *e = NULL;
-	  if (!(f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
-	  if (!e)
-	    e = ea_find((*f_tmp_attrs), code);
-	  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
+	  eattr *e = f_find_ea(fs, code);
 	  u32 data = e ? e->u.data : 0;
 
 	  if (v1.val.i)
@@ -1168,20 +2489,96 @@ interpret(struct f_inst *what)
       default: bug("Unknown type in e,S");
       }
 
-      if (!(what->aux & EAF_TEMP) && (!(f_flags & FF_FORCE_TMPATTR))) {
-	f_rta_cow();
-	l->next = (*f_rte)->attrs->eattrs;
-	(*f_rte)->attrs->eattrs = l;
-      } else {
-	l->next = (*f_tmp_attrs);
-	(*f_tmp_attrs) = l;
+      f_store_ea(fs, what, l);
+    }
+    break;
+  case FI_EA_EDIT:	/* Community list attribute add or delete in place, see f_edit_get() */
+    ACCESS_RTE;
+    ONEARG;
+    {
+      struct f_edit *ed;
+      u32 key[3];
+      int arg_set = 0;
+
+      switch (what->aux & EAF_TYPE_MASK)
+      {
+      case EAF_TYPE_INT_SET:
+	if ((v1.type == T_PAIR) || (v1.type == T_QUAD))
+	  key[0] = v1.val.i;
+#ifndef IPV6
+	/* IP->Quad implicit conversion */
+	else if (v1.type == T_IP)
+	  key[0] = ipa_to_u32(v1.val.px.ip);
+#endif
+	else if ((v1.type == T_SET) && clist_set_type(v1.val.t, &v2))
+	  arg_set = 1;
+	else if (v1.type == T_CLIST)
+	  arg_set = 2;
+	else
+	  runtime("Can't add/delete non-pair");
+	break;
+
+      case EAF_TYPE_EC_SET:
+	if ((v1.type == T_SET) && eclist_set_type(v1.val.t))
+	  arg_set = 1;
+	else if (v1.type == T_ECLIST)
+	  arg_set = 2;
+	else if (v1.type != T_EC)
+	  runtime("Can't add/delete non-ec");
+	else
+	{
+	  key[0] = ec_hi(v1.val.ec);
+	  key[1] = ec_lo(v1.val.ec);
+	}
+	break;
+
+      case EAF_TYPE_LC_SET:
+	if ((v1.type == T_SET) && lclist_set_type(v1.val.t))
+	  arg_set = 1;
+	else if (v1.type == T_LCLIST)
+	  arg_set = 2;
+	else if (v1.type != T_LC)
+	  runtime("Can't add/delete non-lc");
+	else
+	  lc_put(key, v1.val.lc);
+	break;
+
+      default:
+	bug("Invalid list attribute type");
+      }
+
+      if ((op->arg == 'a') && (arg_set == 1))
+	runtime("Can't add set");
+
+      if ((op->arg == 'f') && !arg_set)
+	runtime(((what->aux & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) ? "Can't filter pair" :
+		((what->aux & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) ? "Can't filter ec" : "Can't filter lc");
+
+      ed = f_edit_get(fs, what);
+
+      if (!arg_set)
+      {
+	if (op->arg == 'a')
+	  f_edit_add(fs, ed, key);
+	else
+	  f_edit_del(ed, key);
+      }
+      else if (op->arg == 'a')
+      {
+	u32 *data = (u32 *) v1.val.ad->data;
+	uint len = v1.val.ad->length / sizeof(u32);
+
+	for (u1 = 0; u1 + ed->width <= len; u1 += ed->width)
+	  f_edit_add(fs, ed, data + u1);
       }
+      else
+	f_edit_filter(ed, v1, what->a1.p, op->arg == 'f');
     }
     break;
   case 'P':
     ACCESS_RTE;
     res.type = T_INT;
-    res.val.i = (*f_rte)->pref;
+    res.val.i = (*fs->rte)->pref;
     break;
   case P('P','S'):
     ACCESS_RTE;
@@ -1190,8 +2587,8 @@ interpret(struct f_inst *what)
       runtime( "Can't set preference to non-integer" );
     if (v1.val.i > 0xFFFF)
       runtime( "Setting preference value out of bounds" );
-    f_rte_cow();
-    (*f_rte)->pref = v1.val.i;
+    f_rte_cow(fs);
+    (*fs->rte)->pref = v1.val.i;
     break;
   case 'L':	/* Get length of */
     ONEARG;
@@ -1248,17 +2645,21 @@ interpret(struct f_inst *what)
     ONEARG;
     res = v1;
     res.type |= T_RETURN;
-    return res;
-  case P('c','a'): /* CALL: this is special: if T_RETURN and returning some value, mask it out  */
-    ONEARG;
-    res = interpret(what->a2.p);
-    if (res.type == T_RETURN)
+    /* Outside of functions (or when returning void) return from the whole filter */
+    if (!fp || (res.type == T_RETURN))
       return res;
     res.type &= ~T_RETURN;
-    break;
-  case P('c','v'):	/* Clear local variables */
+    goto leave;
+  case P('c','a'): /* CALL: arguments were already pushed as parameters */
+    sp -= what->aux;
+    frames[fp++] = (struct f_frame) { .pc = pc, .sp = sp, .push = op->push, .vars = vars };
+    vars = &stack[sp];
+    sp += what->aux;
+    pc = op->arg;
+    continue;
+  case P('c','v'):	/* Allocate local variables */
     for (sym = what->a1.p; sym != NULL; sym = sym->aux2)
-      ((struct f_val *) sym->def)->type = T_VOID;
+      stack[sp++].type = T_VOID;
     break;
   case P('S','W'):
     ONEARG;
@@ -1269,14 +2670,13 @@ interpret(struct f_inst *what)
 	t = find_tree(what->a2.p, v1);
 	if (!t) {
 	  debug( "No else statement?\n");
+	  pc = op->arg;
 	  break;
 	}
       }
-      /* It is actually possible to have t->data NULL */
 
-      res = interpret(t->data);
-      if (res.type & T_RETURN)
-	return res;
+      /* Jump to the case body, see f_compile_cases() */
+      pc = (uintptr_t) t->data;
     }
     break;
   case P('i','M'): /* IP.MASK(val) */
@@ -1294,7 +2694,7 @@ interpret(struct f_inst *what)
 
   case 'E':	/* Create empty attribute */
     res.type = what->aux;
-    res.val.ad = adata_empty(f_pool, 0);
+    res.val.ad = adata_empty(fs->pool, 0);
     break;
   case P('A','p'):	/* Path prepend */
     TWOARGS;
@@ -1304,11 +2704,23 @@ interpret(struct f_inst *what)
       runtime("Can't prepend non-integer");
 
     res.type = T_PATH;
-    res.val.ad = as_path_prepend(f_pool, v1.val.ad, v2.val.i);
+    res.val.ad = as_path_prepend(fs->pool, v1.val.ad, v2.val.i);
     break;
 
   case P('C','a'):	/* (Extended) Community list add or delete */
-    TWOARGS;
+  case FI_FILTER_SET:	/* The same with set constant in a1 and its index in a2 */
+    if (op->code == FI_FILTER_SET)
+    {
+      ONEARG;
+      v2 = * (struct f_val *) what->a1.p;
+      idx = what->a2.p;
+    }
+    else
+    {
+      TWOARGS;
+      idx = NULL;
+    }
+
     if (v1.type == T_PATH)
     {
       struct f_tree *set = NULL;
@@ -1334,7 +2746,7 @@ interpret(struct f_inst *what)
 	runtime("Can't filter integer");
 
       res.type = T_PATH;
-      res.val.ad = as_path_filter(f_pool, v1.val.ad, set, key, pos);
+      res.val.ad = as_path_filter(fs->pool, v1.val.ad, set, key, pos);
     }
     else if (v1.type == T_CLIST)
     {
@@ -1364,22 +2776,22 @@ interpret(struct f_inst *what)
 	if (arg_set == 1)
 	  runtime("Can't add set");
 	else if (!arg_set)
-	  res.val.ad = int_set_add(f_pool, v1.val.ad, n);
+	  res.val.ad = int_set_add(fs->pool, v1.val.ad, n);
 	else
-	  res.val.ad = int_set_union(f_pool, v1.val.ad, v2.val.ad);
+	  res.val.ad = int_set_union(fs->pool, v1.val.ad, v2.val.ad);
 	break;
 
       case 'd':
 	if (!arg_set)
-	  res.val.ad = int_set_del(f_pool, v1.val.ad, n);
+	  res.val.ad = int_set_del(fs->pool, v1.val.ad, n);
 	else
-	  res.val.ad = clist_filter(f_pool, v1.val.ad, v2, 0);
+	  res.val.ad = clist_filter(fs->pool, v1.val.ad, v2, idx, 0);
 	break;
 
       case 'f':
 	if (!arg_set)
 	  runtime("Can't filter pair");
-	res.val.ad = clist_filter(f_pool, v1.val.ad, v2, 1);
+	res.val.ad = clist_filter(fs->pool, v1.val.ad, v2, idx, 1);
 	break;
 
       default:
@@ -1406,22 +2818,22 @@ interpret(struct f_inst *what)
 	if (arg_set == 1)
 	  runtime("Can't add set");
 	else if (!arg_set)
-	  res.val.ad = ec_set_add(f_pool, v1.val.ad, v2.val.ec);
+	  res.val.ad = ec_set_add(fs->pool, v1.val.ad, v2.val.ec);
 	else
-	  res.val.ad = ec_set_union(f_pool, v1.val.ad, v2.val.ad);
+	  res.val.ad = ec_set_union(fs->pool, v1.val.ad, v2.val.ad);
 	break;
 
       case 'd':
 	if (!arg_set)
-	  res.val.ad = ec_set_del(f_pool, v1.val.ad, v2.val.ec);
+	  res.val.ad = ec_set_del(fs->pool, v1.val.ad, v2.val.ec);
 	else
-	  res.val.ad = eclist_filter(f_pool, v1.val.ad, v2, 0);
+	  res.val.ad = eclist_filter(fs->pool, v1.val.ad, v2, idx, 0);
 	break;
 
       case 'f':
 	if (!arg_set)
 	  runtime("Can't filter ec");
-	res.val.ad = eclist_filter(f_pool, v1.val.ad, v2, 1);
+	res.val.ad = eclist_filter(fs->pool, v1.val.ad, v2, idx, 1);
 	break;
 
       default:
@@ -1448,22 +2860,22 @@ interpret(struct f_inst *what)
 	if (arg_set == 1)
 	  runtime("Can't add set");
 	else if (!arg_set)
-	  res.val.ad = lc_set_add(f_pool, v1.val.ad, v2.val.lc);
+	  res.val.ad = lc_set_add(fs->pool, v1.val.ad, v2.val.lc);
 	else
-	  res.val.ad = lc_set_union(f_pool, v1.val.ad, v2.val.ad);
+	  res.val.ad = lc_set_union(fs->pool, v1.val.ad, v2.val.ad);
 	break;
 
       case 'd':
 	if (!arg_set)
-	  res.val.ad = lc_set_del(f_pool, v1.val.ad, v2.val.lc);
+	  res.val.ad = lc_set_del(fs->pool, v1.val.ad, v2.val.lc);
 	else
-	  res.val.ad = lclist_filter(f_pool, v1.val.ad, v2, 0);
+	  res.val.ad = lclist_filter(fs->pool, v1.val.ad, v2, idx, 0);
 	break;
 
       case 'f':
 	if (!arg_set)
 	  runtime("Can't filter lc");
-	res.val.ad = lclist_filter(f_pool, v1.val.ad, v2, 1);
+	res.val.ad = lclist_filter(fs->pool, v1.val.ad, v2, idx, 1);
 	break;
 
       default:
@@ -1487,12 +2899,12 @@ interpret(struct f_inst *what)
     else
     {
       ACCESS_RTE;
-      v1.val.px.ip = (*f_rte)->net->n.prefix;
-      v1.val.px.len = (*f_rte)->net->n.pxlen;
+      v1.val.px.ip = (*fs->rte)->net->n.prefix;
+      v1.val.px.len = (*fs->rte)->net->n.pxlen;
 
       /* We ignore temporary attributes, probably not a problem here */
       /* 0x02 is a value of BA_AS_PATH, we don't want to include BGP headers */
-      eattr *e = ea_find((*f_rte)->attrs->eattrs, EA_CODE(EAP_BGP, 0x02));
+      eattr *e = ea_find((*fs->rte)->attrs->eattrs, EA_CODE(EAP_BGP, 0x02));
 
       if (!e || e->type != EAF_TYPE_AS_PATH)
 	runtime("Missing AS_PATH attribute");
@@ -1508,15 +2920,144 @@ interpret(struct f_inst *what)
     res.val.i = roa_check(rtc->table, v1.val.px.ip, v1.val.px.len, as);
     break;
 
+  /* Control instructions of compiled code */
+  case FI_VOID:
+    break;
+  case FI_DROP:
+    sp--;
+    break;
+  case FI_JUMP:
+    pc = op->arg;
+    break;
+  case FI_JUMP_FALSE:
+    ONEARG;
+    if (v1.type != T_BOOL)
+      runtime( "If requires boolean expression" );
+    if (!v1.val.i)
+      pc = op->arg;
+    break;
+  case FI_AND:
+  case FI_OR:
+    /* Short-circuit evaluation, the first argument is the result */
+    if (stack[sp-1].type != T_BOOL)
+      runtime( "Can't do boolean operation on non-booleans" );
+    if (stack[sp-1].val.i == (op->code == FI_OR))
+      pc = op->arg;
+    else
+      sp--;
+    break;
+  case FI_BOOL:
+    if (stack[sp-1].type != T_BOOL)
+      runtime( "Can't do boolean operation on non-booleans" );
+    break;
+  case FI_CONST_BOOL:
+    res.type = T_BOOL;
+    res.val.i = op->arg;
+    break;
+  case FI_LEAVE:
+    ONEARG;
+    res = v1;
+  leave:
+    fp--;
+    pc = frames[fp].pc;
+    sp = frames[fp].sp;
+    vars = frames[fp].vars;
+    if (frames[fp].push)
+      stack[sp++] = res;
+    continue;
+  case FI_END:
+    ONEARG;
+    return v1;
+  case FI_CMP_INT:	/* Original instruction in arg, constant on the left side if aux */
+    ONEARG;
+    if (what->aux)
+    {
+      v2 = v1;
+      v1 = * (struct f_val *) what->a1.p;
+    }
+    else
+      v2 = * (struct f_val *) what->a1.p;
+
+    if ((v1.type == T_INT) && (v2.type == T_INT))
+      i = uint_cmp(v1.val.i, v2.val.i);
+    else if ((op->arg == P('=','=')) || (op->arg == P('!','=')))
+      i = !val_same(v1, v2);
+    else if ((i = val_compare(v1, v2)) == CMP_ERROR)
+      runtime( "Can't compare values of incompatible types" );
+
+    res.type = T_BOOL;
+    switch (op->arg)
+    {
+    case P('=','='): res.val.i = (i == 0); break;
+    case P('!','='): res.val.i = (i != 0); break;
+    case '<': res.val.i = (i == -1); break;
+    case P('<','='): res.val.i = (i != 1); break;
+    }
+    break;
+  case FI_MATCH_SET:	/* Original instruction in arg, set index or compiled path mask in a2 */
+    ONEARG;
+    v2 = * (struct f_val *) what->a1.p;
+    idx = (v2.type == T_SET) ? what->a2.p : NULL;
+
+    if ((v1.type == T_PREFIX) && (v2.type == T_PREFIX_SET))
+      i = trie_match_fprefix(v2.val.ti, &v1.val.px);
+    else if ((v1.type == T_PATH) && (v2.type == T_PATH_MASK) && what->a2.p)
+      i = as_path_match_nfa(v1.val.ad, what->a2.p);
+    else if (idx && (v1.type == idx->type))
+      i = set_index_find(idx, v1);
+    else if (idx && (v1.type == T_CLIST))
+      i = clist_match_set(v1.val.ad, v2.val.t, idx);
+    else if (idx && (v1.type == T_ECLIST))
+      i = eclist_match_set(v1.val.ad, v2.val.t, idx);
+    else if (idx && (v1.type == T_LCLIST))
+      i = lclist_match_set(v1.val.ad, v2.val.t, idx);
+    else if ((v2.type == T_SET) && (v1.type == T_INT) && (v2.val.t->from.type == T_INT))
+      i = !!find_tree(v2.val.t, v1);
+    else
+      i = val_in_range(v1, v2);
+
+    if (i == CMP_ERROR)
+      runtime( (op->arg == '~') ? "~ applied on unknown type pair" : "!~ applied on unknown type pair" );
+
+    res.type = T_BOOL;
+    res.val.i = (op->arg == '~') ? !!i : !i;
+    break;
+  case FI_PATHMASK:
+    {
+      struct f_path_mask *m, **last = &res.val.path_mask;
+
+      for (m = what->a1.p; m; m = m->next)
+      {
+	struct f_path_mask *n = lp_alloc(fs->pool, sizeof(struct f_path_mask));
+	*n = *m;
+
+	if (m->kind == PM_ASN_EXPR)
+	{
+	  /* Nested execution with the same state and variables */
+	  v1 = f_exec((struct f_code *) m->val, fs, vars);
+	  n->val = (v1.type == T_INT) ? v1.val.i : 0;
+	}
+
+	*last = n;
+	last = &n->next;
+      }
+      *last = NULL;
+
+      res.type = T_PATH_MASK;
+    }
+    break;
+
   default:
-    bug( "Unknown instruction %d (%c)", what->code, what->code & 0xff);
+    bug( "Unknown instruction %d (%c)", op->code, op->code & 0xff);
+  }
+
+  if (op->push)
+    stack[sp++] = res;
   }
-  if (what->next)
-    return interpret(what->next);
-  return res;
 }
 
-#undef ARG
+#undef ONEARG
+#undef TWOARGS
 #define ARG(x,y) \
 	if (!i_same(f1->y, f2->y)) \
 		return 0;
@@ -1679,6 +3220,10 @@ i_same(struct f_inst *f1, struct f_inst *f2)
  * if a new rte is returned, it has its own clone of cached rta
  * (and cached rta of read-only source rte is intact), if rte is
  * modified in place, old cached rta is possibly freed.
+ *
+ * When filter profiling is enabled (option &profile filters), number of
+ * executions and time spent are accounted for each instruction of the
+ * filter, see filter_show_profile().
  */
 int
 f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags)
@@ -1692,33 +3237,42 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   int rte_cow = ((*rte)->flags & REF_COW);
   DBG( "Running filter `%s'...", filter->name );
 
-  f_rte = rte;
-  f_old_rta = NULL;
-  f_tmp_attrs = tmp_attrs;
-  f_pool = tmp_pool;
-  f_flags = flags;
+  struct filter_state fs = {
+    .rte = rte,
+    .tmp_attrs = tmp_attrs,
+    .pool = tmp_pool,
+    .flags = flags,
+  };
 
-  LOG_BUFFER_INIT(f_buf);
+  LOG_BUFFER_INIT(fs.buf);
 
-  struct f_val res = interpret(filter->root);
+  if (config->filter_profile)
+    fs.prof_code = f_prof_init(filter->code);
 
-  if (f_old_rta) {
+  struct f_val res = f_exec(filter->code, &fs, NULL);
+
+  if (fs.prof_last)
+    f_prof_charge(&fs, NULL);
+
+  f_edit_finish(&fs);
+
+  if (fs.old_rta) {
     /*
-     * Cached rta was modified and f_rte contains now an uncached one,
+     * Cached rta was modified and fs.rte contains now an uncached one,
      * sharing some part with the cached one. The cached rta should
-     * be freed (if rte was originally COW, f_old_rta is a clone
+     * be freed (if rte was originally COW, fs.old_rta is a clone
      * obtained during rte_cow()).
      *
      * This also implements the exception mentioned in f_run()
      * description. The reason for this is that rta reuses parts of
-     * f_old_rta, and these may be freed during rta_free(f_old_rta).
+     * fs.old_rta, and these may be freed during rta_free(fs.old_rta).
      * This is not the problem if rte was COW, because original rte
      * also holds the same rta.
      */
     if (!rte_cow)
-      (*f_rte)->attrs = rta_lookup((*f_rte)->attrs);
+      (*fs.rte)->attrs = rta_lookup((*fs.rte)->attrs);
 
-    rta_free(f_old_rta);
+    rta_free(fs.old_rta);
   }
 
 
@@ -1730,23 +3284,158 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   return res.val.i;
 }
 
+struct f_prof_line {
+  uint lineno;
+  u64 count;
+  u64 ticks;
+};
+
+static int
+f_prof_line_cmp(const void *x, const void *y)
+{
+  const struct f_prof_line *a = x, *b = y;
+  return (a->lineno > b->lineno) - (a->lineno < b->lineno);
+}
+
+static void
+f_show_profile(struct symbol *sym)
+{
+  struct filter *f = sym->def;
+  struct f_code *code = f->code;
+  struct f_prof *prof = code ? code->prof : NULL;
+
+  if (!prof || !prof[0].count)
+  {
+    cli_msg(-1027, "%s: not run", sym->name);
+    return;
+  }
+
+  /*
+   * Instructions are aggregated by source lines. Internal instructions
+   * without a source node are accounted to the preceding line. The count of
+   * a line is the count of its most frequently executed instruction.
+   */
+  struct f_prof_line *lines = xmalloc(code->len * sizeof(struct f_prof_line));
+  uint lineno = 0, n = 0, i;
+  u64 total = 0;
+
+  for (i = 0; i < code->len; i++)
+  {
+    if (code->ops[i].i)
+      lineno = code->ops[i].i->lineno;
+
+    lines[n++] = (struct f_prof_line) { lineno, prof[i].count, prof[i].ticks };
+    total += prof[i].ticks;
+  }
+
+  qsort(lines, n, sizeof(struct f_prof_line), f_prof_line_cmp);
+
+  cli_msg(-1027, "%s: %lu runs, %lu %s", sym->name,
+	  (unsigned long) prof[0].count, (unsigned long) total, F_PROF_UNIT);
+  cli_msg(-1027, "  %6s %12s %14s %6s", "Line", "Count", F_PROF_UNIT, "Share");
+
+  for (i = 0; i < n; )
+  {
+    struct f_prof_line l = lines[i];
+
+    for (i++; (i < n) && (lines[i].lineno == l.lineno); i++)
+    {
+      l.count = MAX(l.count, lines[i].count);
+      l.ticks += lines[i].ticks;
+    }
+
+    if (!l.count)
+      continue;
+
+    uint share = total ? (uint) (l.ticks * 1000 / total) : 0;
+    cli_msg(-1027, "  %6u %12lu %14lu %3u.%u%%", l.lineno,
+	    (unsigned long) l.count, (unsigned long) l.ticks, share / 10, share % 10);
+  }
+
+  xfree(lines);
+}
+
+static void
+f_flush_profile(struct symbol *sym)
+{
+  struct filter *f = sym->def;
+  struct f_code *code = f->code;
+
+  if (code && code->prof)
+    memset(code->prof, 0, code->len * sizeof(struct f_prof));
+}
+
+static void
+f_walk_filters(struct symbol *sym, void (*hook)(struct symbol *))
+{
+  if (sym)
+  {
+    hook(sym);
+    return;
+  }
+
+  HASH_WALK(config->sym_hash, next, s)
+  {
+    if (s->scope->active && (s->class == SYM_FILTER))
+      hook(s);
+  }
+  HASH_WALK_END;
+}
+
+/**
+ * filter_show_profile - show filter execution profile
+ * @sym: filter symbol, or NULL for all named filters
+ *
+ * Prints number of executions and time spent for each source line of the
+ * filter, as collected by f_run() when option &profile filters is enabled.
+ */
+void
+filter_show_profile(struct symbol *sym)
+{
+  if (!config->filter_profile)
+    cli_msg(-1027, "Filter profiling is disabled");
+
+  f_walk_filters(sym, f_show_profile);
+  cli_msg(0, "");
+}
+
+/**
+ * filter_flush_profile - reset filter execution profile
+ * @sym: filter symbol, or NULL for all named filters
+ */
+void
+filter_flush_profile(struct symbol *sym)
+{
+  f_walk_filters(sym, f_flush_profile);
+  cli_msg(0, "");
+}
+
 /* TODO: perhaps we could integrate f_eval(), f_eval_rte() and f_run() */
 
+/**
+ * f_eval_rte - run commands on a route
+ * @code: commands compiled by f_compile() when the config was loaded
+ * @rte: route to be modified, its rta must be private
+ * @tmp_pool: pool for temporary allocations
+ *
+ * Used by static protocol for per-route attribute settings.
+ */
 struct f_val
-f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
+f_eval_rte(struct f_code *code, struct rte **rte, struct linpool *tmp_pool)
 {
   struct ea_list *tmp_attrs = NULL;
 
-  f_rte = rte;
-  f_old_rta = NULL;
-  f_tmp_attrs = &tmp_attrs;
-  f_pool = tmp_pool;
-  f_flags = 0;
+  struct filter_state fs = {
+    .rte = rte,
+    .tmp_attrs = &tmp_attrs,
+    .pool = tmp_pool,
+  };
 
-  LOG_BUFFER_INIT(f_buf);
+  LOG_BUFFER_INIT(fs.buf);
 
   /* Note that in this function we assume that rte->attrs is private / uncached */
-  struct f_val res = interpret(expr);
+  struct f_val res = f_exec(code, &fs, NULL);
+  f_edit_finish(&fs);
 
   /* Hack to include EAF_TEMP attributes to the main list */
   (*rte)->attrs->eattrs = ea_append(tmp_attrs, (*rte)->attrs->eattrs);
@@ -1757,14 +3446,27 @@ f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
 struct f_val
 f_eval(struct f_inst *expr, struct linpool *tmp_pool)
 {
-  f_flags = 0;
-  f_tmp_attrs = NULL;
-  f_rte = NULL;
-  f_pool = tmp_pool;
+  struct filter_state fs = {
+    .pool = tmp_pool,
+  };
+
+  LOG_BUFFER_INIT(fs.buf);
+
+  /* Expressions are evaluated just once, constants need not be compiled */
+  if (!expr->next && ((expr->code == 'c') || ((expr->code == 'C') && !f_pm_has_expr(expr))))
+  {
+    struct {
+      struct f_code code;
+      struct f_op ops[2];
+    } fc = { .code = { .len = 2, .stack = 1 } };
+
+    fc.ops[0] = (struct f_op) { .code = expr->code, .push = 1, .i = expr };
+    fc.ops[1] = (struct f_op) { .code = FI_END };
 
-  LOG_BUFFER_INIT(f_buf);
+    return f_exec(&fc.code, &fs, NULL);
+  }
 
-  return interpret(expr);
+  return f_exec(f_compile(expr, tmp_pool), &fs, NULL);
 }
 
 uint
@@ -1779,14 +3481,6 @@ f_eval_int(struct f_inst *expr)
   return res.val.i;
 }
 
-u32
-f_eval_asn(struct f_inst *expr)
-{
-  /* Called as a part of another interpret call, therefore no log_reset() */
-  struct f_val res = interpret(expr);
-  return (res.type == T_INT) ? res.val.i : 0;
-}
-
 /**
  * filter_same - compare two filters
  * @new: first filter to be compared
@@ -1807,3 +3501,143 @@ filter_same(struct filter *new, struct filter *old)
     return 0;
   return i_same(new->root, old->root);
 }
+
+/* Function bodies already examined by i_uses_roa() */
+#define ROA_WALK_MAX_CALLS 64
+
+struct roa_walk {
+  struct roa_table *table;
+  struct f_inst *calls[ROA_WALK_MAX_CALLS];
+  uint ncalls;
+};
+
+static int i_uses_roa(struct f_inst *what, struct roa_walk *w);
+
+static int
+tree_uses_roa(struct f_tree *t, struct roa_walk *w)
+{
+  if (!t)
+    return 0;
+
+  return i_uses_roa(t->data, w) || tree_uses_roa(t->left, w) || tree_uses_roa(t->right, w);
+}
+
+static int
+i_uses_roa(struct f_inst *what, struct roa_walk *w)
+{
+  for (; what; what = what->next)
+    switch(what->code) {
+    case ',':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '|':
+    case '&':
+    case P('m','p'):
+    case P('m','c'):
+    case P('!','='):
+    case P('=','='):
+    case '<':
+    case P('<','='):
+    case P('!', '~'):
+    case '~':
+    case '?':
+    case P('i','M'):
+    case P('A','p'):
+    case P('C','a'):
+      if (i_uses_roa(what->a1.p, w) || i_uses_roa(what->a2.p, w))
+	return 1;
+      break;
+
+    case P('m','l'):
+      if (i_uses_roa(what->a1.p, w) || i_uses_roa(what->a2.p, w) ||
+	  i_uses_roa(INST3(what).p, w))
+	return 1;
+      break;
+
+    case '!':
+    case P('d','e'):
+    case 'p':
+    case 'L':
+    case P('p',','):
+    case P('P','S'):
+    case P('a','S'):
+    case P('e','S'):
+    case 'r':
+    case P('c','p'):
+    case P('a','f'):
+    case P('a','l'):
+    case P('a','L'):
+      if (i_uses_roa(what->a1.p, w))
+	return 1;
+      break;
+
+    case 's':
+      if (i_uses_roa(what->a2.p, w))
+	return 1;
+      break;
+
+    case 'c': case 'C': case 'V': case '0': case 'E':
+    case 'P': case 'a': case P('e','a'): case P('c','v'):
+      break;
+
+    case P('S','W'):
+      if (i_uses_roa(what->a1.p, w) || tree_uses_roa(what->a2.p, w))
+	return 1;
+      break;
+
+    case P('c','a'):
+      if (i_uses_roa(what->a1.p, w))
+	return 1;
+
+      /* Examine each function body just once */
+      {
+	uint i;
+	for (i = 0; i < w->ncalls; i++)
+	  if (w->calls[i] == what->a2.p)
+	    break;
+
+	if (i < w->ncalls)
+	  break;
+
+	if (w->ncalls < ROA_WALK_MAX_CALLS)
+	  w->calls[w->ncalls++] = what->a2.p;
+
+	if (i_uses_roa(what->a2.p, w))
+	  return 1;
+      }
+      break;
+
+    case P('R','C'):
+      if (!strcmp(((struct f_inst_roa_check *) what)->rtc->name, w->table->name))
+	return 1;
+      if (i_uses_roa(what->a1.p, w) || i_uses_roa(what->a2.p, w))
+	return 1;
+      break;
+
+    default:
+      bug( "Unknown instruction %d in roa walk (%c)", what->code, what->code & 0xff);
+    }
+
+  return 0;
+}
+
+/**
+ * filter_uses_roa - check whether filter depends on a ROA table
+ * @f: filter to be examined
+ * @t: ROA table
+ *
+ * Returns 1 if @f (or any function called from it) calls roa_check()
+ * on ROA table @t, so its results may change when @t is modified.
+ */
+int
+filter_uses_roa(struct filter *f, struct roa_table *t)
+{
+  struct roa_walk w = { .table = t };
+
+  if (f == FILTER_ACCEPT || f == FILTER_REJECT)
+    return 0;
+
+  return i_uses_roa(f->root, &w);
+}
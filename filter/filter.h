@@ -75,13 +75,60 @@ struct f_val {
   } val;
 };
 
+struct f_op {			/* Instruction of compiled filter code */
+  u16 code;			/* Instruction code, as in &f_inst */
+  u16 push;			/* Push result to value stack */
+  uint arg;			/* Jump target or other immediate value */
+  struct f_inst *i;		/* Source instruction with remaining arguments */
+};
+
+struct f_code {			/* Compiled filter code, see f_compile() */
+  uint len;			/* Number of instructions */
+  uint stack;			/* Maximal depth of value stack */
+  uint frames;			/* Maximal depth of function calls */
+  uint slots;			/* Number of attribute cache slots */
+  uint optimized;		/* Number of optimized instructions */
+  uint deps;			/* What the code depends on and modifies, FD_* */
+  struct linpool *pool;		/* Pool the code was allocated from */
+  struct f_prof *prof;		/* Execution profile, see f_run() */
+  struct f_op ops[0];
+};
+
+/* Dependency summary of compiled code, see f_deps() */
+#define FD_NET		0x01	/* Reads network prefix */
+#define FD_RTE		0x02	/* Reads route fields outside rta (preference, temporary attributes) */
+#define FD_SOURCE	0x04	/* Reads source protocol or route source */
+#define FD_ATTRS	0x08	/* Reads other route attributes */
+#define FD_WRITE	0x10	/* Modifies route */
+#define FD_EXTERNAL	0x20	/* Depends on external state (ROA tables) */
+#define FD_OUTPUT	0x40	/* Prints messages */
+
+struct f_prof {			/* Profile of one instruction */
+  u64 count;			/* Number of executions */
+  u64 ticks;			/* Time spent in the instruction */
+};
+
+/*
+ * Profiling clock. We use the CPU cycle counter where it is cheap to read,
+ * otherwise the precise system time.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define F_PROF_UNIT "cycles"
+static inline u64 f_prof_ticks(void) { return __builtin_ia32_rdtsc(); }
+#else
+#define F_PROF_UNIT "us"
+static inline u64 f_prof_ticks(void) { return precise_time(); }
+#endif
+
 struct filter {
   char *name;
   struct f_inst *root;
+  struct f_code *code;		/* Compiled root */
 };
 
 struct f_inst *f_new_inst(void);
 struct f_inst *f_new_dynamic_attr(int type, int f_type, int code);	/* Type as core knows it, type as filters know it, and code of dynamic attribute */
+#define F_EA_ORDERED 0x100		/* Flag in type of list attribute whose order of items is significant */
 struct f_tree *f_new_tree(void);
 struct f_inst *f_generate_complex(int operation, int operation_aux, struct f_inst *dyn, struct f_inst *argument);
 struct f_inst *f_generate_roa_check(struct symbol *sym, struct f_inst *prefix, struct f_inst *asn);
@@ -91,10 +138,14 @@ struct f_tree *build_tree(struct f_tree *);
 struct f_tree *find_tree(struct f_tree *t, struct f_val val);
 int same_tree(struct f_tree *t1, struct f_tree *t2);
 void tree_format(struct f_tree *t, buffer *buf);
+struct f_set_index *build_set_index(struct f_tree *t, linpool *lp);
+int set_index_find(struct f_set_index *idx, struct f_val v);
 
 struct f_trie *f_new_trie(linpool *lp, uint node_size);
 void *trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h);
 int trie_match_prefix(struct f_trie *t, ip_addr px, int plen);
+void trie_walk_covering(struct f_trie *t, void (*hook)(void *data, ip_addr px, int plen), void *data);
+void trie_compile(struct f_trie *t);
 int trie_same(struct f_trie *t1, struct f_trie *t2);
 void trie_format(struct f_trie *t, buffer *buf);
 
@@ -118,14 +169,17 @@ trie_match_fprefix(struct f_trie *t, struct f_prefix *px)
 struct ea_list;
 struct rte;
 
+struct f_code *f_compile(struct f_inst *what, struct linpool *pool);
 int f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags);
-struct f_val f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool);
+struct f_val f_eval_rte(struct f_code *code, struct rte **rte, struct linpool *tmp_pool);
 struct f_val f_eval(struct f_inst *expr, struct linpool *tmp_pool);
+void filter_show_profile(struct symbol *sym);
+void filter_flush_profile(struct symbol *sym);
 uint f_eval_int(struct f_inst *expr);
-u32 f_eval_asn(struct f_inst *expr);
 
 char *filter_name(struct filter *filter);
 int filter_same(struct filter *new, struct filter *old);
+int filter_uses_roa(struct filter *f, struct roa_table *t);
 
 int i_same(struct f_inst *f1, struct f_inst *f2);
 
@@ -145,6 +199,19 @@ void val_format(struct f_val v, buffer *buf);
 #define FILTER_ACCEPT NULL
 #define FILTER_REJECT ((void *) 1)
 
+static inline uint
+filter_deps(struct filter *f)
+{
+  return ((f == FILTER_ACCEPT) || (f == FILTER_REJECT)) ? 0 : f->code->deps;
+}
+
+/* Filter result depends only on rta of the route and the filter has no side effects */
+static inline int
+filter_rta_only(struct filter *f)
+{
+  return !(filter_deps(f) & (FD_NET | FD_RTE | FD_WRITE | FD_EXTERNAL | FD_OUTPUT));
+}
+
 /* Type numbers must be in 0..0xff range */
 #define T_MASK 0xff
 
@@ -209,6 +276,13 @@ struct f_tree {
   void *data;
 };
 
+struct f_set_index {
+  int type;				/* Type of indexed values */
+  uint len;				/* Number of single values */
+  void *data;				/* Sorted array of single values (u32, u64 or lcomm) */
+  struct f_tree *ranges;		/* Tree of remaining ranges */
+};
+
 struct f_trie_node
 {
   ip_addr addr, mask, accept;
@@ -216,11 +290,21 @@ struct f_trie_node
   struct f_trie_node *c[2];
 };
 
+struct f_trie_stride
+{
+  u64 local[4];				/* Accepted prefixes ending in the stride, indexed by (1 << len) | bits */
+  u64 inner[4];				/* Bytes leading to inner nodes */
+  u64 leaf[4];				/* Bytes where the leaf changes */
+  u32 inner_base, leaf_base;		/* Index of the first inner node and leaf */
+};
+
 struct f_trie
 {
   linpool *lp;
   int zero;
   uint node_size;
+  struct f_trie_stride *stride;		/* Compiled trie, see trie_compile() */
+  ip_addr *leaves;
   struct f_trie_node root[0];		/* Root trie node follows */
 };
 
@@ -174,3 +174,171 @@ tree_format(struct f_tree *t, buffer *buf)
 
   buffer_puts(buf, "]");
 }
+
+
+/*
+ *	Set index
+ *
+ * Matching a route attribute against a large set of communities walks the
+ * tree and calls val_compare() for each community in the list, which is
+ * slow. Sets of plain integer-like values are therefore indexed as sorted
+ * arrays of raw values, searched by a branch-free binary search. Ranges stay
+ * in a (smaller) tree which is searched only when the value is not found
+ * in the array.
+ */
+
+static inline int
+set_index_type(int type)
+{
+  switch (type)
+  {
+  case T_INT:
+  case T_PAIR:
+  case T_QUAD:
+  case T_EC:
+  case T_LC:
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+static int
+set_index_count(struct f_tree *t, int type, uint *points)
+{
+  if (!t)
+    return 1;
+
+  if ((t->from.type != type) || (t->to.type != type))
+    return 0;
+
+  if (!val_compare(t->from, t->to))
+    (*points)++;
+
+  return set_index_count(t->left, type, points) &&
+    set_index_count(t->right, type, points);
+}
+
+/* In-order walk, so the array is filled already sorted */
+static void
+set_index_fill(struct f_tree *t, struct f_set_index *idx, linpool *lp, struct f_tree **ranges)
+{
+  if (!t)
+    return;
+
+  set_index_fill(t->left, idx, lp, ranges);
+
+  if (val_compare(t->from, t->to))
+  {
+    struct f_tree *r = lp_alloc(lp, sizeof(struct f_tree));
+    *r = (struct f_tree) { .left = *ranges, .from = t->from, .to = t->to };
+    *ranges = r;
+  }
+  else switch (idx->type)
+  {
+  case T_EC: ((u64 *) idx->data)[idx->len++] = t->from.val.ec; break;
+  case T_LC: ((lcomm *) idx->data)[idx->len++] = t->from.val.lc; break;
+  default:   ((u32 *) idx->data)[idx->len++] = t->from.val.i; break;
+  }
+
+  set_index_fill(t->right, idx, lp, ranges);
+}
+
+/**
+ * build_set_index - build index of a set
+ * @t: set tree, as returned by build_tree()
+ * @lp: linpool to allocate the index from
+ *
+ * Builds sorted array of single values of the set @t for set_index_find().
+ * Returns NULL if the set does not contain any single values or if its
+ * values are not suitable for indexing.
+ */
+struct f_set_index *
+build_set_index(struct f_tree *t, linpool *lp)
+{
+  struct f_set_index *idx;
+  struct f_tree *ranges = NULL;
+  uint points = 0;
+  uint size;
+
+  if (!t || !set_index_type(t->from.type) ||
+      !set_index_count(t, t->from.type, &points) || !points)
+    return NULL;
+
+  switch (t->from.type)
+  {
+  case T_EC: size = sizeof(u64); break;
+  case T_LC: size = sizeof(lcomm); break;
+  default:   size = sizeof(u32); break;
+  }
+
+  idx = lp_alloc(lp, sizeof(struct f_set_index));
+  idx->type = t->from.type;
+  idx->len = 0;
+  idx->data = lp_alloc(lp, points * size);
+
+  set_index_fill(t, idx, lp, &ranges);
+  idx->ranges = build_tree(ranges);
+
+  return idx;
+}
+
+static inline int
+lc_le(lcomm v1, lcomm v2)
+{
+  if (v1.asn != v2.asn)
+    return v1.asn < v2.asn;
+  if (v1.ldp1 != v2.ldp1)
+    return v1.ldp1 < v2.ldp1;
+  return v1.ldp2 <= v2.ldp2;
+}
+
+/* Branch-free search for the last item not greater than the key */
+#define SET_INDEX_SEARCH(a, n, le, key) ({ \
+  while (n > 1) { uint half_ = n / 2; a = le(a[half_], key) ? a + half_ : a; n -= half_; } })
+
+#define SET_INDEX_LE(v1, v2) ((v1) <= (v2))
+
+/**
+ * set_index_find - check whether value is in indexed set
+ * @idx: set index from build_set_index()
+ * @v: value to find, must be of the indexed type
+ *
+ * Returns 1 if @v is in the set, 0 otherwise.
+ */
+int
+set_index_find(struct f_set_index *idx, struct f_val v)
+{
+  uint n = idx->len;
+  int found;
+
+  switch (idx->type)
+  {
+  case T_EC:
+    {
+      u64 *a = idx->data;
+      SET_INDEX_SEARCH(a, n, SET_INDEX_LE, v.val.ec);
+      found = (*a == v.val.ec);
+      break;
+    }
+
+  case T_LC:
+    {
+      lcomm *a = idx->data;
+      SET_INDEX_SEARCH(a, n, lc_le, v.val.lc);
+      found = (a->asn == v.val.lc.asn) && (a->ldp1 == v.val.lc.ldp1) && (a->ldp2 == v.val.lc.ldp2);
+      break;
+    }
+
+  default:
+    {
+      u32 *a = idx->data;
+      SET_INDEX_SEARCH(a, n, SET_INDEX_LE, v.val.i);
+      found = (*a == v.val.i);
+      break;
+    }
+  }
+
+  return found || (idx->ranges && find_tree(idx->ranges, v));
+}
@@ -67,9 +67,20 @@
  *
  * The walking code in trie_match_prefix() is structured according to
  * these cases.
+ *
+ * Constant prefix sets are frozen and compiled by trie_compile() to a
+ * multibit trie with 8-bit strides, which is then used for matching instead
+ * of the binary trie. Each stride node represents one prefix with length
+ * divisible by 8 and contains bitmaps of accepted prefixes ending within the
+ * stride, of bytes leading to further stride nodes and of leaf changes,
+ * similarly to Poptrie. Children and leaves of a node are stored in arrays
+ * indexed by popcount of the respective bitmaps. A leaf represents a subtree
+ * of the binary trie where the result depends only on the prefix length, so
+ * it is a mask of accepted lengths in the same format as &accept.
  */
 
 #include "nest/bird.h"
+#include "lib/buffer.h"
 #include "lib/string.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
@@ -126,6 +137,10 @@ attach_node(struct f_trie_node *parent, struct f_trie_node *child)
 void *
 trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h)
 {
+  /* Compiled trie is no longer valid */
+  t->stride = NULL;
+  t->leaves = NULL;
+
   if (l == 0)
     t->zero = 1;
   else
@@ -196,27 +211,12 @@ trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h)
   return a;
 }
 
-/**
- * trie_match_prefix
- * @t: trie
- * @px: prefix address
- * @plen: prefix length
- *
- * Tries to find a matching prefix pattern in the trie such that
- * prefix @px/@plen matches that prefix pattern. Returns 1 if there
- * is such prefix pattern in the trie.
- */
-int
-trie_match_prefix(struct f_trie *t, ip_addr px, int plen)
+/* Walk the binary trie from node @n, @paddr must be masked to @plen */
+static int
+trie_match_node(struct f_trie_node *n, ip_addr paddr, int plen)
 {
   ip_addr pmask = ipa_mkmask(plen);
-  ip_addr paddr = ipa_and(px, pmask);
-
-  if (plen == 0)
-    return t->zero;
-
   int plentest = plen - 1;
-  struct f_trie_node *n = t->root;
 
   while(n)
     {
@@ -241,6 +241,281 @@ trie_match_prefix(struct f_trie *t, ip_addr px, int plen)
   return 0;
 }
 
+static inline uint
+trie_bits(ip_addr a, uint pos, uint n)
+{
+#ifdef IPV6
+  u32 w = a.addr[pos / 32];
+#else
+  u32 w = _I(a);
+#endif
+
+  return (w >> (32 - (pos % 32) - n)) & ((1 << n) - 1);
+}
+
+static inline uint
+trie_rank(const u64 *bv, uint pos)
+{
+  uint i, k = 0;
+
+  for (i = 0; i < pos / 64; i++)
+    k += u64_popcount(bv[i]);
+
+  return k + u64_popcount(bv[i] & (~0ULL >> (63 - pos % 64)));
+}
+
+static inline int
+trie_test(const u64 *bv, uint pos)
+{ return (bv[pos / 64] >> (pos % 64)) & 1; }
+
+static int
+trie_match_stride(struct f_trie *t, ip_addr px, int plen)
+{
+  struct f_trie_stride *n = t->stride;
+  uint pos = 0, c;
+
+  while (plen - pos >= 8)
+  {
+    c = trie_bits(px, pos, 8);
+
+    if (!trie_test(n->inner, c))
+      return !!ipa_getbit(t->leaves[n->leaf_base + trie_rank(n->leaf, c) - 1], plen - 1);
+
+    n = t->stride + n->inner_base + trie_rank(n->inner, c) - 1;
+    pos += 8;
+  }
+
+  c = plen - pos;
+  return trie_test(n->local, (1 << c) | (c ? trie_bits(px, pos, c) : 0));
+}
+
+/**
+ * trie_match_prefix
+ * @t: trie
+ * @px: prefix address
+ * @plen: prefix length
+ *
+ * Tries to find a matching prefix pattern in the trie such that
+ * prefix @px/@plen matches that prefix pattern. Returns 1 if there
+ * is such prefix pattern in the trie.
+ */
+int
+trie_match_prefix(struct f_trie *t, ip_addr px, int plen)
+{
+  if (plen == 0)
+    return t->zero;
+
+  if (t->stride)
+    return trie_match_stride(t, px, plen);
+
+  return trie_match_node(t->root, ipa_and(px, ipa_mkmask(plen)), plen);
+}
+
+static void
+trie_walk_node_covering(struct f_trie_node *n, void (*hook)(void *data, ip_addr px, int plen), void *data)
+{
+  if (!n)
+    return;
+
+  /* Node accepts its prefix and all subprefixes (accept mask bits plen-1 and up) */
+  if (n->plen && ipa_zero(ipa_not(ipa_or(n->accept, ipa_mkmask(n->plen - 1)))))
+  {
+    hook(data, n->addr, n->plen);
+    return;
+  }
+
+  trie_walk_node_covering(n->c[0], hook, data);
+  trie_walk_node_covering(n->c[1], hook, data);
+}
+
+/**
+ * trie_walk_covering - walk prefixes matching all their subprefixes
+ * @t: trie to walk
+ * @hook: function called for each prefix
+ * @data: argument passed to @hook
+ *
+ * For each prefix pattern @px/@plen{@plen,max} (i.e. a prefix with all its
+ * subprefixes) in the trie, which is not covered by another such pattern,
+ * calls @hook with @px and @plen. Other prefix patterns are skipped.
+ */
+void
+trie_walk_covering(struct f_trie *t, void (*hook)(void *data, ip_addr px, int plen), void *data)
+{
+  if (t->zero && ipa_zero(ipa_not(t->root->accept)))
+  {
+    hook(data, IPA_NONE, 0);
+    return;
+  }
+
+  trie_walk_node_covering(t->root, hook, data);
+}
+
+
+struct trie_compiler {
+  struct f_trie *trie;
+  BUFFER(struct f_trie_stride) nodes;
+  BUFFER(ip_addr) leaves;
+};
+
+static inline ip_addr
+trie_set_bits(ip_addr a, uint pos, uint n, uint v)
+{
+  if (!n)
+    return a;
+
+#ifdef IPV6
+  a.addr[pos / 32] |= v << (32 - (pos % 32) - n);
+  return a;
+#else
+  return _MI4(_I(a) | (v << (32 - pos - n)));
+#endif
+}
+
+/*
+ * Walk all prefixes @px of length @pos + @i within the stride node @idx, @v are
+ * their last @i bits. Node @m is the first node of the binary trie on the path
+ * with plen >= @pos + @i, @acc are merged accept masks of the nodes above it.
+ * Prefixes of the next stride (@i == 8) are stored to @cn and @cacc.
+ */
+static void
+trie_walk_stride(struct trie_compiler *tc, struct f_trie_stride *sn, ip_addr px, uint pos, uint i, uint v,
+		 struct f_trie_node *m, ip_addr acc, struct f_trie_node **cn, ip_addr *cacc)
+{
+  uint len = pos + i;
+  uint b;
+
+  /* Node out of path, it cannot match this nor any longer prefix */
+  if (m && ipa_compare(px, ipa_and(m->addr, ipa_mkmask(len))))
+    m = NULL;
+
+  if (i == 8)
+  {
+    cn[v] = m;
+    cacc[v] = ipa_and(acc, ipa_not(ipa_mkmask(len - 1)));
+    return;
+  }
+
+  /* No more nodes, the result depends just on length */
+  if (!m && len)
+  {
+    uint j, k, n;
+
+    for (j = i; (j < 8) && (pos + j <= MAX_PREFIX_LENGTH); j++)
+      if (ipa_getbit(acc, pos + j - 1))
+	for (k = (1 << j) | (v << (j - i)), n = 1 << (j - i); n--; k++)
+	  sn->local[k / 64] |= 1ULL << (k % 64);
+
+    if (pos + 8 <= MAX_PREFIX_LENGTH)
+    {
+      ip_addr a = ipa_and(acc, ipa_not(ipa_mkmask(pos + 7)));
+
+      for (k = v << (8 - i), n = 1 << (8 - i); n--; k++)
+      {
+	cn[k] = NULL;
+	cacc[k] = a;
+      }
+    }
+
+    return;
+  }
+
+  if (len ? (ipa_getbit(acc, len - 1) || (m && ipa_getbit(m->accept, len - 1))) : tc->trie->zero)
+    sn->local[((1 << i) | v) / 64] |= 1ULL << (((1 << i) | v) % 64);
+
+  if (len == MAX_PREFIX_LENGTH)
+    return;
+
+  /* Longer prefixes walk through the node */
+  if (m && (m->plen == (int) len))
+    acc = ipa_or(acc, m->accept);
+
+  for (b = 0; b < 2; b++)
+    trie_walk_stride(tc, sn, trie_set_bits(px, len, 1, b), pos, i + 1, 2 * v + b,
+		     (m && (m->plen == (int) len)) ? m->c[b] : m, acc, cn, cacc);
+}
+
+/*
+ * Fill stride node @idx for prefix @px/@pos, see trie_walk_stride() for @n
+ * and @acc.
+ */
+static void
+trie_compile_node(struct trie_compiler *tc, uint idx, ip_addr px, uint pos, struct f_trie_node *n, ip_addr acc)
+{
+  struct f_trie_node *cn[256];
+  ip_addr cacc[256];
+  uint base, i, v;
+  int last = -1;
+
+  trie_walk_stride(tc, &tc->nodes.data[idx], px, pos, 0, 0, n, acc, cn, cacc);
+
+  if (pos + 8 > MAX_PREFIX_LENGTH)
+    return;
+
+  /* Leaves, stored only when changed */
+  tc->nodes.data[idx].leaf_base = tc->leaves.used;
+  for (v = 0; v < 256; v++)
+  {
+    if (cn[v])
+      continue;
+
+    if ((last < 0) || !ipa_equal(cacc[v], cacc[last]))
+    {
+      BUFFER_PUSH(tc->leaves) = cacc[v];
+      tc->nodes.data[idx].leaf[v / 64] |= 1ULL << (v % 64);
+    }
+
+    last = v;
+  }
+
+  /* Inner nodes, allocated together before filling them */
+  base = tc->nodes.used;
+  for (v = 0, i = 0; v < 256; v++)
+    if (cn[v])
+    {
+      tc->nodes.data[idx].inner[v / 64] |= 1ULL << (v % 64);
+      i++;
+    }
+
+  if (!i)
+    return;
+
+  tc->nodes.data[idx].inner_base = base;
+  memset(BUFFER_INC(tc->nodes, i), 0, i * sizeof(struct f_trie_stride));
+
+  for (v = 0, i = 0; v < 256; v++)
+    if (cn[v])
+      trie_compile_node(tc, base + i++, trie_set_bits(px, pos, 8, v), pos + 8, cn[v], cacc[v]);
+}
+
+/**
+ * trie_compile
+ * @t: trie to be compiled
+ *
+ * Builds the multibit representation of the trie @t, which is then used
+ * by trie_match_prefix(). The trie must not be modified afterwards, adding
+ * a prefix drops the compiled representation.
+ */
+void
+trie_compile(struct f_trie *t)
+{
+  struct trie_compiler tc = { .trie = t };
+
+  BUFFER_INIT(tc.nodes, &root_pool, 16);
+  BUFFER_INIT(tc.leaves, &root_pool, 64);
+
+  memset(BUFFER_INC(tc.nodes, 1), 0, sizeof(struct f_trie_stride));
+  trie_compile_node(&tc, 0, IPA_NONE, 0, t->root, IPA_NONE);
+
+  t->stride = lp_alloc(t->lp, tc.nodes.used * sizeof(struct f_trie_stride));
+  memcpy(t->stride, tc.nodes.data, tc.nodes.used * sizeof(struct f_trie_stride));
+
+  t->leaves = lp_alloc(t->lp, (tc.leaves.used ?: 1) * sizeof(ip_addr));
+  memcpy(t->leaves, tc.leaves.data, tc.leaves.used * sizeof(ip_addr));
+
+  mb_free(tc.nodes.data);
+  mb_free(tc.leaves.data);
+}
+
 static int
 trie_node_same(struct f_trie_node *t1, struct f_trie_node *t2)
 {
@@ -93,6 +93,8 @@ typedef s64 btime;
 #define US	US_
 #endif
 
+btime precise_time(void);		/* Not cached, for measuring durations (sysdep) */
+
 
 /* Rate limiting */
 
@@ -0,0 +1,203 @@
+/*
+ *	BIRD Library -- Open-Addressing Hash Table
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/hash.h"
+
+/* Number of old table slots visited during each insert while migrating */
+#define OA_MIGRATE_STEPS 4
+
+static inline uint
+oa_home(u32 hash, uint order)
+{
+  return hash >> (32 - order);
+}
+
+static void
+oa_put(struct oa_slot *data, uint order, u32 hash, void *node)
+{
+  uint mask = (1U << order) - 1;
+  uint i = oa_home(hash, order);
+
+  while (data[i].node)
+    i = (i + 1) & mask;
+
+  data[i].hash = hash;
+  data[i].node = node;
+}
+
+/*
+ * Backward-shift deletion: after emptying slot @i, move later nodes of the
+ * same cluster back unless that would place them before their home slot.
+ */
+static void
+oa_del(struct oa_slot *data, uint order, uint i)
+{
+  uint mask = (1U << order) - 1;
+  uint j = i, k;
+
+  for (;;)
+  {
+    data[i].node = NULL;
+
+    do
+    {
+      j = (j + 1) & mask;
+      if (!data[j].node)
+	return;
+
+      k = oa_home(data[j].hash, order);
+    }
+    while ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)));
+
+    data[i] = data[j];
+    i = j;
+  }
+}
+
+static int
+oa_lookup(struct oa_slot *data, uint order, u32 hash, void *node)
+{
+  uint mask = (1U << order) - 1;
+  uint i;
+
+  for (i = oa_home(hash, order); data[i].node; i = (i + 1) & mask)
+    if (data[i].node == node)
+      return i;
+
+  return -1;
+}
+
+/*
+ * Move nodes from the old table to the current one. Slots before old_pos
+ * are always empty, as oa_del() never shifts nodes across an empty slot.
+ */
+static void
+oa_migrate(struct oa_hash *h, uint steps)
+{
+  uint size = 1U << h->old_order;
+
+  while (h->old_count && steps-- && (h->old_pos < size))
+  {
+    struct oa_slot *s = &h->old[h->old_pos];
+
+    if (s->node)
+    {
+      oa_put(h->data, h->order, s->hash, s->node);
+      oa_del(h->old, h->old_order, h->old_pos);
+      h->old_count--;
+    }
+    else
+      h->old_pos++;
+  }
+
+  if (!h->old_count)
+  {
+    mb_free(h->old);
+    h->old = NULL;
+  }
+}
+
+static void
+oa_grow(struct oa_hash *h, pool *p)
+{
+  /* Should not happen with reasonable migration rate, but be safe */
+  if (h->old)
+    oa_migrate(h, ~0U);
+
+  DBG("Growing open-addressing hash from order %u\n", h->order);
+
+  h->old = h->data;
+  h->old_order = h->order;
+  h->old_count = h->count;
+  h->old_pos = 0;
+
+  h->order++;
+  h->data = mb_allocz(p, (1U << h->order) * sizeof(struct oa_slot));
+}
+
+/**
+ * oa_hash_init - initialize an open-addressing hash table
+ * @h: hash table
+ * @p: pool to allocate slot arrays from
+ * @order: initial order (log2 of the number of slots)
+ */
+void
+oa_hash_init(struct oa_hash *h, pool *p, uint order)
+{
+  ASSERT((order > 0) && (order < 32));
+
+  *h = (struct oa_hash) { .order = order };
+  h->data = mb_allocz(p, (1U << order) * sizeof(struct oa_slot));
+}
+
+/**
+ * oa_hash_free - free an open-addressing hash table
+ * @h: hash table
+ *
+ * Releases slot arrays of the table. Nodes themselves are not touched.
+ */
+void
+oa_hash_free(struct oa_hash *h)
+{
+  mb_free(h->data);
+  mb_free(h->old);
+  *h = (struct oa_hash) { };
+}
+
+/**
+ * oa_hash_insert - insert a node to an open-addressing hash table
+ * @h: hash table
+ * @p: pool used when the table grows
+ * @hash: hash value of the node
+ * @node: node to insert
+ *
+ * The node must not already be present. If the table is being resized,
+ * a few more nodes of the old table are migrated.
+ */
+void
+oa_hash_insert(struct oa_hash *h, pool *p, u32 hash, void *node)
+{
+  if (h->old)
+    oa_migrate(h, OA_MIGRATE_STEPS);
+
+  if ((h->count + 1) > ((3U << h->order) / 4))
+    oa_grow(h, p);
+
+  oa_put(h->data, h->order, hash, node);
+  h->count++;
+}
+
+/**
+ * oa_hash_remove - remove a node from an open-addressing hash table
+ * @h: hash table
+ * @hash: hash value of the node
+ * @node: node to remove
+ *
+ * Result: @node if it was found and removed, %NULL otherwise.
+ */
+void *
+oa_hash_remove(struct oa_hash *h, u32 hash, void *node)
+{
+  int i;
+
+  if ((i = oa_lookup(h->data, h->order, hash, node)) >= 0)
+    oa_del(h->data, h->order, i);
+  else if (h->old && ((i = oa_lookup(h->old, h->old_order, hash, node)) >= 0))
+  {
+    oa_del(h->old, h->old_order, i);
+    h->old_count--;
+
+    if (!h->old_count)
+      oa_migrate(h, 0);
+  }
+  else
+    return NULL;
+
+  h->count--;
+  return node;
+}
@@ -194,4 +194,72 @@
 
 #define HASH_WALK_FILTER_END } while (0)
 
+
+/*
+ *	Open-addressing hash table
+ *
+ *	Nodes are kept in a flat array of slots, each holding the node pointer
+ *	together with its cached 32-bit hash value, so probing walks a contiguous
+ *	array and touches the nodes themselves only on a hash match. Collisions
+ *	are resolved by linear probing and deletion uses backward shifting, so
+ *	there are no tombstones. When the table gets 3/4 full, a table of double
+ *	size is allocated and nodes are migrated from the old one incrementally
+ *	on subsequent inserts, so no single insert pays for a complete rehash.
+ *
+ *	The caller computes the full 32-bit hash (its upper bits are used for
+ *	the slot index, so it should be well mixed, e.g. by u32_hash()) and
+ *	passes it to all operations. id##_KEY() and id##_EQ() have the same
+ *	meaning as for HASH() above.
+ */
+
+struct pool;
+
+struct oa_slot {
+  u32 hash;
+  void *node;				/* NULL for empty slot */
+};
+
+struct oa_hash {
+  struct oa_slot *data;			/* Current table */
+  struct oa_slot *old;			/* Table being migrated, or NULL */
+  uint count, order;			/* Number of nodes in both tables, order of current table */
+  uint old_count, old_order, old_pos;	/* Nodes left in old table, its order, migration position */
+};
+
+#define OA_HASH(type)		union { struct oa_hash h; type *type_; }
+#define OA_HASH_TYPE(v)		typeof(* (v).type_)
+#define OA_HASH_COUNT(v)	((v).h.count)
+
+#define OA_HASH_INIT(v,pool,init_order)	oa_hash_init(&(v).h, pool, init_order)
+#define OA_HASH_FREE(v)			oa_hash_free(&(v).h)
+#define OA_HASH_INSERT(v,pool,hv,node)	oa_hash_insert(&(v).h, pool, hv, node)
+#define OA_HASH_REMOVE(v,hv,node)	((OA_HASH_TYPE(v) *) oa_hash_remove(&(v).h, hv, node))
+
+#define OA_HASH_FIND(v,id,hv,key...)					\
+  ({									\
+    u32 _hv = (hv);							\
+    OA_HASH_TYPE(v) *_n = NULL;						\
+    struct oa_slot *_d = (v).h.data;					\
+    uint _o = (v).h.order;						\
+    uint _i, _m, _t;							\
+									\
+    for (_t = 0; _d && !_n; _t++)					\
+    {									\
+      _m = (1U << _o) - 1;						\
+      for (_i = _hv >> (32 - _o); _d[_i].node; _i = (_i + 1) & _m)	\
+	if ((_d[_i].hash == _hv) &&					\
+	    HASH_EQ(v, id, id##_KEY(((OA_HASH_TYPE(v) *) _d[_i].node)), key)) \
+	{ _n = _d[_i].node; break; }					\
+									\
+      _d = _t ? NULL : (v).h.old;					\
+      _o = (v).h.old_order;						\
+    }									\
+    _n;									\
+  })
+
+void oa_hash_init(struct oa_hash *h, struct pool *p, uint order);
+void oa_hash_free(struct oa_hash *h);
+void oa_hash_insert(struct oa_hash *h, struct pool *p, u32 hash, void *node);
+void *oa_hash_remove(struct oa_hash *h, u32 hash, void *node);
+
 #endif
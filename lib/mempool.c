@@ -199,6 +199,26 @@ lp_flush(linpool *m)
   m->total_large = 0;
 }
 
+/**
+ * lp_used - amount of memory allocated from a linear memory pool
+ * @m: linear memory pool
+ *
+ * This function returns the number of bytes allocated from @m since
+ * its creation or the last lp_flush(), including alignment and unused
+ * ends of chunks.
+ */
+uint
+lp_used(linpool *m)
+{
+  struct lp_chunk *c;
+  uint used = m->total_large - (m->end - m->ptr);
+
+  for (c = m->first; c != m->current; c = c->next)
+    used += c->size;
+
+  return used;
+}
+
 static void
 lp_free(resource *r)
 {
@@ -64,6 +64,7 @@ void *lp_alloc(linpool *, unsigned size);	/* Aligned */
 void *lp_allocu(linpool *, unsigned size);	/* Unaligned */
 void *lp_allocz(linpool *, unsigned size);	/* With clear */
 void lp_flush(linpool *);			/* Free everything, but leave linpool */
+uint lp_used(linpool *);			/* Amount of memory allocated since last flush */
 
 /* Slabs */
 
@@ -27,6 +27,13 @@ get_u16(const void *p)
   return ntohs(x);
 }
 
+static inline u32
+get_u24(const void *p)
+{
+  const byte *b = p;
+  return (b[0] << 16) | (b[1] << 8) | b[2];
+}
+
 static inline u32
 get_u32(const void *p)
 {
@@ -51,6 +58,15 @@ put_u16(void *p, u16 x)
   memcpy(p, &x, 2);
 }
 
+static inline void
+put_u24(void *p, u32 x)
+{
+  byte *b = p;
+  b[0] = x >> 16;
+  b[1] = x >> 8;
+  b[2] = x;
+}
+
 static inline void
 put_u32(void *p, u32 x)
 {
@@ -7,6 +7,8 @@
  *	Can be freely distributed and used under the terms of the GNU GPL.
  */
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/attrs.h"
@@ -532,11 +534,9 @@ as_path_match(struct adata *path, struct f_path_mask *mask)
 	  break;
 
 	case PM_ASN:	/* Define single ASN as ASN..ASN - very narrow interval */
+	case PM_ASN_EXPR:	/* Expression value is filled by filters before matching */
 	  val2 = val = mask->val;
 	  goto step;
-	case PM_ASN_EXPR:
-	  val2 = val = f_eval_asn((struct f_inst *) mask->val);
-	  goto step;
 	case PM_ASN_RANGE:
 	  val = mask->val;
 	  val2 = mask->val2;
@@ -565,3 +565,167 @@ as_path_match(struct adata *path, struct f_path_mask *mask)
 
   return pos[plen].mark;
 }
+
+
+/*
+ * Path masks without expressions may be compiled to a bit-parallel NFA with
+ * mask items as states, while the AS path is the input. A state k means that
+ * first k items of the mask were matched, asterisks keep their state when
+ * consuming an ASN and have epsilon transitions to the next state. ASNs are
+ * split to classes by boundaries of all ranges in the mask, so that each
+ * class matches the same set of items. AS sets in a path do not fit into
+ * this model, such paths are matched by as_path_match().
+ */
+
+#define PM_NFA_MAX	63	/* States must fit into u64 */
+
+static int
+pm_bound_cmp(const void *a, const void *b)
+{
+  u32 x = *(const u32 *) a, y = *(const u32 *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * as_path_compile - compile path mask to NFA
+ * @mask: path mask without expressions
+ * @pool: linpool to allocate the NFA from
+ *
+ * Returns compiled mask for as_path_match_nfa(), or NULL if the mask contains
+ * expressions or is too long.
+ */
+struct pm_nfa *
+as_path_compile(struct f_path_mask *mask, struct linpool *pool)
+{
+  struct pm_nfa *nfa;
+  struct f_path_mask *m;
+  u32 lo[PM_NFA_MAX], hi[PM_NFA_MAX], b[2 * PM_NFA_MAX];
+  uint n = 0, nb = 0, i, j, k;
+
+  for (m = mask; m; m = m->next)
+  {
+    if ((m->kind == PM_ASN_EXPR) || (n == PM_NFA_MAX))
+      return NULL;
+
+    n++;
+  }
+
+  nfa = lp_allocz(pool, sizeof(struct pm_nfa));
+  nfa->mask = mask;
+  nfa->states = n;
+
+  for (m = mask, k = 0; m; m = m->next, k++)
+    switch (m->kind)
+    {
+    case PM_ASTERISK:
+      nfa->star |= 1ULL << k;
+      lo[k] = 1;
+      hi[k] = 0;
+      break;
+
+    case PM_QUESTION:
+      lo[k] = 0;
+      hi[k] = 0xffffffff;
+      break;
+
+    case PM_ASN:
+    case PM_ASN_RANGE:
+      lo[k] = m->val;
+      hi[k] = (m->kind == PM_ASN) ? m->val : m->val2;
+
+      /* Class boundaries */
+      b[nb++] = lo[k];
+      if (hi[k] != 0xffffffff)
+	b[nb++] = hi[k] + 1;
+      break;
+    }
+
+  qsort(b, nb, sizeof(u32), pm_bound_cmp);
+
+  /* Remove duplicates and zero, class 0 always starts at 0 */
+  for (i = j = 0; i < nb; i++)
+    if (b[i] && (!j || (b[i] != b[j-1])))
+      b[j++] = b[i];
+
+  nfa->bounds = lp_alloc(pool, (j ?: 1) * sizeof(u32));
+  memcpy(nfa->bounds, b, j * sizeof(u32));
+  nfa->classes = j + 1;
+
+  /* Items matching each class, represented by its lowest ASN */
+  nfa->match = lp_allocz(pool, nfa->classes * sizeof(u64));
+  for (i = 0; i < nfa->classes; i++)
+  {
+    u32 asn = i ? nfa->bounds[i-1] : 0;
+
+    for (k = 0; k < n; k++)
+      if ((asn >= lo[k]) && (asn <= hi[k]))
+	nfa->match[i] |= 1ULL << k;
+  }
+
+  return nfa;
+}
+
+static inline u64
+pm_nfa_closure(struct pm_nfa *nfa, u64 s)
+{
+  u64 t;
+
+  while ((t = s | ((s & nfa->star) << 1)) != s)
+    s = t;
+
+  return s;
+}
+
+static inline u64
+pm_nfa_class(struct pm_nfa *nfa, u32 asn)
+{
+  u32 *a = nfa->bounds;
+  uint n = nfa->classes - 1;
+
+  if (!n || (asn < a[0]))
+    return nfa->match[0];
+
+  /* Branch-free search for the last boundary not greater than asn */
+  while (n > 1)
+  {
+    uint half = n / 2;
+    a = (a[half] <= asn) ? a + half : a;
+    n -= half;
+  }
+
+  return nfa->match[a - nfa->bounds + 1];
+}
+
+/**
+ * as_path_match_nfa - match path against compiled path mask
+ * @path: AS path
+ * @nfa: path mask compiled by as_path_compile()
+ *
+ * Equivalent to as_path_match() with the original mask.
+ */
+int
+as_path_match_nfa(struct adata *path, struct pm_nfa *nfa)
+{
+  u8 *p = path->data;
+  u8 *q = p + path->length;
+  u64 s = pm_nfa_closure(nfa, 1);
+  int i, len;
+
+  while (p < q)
+  {
+    if (*p++ != AS_PATH_SEQUENCE)
+      return as_path_match(path, nfa->mask);
+
+    len = *p++;
+    for (i = 0; i < len; i++, p += BS)
+    {
+      s = ((s & pm_nfa_class(nfa, get_as(p))) << 1) | (s & nfa->star);
+      s = pm_nfa_closure(nfa, s);
+    }
+
+    if (!s)
+      return 0;
+  }
+
+  return (s >> nfa->states) & 1;
+}
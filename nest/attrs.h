@@ -56,6 +56,18 @@ struct f_path_mask {
 
 int as_path_match(struct adata *path, struct f_path_mask *mask);
 
+struct pm_nfa {
+  struct f_path_mask *mask;		/* Original mask, for paths with AS sets */
+  uint states;				/* Number of mask items */
+  uint classes;				/* Number of ASN classes */
+  u64 star;				/* Items that are asterisks */
+  u32 *bounds;				/* First ASN of each class except the first one */
+  u64 *match;				/* Items matching ASNs of each class */
+};
+
+struct pm_nfa *as_path_compile(struct f_path_mask *mask, struct linpool *pool);
+int as_path_match_nfa(struct adata *path, struct pm_nfa *nfa);
+
 /* a-set.c */
 
 
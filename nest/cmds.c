@@ -43,11 +43,24 @@ cmd_show_status(void)
     cli_msg(13, "Daemon is up and running");
 }
 
+static void
+cmd_show_symbol(int code, struct symbol *sym)
+{
+  struct filter *f = sym->def;
+
+  /* Size of compiled code, including called functions */
+  if ((sym->class == SYM_FILTER) && f && f->code)
+    cli_msg(code, "%-8s\t%s (%u instructions, %u optimized)", sym->name,
+	    cf_symbol_class_name(sym), f->code->len, f->code->optimized);
+  else
+    cli_msg(code, "%-8s\t%s", sym->name, cf_symbol_class_name(sym));
+}
+
 void
 cmd_show_symbols(struct sym_show_data *sd)
 {
   if (sd->sym)
-    cli_msg(1010, "%-8s\t%s", sd->sym->name, cf_symbol_class_name(sd->sym));
+    cmd_show_symbol(1010, sd->sym);
   else
   {
     HASH_WALK(config->sym_hash, next, sym)
@@ -58,7 +71,7 @@ cmd_show_symbols(struct sym_show_data *sd)
       if (sd->type && (sym->class != sd->type))
 	continue;
 
-      cli_msg(-1010, "%-8s\t%s", sym->name, cf_symbol_class_name(sym));
+      cmd_show_symbol(-1010, sym);
     }
     HASH_WALK_END;
 
@@ -223,7 +223,10 @@ proto_unlink_ahooks(struct proto *p)
 
   if (p->rt_notify)
     for(h=p->ahooks; h; h=h->next)
+    {
       rem_node(&h->n);
+      rt_flush_any_sel(h);
+    }
 }
 
 static void
@@ -234,6 +237,8 @@ proto_free_ahooks(struct proto *p)
   for(h = p->ahooks; h; h = hn)
   {
     hn = h->next;
+    rt_flush_import_memo(h);
+    rt_flush_any_sel(h);
     mb_free(h);
   }
 
@@ -438,6 +443,7 @@ proto_reconfigure(struct proto *p, struct proto_config *oc, struct proto_config
   if (p->main_ahook)
     {  
       struct announce_hook *ah = p->main_ahook;
+      rt_flush_import_memo(ah);
       ah->in_filter = nc->in_filter;
       ah->out_filter = nc->out_filter;
       ah->rx_limit = nc->rx_limit;
@@ -926,6 +932,9 @@ protos_build(void)
 #ifdef CONFIG_BABEL
   proto_build(&proto_babel);
 #endif
+#ifdef CONFIG_RPKI
+  proto_build(&proto_rpki);
+#endif
 
   proto_pool = rp_new(&root_pool, "Protocols");
   proto_flush_event = ev_new(proto_pool);
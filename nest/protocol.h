@@ -12,6 +12,7 @@
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "lib/hash.h"
 #include "nest/route.h"
 #include "conf/conf.h"
 
@@ -29,6 +30,7 @@ struct event;
 struct ea_list;
 struct eattr;
 struct symbol;
+struct f_trie;
 
 /*
  *	Routing Protocol
@@ -77,7 +79,8 @@ void protos_dump_all(void);
 
 extern struct protocol
   proto_device, proto_radv, proto_rip, proto_static,
-  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_babel;
+  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_babel,
+  proto_rpki;
 
 /*
  *	Routing Protocol Instance
@@ -161,6 +164,11 @@ struct proto {
   byte down_sched;			/* Shutdown is scheduled for later (PDS_*) */
   byte down_code;			/* Reason for shutdown (PDC_* codes) */
   byte merge_limit;			/* Maximal number of nexthops for RA_MERGED */
+  byte any_select;			/* Which routes are exported for RA_ANY (RAS_*) */
+  uint any_limit;			/* Maximal number of routes for RAS_BEST */
+  byte import_timing;			/* Measure time spent in route import */
+  btime imp_filter_time;		/* Time spent in import filters (if import_timing) */
+  btime imp_table_time;			/* Time spent in table updates (if import_timing) */
   u32 hash_key;				/* Random key used for hashing of neighbors */
   bird_clock_t last_state_change;	/* Time of last state transition */
   char *last_state_name_announced;	/* Last state name we've announced to the user */
@@ -183,6 +191,9 @@ struct proto {
    *	   reload_routes   Request protocol to reload all its routes to the core
    *			(using rte_update()). Returns: 0=reload cannot be done,
    *			1= reload is scheduled and will happen (asynchronously).
+   *	   reload_prefixes Reimport routes for networks matching given prefix trie
+   *			(ROA revalidation). The trie is valid only during the call.
+   *			Returns: 0=reload cannot be done, 1=reload is scheduled.
    *	   feed_begin	Notify protocol about beginning of route feeding.
    *	   feed_end	Notify protocol about finish of route feeding.
    */
@@ -195,6 +206,7 @@ struct proto {
   void (*store_tmp_attrs)(struct rte *rt, struct ea_list *attrs);
   int (*import_control)(struct proto *, struct rte **rt, struct ea_list **attrs, struct linpool *pool);
   int (*reload_routes)(struct proto *);
+  int (*reload_prefixes)(struct proto *, struct f_trie *trie);
   void (*feed_begin)(struct proto *, int initial);
   void (*feed_end)(struct proto *);
 
@@ -205,6 +217,7 @@ struct proto {
    *	   rte_better	Compare two rte's and decide which one is better (1=first, 0=second).
    *       rte_same	Compare two rte's and decide whether they are identical (1=yes, 0=no).
    *       rte_mergable	Compare two rte's and decide whether they could be merged (1=yes, 0=no).
+   *	   rte_group	Return group of the rte for RAS_GROUPS route selection.
    *	   rte_insert	Called whenever a rte is inserted to a routing table.
    *	   rte_remove	Called whenever a rte is removed from the routing table.
    */
@@ -213,6 +226,7 @@ struct proto {
   int (*rte_better)(struct rte *, struct rte *);
   int (*rte_same)(struct rte *, struct rte *);
   int (*rte_mergable)(struct rte *, struct rte *);
+  u32 (*rte_group)(struct rte *);
   void (*rte_insert)(struct network *, struct rte *);
   void (*rte_remove)(struct network *, struct rte *);
 
@@ -471,6 +485,9 @@ struct announce_hook {
   struct proto_stats *stats;		/* Per-table protocol statistics */
   struct announce_hook *next;		/* Next hook for the same protocol */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  HASH(struct rt_any_sel) any_sel;	/* Cached selections of routes of networks (RAS_*) */
+  struct rta *in_memo;			/* Attributes of the last route run through in_filter */
+  int in_memo_result;			/* and the filter result for them, see rte_import_filter() */
 };
 
 struct announce_hook *proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *stats);
@@ -19,6 +19,7 @@ struct proto;
 struct rte_src;
 struct symbol;
 struct filter;
+struct f_trie;
 struct cli;
 
 /*
@@ -73,6 +74,12 @@ void fib_delete(struct fib *, void *);	/* Remove fib entry */
 void fib_free(struct fib *);		/* Destroy the fib */
 void fib_check(struct fib *);		/* Consistency check for debugging */
 
+static inline uint fib_hash(struct fib *f, ip_addr *a)
+{ return ipa_hash(*a) >> f->hash_shift; }
+
+static inline void fib_prefetch(struct fib *f, ip_addr *a)	/* Hint that fib_find(f, a, ...) follows */
+{ __builtin_prefetch(&f->hash_table[fib_hash(f, a)]); }
+
 void fit_init(struct fib_iterator *, struct fib *); /* Internal functions, don't call */
 struct fib_node *fit_get(struct fib *, struct fib_iterator *);
 void fit_put(struct fib_iterator *, struct fib_node *);
@@ -219,6 +226,11 @@ typedef struct rte {
 #ifdef CONFIG_BGP
     struct {
       u8 suppressed;			/* Used for deterministic MED comparison */
+      u8 origin;			/* Route selection key, see bgp_rte_key() */
+      u16 path_len;
+      u32 local_pref;
+      u32 med;
+      u32 neighbor_as;
     } bgp;
 #endif
 #ifdef CONFIG_BABEL
@@ -255,6 +267,12 @@ static inline int rte_is_filtered(rte *r) { return !!(r->flags & REF_FILTERED);
 #define RA_ANY		3		/* Announcement of any route change */
 #define RA_MERGED	4		/* Announcement of optimal route merged with next ones */
 
+/* Selection of routes exported with RA_ANY */
+#define RAS_ALL		0		/* All valid routes */
+#define RAS_BEST	1		/* Limited number of best routes */
+#define RAS_GROUPS	2		/* Best route from each group (see rte_group() hook) */
+#define RAS_MERGED	3		/* Best route and routes mergable with it */
+
 /* Return value of import_control() callback */
 #define RIC_ACCEPT	1		/* Accepted by protocol */
 #define RIC_PROCESS	0		/* Process it through import filter */
@@ -274,6 +292,10 @@ static inline net *net_get(rtable *tab, ip_addr addr, unsigned len) { return (ne
 rte *rte_find(net *net, struct rte_src *src);
 rte *rte_get_temp(struct rta *);
 void rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src);
+void rte_withdraw_batch(struct announce_hook *ah, net **nets, uint count, struct rte_src *src);
+void rt_flush_import_memo(struct announce_hook *ah);
+void rt_flush_any_sel(struct announce_hook *ah);
+void rte_modify(rte *old, rte *new);
 /* rte_update() moved to protocol.h to avoid dependency conflicts */
 int rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter);
 rte *rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, struct ea_list **tmpa, linpool *pool, int silent);
@@ -471,7 +493,7 @@ static inline int adata_same(struct adata *a, struct adata *b)
 typedef struct ea_list {
   struct ea_list *next;			/* In case we have an override list */
   byte flags;				/* Flags: EALF_... */
-  byte rfu;
+  byte slot_proto;			/* Protocol of attributes indexed by slots */
   word count;				/* Number of attributes */
   eattr attrs[0];			/* Attribute definitions themselves */
 } ea_list;
@@ -479,6 +501,9 @@ typedef struct ea_list {
 #define EALF_SORTED 1			/* Attributes are sorted by code */
 #define EALF_BISECT 2			/* Use interval bisection for searching */
 #define EALF_CACHED 4			/* Attributes belonging to cached rta */
+#define EALF_SLOTS 8			/* Attribute slots follow attrs[], see ea_find() */
+
+#define EA_SLOTS 16			/* Number of attribute slots */
 
 struct rte_src *rt_find_source(struct proto *p, u32 id);
 struct rte_src *rt_get_source(struct proto *p, u32 id);
@@ -574,20 +599,38 @@ struct roa_item {
   u32 asn;
   byte maxlen;
   byte src;
+  byte mark;				/* Used by roa_reconfigure() */
   struct roa_item *next;
 };
 
+struct roa_asn {
+  u32 asn;
+  byte maxlen;				/* Max of maxlen fields of ROAs with this ASN */
+};
+
 struct roa_node {
   struct fib_node n;
   struct roa_item *items;
-  // u32 cached_asn;
+  struct roa_node *child[2];		/* Children in ROA trie */
+  struct roa_asn *asns;			/* Sorted by ASN, summarizes items for roa_check() */
+  uint asn_count;
 };
 
 struct roa_table {
   node n;				/* Node in roa_table_list */
   struct fib fib;
+  struct roa_node *trie;		/* Root of ROA trie, see rt-roa.c */
   char *name;				/* Name of this ROA table */
   struct roa_table_config *cf;		/* Configuration of this ROA table */
+
+  struct f_trie *reval_trie;		/* Prefixes changed since last revalidation */
+  linpool *reval_pool;			/* Linpool for reval_trie */
+  timer *reval_timer;			/* Delays and rate-limits revalidation */
+  u32 reval_pending;			/* Number of changes in reval_trie */
+  u32 reval_changes;			/* Statistics: changes processed */
+  u32 reval_runs;			/* Statistics: revalidations done */
+  u32 reval_reloads;			/* Statistics: protocols reloaded */
+  u32 reval_skipped;			/* Statistics: protocols without prefix reload */
 };
 
 struct roa_item_config {
@@ -603,6 +646,8 @@ struct roa_table_config {
   struct roa_table *table;
 
   struct roa_item_config *roa_items;	/* Preconfigured ROA items */
+  int revalidate;			/* Reimport routes affected by ROA changes */
+  uint revalidate_delay;		/* Minimal time between revalidations (s) */
 
   // char *filename;
   // int gc_max_ops;			/* Maximum number of operations before GC is run */
@@ -625,11 +670,15 @@ struct roa_show_data {
 #define ROA_SRC_ANY	0
 #define ROA_SRC_CONFIG	1
 #define ROA_SRC_DYNAMIC	2
+#define ROA_SRC_RPKI	3
 
 #define ROA_SHOW_ALL	0
 #define ROA_SHOW_PX	1
 #define ROA_SHOW_IN	2
 #define ROA_SHOW_FOR	3
+#define ROA_SHOW_STATS	4
+
+#define ROA_REVALIDATE_DELAY	5	/* Default revalidate delay (s) */
 
 extern struct roa_table *roa_table_default;
 
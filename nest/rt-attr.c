@@ -370,6 +370,40 @@ mpnh_free(struct mpnh *o)
  *	Extended Attributes
  */
 
+/*
+ * Cached attribute lists are always sorted and searched by bisection. They
+ * also have a table of slots appended after attrs[], directly indexed by
+ * attribute ID for the first %EA_SLOTS attributes of one protocol (usually
+ * the protocol that created the route). A slot contains the position of the
+ * attribute in the list plus one, or zero if the attribute is not present.
+ * Therefore lookup of common attributes (e.g. BGP origin, AS path, next hop,
+ * MED, local preference and communities) takes constant time.
+ */
+
+static inline byte *
+ea_slots(ea_list *e)
+{
+  return (byte *) (e->attrs + e->count);
+}
+
+static void
+ea_index_slots(ea_list *e)
+{
+  byte *slots = ea_slots(e);
+  uint i, proto;
+
+  /* Protocol attributes are sorted after generic ones */
+  proto = e->count ? EA_PROTO(e->attrs[e->count - 1].id) : 0;
+
+  memset(slots, 0, EA_SLOTS);
+  for (i = 0; i < e->count; i++)
+    if ((EA_PROTO(e->attrs[i].id) == proto) && (EA_ID(e->attrs[i].id) < EA_SLOTS))
+      slots[EA_ID(e->attrs[i].id)] = i + 1;
+
+  e->slot_proto = proto;
+  e->flags |= EALF_SLOTS;
+}
+
 static inline eattr *
 ea__find(ea_list *e, unsigned id)
 {
@@ -378,7 +412,13 @@ ea__find(ea_list *e, unsigned id)
 
   while (e)
     {
-      if (e->flags & EALF_BISECT)
+      if ((e->flags & EALF_SLOTS) && (EA_PROTO(id) == e->slot_proto) && (EA_ID(id) < EA_SLOTS))
+	{
+	  m = ea_slots(e)[EA_ID(id)];
+	  if (m)
+	    return &e->attrs[m - 1];
+	}
+      else if (e->flags & EALF_BISECT)
 	{
 	  l = 0;
 	  r = e->count - 1;
@@ -702,15 +742,21 @@ static inline ea_list *
 ea_list_copy(ea_list *o)
 {
   ea_list *n;
-  unsigned i, len;
+  unsigned i, len, slots;
 
   if (!o)
     return NULL;
   ASSERT(!o->next);
   len = sizeof(ea_list) + sizeof(eattr) * o->count;
-  n = mb_alloc(rta_pool, len);
+  slots = (o->count < 255) ? EA_SLOTS : 0;
+  n = mb_alloc(rta_pool, len + slots);
   memcpy(n, o, len);
-  n->flags |= EALF_CACHED;
+
+  /* The list was sorted by rta_lookup() */
+  n->flags |= EALF_CACHED | EALF_BISECT;
+  if (slots)
+    ea_index_slots(n);
+
   for(i=0; i<o->count; i++)
     {
       eattr *a = &n->attrs[i];
@@ -934,10 +980,11 @@ ea_dump(ea_list *e)
     }
   while (e)
     {
-      debug("[%c%c%c]",
+      debug("[%c%c%c%c]",
 	    (e->flags & EALF_SORTED) ? 'S' : 's',
 	    (e->flags & EALF_BISECT) ? 'B' : 'b',
-	    (e->flags & EALF_CACHED) ? 'C' : 'c');
+	    (e->flags & EALF_CACHED) ? 'C' : 'c',
+	    (e->flags & EALF_SLOTS) ? 'X' : 'x');
       for(i=0; i<e->count; i++)
 	{
 	  eattr *a = &e->attrs[i];
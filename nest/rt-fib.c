@@ -90,12 +90,6 @@ fib_ht_free(struct fib_node **h)
   mb_free(h);
 }
 
-static inline unsigned
-fib_hash(struct fib *f, ip_addr *a)
-{
-  return ipa_hash(*a) >> f->hash_shift;
-}
-
 static void
 fib_dummy_init(struct fib_node *dummy UNUSED)
 {
@@ -7,9 +7,13 @@
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/cli.h"
+#include "nest/protocol.h"
+#include "filter/filter.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/event.h"
@@ -26,6 +30,176 @@ static inline int
 src_match(struct roa_item *it, byte src)
 { return !src || it->src == src; }
 
+/*
+ * ROA nodes are kept in a FIB for exact lookups and also linked in a
+ * path-compressed binary trie, so roa_check() finds all covering ROAs in
+ * one descent. Each trie node is either a prefix of some ROA entries, or a
+ * branching node (without items) for the common part of prefixes in its
+ * subtrees. Like FIB nodes, trie nodes are never removed. Items of each node
+ * are summarized in an array sorted by ASN with the maximal maxlen for each
+ * ASN, which is rebuilt whenever the items change.
+ */
+
+#define ROA_NF_TRIE	1		/* Node is linked in the trie (n.flags) */
+
+static struct roa_node *
+roa_trie_get(struct roa_table *t, ip_addr prefix, byte pxlen)
+{
+  struct roa_node *n = fib_get(&t->fib, &prefix, pxlen);
+  struct roa_node **np, *c, *b;
+
+  if (n->n.flags & ROA_NF_TRIE)
+    return n;
+
+  for (np = &t->trie; c = *np; np = &c->child[!!ipa_getbit(prefix, c->n.pxlen)])
+    {
+      /* Node c covers new prefix, continue to its subtree */
+      if (net_in_net(prefix, pxlen, c->n.prefix, c->n.pxlen))
+	continue;
+
+      /* New prefix covers node c, insert it above c */
+      if (net_in_net(c->n.prefix, c->n.pxlen, prefix, pxlen))
+	{
+	  n->child[!!ipa_getbit(c->n.prefix, pxlen)] = c;
+	  break;
+	}
+
+      /* Prefixes diverge, add branching node for their common part */
+      uint len = ipa_pxlen(prefix, c->n.prefix);
+      ip_addr px = ipa_and(prefix, ipa_mkmask(len));
+      b = fib_get(&t->fib, &px, len);
+      ASSERT(!(b->n.flags & ROA_NF_TRIE));
+      b->n.flags |= ROA_NF_TRIE;
+      b->child[!!ipa_getbit(c->n.prefix, len)] = c;
+      b->child[!!ipa_getbit(prefix, len)] = n;
+      n->n.flags |= ROA_NF_TRIE;
+      *np = b;
+      return n;
+    }
+
+  n->n.flags |= ROA_NF_TRIE;
+  *np = n;
+  return n;
+}
+
+static int
+roa_asn_compare(const void *x, const void *y)
+{
+  const struct roa_asn *a = x, *b = y;
+
+  if (a->asn != b->asn)
+    return (a->asn < b->asn) ? -1 : 1;
+
+  /* Higher maxlen first */
+  return (int) b->maxlen - (int) a->maxlen;
+}
+
+static void
+roa_node_update(struct roa_node *n)
+{
+  struct roa_item *it;
+  struct roa_asn *a;
+  uint i, j, count = 0;
+
+  for (it = n->items; it; it = it->next)
+    count++;
+
+  mb_free(n->asns);
+  n->asns = NULL;
+  n->asn_count = 0;
+
+  if (!count)
+    return;
+
+  a = mb_alloc(roa_pool, count * sizeof(struct roa_asn));
+  for (i = 0, it = n->items; it; i++, it = it->next)
+    {
+      a[i].asn = it->asn;
+      a[i].maxlen = it->maxlen;
+    }
+
+  qsort(a, count, sizeof(struct roa_asn), roa_asn_compare);
+
+  /* Keep only the first (highest maxlen) entry for each ASN */
+  for (i = j = 1; i < count; i++)
+    if (a[i].asn != a[j-1].asn)
+      a[j++] = a[i];
+
+  n->asns = a;
+  n->asn_count = j;
+}
+
+static inline int
+roa_node_match(struct roa_node *n, u32 asn, byte pxlen)
+{
+  uint lo = 0, hi = n->asn_count;
+
+  while (lo < hi)
+    {
+      uint mid = (lo + hi) / 2;
+      if (n->asns[mid].asn < asn)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return (lo < n->asn_count) && (n->asns[lo].asn == asn) && (n->asns[lo].maxlen >= pxlen);
+}
+
+/*
+ * Routes are revalidated when the ROA table changes. Changed ROA prefixes
+ * are collected in a prefix trie, each one matching all its subprefixes,
+ * as routes for any of them may be affected. After the revalidate delay,
+ * routes within changed prefixes are reimported by protocols whose import
+ * filter calls roa_check() on the table, using the reload_prefixes() hook.
+ * Protocols that cannot do that are just counted as skipped. Changes
+ * arriving meanwhile are accumulated for the next run, so the delay also
+ * limits the rate of revalidations.
+ */
+
+static void
+roa_changed(struct roa_table *t, ip_addr prefix, byte pxlen)
+{
+  if (!t->cf->revalidate)
+    return;
+
+  if (!t->reval_trie)
+    t->reval_trie = f_new_trie(t->reval_pool, sizeof(struct f_trie_node));
+
+  trie_add_prefix(t->reval_trie, prefix, pxlen, pxlen, MAX_PREFIX_LENGTH);
+  t->reval_pending++;
+
+  if (!tm_active(t->reval_timer))
+    tm_start(t->reval_timer, t->cf->revalidate_delay);
+}
+
+static void
+roa_revalidate(timer *tm)
+{
+  struct roa_table *t = tm->data;
+  struct proto *p;
+
+  if (!t->reval_trie)
+    return;
+
+  WALK_LIST(p, active_proto_list)
+    if ((p->proto_state == PS_UP) && p->main_ahook &&
+	filter_uses_roa(p->main_ahook->in_filter, t))
+    {
+      if (p->reload_prefixes && p->reload_prefixes(p, t->reval_trie))
+	t->reval_reloads++;
+      else
+	t->reval_skipped++;
+    }
+
+  t->reval_changes += t->reval_pending;
+  t->reval_runs++;
+
+  t->reval_trie = NULL;
+  t->reval_pending = 0;
+  lp_flush(t->reval_pool);
+}
+
 /**
  * roa_add_item - add a ROA entry
  * @t: ROA table
@@ -42,7 +216,7 @@ src_match(struct roa_item *it, byte src)
 void
 roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src)
 {
-  struct roa_node *n = fib_get(&t->fib, &prefix, pxlen);
+  struct roa_node *n = roa_trie_get(t, prefix, pxlen);
 
   // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
   // t->cached_items--;
@@ -56,8 +230,12 @@ roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 a
   it->asn = asn;
   it->maxlen = maxlen;
   it->src = src;
+  it->mark = 0;
   it->next = n->items;
   n->items = it;
+
+  roa_node_update(n);
+  roa_changed(t, prefix, pxlen);
 }
 
 /**
@@ -91,6 +269,8 @@ roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u3
 
   *itp = it->next;
   sl_free(roa_slab, it);
+  roa_node_update(n);
+  roa_changed(t, prefix, pxlen);
 
   // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
   // t->cached_items++;
@@ -111,10 +291,12 @@ roa_flush(struct roa_table *t, byte src)
 {
   struct roa_item *it, **itp;
   struct roa_node *n;
+  int changed;
 
   FIB_WALK(&t->fib, fn)
     {
       n = (struct roa_node *) fn;
+      changed = 0;
 
       itp = &n->items;
       while (it = *itp)
@@ -122,9 +304,16 @@ roa_flush(struct roa_table *t, byte src)
 	  {
 	    *itp = it->next;
 	    sl_free(roa_slab, it);
+	    changed = 1;
 	  }
 	else
 	  itp = &it->next;
+
+      if (changed)
+	{
+	  roa_node_update(n);
+	  roa_changed(t, n->n.prefix, n->n.pxlen);
+	}
     }
   FIB_WALK_END;
 
@@ -179,30 +368,29 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
  * length, return ROA_VALID. Otherwise return ROA_INVALID. If caller
  * cannot determine origin AS, 0 could be used (in that case ROA_VALID
  * cannot happen).
+ *
+ * All candidate ROAs are found in one descent of the ROA trie, matching
+ * ASN is looked up by binary search in per-node summary arrays.
  */
 byte
 roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n;
-  ip_addr px;
+  struct roa_node *n = t->trie;
   byte anything = 0;
 
-  int len;
-  for (len = pxlen; len >= 0; len--)
+  while (n && net_in_net(prefix, pxlen, n->n.prefix, n->n.pxlen))
     {
-      px = ipa_and(prefix, ipa_mkmask(len));
-      n = fib_find(&t->fib, &px, len);
-
-      if (!n)
-	continue;
-
-      struct roa_item *it;
-      for (it = n->items; it; it = it->next)
+      if (n->asn_count)
 	{
 	  anything = 1;
-	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
+	  if (asn && roa_node_match(n, asn, pxlen))
 	    return ROA_VALID;
 	}
+
+      if (n->n.pxlen == pxlen)
+	break;
+
+      n = n->child[!!ipa_getbit(prefix, n->n.pxlen)];
     }
 
   return anything ? ROA_INVALID : ROA_UNKNOWN;
@@ -212,7 +400,11 @@ static void
 roa_node_init(struct fib_node *fn)
 {
   struct roa_node *n = (struct roa_node *) fn;
+  n->n.flags = 0;
   n->items = NULL;
+  n->child[0] = n->child[1] = NULL;
+  n->asns = NULL;
+  n->asn_count = 0;
 }
 
 static inline void
@@ -223,6 +415,46 @@ roa_populate(struct roa_table *t)
     roa_add_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
 }
 
+static struct roa_item *
+roa_find_config_item(struct roa_table *t, struct roa_item_config *ric)
+{
+  struct roa_node *n = fib_find(&t->fib, &ric->prefix, ric->pxlen);
+  struct roa_item *it;
+
+  for (it = n ? n->items : NULL; it; it = it->next)
+    if ((it->maxlen == ric->maxlen) && (it->asn == ric->asn) && (it->src == ROA_SRC_CONFIG))
+      return it;
+
+  return NULL;
+}
+
+/*
+ * Static ROA entries are updated by the difference between the old and the
+ * new configuration, so unchanged entries are not reported to revalidation.
+ * Entries of the old configuration are marked, entries found in the new one
+ * are unmarked or added, and entries still marked are removed.
+ */
+static void
+roa_reconfigure(struct roa_table *t, struct roa_table_config *old, struct roa_table_config *new)
+{
+  struct roa_item_config *ric;
+  struct roa_item *it;
+
+  for (ric = old->roa_items; ric; ric = ric->next)
+    if (it = roa_find_config_item(t, ric))
+      it->mark = 1;
+
+  for (ric = new->roa_items; ric; ric = ric->next)
+    if (it = roa_find_config_item(t, ric))
+      it->mark = 0;
+    else
+      roa_add_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
+
+  for (ric = old->roa_items; ric; ric = ric->next)
+    if ((it = roa_find_config_item(t, ric)) && it->mark)
+      roa_delete_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
+}
+
 static void
 roa_new_table(struct roa_table_config *cf)
 {
@@ -232,6 +464,8 @@ roa_new_table(struct roa_table_config *cf)
   fib_init(&t->fib, roa_pool, sizeof(struct roa_node), 0, roa_node_init);
   t->name = cf->name;
   t->cf = cf;
+  t->reval_pool = lp_new(roa_pool, 4080);
+  t->reval_timer = tm_new_set(roa_pool, roa_revalidate, t, 0, 0);
 
   cf->table = t;
   add_tail(&roa_table_list, &t->n);
@@ -246,6 +480,8 @@ roa_new_table_config(struct symbol *s)
 
   cf_define_symbol(s, SYM_ROA, rtc);
   rtc->name = s->name;
+  rtc->revalidate = 1;
+  rtc->revalidate_delay = ROA_REVALIDATE_DELAY;
   add_tail(&new_config->roa_tables, &rtc->n);
   return rtc;
 }
@@ -318,11 +554,10 @@ roa_commit(struct config *new, struct config *old)
 	    cf = sym->def;
 	    cf->table = t;
 	    t->name = cf->name;
-	    t->cf = cf;
 
 	    /* Reconfigure it */
-	    roa_flush(t, ROA_SRC_CONFIG);
-	    roa_populate(t);
+	    roa_reconfigure(t, t->cf, cf);
+	    t->cf = cf;
 	  }
 	else
 	  {
@@ -331,6 +566,8 @@ roa_commit(struct config *new, struct config *old)
 	    /* Free it now */
 	    roa_flush(t, ROA_SRC_ANY);
 	    rem_node(&t->n);
+	    rfree(t->reval_timer);
+	    rfree(t->reval_pool);
 	    fib_free(&t->fib);
 	    mb_free(t);
 	  }
@@ -398,8 +635,7 @@ roa_show_cleanup(struct cli *c)
 void
 roa_show(struct roa_show_data *d)
 {
-  struct roa_node *rn;
-  ip_addr px;
+  struct roa_node *rn, *path[MAX_PREFIX_LENGTH + 1];
   int len;
 
   switch (d->mode)
@@ -424,17 +660,39 @@ roa_show(struct roa_show_data *d)
       break;
 
     case ROA_SHOW_FOR:
-      for (len = d->pxlen; len >= 0; len--)
+      /* Collect covering nodes from the trie, show the most specific first */
+      rn = d->table->trie;
+      len = 0;
+      while (rn && net_in_net(d->prefix, d->pxlen, rn->n.prefix, rn->n.pxlen))
 	{
-	  px = ipa_and(d->prefix, ipa_mkmask(len));
-	  rn = fib_find(&d->table->fib, &px, len);
+	  path[len++] = rn;
 
-	  if (!rn)
-	    continue;
+	  if (rn->n.pxlen == d->pxlen)
+	    break;
 
-	  roa_show_node(this_cli, rn, 0, d->asn);
+	  rn = rn->child[!!ipa_getbit(d->prefix, rn->n.pxlen)];
 	}
+
+      while (len--)
+	roa_show_node(this_cli, path[len], 0, d->asn);
+
       cli_msg(0, "");
       break;
+
+    case ROA_SHOW_STATS:
+      {
+	struct roa_table *t = d->table;
+	cli_msg(-1019, "Table %s:", t->name);
+	if (t->cf->revalidate)
+	  cli_msg(-1019, "  Revalidation:       on, delay %u s", t->cf->revalidate_delay);
+	else
+	  cli_msg(-1019, "  Revalidation:       off");
+	cli_msg(-1019, "  Changes:            %u processed, %u pending", t->reval_changes, t->reval_pending);
+	cli_msg(-1019, "  Revalidations:      %u", t->reval_runs);
+	cli_msg(-1019, "  Protocols reloaded: %u", t->reval_reloads);
+	cli_msg(-1019, "  Protocols skipped:  %u", t->reval_skipped);
+	cli_msg(0, "");
+      }
+      break;
     }
 }
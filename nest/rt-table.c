@@ -705,6 +705,506 @@ rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_
 }
 
 
+/*
+ * Protocols accepting RA_ANY announcements may limit exported routes to a
+ * selection of routes of the network, given by p->any_select. The selection
+ * is computed from all valid routes before export filters are applied. It is
+ * cached for each network in the announce hook, rt_select_any_begin() computes
+ * it before the first change of the network. As the selection may change for
+ * other routes than the changed one, rt_notify_selected() updates the cached
+ * selection by the changed route, announcing routes that entered the selection
+ * and withdrawing routes that left it. Just the changed route is ranked
+ * against selected routes (RAS_BEST), or the best route of its group is found
+ * (RAS_GROUPS). The selection is computed again from all routes when the best
+ * route changes (RAS_MERGED), or when the changed route may change preference
+ * of other routes by the rte_recalculate() hook (e.g. deterministic MED in
+ * BGP). Cached selections are flushed by rt_flush_any_sel() when the announce
+ * hook is unlinked from the table and stops receiving changes.
+ */
+
+struct rt_any_sel {
+  net *net;
+  struct rt_any_sel *next;
+  uint count, size;
+  rte *routes[0];
+};
+
+#define RSH_KEY(n)		n->net
+#define RSH_NEXT(n)		n->next
+#define RSH_EQ(n1,n2)		n1 == n2
+#define RSH_FN(k)		ipa_hash32(k->n.prefix) ^ u32_hash(k->n.pxlen)
+
+#define RSH_REHASH		rt_any_sel_rehash
+#define RSH_PARAMS		/8, *2, 2, 2, 8, 24
+
+HASH_DEFINE_REHASH_FN(RSH, struct rt_any_sel)
+
+static inline u32
+rte_group(rte *e)
+{
+  u32 (*group)(rte *) = e->attrs->src->proto->rte_group;
+  return group ? group(e) : 0;
+}
+
+static uint
+rt_select_any(struct proto *p, net *net, rte *add, rte ***sel)
+{
+  rte *e, *best, **routes;
+  uint count = 0, n = 0, i, j;
+
+  for (e = net->routes; e; e = e->next)
+    if (rte_is_valid(e))
+      count++;
+
+  if (rte_is_valid(add))
+    count++;
+
+  routes = lp_alloc(rte_update_pool, (count + 1) * sizeof(rte *));
+  *sel = routes;
+
+  for (e = net->routes; e; e = e->next)
+    if (rte_is_valid(e))
+      routes[n++] = e;
+
+  if (rte_is_valid(add))
+    routes[n++] = add;
+
+  switch (p->any_select)
+  {
+  case RAS_BEST:
+    /* Partial selection sort */
+    n = MIN(p->any_limit, count);
+    for (i = 0; i < n; i++)
+    {
+      for (j = i + 1; j < count; j++)
+	if (rte_better(routes[j], routes[i]))
+	{
+	  e = routes[i];
+	  routes[i] = routes[j];
+	  routes[j] = e;
+	}
+    }
+    return n;
+
+  case RAS_GROUPS:
+  {
+    u32 *groups = lp_alloc(rte_update_pool, (count + 1) * sizeof(u32));
+
+    for (i = 0; i < count; i++)
+      groups[i] = rte_group(routes[i]);
+
+    /* Selected routes are stored to already processed positions */
+    for (i = n = 0; i < count; i++)
+      if (best = routes[i])
+      {
+	for (j = i + 1; j < count; j++)
+	  if (routes[j] && (groups[j] == groups[i]))
+	  {
+	    if (rte_better(routes[j], best))
+	      best = routes[j];
+	    routes[j] = NULL;
+	  }
+
+	routes[n++] = best;
+      }
+    return n;
+  }
+
+  case RAS_MERGED:
+    if (!count)
+      return 0;
+
+    best = routes[0];
+    for (i = 1; i < count; i++)
+      if (rte_better(routes[i], best))
+	best = routes[i];
+
+    for (i = n = 0; i < count; i++)
+      if ((routes[i] == best) || rte_mergable(best, routes[i]))
+	routes[n++] = routes[i];
+    return n;
+
+  default:
+    return count;
+  }
+}
+
+static inline struct rt_any_sel *
+rt_any_sel_find(struct announce_hook *ah, net *net)
+{
+  return ah->any_sel.data ? HASH_FIND(ah->any_sel, RSH, net) : NULL;
+}
+
+static void
+rt_any_sel_free(struct announce_hook *ah, struct rt_any_sel *s)
+{
+  HASH_REMOVE2(ah->any_sel, RSH, rt_table_pool, s);
+  mb_free(s);
+}
+
+/* Returns cached selection @s, or its copy with room for at least @size routes */
+static struct rt_any_sel *
+rt_any_sel_get(struct announce_hook *ah, net *net, struct rt_any_sel *s, uint size)
+{
+  struct rt_any_sel *n;
+
+  if (s && (s->size >= size))
+    return s;
+
+  size = MAX(size, s ? 2 * s->size : 4);
+  n = mb_alloc(rt_table_pool, sizeof(struct rt_any_sel) + size * sizeof(rte *));
+  n->net = net;
+  n->count = 0;
+  n->size = size;
+
+  if (s)
+  {
+    memcpy(n->routes, s->routes, s->count * sizeof(rte *));
+    n->count = s->count;
+    rt_any_sel_free(ah, s);
+  }
+
+  if (!ah->any_sel.data)
+    HASH_INIT(ah->any_sel, rt_table_pool, 8);
+
+  HASH_INSERT2(ah->any_sel, RSH, rt_table_pool, n);
+  return n;
+}
+
+static struct rt_any_sel *
+rt_any_sel_store(struct announce_hook *ah, net *net, struct rt_any_sel *s, rte **sel, uint count)
+{
+  if (!count)
+  {
+    if (s)
+      rt_any_sel_free(ah, s);
+
+    return NULL;
+  }
+
+  s = rt_any_sel_get(ah, net, s, count);
+  memcpy(s->routes, sel, count * sizeof(rte *));
+  s->count = count;
+  return s;
+}
+
+static inline uint
+rt_any_sel_index(struct rt_any_sel *s, rte *e)
+{
+  uint i;
+
+  for (i = 0; i < s->count; i++)
+    if (s->routes[i] == e)
+      break;
+
+  return i;
+}
+
+static inline void
+rt_any_sel_remove(struct rt_any_sel *s, uint i)
+{
+  s->count--;
+  memmove(s->routes + i, s->routes + i + 1, (s->count - i) * sizeof(rte *));
+}
+
+/* Insert route by its rank, the selection is kept sorted */
+static inline void
+rt_any_sel_insert(struct rt_any_sel *s, rte *e)
+{
+  uint i;
+
+  for (i = 0; i < s->count; i++)
+    if (rte_better(e, s->routes[i]))
+      break;
+
+  memmove(s->routes + i + 1, s->routes + i, (s->count - i) * sizeof(rte *));
+  s->routes[i] = e;
+  s->count++;
+}
+
+void
+rt_flush_any_sel(struct announce_hook *ah)
+{
+  if (!ah->any_sel.data)
+    return;
+
+  HASH_WALK_DELSAFE(ah->any_sel, next, s)
+    mb_free(s);
+  HASH_WALK_DELSAFE_END;
+
+  HASH_FREE(ah->any_sel);
+}
+
+static void
+rt_select_any_begin(rtable *tab, net *net, rte *old)
+{
+  struct announce_hook *a;
+  rte **sel;
+  uint count;
+
+  WALK_LIST(a, tab->hooks)
+    if ((a->proto->accept_ra_types == RA_ANY) && a->proto->any_select &&
+	!rt_any_sel_find(a, net))
+    {
+      count = rt_select_any(a->proto, net, old, &sel);
+      rt_any_sel_store(a, net, NULL, sel, count);
+    }
+}
+
+/* Selection for feeding, it is cached if it was not */
+static uint
+rt_select_any_cached(struct announce_hook *ah, net *net, rte ***sel)
+{
+  struct rt_any_sel *s = rt_any_sel_find(ah, net);
+  uint count;
+
+  if (s)
+  {
+    *sel = s->routes;
+    return s->count;
+  }
+
+  count = rt_select_any(ah->proto, net, NULL, sel);
+  rt_any_sel_store(ah, net, NULL, *sel, count);
+  return count;
+}
+
+static inline int
+rt_selected(rte **sel, uint count, rte *e)
+{
+  uint i;
+
+  for (i = 0; i < count; i++)
+    if (sel[i] == e)
+      return 1;
+
+  return 0;
+}
+
+/* Compute the selection again from all routes */
+static void
+rt_notify_selected_all(struct announce_hook *ah, net *net, struct rt_any_sel *s, rte *new_changed, rte *old_changed)
+{
+  rte **old_sel = s ? s->routes : NULL;
+  uint old_count = s ? s->count : 0;
+  rte **new_sel;
+  uint new_count, i;
+
+  new_count = rt_select_any(ah->proto, net, NULL, &new_sel);
+
+  /* The changed route itself */
+  rte *new = rt_selected(new_sel, new_count, new_changed) ? new_changed : NULL;
+  rte *old = rt_selected(old_sel, old_count, old_changed) ? old_changed : NULL;
+
+  if (new || old)
+    rt_notify_basic(ah, net, new, old, 0);
+
+  /* Other routes entering the selection */
+  for (i = 0; i < new_count; i++)
+    if ((new_sel[i] != new_changed) && !rt_selected(old_sel, old_count, new_sel[i]))
+      rt_notify_basic(ah, net, new_sel[i], NULL, 0);
+
+  /* Other routes leaving the selection */
+  for (i = 0; i < old_count; i++)
+    if ((old_sel[i] != old_changed) && !rt_selected(new_sel, new_count, old_sel[i]))
+      rt_notify_basic(ah, net, NULL, old_sel[i], 0);
+
+  rt_any_sel_store(ah, net, s, new_sel, new_count);
+}
+
+static void
+rt_notify_selected_best(struct announce_hook *ah, net *net, struct rt_any_sel *s, rte *new, rte *old)
+{
+  uint limit = ah->proto->any_limit;
+  rte *new_sel = NULL, *old_sel = NULL, *enter = NULL, *leave = NULL;
+  rte *e;
+  uint i;
+
+  s = rt_any_sel_get(ah, net, s, MIN(limit, (s ? s->count : 0) + 1));
+  int full = (s->count == limit);
+
+  if (old && ((i = rt_any_sel_index(s, old)) < s->count))
+  {
+    rt_any_sel_remove(s, i);
+    old_sel = old;
+  }
+
+  /*
+   * When a selected route is removed from the full selection, the best of
+   * other routes (including the new one) takes its place. Otherwise, all
+   * valid routes were selected, or just the new route is ranked.
+   */
+  if (old_sel && full)
+  {
+    for (e = net->routes; e; e = e->next)
+      if (rte_is_valid(e) && (!enter || rte_better(e, enter)) &&
+	  (rt_any_sel_index(s, e) == s->count))
+	enter = e;
+
+    if (enter)
+      rt_any_sel_insert(s, enter);
+
+    if (enter && (enter == new))
+    {
+      new_sel = new;
+      enter = NULL;
+    }
+  }
+  else if (new && ((s->count < limit) || rte_better(new, s->routes[limit - 1])))
+  {
+    if (s->count == limit)
+      leave = s->routes[--s->count];
+
+    rt_any_sel_insert(s, new);
+    new_sel = new;
+  }
+
+  if (new_sel || old_sel)
+    rt_notify_basic(ah, net, new_sel, old_sel, 0);
+
+  if (enter)
+    rt_notify_basic(ah, net, enter, NULL, 0);
+
+  if (leave)
+    rt_notify_basic(ah, net, NULL, leave, 0);
+
+  if (!s->count)
+    rt_any_sel_free(ah, s);
+}
+
+/* Find the best route of group @g again, updating selection @s */
+static struct rt_any_sel *
+rt_reselect_group(struct announce_hook *ah, net *net, struct rt_any_sel *s, u32 g, rte **enter, rte **leave)
+{
+  rte *e, *best = NULL;
+  uint i;
+
+  *enter = *leave = NULL;
+
+  for (e = net->routes; e; e = e->next)
+    if (rte_is_valid(e) && (rte_group(e) == g) && (!best || rte_better(e, best)))
+      best = e;
+
+  for (i = 0; i < s->count; i++)
+    if (rte_group(s->routes[i]) == g)
+      break;
+
+  if (i < s->count)
+  {
+    if (s->routes[i] == best)
+      return s;
+
+    *leave = s->routes[i];
+
+    if (best)
+      s->routes[i] = best;
+    else
+      s->routes[i] = s->routes[--s->count];
+  }
+  else if (best)
+  {
+    s = rt_any_sel_get(ah, net, s, s->count + 1);
+    s->routes[s->count++] = best;
+  }
+
+  *enter = best;
+  return s;
+}
+
+static void
+rt_notify_selected_groups(struct announce_hook *ah, net *net, struct rt_any_sel *s, rte *new, rte *old)
+{
+  rte *enter[2], *leave[2];
+  uint i;
+
+  s = rt_any_sel_get(ah, net, s, 1);
+
+  /* Groups of the changed route, the old route is still available */
+  s = rt_reselect_group(ah, net, s, rte_group(old ?: new), &enter[0], &leave[0]);
+  enter[1] = leave[1] = NULL;
+
+  if (old && new && (rte_group(new) != rte_group(old)))
+    s = rt_reselect_group(ah, net, s, rte_group(new), &enter[1], &leave[1]);
+
+  rte *new_sel = ((enter[0] == new) || (enter[1] == new)) ? new : NULL;
+  rte *old_sel = ((leave[0] == old) || (leave[1] == old)) ? old : NULL;
+
+  if (new_sel || old_sel)
+    rt_notify_basic(ah, net, new_sel, old_sel, 0);
+
+  for (i = 0; i < 2; i++)
+    if (enter[i] && (enter[i] != new))
+      rt_notify_basic(ah, net, enter[i], NULL, 0);
+
+  for (i = 0; i < 2; i++)
+    if (leave[i] && (leave[i] != old))
+      rt_notify_basic(ah, net, NULL, leave[i], 0);
+
+  if (!s->count)
+    rt_any_sel_free(ah, s);
+}
+
+static void
+rt_notify_selected_merged(struct announce_hook *ah, net *net, struct rt_any_sel *s, rte *new, rte *old)
+{
+  rte *best = rte_is_valid(net->routes) ? net->routes : NULL;
+  rte *new_sel = NULL, *old_sel = NULL;
+  uint i;
+
+  /* The whole selection depends on the best route, which is the first one */
+  if (!s || (s->routes[0] != best))
+  {
+    rt_notify_selected_all(ah, net, s, new, old);
+    return;
+  }
+
+  if (old && ((i = rt_any_sel_index(s, old)) < s->count))
+  {
+    rt_any_sel_remove(s, i);
+    old_sel = old;
+  }
+
+  if (new && rte_mergable(best, new))
+  {
+    s = rt_any_sel_get(ah, net, s, s->count + 1);
+    s->routes[s->count++] = new;
+    new_sel = new;
+  }
+
+  if (new_sel || old_sel)
+    rt_notify_basic(ah, net, new_sel, old_sel, 0);
+}
+
+static void
+rt_notify_selected(struct announce_hook *ah, net *net, rte *new, rte *old)
+{
+  struct rt_any_sel *s = rt_any_sel_find(ah, net);
+  rte *changed = new ?: old;
+
+  /* Preference of other routes in the group may change, see rte_recalculate() */
+  if (changed->attrs->src->proto->rte_recalculate && (ah->proto->any_select != RAS_GROUPS))
+  {
+    rt_notify_selected_all(ah, net, s, new, old);
+    return;
+  }
+
+  switch (ah->proto->any_select)
+  {
+  case RAS_BEST:
+    rt_notify_selected_best(ah, net, s, new, old);
+    break;
+
+  case RAS_GROUPS:
+    rt_notify_selected_groups(ah, net, s, new, old);
+    break;
+
+  case RAS_MERGED:
+    rt_notify_selected_merged(ah, net, s, new, old);
+    break;
+  }
+}
+
+
 /**
  * rte_announce - announce a routing table change
  * @tab: table the route has been added to
@@ -776,6 +1276,8 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 	  rt_notify_accepted(a, net, new, old, before_old, 0);
 	else if (type == RA_MERGED)
 	  rt_notify_merged(a, net, new, old, new_best, old_best, 0);
+	else if (a->proto->any_select)
+	  rt_notify_selected(a, net, new, old);
 	else
 	  rt_notify_basic(a, net, new, old, 0);
     }
@@ -983,6 +1485,9 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
   if (old)
     rte_is_filtered(old) ? stats->filt_routes-- : stats->imp_routes--;
 
+  /* Record selection of routes for RA_ANY before the change, old was already unlinked */
+  rt_select_any_begin(table, net, old);
+
   if (table->config->sorted)
     {
       /* If routes are sorted, just insert new route to appropriate position */
@@ -1138,6 +1643,48 @@ rte_unhide_dummy_routes(net *net, rte **dummy)
   }
 }
 
+/*
+ * Import filters which depend only on route attributes (see filter_rta_only())
+ * give the same result for routes sharing a cached rta, e.g. for all prefixes
+ * received in one BGP UPDATE. The result for the last such rta is kept in the
+ * announce hook, it must be flushed by rt_flush_import_memo() when the filter
+ * is replaced.
+ */
+static int
+rte_import_filter(struct announce_hook *ah, rte **new, ea_list **tmpa)
+{
+  struct filter *filter = ah->in_filter;
+  rta *a = (*new)->attrs;
+  int fr;
+
+  if (!rta_is_cached(a) || !filter_rta_only(filter))
+    return f_run(filter, new, tmpa, rte_update_pool, 0);
+
+  if (a == ah->in_memo)
+    return ah->in_memo_result;
+
+  fr = f_run(filter, new, tmpa, rte_update_pool, 0);
+
+  /* Runtime errors are not memoized, they should be logged for each route */
+  if (fr != F_ERROR)
+    {
+      rt_flush_import_memo(ah);
+      ah->in_memo = rta_clone(a);
+      ah->in_memo_result = fr;
+    }
+
+  return fr;
+}
+
+void
+rt_flush_import_memo(struct announce_hook *ah)
+{
+  if (ah->in_memo)
+    rta_free(ah->in_memo);
+
+  ah->in_memo = NULL;
+}
+
 /**
  * rte_update - enter a new update to a routing table
  * @table: table to be updated
@@ -1188,6 +1735,7 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   struct filter *filter = ah->in_filter;
   ea_list *tmpa = NULL;
   rte *dummy = NULL;
+  btime t0 = p->import_timing ? precise_time() : 0;
 
   rte_update_lock();
   if (new)
@@ -1219,7 +1767,7 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	  if (filter && (filter != FILTER_REJECT))
 	    {
 	      ea_list *old_tmpa = tmpa;
-	      int fr = f_run(filter, &new, &tmpa, rte_update_pool, 0);
+	      int fr = rte_import_filter(ah, &new, &tmpa);
 	      if (fr > F_ACCEPT)
 		{
 		  stats->imp_updates_filtered++;
@@ -1251,10 +1799,20 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
     }
 
  recalc:
+  if (p->import_timing)
+    {
+      btime t1 = precise_time();
+      p->imp_filter_time += t1 - t0;
+      t0 = t1;
+    }
+
   rte_hide_dummy_routes(net, &dummy);
   rte_recalculate(ah, net, new, src);
   rte_unhide_dummy_routes(net, &dummy);
   rte_update_unlock();
+
+  if (p->import_timing)
+    p->imp_table_time += precise_time() - t0;
   return;
 
  drop:
@@ -1263,6 +1821,63 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   goto recalc;
 }
 
+/**
+ * rte_withdraw_batch - withdraw a batch of routes
+ * @ah: pointer to table announce hook
+ * @nets: array of networks (entries may be %NULL)
+ * @count: number of entries in @nets
+ * @src: protocol originating the routes
+ *
+ * This function is equivalent to calling rte_update2() with %NULL route
+ * for each of @nets, but it is cheaper for large batches, like mass
+ * withdrawals received in one BGP UPDATE message. Route lists of all
+ * networks are prefetched before they are processed and the whole batch
+ * is done under one update lock, so temporary memory is flushed just once.
+ */
+void
+rte_withdraw_batch(struct announce_hook *ah, net **nets, uint count, struct rte_src *src)
+{
+  struct proto *p = ah->proto;
+  struct proto_stats *stats = ah->stats;
+  rte *dummy = NULL;
+  btime t0;
+  uint i;
+
+  stats->imp_withdraws_received += count;
+
+  if (!src)
+    {
+      stats->imp_withdraws_ignored += count;
+      return;
+    }
+
+  t0 = p->import_timing ? precise_time() : 0;
+
+  for (i = 0; i < count; i++)
+    if (nets[i])
+      __builtin_prefetch(nets[i]->routes);
+
+  rte_update_lock();
+  for (i = 0; i < count; i++)
+    {
+      net *n = nets[i];
+
+      if (!n)
+	{
+	  stats->imp_withdraws_ignored++;
+	  continue;
+	}
+
+      rte_hide_dummy_routes(n, &dummy);
+      rte_recalculate(ah, n, NULL, src);
+      rte_unhide_dummy_routes(n, &dummy);
+    }
+  rte_update_unlock();
+
+  if (p->import_timing)
+    p->imp_table_time += precise_time() - t0;
+}
+
 /* Independent call to rte_announce(), used from next hop
    recalculation, outside of rte_update(). new must be non-NULL */
 static inline void 
@@ -1282,6 +1897,36 @@ rte_discard(rte *old)	/* Non-filtered route deletion, used during garbage collec
   rte_update_unlock();
 }
 
+/**
+ * rte_modify - replace a route in a routing table by its modified version
+ * @old: route in a routing table
+ * @new: modified version of @old, or %NULL to remove it
+ *
+ * This function replaces @old by @new (or removes @old), bypassing import
+ * filters. It is used by protocols that keep track of their stale routes
+ * themselves instead of using refresh cycles, see rt_refresh_begin(). The
+ * route @new is a temporary &rte (e.g. from rte_do_cow()), its attributes
+ * may be cached or not.
+ */
+void
+rte_modify(rte *old, rte *new)
+{
+  struct announce_hook *ah = old->sender;
+  net *net = old->net;
+
+  rte_update_lock();
+  if (new)
+    {
+      new->sender = ah;
+      new->net = net;
+      if (!rta_is_cached(new->attrs))
+	new->attrs = rta_lookup(new->attrs);
+      new->flags = (old->flags & REF_FILTERED) | REF_COW;
+    }
+  rte_recalculate(ah, net, new, old->attrs->src);
+  rte_update_unlock();
+}
+
 /* Check rtable for best route to given net whether it would be exported do p */
 int
 rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter)
@@ -1732,17 +2377,21 @@ rt_next_hop_update_net(rtable *tab, net *n)
   for (k = &n->routes; e = *k; k = &e->next)
     if (rta_next_hop_outdated(e->attrs))
       {
+	rte_update_lock();
+	rt_select_any_begin(tab, n, NULL);
+
 	new = rt_next_hop_update_rte(tab, e);
 	*k = new;
 
-	rte_announce_i(tab, RA_ANY, n, new, e, NULL, NULL);
-	rte_trace_in(D_ROUTES, new->sender->proto, new, "updated");
-
 	/* Call a pre-comparison hook */
 	/* Not really an efficient way to compute this */
 	if (e->attrs->src->proto->rte_recalculate)
 	  e->attrs->src->proto->rte_recalculate(tab, n, new, e, NULL);
 
+	rte_announce(tab, RA_ANY, n, new, e, NULL, NULL, NULL);
+	rte_update_unlock();
+	rte_trace_in(D_ROUTES, new->sender->proto, new, "updated");
+
 	if (e != old_best)
 	  rte_free_quick(e);
 	else /* Freeing of the old best rte is postponed */
@@ -2006,7 +2655,22 @@ again:
 	    max_feed--;
 	  }
 
-      if (p->accept_ra_types == RA_ANY)
+      if ((p->accept_ra_types == RA_ANY) && p->any_select)
+	{
+	  rte **sel;
+	  uint i, count;
+
+	  if (p->export_state != ES_FEEDING)
+	    return 1;  /* In the meantime, the protocol fell down. */
+
+	  rte_update_lock();
+	  count = rt_select_any_cached(h, n, &sel);
+	  for (i = 0; i < count; i++)
+	    do_feed_baby(p, RA_ANY, h, n, sel[i]);
+	  rte_update_unlock();
+	  max_feed -= count;
+	}
+      else if (p->accept_ra_types == RA_ANY)
 	for(e = n->routes; e; e = e->next)
 	  {
 	    if (p->export_state != ES_FEEDING)
@@ -16,9 +16,11 @@
 #include "nest/route.h"
 #include "nest/attrs.h"
 #include "conf/conf.h"
+#include "lib/event.h"
 #include "lib/resource.h"
 #include "lib/string.h"
 #include "lib/unaligned.h"
+#include "filter/filter.h"
 
 #include "bgp.h"
 
@@ -631,15 +633,6 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
   return -1;
 }
 
-/*
-static void
-bgp_init_prefix(struct fib_node *N)
-{
-  struct bgp_prefix *p = (struct bgp_prefix *) N;
-  p->bucket_node.next = NULL;
-}
-*/
-
 static int
 bgp_compare_u32(const u32 *x, const u32 *y)
 {
@@ -709,38 +702,69 @@ bgp_normalize_lc_set(u32 *dest, u32 *src, unsigned cnt)
   qsort(dest, cnt, LCOMM_LENGTH, (int(*)(const void *, const void *)) bgp_compare_lc);
 }
 
+/* Check whether set of @cnt elements of @w words is already sorted, e.g. by filters */
+static int
+bgp_set_sorted(u32 *data, unsigned cnt, unsigned w)
+{
+  unsigned i, j;
+
+  for (i = 1; i < cnt; i++, data += w)
+    for (j = 0; j < w; j++)
+      if (data[j] != data[w + j])
+	{
+	  if (data[j] > data[w + j])
+	    return 0;
+	  break;
+	}
+
+  return 1;
+}
+
+/* Bucket hash table */
+
+#define BKH_KEY(n)		n->eattrs
+#define BKH_EQ(a,b)		ea_same(a, b)
+
 static void
-bgp_rehash_buckets(struct bgp_proto *p)
+bgp_init_bucket(struct bgp_proto *p, struct bgp_bucket *b)
 {
-  struct bgp_bucket **old = p->bucket_hash;
-  struct bgp_bucket **new;
-  unsigned oldn = p->hash_size;
-  unsigned i, e, mask;
-  struct bgp_bucket *b;
+  b->send_node.next = NULL;
+  b->uc = 0;
+  b->px_count = 0;
+  b->px_size = BGP_BUCKET_INLINE;
+  b->prefixes = b->px_inline;
 
-  p->hash_size = p->hash_limit;
-  DBG("BGP: Rehashing bucket table from %d to %d\n", oldn, p->hash_size);
-  p->hash_limit *= 4;
-  if (p->hash_limit >= 65536)
-    p->hash_limit = ~0;
-  new = p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
-  mask = p->hash_size - 1;
-  for (i=0; i<oldn; i++)
-    while (b = old[i])
-      {
-	old[i] = b->hash_next;
-	e = b->hash & mask;
-	b->hash_next = new[e];
-	if (b->hash_next)
-	  b->hash_next->hash_prev = b;
-	b->hash_prev = NULL;
-	new[e] = b;
-      }
-  mb_free(old);
+  /* Assign bucket ID */
+  if (p->bucket_free_count)
+    b->id = p->bucket_free[--p->bucket_free_count];
+  else
+    {
+      if (p->bucket_used == p->bucket_size)
+	{
+	  p->bucket_size *= 2;
+	  p->bucket_map = mb_realloc(p->bucket_map, p->bucket_size * sizeof(struct bgp_bucket *));
+	  p->bucket_free = mb_realloc(p->bucket_free, p->bucket_size * sizeof(u32));
+	}
+
+      b->id = p->bucket_used++;
+    }
+
+  p->bucket_map[b->id] = b;
+}
+
+static void
+bgp_release_bucket(struct bgp_proto *p, struct bgp_bucket *b)
+{
+  if (b->prefixes != b->px_inline)
+    mb_free(b->prefixes);
+
+  p->bucket_map[b->id] = NULL;
+  p->bucket_free[p->bucket_free_count++] = b->id;
+  mb_free(b);
 }
 
 static struct bgp_bucket *
-bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
+bgp_new_bucket(struct bgp_proto *p, ea_list *new, u32 hash)
 {
   struct bgp_bucket *b;
   unsigned ea_size = sizeof(ea_list) + new->count * sizeof(eattr);
@@ -748,7 +772,6 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
   unsigned size = sizeof(struct bgp_bucket) + ea_size_aligned;
   unsigned i;
   byte *dest;
-  unsigned index = hash & (p->hash_size - 1);
 
   /* Gather total size of non-inline attributes */
   for (i=0; i<new->count; i++)
@@ -760,14 +783,8 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
 
   /* Create the bucket and hash it */
   b = mb_alloc(p->p.pool, size);
-  b->hash_next = p->bucket_hash[index];
-  if (b->hash_next)
-    b->hash_next->hash_prev = b;
-  p->bucket_hash[index] = b;
-  b->hash_prev = NULL;
+  bgp_init_bucket(p, b);
   b->hash = hash;
-  add_tail(&p->bucket_queue, &b->send_node);
-  init_list(&b->prefixes);
   memcpy(b->eattrs, new, ea_size);
   dest = ((byte *)b->eattrs) + ea_size_aligned;
 
@@ -785,19 +802,17 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
 	}
     }
 
-  /* If needed, rehash */
-  p->hash_count++;
-  if (p->hash_count > p->hash_limit)
-    bgp_rehash_buckets(p);
+  OA_HASH_INSERT(p->bucket_hash, p->p.pool, hash, b);
 
   return b;
 }
 
-static struct bgp_bucket *
+struct bgp_bucket *
 bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 {
   ea_list *new;
-  unsigned i, cnt, hash, code;
+  unsigned i, cnt, code;
+  u32 hash;
   eattr *a, *d;
   u32 seen = 0;
   struct bgp_bucket *b;
@@ -813,162 +828,1255 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
   new->count = 0;
   for(i=0; i<cnt; i++)
     {
-      a = &new->attrs[i];
-      if (EA_PROTO(a->id) != EAP_BGP)
-	continue;
-      code = EA_ID(a->id);
-      if (ATTR_KNOWN(code))
+      a = &new->attrs[i];
+      if (EA_PROTO(a->id) != EAP_BGP)
+	continue;
+      code = EA_ID(a->id);
+      if (ATTR_KNOWN(code))
+	{
+	  if (!p->is_internal)
+	    {
+	      if (!bgp_attr_table[code].allow_in_ebgp)
+		continue;
+	      if ((code == BA_LOCAL_PREF) && !p->cf->allow_local_pref)
+		continue;
+	    }
+	  /* The flags might have been zero if the attr was added by filters */
+	  a->flags = (a->flags & BAF_PARTIAL) | bgp_attr_table[code].expected_flags;
+	  if (code < 32)
+	    seen |= 1 << code;
+	}
+      else
+	{
+	  /* Don't re-export unknown non-transitive attributes */
+	  if (!(a->flags & BAF_TRANSITIVE))
+	    continue;
+	}
+      *d = *a;
+      if ((d->type & EAF_ORIGINATED) && !originate && (d->flags & BAF_TRANSITIVE) && (d->flags & BAF_OPTIONAL))
+	d->flags |= BAF_PARTIAL;
+      switch (d->type & EAF_TYPE_MASK)
+	{
+	case EAF_TYPE_INT_SET:
+	  {
+	    if (bgp_set_sorted((u32 *) d->u.ptr->data, d->u.ptr->length / 4, 1))
+	      break;
+
+	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
+	    z->length = d->u.ptr->length;
+	    bgp_normalize_int_set((u32 *) z->data, (u32 *) d->u.ptr->data, z->length / 4);
+	    d->u.ptr = z;
+	    break;
+	  }
+	case EAF_TYPE_EC_SET:
+	  {
+	    if (p->is_internal && bgp_set_sorted((u32 *) d->u.ptr->data, d->u.ptr->length / 8, 2))
+	      break;
+
+	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
+	    z->length = d->u.ptr->length;
+	    bgp_normalize_ec_set(z, (u32 *) d->u.ptr->data, p->is_internal);
+	    d->u.ptr = z;
+	    break;
+	  }
+	case EAF_TYPE_LC_SET:
+	  {
+	    if (bgp_set_sorted((u32 *) d->u.ptr->data, d->u.ptr->length / LCOMM_LENGTH, 3))
+	      break;
+
+	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
+	    z->length = d->u.ptr->length;
+	    bgp_normalize_lc_set((u32 *) z->data, (u32 *) d->u.ptr->data, z->length / LCOMM_LENGTH);
+	    d->u.ptr = z;
+	    break;
+	  }
+	default: ;
+	}
+      d++;
+      new->count++;
+    }
+
+  /* Hash */
+  hash = u32_hash(ea_hash(new));
+  if (b = OA_HASH_FIND(p->bucket_hash, BKH, hash, new))
+    {
+      DBG("Found bucket.\n");
+      return b;
+    }
+
+  /* Ensure that there are all mandatory attributes */
+  for(i=0; i<ARRAY_SIZE(bgp_mandatory_attrs); i++)
+    if (!(seen & (1 << bgp_mandatory_attrs[i])))
+      {
+	log(L_ERR "%s: Mandatory attribute %s missing in route %I/%d", p->p.name, bgp_attr_table[bgp_mandatory_attrs[i]].name, n->n.prefix, n->n.pxlen);
+	return NULL;
+      }
+
+  /* Check if next hop is valid */
+  a = ea_find(new, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  if (!a || ipa_equal(p->cf->remote_ip, *(ip_addr *)a->u.ptr->data))
+    {
+      log(L_ERR "%s: Invalid NEXT_HOP attribute in route %I/%d", p->p.name, n->n.prefix, n->n.pxlen);
+      return NULL;
+    }
+
+  /* Create new bucket */
+  DBG("Creating bucket.\n");
+  return bgp_new_bucket(p, new, hash);
+}
+
+void
+bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
+{
+  /* Buckets used by Adj-RIB-Out are kept even when not queued */
+  if (buck->uc)
+    return;
+
+  OA_HASH_REMOVE(p->bucket_hash, buck->hash, buck);
+  bgp_release_bucket(p, buck);
+}
+
+static inline void
+bgp_unlock_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
+{
+  if (!--buck->uc && !buck->send_node.next)
+    bgp_free_bucket(p, buck);
+}
+
+static struct bgp_bucket *
+bgp_get_withdraw_bucket(struct bgp_proto *p)
+{
+  struct bgp_bucket *buck = p->withdraw_bucket;
+
+  if (!buck)
+    {
+      buck = p->withdraw_bucket = mb_alloc(p->p.pool, sizeof(struct bgp_bucket));
+      bgp_init_bucket(p, buck);
+    }
+
+  return buck;
+}
+
+
+/* Prefix table */
+
+#define PXT_MIN_SIZE		64
+#define PXT_KEEP_SIZE		1024	/* Keep smaller tables when empty */
+#define PXH_MIN_ORDER		8
+#define PXH_MAX_ORDER		24
+
+static inline u32 *
+bgp_prefix_chain(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id)
+{
+  u32 h = ipa_hash32(prefix) ^ u32_hash((pxlen << 16) ^ path_id);
+  return &p->prefix_hash[h >> (32 - p->prefix_hash_order)];
+}
+
+void
+bgp_init_prefix_table(struct bgp_proto *p)
+{
+  p->prefix_hash_order = PXH_MIN_ORDER;
+  p->prefix_hash = mb_allocz(p->p.pool, sizeof(u32) << PXH_MIN_ORDER);
+  p->prefix_size = PXT_MIN_SIZE;
+  p->prefix_table = mb_alloc(p->p.pool, PXT_MIN_SIZE * sizeof(struct bgp_prefix));
+  p->prefix_used = 1;
+  p->prefix_free = 0;
+  p->prefix_count = 0;
+}
+
+void
+bgp_free_prefix_table(struct bgp_proto *p)
+{
+  mb_free(p->prefix_hash);
+  mb_free(p->prefix_table);
+  p->prefix_hash = NULL;
+  p->prefix_table = NULL;
+}
+
+static void
+bgp_rehash_prefix_table(struct bgp_proto *p, uint order)
+{
+  u32 *old = p->prefix_hash;
+  uint old_size = 1 << p->prefix_hash_order;
+  u32 i, id, next;
+
+  p->prefix_hash_order = order;
+  p->prefix_hash = mb_allocz(p->p.pool, sizeof(u32) << order);
+
+  for (i = 0; i < old_size; i++)
+    for (id = old[i]; id; id = next)
+    {
+      struct bgp_prefix *px = &p->prefix_table[id];
+      u32 *chain = bgp_prefix_chain(p, px->prefix, px->pxlen, px->path_id);
+
+      next = px->next;
+      px->next = *chain;
+      *chain = id;
+    }
+
+  mb_free(old);
+}
+
+static u32
+bgp_get_prefix(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id)
+{
+  u32 *chain = bgp_prefix_chain(p, prefix, pxlen, path_id);
+  struct bgp_prefix *px;
+  u32 id;
+
+  for (id = *chain; id; id = px->next)
+  {
+    px = &p->prefix_table[id];
+    if (ipa_equal(px->prefix, prefix) && (px->pxlen == pxlen) && (px->path_id == path_id))
+      return id;
+  }
+
+  if (p->prefix_free)
+  {
+    id = p->prefix_free;
+    p->prefix_free = p->prefix_table[id].next;
+  }
+  else
+  {
+    if (p->prefix_used == p->prefix_size)
+    {
+      p->prefix_size *= 2;
+      p->prefix_table = mb_realloc(p->prefix_table, p->prefix_size * sizeof(struct bgp_prefix));
+    }
+
+    id = p->prefix_used++;
+  }
+
+  px = &p->prefix_table[id];
+  px->prefix = prefix;
+  px->pxlen = pxlen;
+  px->path_id = path_id;
+  px->bucket = 0;
+  px->next = *chain;
+  *chain = id;
+
+  if ((++p->prefix_count > (1U << p->prefix_hash_order)) &&
+      (p->prefix_hash_order < PXH_MAX_ORDER))
+    bgp_rehash_prefix_table(p, p->prefix_hash_order + 1);
+
+  return id;
+}
+
+static void
+bgp_free_prefix(struct bgp_proto *p, u32 id)
+{
+  struct bgp_prefix *px = &p->prefix_table[id];
+  u32 *chain = bgp_prefix_chain(p, px->prefix, px->pxlen, px->path_id);
+
+  while (*chain != id)
+    chain = &p->prefix_table[*chain].next;
+
+  *chain = px->next;
+  px->next = p->prefix_free;
+  p->prefix_free = id;
+  p->prefix_count--;
+
+  /* Return memory when the queue is drained, e.g. after the initial feed */
+  if (!p->prefix_count && (p->prefix_size > PXT_KEEP_SIZE))
+  {
+    bgp_free_prefix_table(p);
+    bgp_init_prefix_table(p);
+  }
+}
+
+static void
+bgp_bucket_add_prefix(struct bgp_proto *p, struct bgp_bucket *buck, u32 id)
+{
+  if (buck->px_count == buck->px_size)
+  {
+    u32 *old = buck->prefixes;
+
+    buck->px_size *= 2;
+    if (old == buck->px_inline)
+    {
+      buck->prefixes = mb_alloc(p->p.pool, buck->px_size * sizeof(u32));
+      memcpy(buck->prefixes, old, buck->px_count * sizeof(u32));
+    }
+    else
+      buck->prefixes = mb_realloc(old, buck->px_size * sizeof(u32));
+  }
+
+  p->prefix_table[id].bucket = buck->id;
+  p->prefix_table[id].pos = buck->px_count;
+  buck->prefixes[buck->px_count++] = id;
+}
+
+static void
+bgp_bucket_trim(struct bgp_bucket *buck)
+{
+  /* Free the array of an empty bucket, it may be kept by Adj-RIB-Out */
+  if (!buck->px_count && (buck->prefixes != buck->px_inline))
+  {
+    mb_free(buck->prefixes);
+    buck->px_size = BGP_BUCKET_INLINE;
+    buck->prefixes = buck->px_inline;
+  }
+}
+
+static void
+bgp_bucket_remove_prefix(struct bgp_proto *p, struct bgp_bucket *buck, u32 id)
+{
+  struct bgp_prefix *px = &p->prefix_table[id];
+  u32 last = buck->prefixes[--buck->px_count];
+
+  /* Keep the array dense, move the last prefix to the free position */
+  if (last != id)
+  {
+    buck->prefixes[px->pos] = last;
+    p->prefix_table[last].pos = px->pos;
+  }
+
+  px->bucket = 0;
+  bgp_bucket_trim(buck);
+}
+
+/**
+ * bgp_dequeue_prefix - remove the last prefix from a bucket
+ * @p: BGP instance
+ * @buck: bucket
+ *
+ * Called after the last prefix of @buck (see bgp_last_prefix()) has been
+ * encoded to an UPDATE message or skipped. The prefix entry is freed.
+ */
+void
+bgp_dequeue_prefix(struct bgp_proto *p, struct bgp_bucket *buck)
+{
+  bgp_free_prefix(p, buck->prefixes[--buck->px_count]);
+  bgp_bucket_trim(buck);
+}
+
+
+static void
+bgp_queue_prefix(struct bgp_proto *p, struct bgp_bucket *buck, ip_addr prefix, int pxlen, u32 path_id)
+{
+  u32 id = bgp_get_prefix(p, prefix, pxlen, path_id);
+  struct bgp_prefix *px = &p->prefix_table[id];
+
+  if (px->bucket == buck->id)
+    return;
+
+  if (px->bucket)
+    bgp_bucket_remove_prefix(p, p->bucket_map[px->bucket], id);
+
+  bgp_bucket_add_prefix(p, buck, id);
+
+  if ((buck != p->withdraw_bucket) && !buck->send_node.next)
+  {
+    add_tail(&p->bucket_queue, &buck->send_node);
+    p->bucket_queue_len++;
+  }
+}
+
+
+/* Adj-RIB-In */
+
+#define AIH_KEY(n)		n->prefix, n->pxlen, n->path_id
+#define AIH_NEXT(n)		n->next
+#define AIH_EQ(p1,l1,i1,p2,l2,i2) ipa_equal(p1, p2) && l1 == l2 && i1 == i2
+/* Path ID is not hashed, so all paths of a network are in one chain */
+#define AIH_FN(p,l,i)		ipa_hash32(p) ^ u32_hash(l)
+
+#define AIH_REHASH		bgp_aih_rehash
+#define AIH_PARAMS		/8, *2, 2, 2, 8, 24
+
+/* Max number of routes reloaded in one event run */
+#define BGP_RELOAD_STEP		512
+
+/* Max number of subprefix lookups or hash entries examined in one event run */
+#define BGP_REVAL_STEP		4096
+
+HASH_DEFINE_REHASH_FN(AIH, struct bgp_adj_in)
+
+static void bgp_adj_in_reload_step(void *P);
+static void bgp_adj_in_reval_step(void *P);
+
+/* The hash table must not be resized while it is walked in steps */
+static inline int
+bgp_adj_in_walking(struct bgp_proto *p)
+{
+  return (p->adj_in_reload_pos != ~0U) || (p->adj_in_reval->trie && p->adj_in_reval->walk);
+}
+
+static inline void
+bgp_adj_in_may_resize(struct bgp_proto *p)
+{
+  if (bgp_adj_in_walking(p))
+    return;
+
+  HASH_MAY_RESIZE_DOWN(p->adj_in_hash, AIH, p->p.pool);
+  HASH_MAY_STEP_UP(p->adj_in_hash, AIH, p->p.pool);
+}
+
+void
+bgp_init_adj_in(struct bgp_proto *p)
+{
+  /* Table may be kept from the previous session, see bgp_conn_leave_established_state() */
+  if (!p->cf->import_table || p->adj_in_slab)
+    return;
+
+  HASH_INIT(p->adj_in_hash, p->p.pool, 8);
+  p->adj_in_slab = sl_new(p->p.pool, sizeof(struct bgp_adj_in));
+  p->adj_in_reload_event = ev_new(p->p.pool);
+  p->adj_in_reload_event->hook = bgp_adj_in_reload_step;
+  p->adj_in_reload_event->data = p;
+  p->adj_in_reload_pos = ~0;
+
+  struct bgp_reval *r = mb_allocz(p->p.pool, sizeof(struct bgp_reval));
+  r->event = ev_new(p->p.pool);
+  r->event->hook = bgp_adj_in_reval_step;
+  r->event->data = p;
+  r->lp = lp_new(p->p.pool, 4080);
+  p->adj_in_reval = r;
+}
+
+void
+bgp_free_adj_in(struct bgp_proto *p)
+{
+  if (!p->adj_in_slab)
+    return;
+
+  HASH_WALK(p->adj_in_hash, next, e)
+    rta_free(e->attrs);
+  HASH_WALK_END;
+
+  HASH_FREE(p->adj_in_hash);
+
+  rfree(p->adj_in_reload_event);
+  p->adj_in_reload_event = NULL;
+
+  rfree(p->adj_in_reval->event);
+  rfree(p->adj_in_reval->lp);
+  mb_free(p->adj_in_reval);
+  p->adj_in_reval = NULL;
+
+  rfree(p->adj_in_slab);
+  p->adj_in_slab = NULL;
+}
+
+/**
+ * bgp_adj_in_update - record received route in Adj-RIB-In
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @path_id: received path ID
+ * @a: cached route attributes, or %NULL for withdraw
+ *
+ * The table keeps received routes before import filters, so they can be
+ * reimported by bgp_adj_in_reload() when the import filter changes. Cached
+ * attributes are shared with routes in the routing table.
+ */
+void
+bgp_adj_in_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, rta *a)
+{
+  struct bgp_adj_in *e = HASH_FIND(p->adj_in_hash, AIH, prefix, pxlen, path_id);
+  int walking = bgp_adj_in_walking(p);
+
+  if (!a)
+    {
+      if (!e)
+	return;
+
+      if (walking)
+	HASH_REMOVE(p->adj_in_hash, AIH, e);
+      else
+	HASH_REMOVE2(p->adj_in_hash, AIH, p->p.pool, e);
+
+      p->adj_in_reval->pxlens[e->pxlen]--;
+      rta_free(e->attrs);
+      sl_free(p->adj_in_slab, e);
+      return;
+    }
+
+  if (!e)
+    {
+      e = sl_alloc(p->adj_in_slab);
+      e->prefix = prefix;
+      e->pxlen = pxlen;
+      e->path_id = path_id;
+      e->attrs = NULL;
+
+      if (walking)
+	HASH_INSERT(p->adj_in_hash, AIH, e);
+      else
+	HASH_INSERT2(p->adj_in_hash, AIH, p->p.pool, e);
+
+      p->adj_in_reval->pxlens[pxlen]++;
+    }
+
+  e->stale = 0;
+
+  if (e->attrs != a)
+    {
+      rta *old = e->attrs;
+      e->attrs = rta_clone(a);
+
+      if (old)
+	rta_free(old);
+    }
+}
+
+static rta *bgp_llgr_stale_attrs(rta *a);
+
+/* Reimport route from Adj-RIB-In, stale routes are marked again */
+static void
+bgp_adj_in_import(struct bgp_proto *p, struct bgp_adj_in *e)
+{
+  rta *a = e->stale ? bgp_llgr_stale_attrs(e->attrs) : rta_clone(e->attrs);
+  net *n = net_get(p->p.table, e->prefix, e->pxlen);
+  rte *r = rte_get_temp(a);
+  r->net = n;
+  r->pflags = bgp_rte_pflags(a);
+  r->u.bgp.suppressed = 0;
+  rte_update2(p->p.main_ahook, n, r, e->attrs->src);
+}
+
+static void
+bgp_adj_in_reload_step(void *P)
+{
+  struct bgp_proto *p = P;
+  uint size = HASH_SIZE(p->adj_in_hash);
+  uint cnt = 0;
+
+  while ((p->adj_in_reload_pos < size) && (cnt < BGP_RELOAD_STEP))
+    {
+      struct bgp_adj_in *e, *next;
+
+      for (e = p->adj_in_hash.data[p->adj_in_reload_pos]; e; e = next)
+	{
+	  next = e->next;
+	  bgp_adj_in_import(p, e);
+	  cnt++;
+	}
+
+      p->adj_in_reload_pos++;
+    }
+
+  lp_flush(bgp_linpool);
+  p->adj_in_reload_count += cnt;
+
+  if (p->adj_in_reload_pos < size)
+    {
+      ev_schedule(p->adj_in_reload_event);
+      return;
+    }
+
+  BGP_TRACE(D_EVENTS, "Reloaded %u routes from import table", p->adj_in_reload_count);
+  p->adj_in_reload_pos = ~0;
+
+  /* Resizing was blocked during reload */
+  bgp_adj_in_may_resize(p);
+}
+
+/**
+ * bgp_adj_in_reload - reimport routes from Adj-RIB-In
+ * @p: BGP instance
+ *
+ * Schedules reimport of all routes recorded in Adj-RIB-In, so they pass
+ * through current import filters again. The reload is done in steps from an
+ * event, a pending reload is restarted from the beginning.
+ */
+void
+bgp_adj_in_reload(struct bgp_proto *p)
+{
+  BGP_TRACE(D_EVENTS, "Reloading routes from import table");
+  p->adj_in_reload_pos = 0;
+  p->adj_in_reload_count = 0;
+  ev_schedule(p->adj_in_reload_event);
+}
+
+/* Reimport all paths of a network from Adj-RIB-In, returns their number */
+static uint
+bgp_adj_in_import_net(struct bgp_proto *p, ip_addr prefix, int pxlen)
+{
+  struct bgp_adj_in *e = p->adj_in_hash.data[HASH_FN(p->adj_in_hash, AIH, prefix, pxlen, 0)];
+  uint cnt = 0;
+
+  for (; e; e = e->next)
+    if (ipa_equal(e->prefix, prefix) && (e->pxlen == pxlen))
+    {
+      bgp_adj_in_import(p, e);
+      cnt++;
+    }
+
+  return cnt;
+}
+
+/* Set @len bits of @a starting at bit @pos to @val */
+static inline ip_addr
+bgp_reval_subprefix(ip_addr a, uint pos, uint len, u32 val)
+{
+  uint i;
+
+  for (i = 0; i < len; i++)
+    if (val & (1U << (len - 1 - i)))
+      a = ipa_or(a, ipa_xor(ipa_mkmask(pos + i + 1), ipa_mkmask(pos + i)));
+
+  return a;
+}
+
+static void
+bgp_reval_add_trie(void *data, ip_addr px, int plen)
+{
+  struct bgp_reval *r = data;
+  trie_add_prefix(r->trie, px, plen, plen, MAX_PREFIX_LENGTH);
+}
+
+static void
+bgp_reval_add_px(void *data, ip_addr px, int plen)
+{
+  struct bgp_reval *r = data;
+
+  if (r->px)
+  {
+    r->px[r->px_count].prefix = px;
+    r->px[r->px_count].pxlen = plen;
+  }
+
+  r->px_count++;
+}
+
+/* Number of subprefix lookups needed, or @limit + 1 if larger than @limit */
+static u64
+bgp_reval_lookups(struct bgp_reval *r, u64 limit)
+{
+  u64 cnt = 0;
+  uint i, l;
+
+  for (i = 0; i < r->px_count; i++)
+    for (l = r->px[i].pxlen; l <= MAX_PREFIX_LENGTH; l++)
+      if (r->lookup[l])
+      {
+	uint bits = l - r->px[i].pxlen;
+
+	if (bits >= 32)
+	  return limit + 1;
+
+	cnt += 1ULL << bits;
+
+	if (cnt > limit)
+	  return limit + 1;
+      }
+
+  return cnt;
+}
+
+static void
+bgp_adj_in_reval_step(void *P)
+{
+  struct bgp_proto *p = P;
+  struct bgp_reval *r = p->adj_in_reval;
+  uint cnt = 0, steps = 0;
+  int done;
+
+  if (r->walk)
+  {
+    uint size = HASH_SIZE(p->adj_in_hash);
+
+    while ((r->pos < size) && (cnt < BGP_RELOAD_STEP) && (steps < BGP_REVAL_STEP))
+    {
+      struct bgp_adj_in *e;
+
+      for (e = p->adj_in_hash.data[r->pos]; e; e = e->next, steps++)
+	if (trie_match_prefix(r->trie, e->prefix, e->pxlen))
+	{
+	  bgp_adj_in_import(p, e);
+	  cnt++;
+	}
+
+      r->pos++;
+    }
+
+    done = (r->pos >= size);
+  }
+  else
+  {
+    while ((r->pos < r->px_count) && (cnt < BGP_RELOAD_STEP) && (steps < BGP_REVAL_STEP))
+    {
+      struct bgp_reval_px *x = &r->px[r->pos];
+      uint bits = r->pxlen - x->pxlen;
+      steps++;
+
+      /* Lookup lengths are limited by bgp_reval_lookups(), so bits < 32 */
+      if (r->lookup[r->pxlen] && (r->val < (1U << bits)))
+      {
+	ip_addr px = bgp_reval_subprefix(x->prefix, x->pxlen, bits, r->val);
+	cnt += bgp_adj_in_import_net(p, px, r->pxlen);
+	r->val++;
+	continue;
+      }
+
+      /* Next prefix length, or next affected prefix */
+      r->val = 0;
+
+      if (r->pxlen < MAX_PREFIX_LENGTH)
+	r->pxlen++;
+      else if (++r->pos < r->px_count)
+	r->pxlen = r->px[r->pos].pxlen;
+    }
+
+    done = (r->pos >= r->px_count);
+  }
+
+  lp_flush(bgp_linpool);
+  r->count += cnt;
+
+  if (!done)
+  {
+    ev_schedule(r->event);
+    return;
+  }
+
+  BGP_TRACE(D_EVENTS, "Reloaded %u routes from import table for revalidation", r->count);
+  r->trie = NULL;
+  r->px = NULL;
+  lp_flush(r->lp);
+
+  /* Resizing was blocked during walk */
+  bgp_adj_in_may_resize(p);
+}
+
+/**
+ * bgp_adj_in_reload_prefixes - reimport selected routes from Adj-RIB-In
+ * @p: BGP instance
+ * @t: trie of affected prefixes
+ *
+ * Schedules reimport of routes recorded in Adj-RIB-In whose networks match
+ * trie @t, so they pass through import filters again. Used for revalidation
+ * after ROA changes. The trie is expected to contain prefixes with all their
+ * subprefixes, other patterns are ignored. Usually just a few networks are
+ * affected, so possible subprefixes of affected prefixes are looked up in
+ * Adj-RIB-In, skipping prefix lengths with no routes. When that would take
+ * more lookups than there are routes, the whole Adj-RIB-In is walked instead.
+ * The reimport is done in steps from an event. Prefixes of a pending
+ * revalidation are merged with @t and the revalidation is restarted.
+ */
+void
+bgp_adj_in_reload_prefixes(struct bgp_proto *p, struct f_trie *t)
+{
+  struct bgp_reval *r = p->adj_in_reval;
+  uint i;
+
+  if (!r->trie)
+    r->trie = f_new_trie(r->lp, sizeof(struct f_trie_node));
+
+  trie_walk_covering(t, bgp_reval_add_trie, r);
+
+  /* Collect affected prefixes, not covered by other ones */
+  r->px = NULL;
+  r->px_count = 0;
+  trie_walk_covering(r->trie, bgp_reval_add_px, r);
+  r->px = lp_alloc(r->lp, r->px_count * sizeof(struct bgp_reval_px));
+  r->px_count = 0;
+  trie_walk_covering(r->trie, bgp_reval_add_px, r);
+
+  /* Routes received later are imported with current ROAs */
+  for (i = 0; i <= MAX_PREFIX_LENGTH; i++)
+    r->lookup[i] = !!r->pxlens[i];
+
+  r->walk = (bgp_reval_lookups(r, p->adj_in_hash.count) > p->adj_in_hash.count);
+  r->pos = 0;
+  r->pxlen = r->px_count ? r->px[0].pxlen : 0;
+  r->val = 0;
+  r->count = 0;
+
+  BGP_TRACE(D_EVENTS, "Reloading routes from import table for revalidation (%u prefixes%s)",
+	    r->px_count, r->walk ? ", full walk" : "");
+  ev_schedule(r->event);
+}
+
+/**
+ * bgp_adj_in_memsize - memory used by Adj-RIB-In
+ * @p: BGP instance
+ *
+ * Returns the size of Adj-RIB-In entries and the hash table. Cached route
+ * attributes are not included as they are shared with the routing table.
+ */
+uint
+bgp_adj_in_memsize(struct bgp_proto *p)
+{
+  return rmemsize(p->adj_in_slab) + HASH_SIZE(p->adj_in_hash) * sizeof(struct bgp_adj_in *);
+}
+
+
+/*
+ *	Stale route tracking
+ *
+ *	When the neighbor may do graceful restart, we keep an index of all
+ *	routes received from it, so stale routes can be found without walking
+ *	the whole routing table. Each entry records the refresh cycle in which
+ *	the route was last received. A refresh cycle (graceful restart or
+ *	enhanced route refresh) is started just by incrementing p->rx_gen, and
+ *	routes not received during the cycle are then removed by a sweep of the
+ *	index, which is done in steps from an event. The same sweep is used to
+ *	mark stale routes for long-lived graceful restart (RFC 9494).
+ */
+
+#define RXH_KEY(n)		n->prefix, n->pxlen, n->path_id
+#define RXH_NEXT(n)		n->next
+#define RXH_EQ(p1,l1,i1,p2,l2,i2) ipa_equal(p1, p2) && l1 == l2 && i1 == i2
+#define RXH_FN(p,l,i)		ipa_hash32(p) ^ u32_hash((l << 16) ^ i)
+
+#define RXH_REHASH		bgp_rxh_rehash
+#define RXH_PARAMS		/8, *2, 2, 2, 8, 24
+
+/* Max number of stale routes processed in one event run */
+#define BGP_SWEEP_STEP		512
+
+HASH_DEFINE_REHASH_FN(RXH, struct bgp_rx_route)
+
+static void bgp_rx_sweep_step(void *P);
+
+/**
+ * bgp_init_rx_routes - start tracking of received routes
+ * @p: BGP instance
+ *
+ * Once started, the tracking is kept until the protocol goes down, as routes
+ * received in the past sessions may still be in the routing table. The index
+ * is allocated from the protocol pool, so no explicit free is needed.
+ */
+void
+bgp_init_rx_routes(struct bgp_proto *p)
+{
+  if (p->rx_slab)
+    return;
+
+  HASH_INIT(p->rx_hash, p->p.pool, 8);
+  p->rx_slab = sl_new(p->p.pool, sizeof(struct bgp_rx_route));
+  p->rx_sweep_event = ev_new(p->p.pool);
+  p->rx_sweep_event->hook = bgp_rx_sweep_step;
+  p->rx_sweep_event->data = p;
+  p->rx_gen = 1;
+  p->rx_sweep_gen = 0;
+  p->rx_llgr_gen = 0;
+  p->rx_sweep_pos = ~0;
+}
+
+/**
+ * bgp_rx_route_update - record received route
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @path_id: received path ID
+ * @announce: 1 for received route, 0 for withdraw
+ */
+void
+bgp_rx_route_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, int announce)
+{
+  struct bgp_rx_route *e = HASH_FIND(p->rx_hash, RXH, prefix, pxlen, path_id);
+
+  /* The hash table must not be resized during sweep */
+  int sweeping = (p->rx_sweep_pos != ~0U);
+
+  if (!announce)
+    {
+      if (!e)
+	return;
+
+      if (sweeping)
+	HASH_REMOVE(p->rx_hash, RXH, e);
+      else
+	HASH_REMOVE2(p->rx_hash, RXH, p->p.pool, e);
+
+      sl_free(p->rx_slab, e);
+      return;
+    }
+
+  if (!e)
+    {
+      e = sl_alloc(p->rx_slab);
+      e->prefix = prefix;
+      e->pxlen = pxlen;
+      e->path_id = path_id;
+
+      if (sweeping)
+	HASH_INSERT(p->rx_hash, RXH, e);
+      else
+	HASH_INSERT2(p->rx_hash, RXH, p->p.pool, e);
+    }
+
+  e->gen = p->rx_gen;
+}
+
+static rte *
+bgp_rx_find_rte(struct bgp_proto *p, struct bgp_rx_route *e)
+{
+  net *n = net_find(p->p.table, e->prefix, e->pxlen);
+  rte *r;
+
+  if (!n)
+    return NULL;
+
+  for (r = n->routes; r; r = r->next)
+    if ((r->sender == p->p.main_ahook) && (r->attrs->src->private_id == e->path_id))
+      return r;
+
+  return NULL;
+}
+
+/* Returns copy of attributes @a with LLGR_STALE community, allocated from bgp_linpool */
+static rta *
+bgp_llgr_stale_attrs(rta *a)
+{
+  eattr *c = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
+  rta *b = rta_do_cow(a, bgp_linpool);
+  ea_list *ea = lp_alloc(bgp_linpool, sizeof(ea_list) + sizeof(eattr));
+
+  ea->next = b->eattrs;
+  ea->flags = EALF_SORTED;
+  ea->count = 1;
+  ea->attrs[0].id = EA_CODE(EAP_BGP, BA_COMMUNITY);
+  ea->attrs[0].flags = BAF_OPTIONAL | BAF_TRANSITIVE;
+  ea->attrs[0].type = EAF_TYPE_INT_SET;
+  ea->attrs[0].u.ptr = int_set_add(bgp_linpool, c ? c->u.ptr : NULL, BGP_COMM_LLGR_STALE);
+  b->eattrs = ea;
+
+  return b;
+}
+
+/* Returns 1 if the route should be removed instead of retained */
+static int
+bgp_rx_llgr_stale(struct bgp_proto *p, struct bgp_rx_route *e, rte *r)
+{
+  struct bgp_adj_in *ai = p->adj_in_slab ?
+    HASH_FIND(p->adj_in_hash, AIH, e->prefix, e->pxlen, e->path_id) : NULL;
+
+  /* Keep the mark for reimport from Adj-RIB-In, see bgp_adj_in_import() */
+  if (ai)
+    ai->stale = 1;
+
+  if (!r)
+    return 0;
+
+  eattr *c = ea_find(r->attrs->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
+  if (c && int_set_contains(c->u.ptr, BGP_COMM_NO_LLGR))
+    return 1;
+
+  if (r->pflags & BGP_REF_STALE)
+    return 0;
+
+  rte *new = rte_do_cow(r);
+  rta_free(new->attrs);
+  new->attrs = bgp_llgr_stale_attrs(r->attrs);
+  new->pflags = r->pflags | BGP_REF_STALE;
+  rte_modify(r, new);
+  return 0;
+}
+
+static void
+bgp_rx_sweep_step(void *P)
+{
+  struct bgp_proto *p = P;
+  uint size = HASH_SIZE(p->rx_hash);
+  uint cnt = 0;
+
+  /* All routes are flushed when the protocol is going down */
+  if ((p->p.proto_state != PS_START) && (p->p.proto_state != PS_UP))
+    {
+      p->rx_sweep_pos = ~0;
+      return;
+    }
+
+  while ((p->rx_sweep_pos < size) && (cnt < BGP_SWEEP_STEP))
+    {
+      struct bgp_rx_route *e, *next;
+
+      for (e = p->rx_hash.data[p->rx_sweep_pos]; e; e = next)
 	{
-	  if (!p->is_internal)
+	  next = e->next;
+	  cnt++;
+
+	  int discard = (e->gen < p->rx_sweep_gen);
+	  if (!discard && (e->gen >= p->rx_llgr_gen))
+	    continue;
+
+	  rte *r = bgp_rx_find_rte(p, e);
+	  if (!discard)
+	    discard = bgp_rx_llgr_stale(p, e, r);
+
+	  if (discard)
 	    {
-	      if (!bgp_attr_table[code].allow_in_ebgp)
-		continue;
-	      if ((code == BA_LOCAL_PREF) && !p->cf->allow_local_pref)
-		continue;
+	      if (r)
+		rte_modify(r, NULL);
+
+	      if (p->adj_in_slab)
+		bgp_adj_in_update(p, e->prefix, e->pxlen, e->path_id, NULL);
+
+	      HASH_REMOVE(p->rx_hash, RXH, e);
+	      sl_free(p->rx_slab, e);
 	    }
-	  /* The flags might have been zero if the attr was added by filters */
-	  a->flags = (a->flags & BAF_PARTIAL) | bgp_attr_table[code].expected_flags;
-	  if (code < 32)
-	    seen |= 1 << code;
-	}
-      else
-	{
-	  /* Don't re-export unknown non-transitive attributes */
-	  if (!(a->flags & BAF_TRANSITIVE))
-	    continue;
-	}
-      *d = *a;
-      if ((d->type & EAF_ORIGINATED) && !originate && (d->flags & BAF_TRANSITIVE) && (d->flags & BAF_OPTIONAL))
-	d->flags |= BAF_PARTIAL;
-      switch (d->type & EAF_TYPE_MASK)
-	{
-	case EAF_TYPE_INT_SET:
-	  {
-	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
-	    z->length = d->u.ptr->length;
-	    bgp_normalize_int_set((u32 *) z->data, (u32 *) d->u.ptr->data, z->length / 4);
-	    d->u.ptr = z;
-	    break;
-	  }
-	case EAF_TYPE_EC_SET:
-	  {
-	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
-	    z->length = d->u.ptr->length;
-	    bgp_normalize_ec_set(z, (u32 *) d->u.ptr->data, p->is_internal);
-	    d->u.ptr = z;
-	    break;
-	  }
-	case EAF_TYPE_LC_SET:
-	  {
-	    struct adata *z = alloca(sizeof(struct adata) + d->u.ptr->length);
-	    z->length = d->u.ptr->length;
-	    bgp_normalize_lc_set((u32 *) z->data, (u32 *) d->u.ptr->data, z->length / LCOMM_LENGTH);
-	    d->u.ptr = z;
-	    break;
-	  }
-	default: ;
 	}
-      d++;
-      new->count++;
-    }
 
-  /* Hash */
-  hash = ea_hash(new);
-  for(b=p->bucket_hash[hash & (p->hash_size - 1)]; b; b=b->hash_next)
-    if (b->hash == hash && ea_same(b->eattrs, new))
-      {
-	DBG("Found bucket.\n");
-	return b;
-      }
+      p->rx_sweep_pos++;
+    }
 
-  /* Ensure that there are all mandatory attributes */
-  for(i=0; i<ARRAY_SIZE(bgp_mandatory_attrs); i++)
-    if (!(seen & (1 << bgp_mandatory_attrs[i])))
-      {
-	log(L_ERR "%s: Mandatory attribute %s missing in route %I/%d", p->p.name, bgp_attr_table[bgp_mandatory_attrs[i]].name, n->n.prefix, n->n.pxlen);
-	return NULL;
-      }
+  lp_flush(bgp_linpool);
 
-  /* Check if next hop is valid */
-  a = ea_find(new, EA_CODE(EAP_BGP, BA_NEXT_HOP));
-  if (!a || ipa_equal(p->cf->remote_ip, *(ip_addr *)a->u.ptr->data))
+  if (p->rx_sweep_pos < size)
     {
-      log(L_ERR "%s: Invalid NEXT_HOP attribute in route %I/%d", p->p.name, n->n.prefix, n->n.pxlen);
-      return NULL;
+      ev_schedule(p->rx_sweep_event);
+      return;
     }
 
-  /* Create new bucket */
-  DBG("Creating bucket.\n");
-  return bgp_new_bucket(p, new, hash);
+  p->rx_sweep_pos = ~0;
+  p->rx_llgr_gen = 0;
+
+  /* Resizing was blocked during sweep */
+  HASH_MAY_RESIZE_DOWN(p->rx_hash, RXH, p->p.pool);
+  HASH_MAY_STEP_UP(p->rx_hash, RXH, p->p.pool);
+}
+
+static void
+bgp_rx_sweep(struct bgp_proto *p)
+{
+  p->rx_sweep_pos = 0;
+  ev_schedule(p->rx_sweep_event);
 }
 
+/**
+ * bgp_rx_refresh_begin - start a refresh cycle of received routes
+ * @p: BGP instance
+ *
+ * This is a replacement of rt_refresh_begin() for tracked routes, it just
+ * starts a new cycle, so all routes received so far become stale.
+ */
 void
-bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
+bgp_rx_refresh_begin(struct bgp_proto *p)
 {
-  if (buck->hash_next)
-    buck->hash_next->hash_prev = buck->hash_prev;
-  if (buck->hash_prev)
-    buck->hash_prev->hash_next = buck->hash_next;
-  else
-    p->bucket_hash[buck->hash & (p->hash_size-1)] = buck->hash_next;
-  mb_free(buck);
+  p->rx_gen++;
+}
+
+/**
+ * bgp_rx_refresh_end - end a refresh cycle of received routes
+ * @p: BGP instance
+ *
+ * This is a replacement of rt_refresh_end() for tracked routes. Routes not
+ * received during the current cycle are removed from the routing table by
+ * a sweep of the index, which takes time proportional to the number of
+ * routes received from the neighbor. A pending sweep is restarted.
+ */
+void
+bgp_rx_refresh_end(struct bgp_proto *p)
+{
+  p->rx_sweep_gen = p->rx_gen;
+  bgp_rx_sweep(p);
+}
+
+/**
+ * bgp_rx_llgr_begin - mark stale routes as LLGR stale
+ * @p: BGP instance
+ *
+ * Routes not received during the current cycle are retained as LLGR stale -
+ * they get LLGR_STALE community and are less preferred than other routes,
+ * see bgp_rte_better(). Routes with NO_LLGR community are removed.
+ */
+void
+bgp_rx_llgr_begin(struct bgp_proto *p)
+{
+  p->rx_llgr_gen = p->rx_gen;
+  bgp_rx_sweep(p);
+}
+
+/**
+ * bgp_rte_pflags - protocol-specific flags for received route
+ * @a: received route attributes
+ *
+ * Routes with LLGR_STALE community are marked by %BGP_REF_STALE flag.
+ */
+byte
+bgp_rte_pflags(rta *a)
+{
+  eattr *c = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_COMMUNITY));
+
+  return (c && int_set_contains(c->u.ptr, BGP_COMM_LLGR_STALE)) ? BGP_REF_STALE : 0;
 }
 
 
-/* Prefix hash table */
+/* Adj-RIB-Out */
 
-#define PXH_KEY(n1)		n1->n.prefix, n1->n.pxlen, n1->path_id
-#define PXH_NEXT(n)		n->next
-#define PXH_EQ(p1,l1,i1,p2,l2,i2) ipa_equal(p1, p2) && l1 == l2 && i1 == i2
-#define PXH_FN(p,l,i)		ipa_hash32(p) ^ u32_hash((l << 16) ^ i)
+#define AOH_KEY(n)		n->prefix, n->pxlen, n->path_id
+#define AOH_NEXT(n)		n->next
+#define AOH_EQ(p1,l1,i1,p2,l2,i2) ipa_equal(p1, p2) && l1 == l2 && i1 == i2
+#define AOH_FN(p,l,i)		ipa_hash32(p) ^ u32_hash((l << 16) ^ i)
 
-#define PXH_REHASH		bgp_pxh_rehash
-#define PXH_PARAMS		/8, *2, 2, 2, 8, 20
+#define AOH_REHASH		bgp_aoh_rehash
+#define AOH_PARAMS		/8, *2, 2, 2, 8, 24
 
 
-HASH_DEFINE_REHASH_FN(PXH, struct bgp_prefix)
+HASH_DEFINE_REHASH_FN(AOH, struct bgp_adj_out)
 
 void
-bgp_init_prefix_table(struct bgp_proto *p, u32 order)
+bgp_init_adj_out(struct bgp_proto *p)
 {
-  HASH_INIT(p->prefix_hash, p->p.pool, order);
+  if (!p->cf->export_table)
+    return;
 
-  p->prefix_slab = sl_new(p->p.pool, sizeof(struct bgp_prefix));
+  HASH_INIT(p->adj_out_hash, p->p.pool, 8);
+  p->adj_out_slab = sl_new(p->p.pool, sizeof(struct bgp_adj_out));
+  p->adj_out_gen = 0;
+  p->adj_out_refeed = 0;
+  p->adj_out_resend = 0;
 }
 
 void
-bgp_free_prefix_table(struct bgp_proto *p)
+bgp_free_adj_out(struct bgp_proto *p)
 {
-  HASH_FREE(p->prefix_hash);
+  if (!p->adj_out_slab)
+    return;
+
+  HASH_WALK(p->adj_out_hash, next, e)
+    if (e->bucket)
+      bgp_unlock_bucket(p, e->bucket);
+  HASH_WALK_END;
 
-  rfree(p->prefix_slab);
-  p->prefix_slab = NULL;
+  HASH_FREE(p->adj_out_hash);
+
+  rfree(p->adj_out_slab);
+  p->adj_out_slab = NULL;
 }
 
-static struct bgp_prefix *
-bgp_get_prefix(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id)
+/*
+ * Record a route change in Adj-RIB-Out. Buckets are shared by all routes with
+ * the same attributes, so the route is unchanged iff it stays in the same
+ * bucket. Returns 0 if the update does not change what the peer has.
+ */
+static int
+bgp_adj_out_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, struct bgp_bucket *buck)
+{
+  struct bgp_adj_out *e = HASH_FIND(p->adj_out_hash, AOH, prefix, pxlen, path_id);
+
+  if (!buck)
+    {
+      if (!e)
+	return 0;
+
+      HASH_REMOVE2(p->adj_out_hash, AOH, p->p.pool, e);
+      if (e->bucket)
+	bgp_unlock_bucket(p, e->bucket);
+      sl_free(p->adj_out_slab, e);
+      return 1;
+    }
+
+  if (!e)
+    {
+      e = sl_alloc(p->adj_out_slab);
+      e->prefix = prefix;
+      e->pxlen = pxlen;
+      e->path_id = path_id;
+      e->bucket = NULL;
+      HASH_INSERT2(p->adj_out_hash, AOH, p->p.pool, e);
+    }
+
+  e->gen = p->adj_out_gen;
+
+  if (e->bucket == buck)
+    return 0;
+
+  buck->uc++;
+  if (e->bucket)
+    bgp_unlock_bucket(p, e->bucket);
+  e->bucket = buck;
+  return 1;
+}
+
+/**
+ * bgp_adj_out_begin_refeed - start Adj-RIB-Out refeed cycle
+ * @p: BGP instance
+ *
+ * Called when the routing table starts to refeed routes to the protocol (e.g.
+ * after export filter change). Refed routes which are the same as recorded in
+ * Adj-RIB-Out are not sent again, routes not refed at all are withdrawn in
+ * bgp_adj_out_end_refeed().
+ */
+void
+bgp_adj_out_begin_refeed(struct bgp_proto *p)
+{
+  p->adj_out_gen++;
+  p->adj_out_refeed = 1;
+}
+
+/**
+ * bgp_adj_out_end_refeed - finish Adj-RIB-Out refeed cycle
+ * @p: BGP instance
+ *
+ * Withdraws all routes from Adj-RIB-Out that were not updated during the
+ * refeed cycle.
+ */
+void
+bgp_adj_out_end_refeed(struct bgp_proto *p)
 {
-  struct bgp_prefix *bp = HASH_FIND(p->prefix_hash, PXH, prefix, pxlen, path_id);
+  uint cnt = 0;
+
+  if (!p->adj_out_refeed)
+    return;
+
+  p->adj_out_refeed = 0;
+
+  HASH_WALK_DELSAFE(p->adj_out_hash, next, e)
+    {
+      if (e->gen == p->adj_out_gen)
+	continue;
+
+      bgp_queue_prefix(p, bgp_get_withdraw_bucket(p), e->prefix, e->pxlen, e->path_id);
 
-  if (bp)
-    return bp;
+      HASH_REMOVE(p->adj_out_hash, AOH, e);
+      if (e->bucket)
+	bgp_unlock_bucket(p, e->bucket);
+      sl_free(p->adj_out_slab, e);
+      cnt++;
+    }
+  HASH_WALK_DELSAFE_END;
+
+  HASH_MAY_RESIZE_DOWN(p->adj_out_hash, AOH, p->p.pool);
 
-  bp = sl_alloc(p->prefix_slab);
-  bp->n.prefix = prefix;
-  bp->n.pxlen = pxlen;
-  bp->path_id = path_id;
-  bp->bucket_node.next = NULL;
+  if (cnt)
+    bgp_schedule_packet(p->conn, PKT_UPDATE);
+}
 
-  HASH_INSERT2(p->prefix_hash, PXH, p->p.pool, bp);
+/**
+ * bgp_adj_out_resend - announce all routes from Adj-RIB-Out again
+ * @p: BGP instance
+ *
+ * Used to answer route refresh requests without running export filters.
+ */
+void
+bgp_adj_out_resend(struct bgp_proto *p)
+{
+  HASH_WALK(p->adj_out_hash, next, e)
+    if (e->bucket)
+      bgp_queue_prefix(p, e->bucket, e->prefix, e->pxlen, e->path_id);
+  HASH_WALK_END;
 
-  return bp;
+  bgp_schedule_packet(p->conn, PKT_UPDATE);
 }
 
+/**
+ * bgp_adj_out_skip - forget a route that could not be sent
+ * @p: BGP instance
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @path_id: path ID
+ * @buck: bucket the route was queued in
+ *
+ * Called for routes dropped from the bucket @buck without being sent (e.g.
+ * when their attributes are too long). The neighbor may still have an older
+ * route for the prefix, so the entry is kept, but without a bucket. Any later
+ * update of the route is therefore sent.
+ */
 void
-bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp)
+bgp_adj_out_skip(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, struct bgp_bucket *buck)
 {
-  HASH_REMOVE2(p->prefix_hash, PXH, p->p.pool, bp);
-  sl_free(p->prefix_slab, bp);
+  struct bgp_adj_out *e = HASH_FIND(p->adj_out_hash, AOH, prefix, pxlen, path_id);
+
+  if (!e || (e->bucket != buck))
+    return;
+
+  e->bucket = NULL;
+  bgp_unlock_bucket(p, buck);
 }
 
 
@@ -977,7 +2085,6 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
 {
   struct bgp_proto *p = (struct bgp_proto *) P;
   struct bgp_bucket *buck;
-  struct bgp_prefix *px;
   rte *key;
   u32 path_id;
 
@@ -993,20 +2100,16 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
   else
     {
       key = old;
-      if (!(buck = p->withdraw_bucket))
-	{
-	  buck = p->withdraw_bucket = mb_alloc(P->pool, sizeof(struct bgp_bucket));
-	  init_list(&buck->prefixes);
-	}
+      buck = bgp_get_withdraw_bucket(p);
     }
   path_id = p->add_path_tx ? key->attrs->src->global_id : 0;
-  px = bgp_get_prefix(p, n->n.prefix, n->n.pxlen, path_id);
-  if (px->bucket_node.next)
-    {
-      DBG("\tRemoving old entry.\n");
-      rem_node(&px->bucket_node);
-    }
-  add_tail(&buck->prefixes, &px->bucket_node);
+
+  /* Skip updates that do not change what the neighbor already has */
+  if (p->adj_out_slab &&
+      !bgp_adj_out_update(p, n->n.prefix, n->n.pxlen, path_id, new ? buck : NULL))
+    return;
+
+  bgp_queue_prefix(p, buck, n->n.prefix, n->n.pxlen, path_id);
   bgp_schedule_packet(p->conn, PKT_UPDATE);
 }
 
@@ -1198,6 +2301,11 @@ bgp_import_control(struct proto *P, rte **new, ea_list **attrs, struct linpool *
       if (p->cf->interpret_communities && bgp_community_filter(p, e))
 	return -1;
 
+      /* RFC 9494 4.5. LLGR stale routes are sent only to LLGR-aware neighbors */
+      if ((e->pflags & BGP_REF_STALE) &&
+	  !(p->cf->llgr_mode && p->conn && p->conn->peer_llgr_aware))
+	return -1;
+
       if (p->local_as == new_bgp->local_as && p->is_internal && new_bgp->is_internal)
 	{
 	  /* Redistribution of internal routes with IBGP */
@@ -1233,6 +2341,42 @@ rte_resolvable(rte *rt)
   return (rd == RTD_ROUTER) || (rd == RTD_DEVICE) || (rd == RTD_MULTIPATH);
 }
 
+/*
+ * Attributes used by bgp_rte_better() are extracted into a route selection
+ * key stored in the route (u.bgp), so comparisons of many alternative routes
+ * do not need repeated ea_find() calls. The key is computed by
+ * bgp_rte_recalculate() hook, which is called for each new route before it
+ * is compared with other ones. Sorted tables do not call the hook, there the
+ * key is refreshed before each comparison.
+ */
+static void
+bgp_rte_key(rte *r)
+{
+  struct bgp_proto *p = (struct bgp_proto *) r->attrs->src->proto;
+  ea_list *attrs = r->attrs->eattrs;
+  eattr *e;
+
+  e = ea_find(attrs, EA_CODE(EAP_BGP, BA_ORIGIN));
+  r->u.bgp.origin = e ? e->u.data : ORIGIN_INCOMPLETE;
+
+  e = ea_find(attrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+  r->u.bgp.path_len = e ? as_path_getlen(e->u.ptr) : AS_PATH_MAXLEN;
+  r->u.bgp.neighbor_as = bgp_get_neighbor(r);
+
+  e = ea_find(attrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
+  r->u.bgp.local_pref = e ? e->u.data : p->cf->default_local_pref;
+
+  e = ea_find(attrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
+  r->u.bgp.med = e ? e->u.data : p->cf->default_med;
+}
+
+static inline void
+bgp_rte_check_key(rte *r)
+{
+  if (r->sender->table->config->sorted)
+    bgp_rte_key(r);
+}
+
 int
 bgp_rte_better(rte *new, rte *old)
 {
@@ -1257,11 +2401,20 @@ bgp_rte_better(rte *new, rte *old)
   if (n < o)
     return 0;
 
+  /* RFC 9494 4.3. LLGR stale routes are least preferred */
+  n = new->pflags & BGP_REF_STALE;
+  o = old->pflags & BGP_REF_STALE;
+  if (n > o)
+    return 0;
+  if (n < o)
+    return 1;
+
+  bgp_rte_check_key(new);
+  bgp_rte_check_key(old);
+
   /* Start with local preferences */
-  x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  n = x ? x->u.data : new_bgp->cf->default_local_pref;
-  o = y ? y->u.data : old_bgp->cf->default_local_pref;
+  n = new->u.bgp.local_pref;
+  o = old->u.bgp.local_pref;
   if (n > o)
     return 1;
   if (n < o)
@@ -1270,10 +2423,8 @@ bgp_rte_better(rte *new, rte *old)
   /* RFC 4271 9.1.2.2. a)  Use AS path lengths */
   if (new_bgp->cf->compare_path_lengths || old_bgp->cf->compare_path_lengths)
     {
-      x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      n = x ? as_path_getlen(x->u.ptr) : AS_PATH_MAXLEN;
-      o = y ? as_path_getlen(y->u.ptr) : AS_PATH_MAXLEN;
+      n = new->u.bgp.path_len;
+      o = old->u.bgp.path_len;
       if (n < o)
 	return 1;
       if (n > o)
@@ -1281,10 +2432,8 @@ bgp_rte_better(rte *new, rte *old)
     }
 
   /* RFC 4271 9.1.2.2. b) Use origins */
-  x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  n = x ? x->u.data : ORIGIN_INCOMPLETE;
-  o = y ? y->u.data : ORIGIN_INCOMPLETE;
+  n = new->u.bgp.origin;
+  o = old->u.bgp.origin;
   if (n < o)
     return 1;
   if (n > o)
@@ -1302,12 +2451,10 @@ bgp_rte_better(rte *new, rte *old)
    * probably not a big issue.
    */
   if (new_bgp->cf->med_metric || old_bgp->cf->med_metric ||
-      (bgp_get_neighbor(new) == bgp_get_neighbor(old)))
+      (new->u.bgp.neighbor_as == old->u.bgp.neighbor_as))
     {
-      x = ea_find(new->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      y = ea_find(old->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      n = x ? x->u.data : new_bgp->cf->default_med;
-      o = y ? y->u.data : old_bgp->cf->default_med;
+      n = new->u.bgp.med;
+      o = old->u.bgp.med;
       if (n < o)
 	return 1;
       if (n > o)
@@ -1367,7 +2514,6 @@ bgp_rte_mergable(rte *pri, rte *sec)
 {
   struct bgp_proto *pri_bgp = (struct bgp_proto *) pri->attrs->src->proto;
   struct bgp_proto *sec_bgp = (struct bgp_proto *) sec->attrs->src->proto;
-  eattr *x, *y;
   u32 p, s;
 
   /* Skip suppressed routes (see bgp_rte_recalculate()) */
@@ -1378,21 +2524,22 @@ bgp_rte_mergable(rte *pri, rte *sec)
   if (!rte_resolvable(sec))
     return 0;
 
+  /* RFC 9494 4.3. LLGR stale routes are least preferred */
+  if ((pri->pflags ^ sec->pflags) & BGP_REF_STALE)
+    return 0;
+
+  bgp_rte_check_key(pri);
+  bgp_rte_check_key(sec);
+
   /* Start with local preferences */
-  x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_LOCAL_PREF));
-  p = x ? x->u.data : pri_bgp->cf->default_local_pref;
-  s = y ? y->u.data : sec_bgp->cf->default_local_pref;
-  if (p != s)
+  if (pri->u.bgp.local_pref != sec->u.bgp.local_pref)
     return 0;
 
   /* RFC 4271 9.1.2.2. a)  Use AS path lengths */
   if (pri_bgp->cf->compare_path_lengths || sec_bgp->cf->compare_path_lengths)
     {
-      x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-      p = x ? as_path_getlen(x->u.ptr) : AS_PATH_MAXLEN;
-      s = y ? as_path_getlen(y->u.ptr) : AS_PATH_MAXLEN;
+      p = pri->u.bgp.path_len;
+      s = sec->u.bgp.path_len;
 
       if (p != s)
 	return 0;
@@ -1402,22 +2549,14 @@ bgp_rte_mergable(rte *pri, rte *sec)
     }
 
   /* RFC 4271 9.1.2.2. b) Use origins */
-  x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_ORIGIN));
-  p = x ? x->u.data : ORIGIN_INCOMPLETE;
-  s = y ? y->u.data : ORIGIN_INCOMPLETE;
-  if (p != s)
+  if (pri->u.bgp.origin != sec->u.bgp.origin)
     return 0;
 
   /* RFC 4271 9.1.2.2. c) Compare MED's */
   if (pri_bgp->cf->med_metric || sec_bgp->cf->med_metric ||
-      (bgp_get_neighbor(pri) == bgp_get_neighbor(sec)))
+      (pri->u.bgp.neighbor_as == sec->u.bgp.neighbor_as))
     {
-      x = ea_find(pri->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      y = ea_find(sec->attrs->eattrs, EA_CODE(EAP_BGP, BA_MULTI_EXIT_DISC));
-      p = x ? x->u.data : pri_bgp->cf->default_med;
-      s = y ? y->u.data : sec_bgp->cf->default_med;
-      if (p != s)
+      if (pri->u.bgp.med != sec->u.bgp.med)
 	return 0;
     }
 
@@ -1436,29 +2575,61 @@ bgp_rte_mergable(rte *pri, rte *sec)
   return 1;
 }
 
+u32
+bgp_rte_group(rte *r)
+{
+  /* Paths are grouped by neighboring AS, like in deterministic MED */
+  bgp_rte_check_key(r);
+  return r->u.bgp.neighbor_as;
+}
+
+
 
+static inline int
+use_deterministic_med(rte *r)
+{
+  struct proto *P = r->attrs->src->proto;
+  return (P->proto == &proto_bgp) && ((struct bgp_proto *) P)->cf->deterministic_med;
+}
 
+/* Valid only for routes with the selection key, see bgp_rte_key() */
 static inline int
 same_group(rte *r, u32 lpref, u32 lasn)
 {
-  return (r->pref == lpref) && (bgp_get_neighbor(r) == lasn);
+  return (r->pref == lpref) && (r->u.bgp.neighbor_as == lasn);
 }
 
 static inline int
-use_deterministic_med(rte *r)
+in_group(rte *r, u32 lpref, u32 lasn)
 {
-  struct proto *P = r->attrs->src->proto;
-  return (P->proto == &proto_bgp) && ((struct bgp_proto *) P)->cf->deterministic_med;
+  return rte_is_valid(r) && use_deterministic_med(r) && same_group(r, lpref, lasn);
 }
 
 int
 bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best)
 {
   rte *r, *s;
+  int old_is_group_best = 0;
+
+  /* Prepare the route selection key for bgp_rte_better() */
+  if (new)
+    bgp_rte_key(new);
+
+  if (!use_deterministic_med(new ? new : old))
+    return 0;
+
+  /* Filtered routes do not participate in route selection */
+  if (!rte_is_valid(new))
+    new = NULL;
+  if (!rte_is_valid(old))
+    old = NULL;
+
+  if (!new && !old)
+    return 0;
+
   rte *key = new ? new : old;
   u32 lpref = key->pref;
-  u32 lasn = bgp_get_neighbor(key);
-  int old_is_group_best = 0;
+  u32 lasn = key->u.bgp.neighbor_as;
 
   /*
    * Proper RFC 4271 path selection is a bit complicated, it cannot be
@@ -1501,12 +2672,14 @@ bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best)
       return i1 || i2;
     }
 
-  /* 
-   * We could find the best-in-group and then make some shortcuts like
-   * in rte_recalculate, but as we would have to walk through all
-   * net->routes just to find it, it is probably not worth. So we
-   * just have two simpler fast cases that use just the old route.
-   * We also set suppressed flag to avoid using it in bgp_rte_better().
+  /*
+   * Each group has exactly one non-suppressed route, its best-in-group,
+   * so the result of the last selection in the group is kept in the routes
+   * themselves. Unless the old best-in-group is removed or replaced with
+   * a worse route, it is enough to compare the new route with it, which
+   * keeps the number of bgp_rte_better() calls constant per update instead
+   * of linear in the group size. We also set suppressed flag to avoid using
+   * it in bgp_rte_better().
    */
 
   if (new)
@@ -1516,14 +2689,12 @@ bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best)
     {
       old_is_group_best = !old->u.bgp.suppressed;
       old->u.bgp.suppressed = 1;
-      int new_is_better = new && bgp_rte_better(new, old);
-
-      /* The first case - replace not best with worse (or remove not best) */
-      if (!old_is_group_best && !new_is_better)
-	return 0;
+    }
 
-      /* The second case - replace the best with better */
-      if (old_is_group_best && new_is_better)
+  if (old_is_group_best)
+    {
+      /* The first case - replace the best with better */
+      if (new && bgp_rte_better(new, old))
 	{
 	  /* new is best-in-group, the see discussion below - this is
 	     a special variant of NBG && OBG. From OBG we can deduce
@@ -1531,12 +2702,42 @@ bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best)
 	  new->u.bgp.suppressed = 0;
 	  return (old == old_best);
 	}
+
+      /* Otherwise find a new best-in-group route below */
+    }
+  else
+    {
+      /* The second case - best-in-group is kept, remove not best */
+      if (!new)
+	return 0;
+
+      /* Find the current best-in-group, new may be already in the list */
+      for (s=net->routes; rte_is_valid(s); s=s->next)
+	if ((s != new) && !s->u.bgp.suppressed && in_group(s, lpref, lasn))
+	  break;
+
+      r = rte_is_valid(s) ? s : NULL;
+
+      /* The third case - new is not better than the current best-in-group */
+      if (r)
+	{
+	  r->u.bgp.suppressed = 1;
+	  if (!bgp_rte_better(new, r))
+	    {
+	      r->u.bgp.suppressed = 0;
+	      return 0;
+	    }
+	}
+
+      /* New is the new best-in-group (NBG && !OBG below) */
+      new->u.bgp.suppressed = 0;
+      return old_best && in_group(old_best, lpref, lasn);
     }
 
-  /* The default case - find a new best-in-group route */
+  /* The default case - the old best-in-group is gone, find a new one */
   r = new; /* new may not be in the list */
   for (s=net->routes; rte_is_valid(s); s=s->next)
-    if (use_deterministic_med(s) && same_group(s, lpref, lasn))
+    if (in_group(s, lpref, lasn))
       {
 	s->u.bgp.suppressed = 1;
 	if (!r || bgp_rte_better(s, r))
@@ -1575,7 +2776,7 @@ bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best)
    */
 
   if (r == new)
-    return old_best && same_group(old_best, lpref, lasn);
+    return old_best && in_group(old_best, lpref, lasn);
   else
     return old_is_group_best;
 }
@@ -1948,29 +3149,41 @@ bgp_get_attr(eattr *a, byte *buf, int buflen)
 void
 bgp_init_bucket_table(struct bgp_proto *p)
 {
-  p->hash_size = 256;
-  p->hash_limit = p->hash_size * 4;
-  p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
+  OA_HASH_INIT(p->bucket_hash, p->p.pool, 8);
   init_list(&p->bucket_queue);
+  p->bucket_queue_len = 0;
   p->withdraw_bucket = NULL;
-  // fib_init(&p->prefix_fib, p->p.pool, sizeof(struct bgp_prefix), 0, bgp_init_prefix);
+
+  /* Bucket ID 0 is not used */
+  p->bucket_size = 64;
+  p->bucket_used = 1;
+  p->bucket_free_count = 0;
+  p->bucket_map = mb_alloc(p->p.pool, p->bucket_size * sizeof(struct bgp_bucket *));
+  p->bucket_free = mb_alloc(p->p.pool, p->bucket_size * sizeof(u32));
 }
 
 void
 bgp_free_bucket_table(struct bgp_proto *p)
 {
-  mb_free(p->bucket_hash);
-  p->bucket_hash = NULL;
+  OA_HASH_FREE(p->bucket_hash);
 
+  /* All buckets are queued or used by Adj-RIB-Out, which was freed before */
   struct bgp_bucket *b;
   WALK_LIST_FIRST(b, p->bucket_queue)
   {
     rem_node(&b->send_node);
-    mb_free(b);
+    bgp_release_bucket(p, b);
   }
+  p->bucket_queue_len = 0;
 
-  mb_free(p->withdraw_bucket);
+  if (p->withdraw_bucket)
+    bgp_release_bucket(p, p->withdraw_bucket);
   p->withdraw_bucket = NULL;
+
+  mb_free(p->bucket_map);
+  mb_free(p->bucket_free);
+  p->bucket_map = NULL;
+  p->bucket_free = NULL;
 }
 
 void
@@ -0,0 +1,798 @@
+/*
+ *	BIRD -- BGP Filter Benchmark on MRT Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Filter benchmark
+ *
+ * The benchmark command runs a filter over all routes from an MRT table dump
+ * (TABLE_DUMP_V2 format, as written by route collectors) without touching
+ * any routing table. That allows to qualify performance of policy changes on
+ * real-world routing data before they are deployed.
+ *
+ * Route attributes are decoded by bgp_decode_attrs() in the context of a
+ * configured BGP instance (which does not need to be running), so they are
+ * the same as if the routes were received by that instance. The benchmark
+ * uses a private fake connection in the closed state, therefore malformed
+ * attributes just make the route invalid and do not affect the real session.
+ *
+ * Decoded attributes are cached by rta_lookup() and the route is passed to
+ * f_run() either as a freshly received route (import mode), or as a
+ * read-only route from a table (export mode). For each route, time spent in
+ * f_run() and memory allocated from the temporary linpool is measured.
+ *
+ * The dump is processed in bounded steps from the CLI continuation hook, the
+ * summary with numbers of accepted and rejected routes, latency percentiles
+ * and allocations is printed when the whole dump is processed.
+ *
+ * Other modes measure single operations on the data from the dump. In match
+ * mode, the prefix of each RIB entry is matched with a constant prefix set by
+ * trie_match_prefix(), both in the compiled form (see trie_compile()) and by
+ * the binary trie walk, and the results are compared. Times of operations
+ * are measured individually, minus the cost of reading the clock, and the
+ * rate is computed from the sum of these times (so it does not include
+ * reading of the dump).
+ *
+ * In ROA mode, each route is validated by roa_check() with the origin AS from
+ * its AS path. For comparison, the route is also validated by one FIB lookup
+ * per prefix length, as roa_check() did before the ROA trie was introduced.
+ *
+ * In buckets mode, decoded attributes of each route are passed to
+ * bgp_get_bucket() as if the route was exported by the BGP instance, using a
+ * private bucket table, so lookups of existing buckets and insertions of new
+ * ones are measured on the real distribution of attribute sets. When the
+ * whole dump is processed, all buckets are removed from the table, which is
+ * measured as well.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdio.h>
+
+#include "nest/bird.h"
+#include "nest/iface.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/attrs.h"
+#include "nest/mrtdump.h"
+#include "nest/cli.h"
+#include "conf/conf.h"
+#include "filter/filter.h"
+#include "lib/event.h"
+#include "lib/resource.h"
+#include "lib/unaligned.h"
+
+#include "bgp.h"
+
+#define TABLE_DUMP_V2			13
+#define TD2_PEER_INDEX_TABLE		1
+#define TD2_RIB_IPV4_UNICAST		2
+#define TD2_RIB_IPV6_UNICAST		4
+#define TD2_RIB_IPV4_UNICAST_ADDPATH	8
+#define TD2_RIB_IPV6_UNICAST_ADDPATH	10
+
+#ifdef IPV6
+#define TD2_RIB				TD2_RIB_IPV6_UNICAST
+#define TD2_RIB_ADDPATH			TD2_RIB_IPV6_UNICAST_ADDPATH
+#else
+#define TD2_RIB				TD2_RIB_IPV4_UNICAST
+#define TD2_RIB_ADDPATH			TD2_RIB_IPV4_UNICAST_ADDPATH
+#endif
+
+#define BGP_BENCH_STEP			256	/* Records processed in one step */
+#define BGP_BENCH_MAX_RECORD		(1 << 20)
+
+struct bgp_bench {
+  resource r;
+  pool *pool;				/* Pool for all benchmark allocations */
+  struct bgp_proto *bgp;
+  struct config *config;		/* Configuration the benchmark runs on */
+  int mode;				/* What is measured, BGP_BENCH_* */
+  struct filter *filter;
+  int export;				/* Routes are read-only, as in export */
+  struct f_trie *trie;			/* Prefix set for match mode */
+  struct roa_table *roa;		/* ROA table for ROA mode */
+  struct bgp_proto *buckets;		/* Private copy with bucket table for buckets mode */
+  FILE *file;
+  byte *buf;				/* Buffer for one MRT record */
+  uint buf_size;
+  ip_addr *peers;			/* Peer addresses from PEER_INDEX_TABLE */
+  uint peer_count;
+  struct bgp_conn conn;			/* Fake connection for bgp_decode_attrs() */
+  struct rte_src *src;
+  net *net;				/* Fake network for routes */
+  linpool *lp;				/* Decoded attributes and filter allocations */
+  struct bgp_hist ticks;		/* Time spent in f_run() (or the operation) per route */
+  struct bgp_hist ticks_walk;		/* Time of the reference method (trie walk, FIB lookups) */
+  struct bgp_hist ticks_insert;		/* Time of bgp_get_bucket() creating a bucket */
+  struct bgp_hist ticks_remove;		/* Time of bucket removal */
+
+  u32 records, skipped;
+  u32 accepted, rejected, errors, invalid;
+  u32 matched, mismatched;
+  u32 roa_states[3];			/* Routes by roa_check() result, ROA_* */
+  u64 alloc_total;
+  uint alloc_max;
+  uint overhead;			/* Ticks spent just by reading the clock */
+  u64 start_ticks;
+  btime start_time;
+};
+
+static void
+bgp_bench_free(resource *r)
+{
+  struct bgp_bench *b = (void *) r;
+
+  if (b->file)
+    fclose(b->file);
+
+  if (b->src)
+    rt_unlock_source(b->src);
+}
+
+static void
+bgp_bench_dump(resource *r)
+{
+  struct bgp_bench *b = (void *) r;
+
+  debug("%s: %u records, %u routes\n", b->bgp->p.name, b->records, b->ticks.count);
+}
+
+static struct resclass bgp_bench_class = {
+  "BGP benchmark",
+  sizeof(struct bgp_bench),
+  bgp_bench_free,
+  bgp_bench_dump,
+  NULL,
+  NULL
+};
+
+static int
+bgp_bench_peers(struct bgp_bench *b, byte *pos, byte *end)
+{
+  uint i, n;
+
+  /* Collector BGP ID, view name */
+  if ((pos + 6 > end) || (pos + 6 + get_u16(pos+4) + 2 > end))
+    return -1;
+  pos += 6 + get_u16(pos+4);
+
+  n = get_u16(pos);
+  pos += 2;
+
+  b->peers = mb_realloc(b->peers, MAX(n, 1) * sizeof(ip_addr));
+  b->peer_count = n;
+
+  for (i = 0; i < n; i++)
+    {
+      /* Peer type, BGP ID, IP address, AS number */
+      if (pos + 5 > end)
+	return -1;
+
+      uint type = pos[0];
+      uint alen = (type & 1) ? 16 : 4;
+      uint len = 5 + alen + ((type & 2) ? 4 : 2);
+
+      if (pos + len > end)
+	return -1;
+
+      b->peers[i] = (alen == sizeof(ip_addr)) ? get_ipa(pos+5) : IPA_NONE;
+      pos += len;
+    }
+
+  return 0;
+}
+
+/* Attach NEXT_HOP attribute as bgp_set_next_hop() would do it */
+static void
+bgp_bench_next_hop(struct bgp_bench *b UNUSED4, rta *a)
+{
+  eattr *nh;
+
+#ifdef IPV6
+  struct bgp_proto *p = b->bgp;
+  byte *x = p->mp_reach_start;
+  uint len = p->mp_reach_len;
+
+  /* Dumps should have just next hop length and address, but some use full MP_REACH_NLRI */
+  if (len && (len != (uint) x[0] + 1) && (len >= 4))
+    { x += 3; len -= 3; }
+
+  if (len && ((x[0] == 16) || (x[0] == 32)) && (len >= (uint) x[0] + 1))
+    {
+      ip_addr *ip = (ip_addr *) bgp_attach_attr_wa(&a->eattrs, b->lp, BA_NEXT_HOP, NEXT_HOP_LENGTH);
+      ip[0] = get_ipa(x+1);
+      ip[1] = (x[0] == 32) ? get_ipa(x+17) : IPA_NONE;
+    }
+#endif
+
+  nh = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  if (!nh)
+    return;
+
+  a->dest = RTD_ROUTER;
+  a->gw = *(ip_addr *) nh->u.ptr->data;
+}
+
+/* Add one measured operation to the histogram, without the clock overhead */
+static inline void
+bgp_bench_time(struct bgp_bench *b, struct bgp_hist *h, u64 t0, u64 t1)
+{
+  u64 t = t1 - t0;
+  t = (t > b->overhead) ? t - b->overhead : 0;
+  bgp_hist_add(h, MIN(t, (u64) 0xffffffff));
+}
+
+/* The original roa_check(), one FIB lookup per prefix length */
+static byte
+bgp_bench_roa_fib(struct roa_table *t, ip_addr prefix, int pxlen, u32 asn)
+{
+  struct roa_node *n;
+  struct roa_item *it;
+  byte anything = 0;
+  ip_addr px;
+  int len;
+
+  for (len = pxlen; len >= 0; len--)
+    {
+      px = ipa_and(prefix, ipa_mkmask(len));
+      n = fib_find(&t->fib, &px, len);
+
+      if (!n)
+	continue;
+
+      for (it = n->items; it; it = it->next)
+	{
+	  anything = 1;
+	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
+	    return ROA_VALID;
+	}
+    }
+
+  return anything ? ROA_INVALID : ROA_UNKNOWN;
+}
+
+static void
+bgp_bench_roa(struct bgp_bench *b, rta *a)
+{
+  ip_addr px = b->net->n.prefix;
+  int pxlen = b->net->n.pxlen;
+  eattr *e = ea_find(a->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+  u32 asn = 0;
+  u64 t0, t1;
+  byte r0, r1;
+
+  /* Routes without origin AS are checked with AS 0, like by the filter */
+  if (e)
+    as_path_get_last(e->u.ptr, &asn);
+
+  t0 = f_prof_ticks();
+  r0 = roa_check(b->roa, px, pxlen, asn);
+  t1 = f_prof_ticks();
+  bgp_bench_time(b, &b->ticks, t0, t1);
+
+  t0 = f_prof_ticks();
+  r1 = bgp_bench_roa_fib(b->roa, px, pxlen, asn);
+  t1 = f_prof_ticks();
+  bgp_bench_time(b, &b->ticks_walk, t0, t1);
+
+  b->roa_states[r0]++;
+  if (r0 != r1)
+    b->mismatched++;
+}
+
+static void
+bgp_bench_bucket(struct bgp_bench *b, rta *a)
+{
+  struct bgp_proto *q = b->buckets;
+  uint count = OA_HASH_COUNT(q->bucket_hash);
+  struct bgp_bucket *buck;
+  u64 t0, t1;
+
+  t0 = f_prof_ticks();
+  buck = bgp_get_bucket(q, b->net, a->eattrs, 0);
+  t1 = f_prof_ticks();
+
+  if (!buck)
+    b->errors++;
+  else if (OA_HASH_COUNT(q->bucket_hash) != count)
+    bgp_bench_time(b, &b->ticks_insert, t0, t1);
+  else
+    bgp_bench_time(b, &b->ticks, t0, t1);
+}
+
+/* Remove all buckets, in the order of their IDs */
+static void
+bgp_bench_bucket_flush(struct bgp_bench *b)
+{
+  struct bgp_proto *q = b->buckets;
+  struct bgp_bucket *buck;
+  u64 t0, t1;
+  uint i;
+
+  for (i = 1; i < q->bucket_used; i++)
+    if (buck = q->bucket_map[i])
+      {
+	t0 = f_prof_ticks();
+	bgp_free_bucket(q, buck);
+	t1 = f_prof_ticks();
+	bgp_bench_time(b, &b->ticks_remove, t0, t1);
+      }
+}
+
+static void
+bgp_bench_route(struct bgp_bench *b, ip_addr from, byte *attrs, uint len)
+{
+  struct bgp_proto *p = b->bgp;
+  struct ea_list *tmpa;
+  rta *a0, *a;
+  rte *e0, *e;
+  u64 t0, t1;
+  uint used;
+  int res;
+
+  lp_flush(b->lp);
+
+  /* Table dumps always use 4B AS numbers */
+  int as4 = p->as4_session;
+  p->as4_session = 1;
+#ifdef IPV6
+  p->mp_reach_len = 0;
+#endif
+  a0 = bgp_decode_attrs(&b->conn, attrs, len, b->lp, 1);
+  p->as4_session = as4;
+
+  if (!a0)
+    {
+      b->invalid++;
+      return;
+    }
+
+  a0->src = b->src;
+  a0->from = from;
+  bgp_bench_next_hop(b, a0);
+
+  if (b->mode == BGP_BENCH_ROA)
+    {
+      bgp_bench_roa(b, a0);
+      return;
+    }
+
+  if (b->mode == BGP_BENCH_BUCKETS)
+    {
+      bgp_bench_bucket(b, a0);
+      return;
+    }
+
+  a = rta_lookup(a0);
+  e = e0 = rte_get_temp(a);
+  e->net = b->net;
+  e->pflags = 0;
+  e->lastmod = now;
+  e->u.bgp.suppressed = 0;
+
+  if (b->export)
+    e->flags |= REF_COW;
+
+  used = lp_used(b->lp);
+  tmpa = rte_make_tmp_attrs(e, b->lp);
+
+  t0 = f_prof_ticks();
+  res = f_run(b->filter, &e, &tmpa, b->lp, b->export ? FF_FORCE_TMPATTR : 0);
+  t1 = f_prof_ticks();
+
+  bgp_bench_time(b, &b->ticks, t0, t1);
+
+  used = lp_used(b->lp) - used;
+  b->alloc_total += used;
+  b->alloc_max = MAX(b->alloc_max, used);
+
+  if (res == F_ACCEPT)
+    b->accepted++;
+  else if (res == F_ERROR)
+    b->errors++;
+  else
+    b->rejected++;
+
+  if (e != e0)
+    rte_free(e);
+  rte_free(e0);
+}
+
+static void
+bgp_bench_match(struct bgp_bench *b)
+{
+  struct f_trie *t = b->trie;
+  struct f_trie_stride *stride = t->stride;
+  ip_addr px = b->net->n.prefix;
+  int pxlen = b->net->n.pxlen;
+  u64 t0, t1;
+  int m0, m1;
+
+  t0 = f_prof_ticks();
+  m0 = trie_match_prefix(t, px, pxlen);
+  t1 = f_prof_ticks();
+  bgp_bench_time(b, &b->ticks, t0, t1);
+
+  /* The same trie without the compiled form, restored right away */
+  t->stride = NULL;
+  t0 = f_prof_ticks();
+  m1 = trie_match_prefix(t, px, pxlen);
+  t1 = f_prof_ticks();
+  t->stride = stride;
+  bgp_bench_time(b, &b->ticks_walk, t0, t1);
+
+  if (m0)
+    b->matched++;
+  if (m0 != m1)
+    b->mismatched++;
+}
+
+static int
+bgp_bench_rib(struct bgp_bench *b, byte *pos, byte *end, int add_path)
+{
+  byte px[sizeof(ip_addr)] = {};
+  uint pxlen, bytes, i, n;
+
+  /* Sequence number, prefix */
+  if (pos + 5 > end)
+    return -1;
+
+  pxlen = pos[4];
+  bytes = (pxlen + 7) / 8;
+  if ((pxlen > BITS_PER_IP_ADDRESS) || (pos + 5 + bytes + 2 > end))
+    return -1;
+
+  memcpy(px, pos+5, bytes);
+  b->net->n.prefix = ipa_and(get_ipa(px), ipa_mkmask(pxlen));
+  b->net->n.pxlen = pxlen;
+  pos += 5 + bytes;
+
+  /* Just the prefix is used, entries are not parsed */
+  if (b->mode == BGP_BENCH_MATCH)
+    {
+      bgp_bench_match(b);
+      return 0;
+    }
+
+  n = get_u16(pos);
+  pos += 2;
+
+  for (i = 0; i < n; i++)
+    {
+      /* Peer index, originated time, path ID, attributes */
+      uint hlen = add_path ? 12 : 8;
+      if (pos + hlen > end)
+	return -1;
+
+      uint peer = get_u16(pos);
+      uint len = get_u16(pos + hlen - 2);
+      pos += hlen;
+
+      if (pos + len > end)
+	return -1;
+
+      ip_addr from = (peer < b->peer_count) ? b->peers[peer] : IPA_NONE;
+      bgp_bench_route(b, from, pos, len);
+      pos += len;
+    }
+
+  return 0;
+}
+
+/*
+ * Read and process one MRT record. Returns 1 if the record was processed (or
+ * skipped), 0 at the end of the dump and -1 for a malformed dump.
+ */
+static int
+bgp_bench_read(struct bgp_bench *b)
+{
+  byte hdr[MRTDUMP_HDR_LENGTH];
+  size_t n;
+
+  n = fread(hdr, 1, MRTDUMP_HDR_LENGTH, b->file);
+  if (!n)
+    return ferror(b->file) ? -1 : 0;
+  if (n < MRTDUMP_HDR_LENGTH)
+    return -1;
+
+  uint type = get_u16(hdr+4);
+  uint subtype = get_u16(hdr+6);
+  uint len = get_u32(hdr+8);
+
+  if (len > BGP_BENCH_MAX_RECORD)
+    return -1;
+
+  if (len > b->buf_size)
+    {
+      b->buf_size = MAX(len, 2 * b->buf_size);
+      b->buf = mb_realloc(b->buf, b->buf_size);
+    }
+
+  if (fread(b->buf, 1, len, b->file) != len)
+    return -1;
+
+  b->records++;
+
+  if (type != TABLE_DUMP_V2)
+    goto skip;
+
+  switch (subtype)
+    {
+    case TD2_PEER_INDEX_TABLE:
+      return bgp_bench_peers(b, b->buf, b->buf + len) ? -1 : 1;
+
+    case TD2_RIB:
+    case TD2_RIB_ADDPATH:
+      return bgp_bench_rib(b, b->buf, b->buf + len, subtype == TD2_RIB_ADDPATH) ? -1 : 1;
+    }
+
+ skip:
+  b->skipped++;
+  return 1;
+}
+
+/* Operations per second in the measured time, ticks are calibrated by the wall clock */
+static uint
+bgp_bench_rate(struct bgp_bench *b, struct bgp_hist *h, btime total)
+{
+  u64 ticks = f_prof_ticks() - b->start_ticks;
+
+  if (!h->sum)
+    return 0;
+
+  return (uint) MIN((u64) h->count * (ticks * (1 S) / total) / h->sum, (u64) 0xffffffff);
+}
+
+static void
+bgp_bench_latency(struct cli *c, const char *name, struct bgp_hist *h)
+{
+  /* Percentiles are upper bounds of histogram bins */
+  cli_printf(c, -1028, "%-10s avg %u, p50 %u, p90 %u, p99 %u, p99.9 %u, max %u %s", name,
+	     (uint) (h->sum / h->count), bgp_hist_percentile(h, 500), bgp_hist_percentile(h, 900),
+	     bgp_hist_percentile(h, 990), bgp_hist_percentile(h, 999), h->max, F_PROF_UNIT);
+}
+
+static void
+bgp_bench_match_summary(struct cli *c, struct bgp_bench *b, btime total)
+{
+  uint prefixes = b->ticks.count;
+
+  cli_printf(c, -1028, "Prefixes:  %u", prefixes);
+  cli_printf(c, -1028, "Matched:   %u (%u mismatched by binary walk)", b->matched, b->mismatched);
+
+  if (prefixes)
+    {
+      bgp_bench_latency(c, "Compiled:", &b->ticks);
+      bgp_bench_latency(c, "Walk:", &b->ticks_walk);
+      cli_printf(c, -1028, "Rate:      compiled %u, walk %u matches/s",
+		 bgp_bench_rate(b, &b->ticks, total), bgp_bench_rate(b, &b->ticks_walk, total));
+    }
+
+  cli_printf(c, -1028, "Total:     %u ms", (uint) (total TO_MS));
+  cli_printf(c, 0, "");
+}
+
+static void
+bgp_bench_roa_summary(struct cli *c, struct bgp_bench *b, btime total)
+{
+  uint routes = b->ticks.count;
+
+  cli_printf(c, -1028, "Routes:    %u (%u invalid)", routes, b->invalid);
+  cli_printf(c, -1028, "Valid:     %u", b->roa_states[ROA_VALID]);
+  cli_printf(c, -1028, "Invalid:   %u", b->roa_states[ROA_INVALID]);
+  cli_printf(c, -1028, "Unknown:   %u (%u mismatched by FIB lookups)", b->roa_states[ROA_UNKNOWN], b->mismatched);
+
+  if (routes)
+    {
+      bgp_bench_latency(c, "Trie:", &b->ticks);
+      bgp_bench_latency(c, "FIB:", &b->ticks_walk);
+      cli_printf(c, -1028, "Rate:      trie %u, FIB %u validations/s",
+		 bgp_bench_rate(b, &b->ticks, total), bgp_bench_rate(b, &b->ticks_walk, total));
+    }
+
+  cli_printf(c, -1028, "Total:     %u ms", (uint) (total TO_MS));
+  cli_printf(c, 0, "");
+}
+
+static void
+bgp_bench_buckets_summary(struct cli *c, struct bgp_bench *b, btime total)
+{
+  struct bgp_hist *lookup = &b->ticks, *insert = &b->ticks_insert, *remove = &b->ticks_remove;
+
+  cli_printf(c, -1028, "Routes:    %u (%u invalid, %u rejected)",
+	     lookup->count + insert->count + b->errors, b->invalid, b->errors);
+  cli_printf(c, -1028, "Buckets:   %u", insert->count);
+
+  if (lookup->count)
+    bgp_bench_latency(c, "Lookup:", lookup);
+
+  if (insert->count)
+    {
+      bgp_bench_latency(c, "Insert:", insert);
+      bgp_bench_latency(c, "Remove:", remove);
+    }
+
+  cli_printf(c, -1028, "Rate:      lookup %u, insert %u, remove %u ops/s",
+	     bgp_bench_rate(b, lookup, total), bgp_bench_rate(b, insert, total),
+	     bgp_bench_rate(b, remove, total));
+  cli_printf(c, -1028, "Total:     %u ms", (uint) (total TO_MS));
+  cli_printf(c, 0, "");
+}
+
+static void
+bgp_bench_summary(struct cli *c, struct bgp_bench *b)
+{
+  btime total = MAX(precise_time() - b->start_time, 1);
+  struct bgp_hist *h = &b->ticks;
+  uint routes = h->count;
+
+  cli_printf(c, -1028, "Records:   %u (%u skipped)", b->records, b->skipped);
+
+  if (b->mode == BGP_BENCH_MATCH)
+    {
+      bgp_bench_match_summary(c, b, total);
+      return;
+    }
+
+  if (b->mode == BGP_BENCH_ROA)
+    {
+      bgp_bench_roa_summary(c, b, total);
+      return;
+    }
+
+  if (b->mode == BGP_BENCH_BUCKETS)
+    {
+      bgp_bench_buckets_summary(c, b, total);
+      return;
+    }
+
+  cli_printf(c, -1028, "Routes:    %u (%u invalid)", routes, b->invalid);
+  cli_printf(c, -1028, "Accepted:  %u", b->accepted);
+  cli_printf(c, -1028, "Rejected:  %u", b->rejected);
+  cli_printf(c, -1028, "Errors:    %u", b->errors);
+
+  if (!routes)
+    goto done;
+
+  bgp_bench_latency(c, "Latency:", h);
+  cli_printf(c, -1028, "Allocated: avg %u, max %u bytes",
+	     (uint) (b->alloc_total / routes), b->alloc_max);
+
+ done:
+  cli_printf(c, -1028, "Total:     %u ms (%u routes/s)",
+	     (uint) (total TO_MS), (uint) ((u64) routes * (1 S) / total));
+  cli_printf(c, 0, "");
+}
+
+static void
+bgp_bench_cont(struct cli *c)
+{
+  struct bgp_bench *b = c->rover;
+  int i, res;
+
+  if (b->config != config)
+    {
+      cli_printf(c, 8004, "Stopped due to reconfiguration");
+      goto done;
+    }
+
+  for (i = 0; i < BGP_BENCH_STEP; i++)
+    {
+      res = bgp_bench_read(b);
+
+      if (res < 0)
+	{
+	  cli_printf(c, 8009, "Malformed MRT dump");
+	  goto done;
+	}
+
+      if (!res)
+	{
+	  if (b->mode == BGP_BENCH_BUCKETS)
+	    bgp_bench_bucket_flush(b);
+
+	  bgp_bench_summary(c, b);
+	  goto done;
+	}
+    }
+
+  /* No output, we have to schedule next step ourselves */
+  ev_schedule(c->event);
+  return;
+
+ done:
+  c->cont = c->cleanup = NULL;
+  rfree(b->pool);
+}
+
+static void
+bgp_bench_cleanup(struct cli *c)
+{
+  struct bgp_bench *b = c->rover;
+  rfree(b->pool);
+}
+
+/* Minimal cost of reading the clock, subtracted from measured times */
+static uint
+bgp_bench_overhead(void)
+{
+  u64 t0, t1, min = ~0ULL;
+  int i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      t0 = f_prof_ticks();
+      t1 = f_prof_ticks();
+      min = MIN(min, t1 - t0);
+    }
+
+  return (uint) min;
+}
+
+/**
+ * bgp_bench - run filter benchmark
+ * @P: BGP instance used for decoding of route attributes
+ * @file: MRT dump file name
+ * @args: what is measured, see &bgp_bench_args
+ *
+ * This function starts the benchmark with routes from the table dump @file.
+ * By default, it runs the filter from @args in import or export mode (the
+ * import or export filter of @P if none is given). The benchmark runs from
+ * the CLI continuation hook.
+ */
+void
+bgp_bench(struct proto *P, char *file, struct bgp_bench_args *args)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+  struct bgp_bench *b;
+  struct filter *f = args->filter;
+
+  if (!f)
+    f = args->export ? P->cf->out_filter : P->cf->in_filter;
+
+  FILE *fd = fopen(file, "r");
+  if (!fd)
+    {
+      cli_msg(8009, "Cannot open %s: %m", file);
+      return;
+    }
+
+  pool *pool = rp_new(this_cli->pool, "BGP benchmark");
+  b = ralloc(pool, &bgp_bench_class);
+  b->pool = pool;
+  b->bgp = p;
+  b->config = config;
+  b->mode = args->mode;
+  b->filter = f;
+  b->export = args->export;
+  b->trie = args->trie;
+  b->roa = args->roa;
+
+  if (b->mode == BGP_BENCH_BUCKETS)
+    {
+      /* Buckets of the instance itself are not touched */
+      b->buckets = mb_alloc(pool, sizeof(struct bgp_proto));
+      *b->buckets = *p;
+      b->buckets->p.pool = pool;
+      bgp_init_bucket_table(b->buckets);
+    }
+  b->file = fd;
+  b->buf_size = BGP_MAX_EXT_MSG_LENGTH;
+  b->buf = mb_alloc(pool, b->buf_size);
+  b->peers = mb_alloc(pool, sizeof(ip_addr));
+  b->conn = (struct bgp_conn) { .bgp = p, .state = BS_CLOSE };
+  b->src = rt_get_source(P, 0);
+  rt_lock_source(b->src);
+  b->net = mb_allocz(pool, sizeof(net));
+  b->lp = lp_new(pool, 4080);
+  b->overhead = bgp_bench_overhead();
+  b->start_ticks = f_prof_ticks();
+  b->start_time = precise_time();
+
+  this_cli->cont = bgp_bench_cont;
+  this_cli->cleanup = bgp_bench_cleanup;
+  this_cli->rover = b;
+}
@@ -106,10 +106,11 @@ bgp_open(struct bgp_proto *p)
   struct config *cfg = p->cf->c.global;
   int errcode;
 
-  if (!bgp_listen_sk)
+  /* Replay sessions do not need listening socket */
+  if (!bgp_listen_sk && !p->cf->replay)
     bgp_listen_sk = bgp_setup_listen_sk(cfg->listen_bgp_addr, cfg->listen_bgp_port, cfg->listen_bgp_flags);
 
-  if (!bgp_listen_sk)
+  if (!bgp_listen_sk && !p->cf->replay)
     {
       errcode = BEM_NO_SOCKET;
       goto err;
@@ -145,7 +146,9 @@ bgp_startup(struct bgp_proto *p)
   BGP_TRACE(D_EVENTS, "Started");
   p->start_state = p->cf->capabilities ? BSS_CONNECT : BSS_CONNECT_NOCAP;
 
-  if (!p->cf->passive)
+  if (p->cf->replay)
+    bgp_replay_start(p);
+  else if (!p->cf->passive)
     bgp_active(p);
 }
 
@@ -317,6 +320,8 @@ bgp_down(struct bgp_proto *p)
   if (p->start_state > BSS_PREPARE)
     bgp_close(p, 1);
 
+  bgp_free_adj_in(p);
+
   BGP_TRACE(D_EVENTS, "Down");
   proto_notify_state(&p->p, PS_DOWN);
 }
@@ -384,7 +389,12 @@ bgp_conn_enter_established_state(struct bgp_conn *conn)
   p->feed_state = BFS_NONE;
   p->load_state = BFS_NONE;
   bgp_init_bucket_table(p);
-  bgp_init_prefix_table(p, 8);
+  bgp_init_prefix_table(p);
+  bgp_init_adj_in(p);
+  bgp_init_adj_out(p);
+
+  if (p->gr_ready)
+    bgp_init_rx_routes(p);
 
   int peer_gr_ready = conn->peer_gr_aware && !(conn->peer_gr_flags & BGP_GRF_RESTART);
 
@@ -417,6 +427,12 @@ bgp_conn_leave_established_state(struct bgp_proto *p)
   p->conn = NULL;
 
   bgp_free_prefix_table(p);
+  bgp_free_adj_out(p);
+
+  /* Adj-RIB-In is kept with routes retained by graceful restart */
+  if (!p->gr_active)
+    bgp_free_adj_in(p);
+
   bgp_free_bucket_table(p);
 
   if (p->p.proto_state == PS_UP)
@@ -454,6 +470,46 @@ bgp_conn_enter_idle_state(struct bgp_conn *conn)
     bgp_conn_leave_established_state(p);
 }
 
+/*
+ *	Refresh cycles of received routes are done by the BGP protocol itself
+ *	when received routes are tracked (see bgp_init_rx_routes()), otherwise
+ *	by the routing table.
+ */
+
+static void
+bgp_refresh_cycle_begin(struct bgp_proto *p)
+{
+  if (p->rx_slab)
+    bgp_rx_refresh_begin(p);
+  else
+    rt_refresh_begin(p->p.main_ahook->table, p->p.main_ahook);
+}
+
+static void
+bgp_refresh_cycle_end(struct bgp_proto *p)
+{
+  if (p->rx_slab)
+    bgp_rx_refresh_end(p);
+  else
+    rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
+}
+
+/**
+ * bgp_llgr_begin - start long-lived stale phase of graceful restart
+ * @p: BGP instance
+ *
+ * Routes not yet refreshed by the neighbor are retained as LLGR stale for
+ * the negotiated stale time, see bgp_rx_llgr_begin().
+ */
+static void
+bgp_llgr_begin(struct bgp_proto *p)
+{
+  BGP_TRACE(D_EVENTS, "Neighbor long-lived graceful restart, stale time %u", p->llgr_time);
+  p->gr_active = BGP_GRS_LLGR;
+  bgp_start_timer(p->gr_timer, p->llgr_time);
+  bgp_rx_llgr_begin(p);
+}
+
 /**
  * bgp_handle_graceful_restart - handle detected BGP graceful restart
  * @p: BGP instance
@@ -475,11 +531,16 @@ bgp_handle_graceful_restart(struct bgp_proto *p)
   proto_notify_state(&p->p, PS_START);
 
   if (p->gr_active)
-    rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
+    bgp_refresh_cycle_end(p);
+
+  p->gr_active = BGP_GRS_ACTIVE;
+  bgp_refresh_cycle_begin(p);
 
-  p->gr_active = 1;
-  bgp_start_timer(p->gr_timer, p->conn->peer_gr_time);
-  rt_refresh_begin(p->p.main_ahook->table, p->p.main_ahook);
+  /* Zero restart time means immediate transition to LLGR, if negotiated */
+  if (!p->conn->peer_gr_time && p->llgr_ready)
+    bgp_llgr_begin(p);
+  else
+    bgp_start_timer(p->gr_timer, p->conn->peer_gr_time);
 }
 
 /**
@@ -496,9 +557,9 @@ void
 bgp_graceful_restart_done(struct bgp_proto *p)
 {
   BGP_TRACE(D_EVENTS, "Neighbor graceful restart done");
-  p->gr_active = 0;
+  p->gr_active = BGP_GRS_NONE;
   tm_stop(p->gr_timer);
-  rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
+  bgp_refresh_cycle_end(p);
 }
 
 /**
@@ -507,7 +568,9 @@ bgp_graceful_restart_done(struct bgp_proto *p)
  *
  * This function is a timeout hook for @gr_timer, implementing BGP restart time
  * limit for reestablisment of the BGP session after the graceful restart. When
- * fired, we just proceed with the usual protocol restart.
+ * fired, we enter the long-lived stale phase if LLGR was negotiated, otherwise
+ * (or when the LLGR stale time expires) we just proceed with the usual
+ * protocol restart.
  */
 
 static void
@@ -515,6 +578,12 @@ bgp_graceful_restart_timeout(timer *t)
 {
   struct bgp_proto *p = t->data;
 
+  if ((p->gr_active == BGP_GRS_ACTIVE) && p->llgr_ready)
+    {
+      bgp_llgr_begin(p);
+      return;
+    }
+
   BGP_TRACE(D_EVENTS, "Neighbor graceful restart timeout");
   bgp_stop(p, 0, NULL, 0);
 }
@@ -537,7 +606,7 @@ bgp_refresh_begin(struct bgp_proto *p)
     { log(L_WARN "%s: BEGIN-OF-RR received before END-OF-RIB, ignoring", p->p.name); return; }
 
   p->load_state = BFS_REFRESHING;
-  rt_refresh_begin(p->p.main_ahook->table, p->p.main_ahook);
+  bgp_refresh_cycle_begin(p);
 }
 
 /**
@@ -547,7 +616,8 @@ bgp_refresh_begin(struct bgp_proto *p)
  * This function is called when an incoming enhanced route refresh sequence is
  * finished by the neighbor, demarcated by the EoRR packet. The function updates
  * the load state and ends the routing table refresh cycle. Routes not received
- * during the sequence are removed by the nest.
+ * during the sequence are removed, either by the nest or by the sweep of
+ * tracked received routes.
  */
 void
 bgp_refresh_end(struct bgp_proto *p)
@@ -556,7 +626,7 @@ bgp_refresh_end(struct bgp_proto *p)
     { log(L_WARN "%s: END-OF-RR received without prior BEGIN-OF-RR, ignoring", p->p.name); return; }
 
   p->load_state = BFS_NONE;
-  rt_refresh_end(p->p.main_ahook->table, p->p.main_ahook);
+  bgp_refresh_cycle_end(p);
 }
 
 
@@ -576,6 +646,10 @@ bgp_send_open(struct bgp_conn *conn)
   conn->peer_gr_time = 0;
   conn->peer_gr_flags = 0;
   conn->peer_gr_aflags = 0;
+  conn->peer_llgr_aware = 0;
+  conn->peer_llgr_able = 0;
+  conn->peer_llgr_time = 0;
+  conn->peer_llgr_aflags = 0;
   conn->peer_ext_messages_support = 0;
 
   DBG("BGP: Sending open\n");
@@ -679,7 +753,7 @@ bgp_keepalive_timeout(timer *t)
     ev_run(conn->tx_ev);
 }
 
-static void
+void
 bgp_setup_conn(struct bgp_proto *p, struct bgp_conn *conn)
 {
   timer *t;
@@ -702,7 +776,7 @@ bgp_setup_conn(struct bgp_proto *p, struct bgp_conn *conn)
   conn->tx_ev->data = conn;
 }
 
-static void
+void
 bgp_setup_sk(struct bgp_conn *conn, sock *s)
 {
   s->data = conn;
@@ -1032,6 +1106,14 @@ static int
 bgp_reload_routes(struct proto *P)
 {
   struct bgp_proto *p = (struct bgp_proto *) P;
+
+  /* Reload locally from import table if available */
+  if (p->adj_in_slab)
+    {
+      bgp_adj_in_reload(p);
+      return 1;
+    }
+
   if (!p->conn || !p->conn->peer_refresh_support)
     return 0;
 
@@ -1039,15 +1121,21 @@ bgp_reload_routes(struct proto *P)
   return 1;
 }
 
-static void
-bgp_feed_begin(struct proto *P, int initial)
+static int
+bgp_reload_prefixes(struct proto *P, struct f_trie *t)
 {
   struct bgp_proto *p = (struct bgp_proto *) P;
 
-  /* This should not happen */
-  if (!p->conn)
-    return;
+  if (!p->adj_in_slab)
+    return 0;
 
+  bgp_adj_in_reload_prefixes(p, t);
+  return 1;
+}
+
+static void
+bgp_feed_state_begin(struct bgp_proto *p, int initial)
+{
   if (initial && p->cf->gr_mode)
     p->feed_state = BFS_LOADING;
 
@@ -1065,14 +1153,8 @@ bgp_feed_begin(struct proto *P, int initial)
 }
 
 static void
-bgp_feed_end(struct proto *P)
+bgp_feed_state_end(struct bgp_proto *p)
 {
-  struct bgp_proto *p = (struct bgp_proto *) P;
-
-  /* This should not happen */
-  if (!p->conn)
-    return;
-
   /* Non-demarcated feed ended, nothing to do */
   if (p->feed_state == BFS_NONE)
     return;
@@ -1089,6 +1171,78 @@ bgp_feed_end(struct proto *P)
   bgp_schedule_packet(p->conn, PKT_UPDATE);
 }
 
+static void
+bgp_feed_begin(struct proto *P, int initial)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  /* This should not happen */
+  if (!p->conn)
+    return;
+
+  /* Refeed with export table sends just changes, so it is not demarcated */
+  if (!initial && p->adj_out_slab)
+    {
+      bgp_adj_out_begin_refeed(p);
+      return;
+    }
+
+  bgp_feed_state_begin(p, initial);
+}
+
+static void
+bgp_feed_end(struct proto *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  /* This should not happen */
+  if (!p->conn)
+    return;
+
+  if (p->adj_out_slab)
+    bgp_adj_out_end_refeed(p);
+
+  bgp_feed_state_end(p);
+
+  /* Route refresh was requested during feed */
+  if (p->adj_out_resend)
+    {
+      p->adj_out_resend = 0;
+      bgp_resend_routes(p);
+    }
+}
+
+/**
+ * bgp_resend_routes - answer route refresh request
+ * @p: BGP instance
+ *
+ * When the export table is enabled, all routes recorded in Adj-RIB-Out are
+ * announced again without running export filters. Otherwise, a refeed of
+ * routes from the routing table is requested. A refeed with the export table
+ * sends just changed routes, so when a feed is running, the resend is
+ * postponed until its end (see bgp_feed_end()).
+ */
+void
+bgp_resend_routes(struct bgp_proto *p)
+{
+  if (!p->adj_out_slab)
+    {
+      proto_request_feeding(&p->p);
+      return;
+    }
+
+  if (p->p.export_state != ES_READY)
+    {
+      p->adj_out_resend = 1;
+      return;
+    }
+
+  BGP_TRACE(D_EVENTS, "Resending routes from export table");
+  bgp_feed_state_begin(p, 0);
+  bgp_adj_out_resend(p);
+  bgp_feed_state_end(p);
+}
+
 
 static void
 bgp_start_locked(struct object_lock *lock)
@@ -1144,8 +1298,12 @@ bgp_start(struct proto *P)
   p->incoming_conn.state = BS_IDLE;
   p->neigh = NULL;
   p->bfd_req = NULL;
+  p->replay = NULL;
   p->gr_ready = 0;
-  p->gr_active = 0;
+  p->gr_active = BGP_GRS_NONE;
+  p->llgr_ready = 0;
+  p->rx_slab = NULL;
+  p->stats = p->cf->statistics ? mb_allocz(P->pool, sizeof(struct bgp_stats)) : NULL;
 
   rt_lock_table(p->igp_table);
 
@@ -1292,11 +1450,16 @@ bgp_init(struct proto_config *C)
   P->import_control = bgp_import_control;
   P->neigh_notify = bgp_neigh_notify;
   P->reload_routes = bgp_reload_routes;
+  P->reload_prefixes = c->import_table ? bgp_reload_prefixes : NULL;
   P->feed_begin = bgp_feed_begin;
   P->feed_end = bgp_feed_end;
   P->rte_better = bgp_rte_better;
   P->rte_mergable = bgp_rte_mergable;
-  P->rte_recalculate = c->deterministic_med ? bgp_rte_recalculate : NULL;
+  P->rte_recalculate = bgp_rte_recalculate;
+  P->rte_group = bgp_rte_group;
+  P->any_select = c->add_path_select;
+  P->any_limit = c->add_path_limit;
+  P->import_timing = c->statistics;
 
   p->cf = c;
   p->local_as = c->local_as;
@@ -1320,6 +1483,10 @@ bgp_check_config(struct bgp_config *c)
     return;
 
 
+  /* Replay sessions have no neighbor entry, like multihop ones */
+  if (c->replay && (c->multihop < 0))
+    c->multihop = 64;
+
   /* EBGP direct by default, IBGP multihop by default */
   if (c->multihop < 0)
     c->multihop = internal ? 64 : 0;
@@ -1374,6 +1541,21 @@ bgp_check_config(struct bgp_config *c)
   if (c->multihop && c->bfd && ipa_zero(c->source_addr))
     cf_error("Multihop BGP with BFD requires specified source address");
 
+  if (c->llgr_mode < 0)
+    c->llgr_mode = c->gr_mode ? BGP_LLGR_AWARE : 0;
+
+  if (c->llgr_mode && !c->gr_mode)
+    cf_error("Long-lived graceful restart requires basic graceful restart");
+
+  if (c->llgr_time > 0xffffff)
+    cf_error("Long-lived stale time must be at most %u", 0xffffff);
+
+  if (c->replay && !c->multihop)
+    cf_error("Replay BGP cannot be direct");
+
+  if (c->replay && (c->bfd || c->password))
+    cf_error("Replay BGP cannot use BFD or MD5 authentication");
+
   if ((c->gw_mode == GW_RECURSIVE) && c->c.table->sorted)
     cf_error("BGP in recursive mode prohibits sorted table");
 
@@ -1396,10 +1578,12 @@ bgp_reconfigure(struct proto *P, struct proto_config *C)
 
   int same = !memcmp(((byte *) old) + sizeof(struct proto_config),
 		     ((byte *) new) + sizeof(struct proto_config),
-		     // password item is last and must be checked separately
+		     // password and replay_file items are last and must be checked separately
 		     OFFSETOF(struct bgp_config, password) - sizeof(struct proto_config))
     && ((!old->password && !new->password)
 	|| (old->password && new->password && !strcmp(old->password, new->password)))
+    && ((!old->replay_file && !new->replay_file)
+	|| (old->replay_file && new->replay_file && !strcmp(old->replay_file, new->replay_file)))
     && (get_igp_table(old) == get_igp_table(new));
 
   if (same && (p->start_state > BSS_PREPARE))
@@ -1486,7 +1670,7 @@ bgp_store_error(struct bgp_proto *p, struct bgp_conn *c, u8 class, u32 code)
 
 static char *bgp_state_names[] = { "Idle", "Connect", "Active", "OpenSent", "OpenConfirm", "Established", "Close" };
 static char *bgp_err_classes[] = { "", "Error: ", "Socket: ", "Received: ", "BGP Error: ", "Automatic shutdown: ", ""};
-static char *bgp_misc_errors[] = { "", "Neighbor lost", "Invalid next hop", "Kernel MD5 auth failed", "No listening socket", "Link down", "BFD session down", "Graceful restart"};
+static char *bgp_misc_errors[] = { "", "Neighbor lost", "Invalid next hop", "Kernel MD5 auth failed", "No listening socket", "Link down", "BFD session down", "Graceful restart", "Cannot open replay file"};
 static char *bgp_auto_errors[] = { "", "Route limit exceeded"};
 
 static const char *
@@ -1535,6 +1719,85 @@ bgp_get_status(struct proto *P, byte *buf)
     bsprintf(buf, "%-14s%s%s", bgp_state_dsc(p), err1, err2);
 }
 
+/* Upper bound of the bin containing the given percentile (in per mille) */
+u32
+bgp_hist_percentile(struct bgp_hist *h, uint per_mille)
+{
+  u64 limit = ((u64) h->count * per_mille + 999) / 1000;
+  u64 sum = 0;
+  uint i;
+
+  for (i = 0; i < BGP_HIST_BINS - 1; i++)
+    if ((sum += h->bins[i]) >= limit)
+      return i ? MIN((1U << i) - 1, h->max) : 0;
+
+  return h->max;
+}
+
+static void
+bgp_show_hist(const char *name, struct bgp_hist *h, const char *unit)
+{
+  if (!h->count)
+    return;
+
+  cli_msg(-1006, "    %-18s%u samples, avg %u, p99 %u, max %u%s", name, h->count,
+	  (uint) (h->sum / h->count), bgp_hist_percentile(h, 990), h->max, unit);
+}
+
+static void
+bgp_show_stats_summary(struct bgp_stats *s)
+{
+  bgp_show_hist("Parse time:", &s->rx_parse, " us");
+  bgp_show_hist("Filter time:", &s->rx_filter, " us");
+  bgp_show_hist("Table time:", &s->rx_table, " us");
+  bgp_show_hist("Export queue:", &s->tx_queue, " prefixes");
+  bgp_show_hist("Bucket queue:", &s->tx_buckets, " buckets");
+  bgp_show_hist("TX backlog:", &s->tx_backlog, " bytes");
+}
+
+static void
+bgp_show_stats_hist(struct proto *P, const char *name, struct bgp_hist *h)
+{
+  char buf[BGP_HIST_BINS * 11 + 1];
+  char *pos = buf;
+  uint i;
+
+  for (i = 0; i < BGP_HIST_BINS; i++)
+    pos += bsprintf(pos, " %u", h->bins[i]);
+
+  cli_msg(-1026, "%s %s %u %lu %u%s", P->name, name, h->count, (unsigned long) h->sum, h->max, buf);
+}
+
+/**
+ * bgp_show_stats - show session statistics
+ * @P: protocol instance
+ * @arg: unused
+ * @cnt: number of protocols shown before
+ *
+ * Implements show bgp statistics command. Histograms are printed in a
+ * machine-readable format, one per line: protocol name, histogram name,
+ * number of samples, sum and maximum of samples, and counts of all bins.
+ */
+void
+bgp_show_stats(struct proto *P, uintptr_t arg UNUSED, int cnt)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+  struct bgp_stats *s = p->stats;
+
+  if (!cnt)
+    cli_msg(-2026, "name stage count sum max bins[%u]", BGP_HIST_BINS);
+
+  if ((P->proto != &proto_bgp) || (P->proto_state == PS_DOWN) || !s)
+    return;
+
+  bgp_show_stats_hist(P, "rx_parse", &s->rx_parse);
+  bgp_show_stats_hist(P, "rx_filter", &s->rx_filter);
+  bgp_show_stats_hist(P, "rx_table", &s->rx_table);
+  bgp_show_stats_hist(P, "tx_queue", &s->tx_queue);
+  bgp_show_stats_hist(P, "tx_buckets", &s->tx_buckets);
+  bgp_show_stats_hist(P, "tx_backlog", &s->tx_backlog);
+}
+
 static void
 bgp_show_proto_info(struct proto *P)
 {
@@ -1547,7 +1810,9 @@ bgp_show_proto_info(struct proto *P)
   cli_msg(-1006, "    Neighbor address: %I%J", p->cf->remote_ip, p->cf->iface);
   cli_msg(-1006, "    Neighbor AS:      %u", p->remote_as);
 
-  if (p->gr_active)
+  if (p->gr_active == BGP_GRS_LLGR)
+    cli_msg(-1006, "    Neighbor long-lived graceful restart active");
+  else if (p->gr_active)
     cli_msg(-1006, "    Neighbor graceful restart active");
 
   if (P->proto_state == PS_START)
@@ -1564,16 +1829,20 @@ bgp_show_proto_info(struct proto *P)
 	cli_msg(-1006, "    Connect delay:    %d/%d",
 		oc->connect_retry_timer->expires - now, p->cf->connect_delay_time);
 
-      if (p->gr_active && p->gr_timer->expires)
+      if ((p->gr_active == BGP_GRS_ACTIVE) && p->gr_timer->expires)
 	cli_msg(-1006, "    Restart timer:    %d/-", p->gr_timer->expires - now);
+
+      if ((p->gr_active == BGP_GRS_LLGR) && p->gr_timer->expires)
+	cli_msg(-1006, "    LLGR stale timer: %d/-", p->gr_timer->expires - now);
     }
   else if (P->proto_state == PS_UP)
     {
       cli_msg(-1006, "    Neighbor ID:      %R", p->remote_id);
-      cli_msg(-1006, "    Neighbor caps:   %s%s%s%s%s%s%s",
+      cli_msg(-1006, "    Neighbor caps:   %s%s%s%s%s%s%s%s",
 	      c->peer_refresh_support ? " refresh" : "",
 	      c->peer_enhanced_refresh_support ? " enhanced-refresh" : "",
 	      c->peer_gr_able ? " restart-able" : (c->peer_gr_aware ? " restart-aware" : ""),
+	      c->peer_llgr_able ? " llgr-able" : (c->peer_llgr_aware ? " llgr-aware" : ""),
 	      c->peer_as4_support ? " AS4" : "",
 	      (c->peer_add_path & ADD_PATH_RX) ? " add-path-rx" : "",
 	      (c->peer_add_path & ADD_PATH_TX) ? " add-path-tx" : "",
@@ -1588,6 +1857,22 @@ bgp_show_proto_info(struct proto *P)
 	      p->add_path_tx ? " add-path-tx" : "",
 	      p->ext_messages ? " ext-messages" : "");
       cli_msg(-1006, "    Source address:   %I", p->source_addr);
+      if (p->adj_in_slab)
+	cli_msg(-1006, "    Import table:     %u routes, %u kB%s", p->adj_in_hash.count,
+		(bgp_adj_in_memsize(p) + 1023) / 1024,
+		(p->adj_in_reload_pos != ~0U) ? " (reloading)" : "");
+      if (p->adj_out_slab)
+	cli_msg(-1006, "    Export table:     %u routes", p->adj_out_hash.count);
+      if (p->add_path_tx && (P->any_select == RAS_BEST))
+	cli_msg(-1006, "    Path selection:   best %u", P->any_limit);
+      else if (p->add_path_tx && (P->any_select == RAS_GROUPS))
+	cli_msg(-1006, "    Path selection:   neighbor as");
+      else if (p->add_path_tx && (P->any_select == RAS_MERGED))
+	cli_msg(-1006, "    Path selection:   ecmp");
+      if (p->replay)
+	bgp_replay_show(p);
+      if (p->stats)
+	bgp_show_stats_summary(p->stats);
       if (P->cf->in_limit)
 	cli_msg(-1006, "    Route limit:      %d/%d",
 		p->p.stats.imp_routes + p->p.stats.filt_routes, P->cf->in_limit->limit);
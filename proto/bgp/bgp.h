@@ -13,6 +13,7 @@
 #include "nest/route.h"
 #include "nest/bfd.h"
 #include "lib/hash.h"
+#include "lib/bitops.h"
 
 struct linpool;
 struct eattr;
@@ -49,11 +50,17 @@ struct bgp_config {
   int interpret_communities;		/* Hardwired handling of well-known communities */
   int secondary;			/* Accept also non-best routes (i.e. RA_ACCEPTED) */
   int add_path;				/* Use ADD-PATH extension [RFC7911] */
+  int add_path_select;			/* Which paths are sent with ADD-PATH TX (RAS_*) */
+  uint add_path_limit;			/* Maximal number of paths sent for RAS_BEST */
+  int import_table;			/* Keep Adj-RIB-In, reload routes locally */
+  int export_table;			/* Keep Adj-RIB-Out, send only changed routes */
   int allow_local_as;			/* Allow that number of local ASNs in incoming AS_PATHs */
   int allow_local_pref;			/* Allow LOCAL_PREF in EBGP sessions */
   int gr_mode;				/* Graceful restart mode (BGP_GR_*) */
+  int llgr_mode;			/* Long-lived graceful restart mode (BGP_LLGR_*) */
   int setkey;				/* Set MD5 password to system SA/SP database */
   unsigned gr_time;			/* Graceful restart timeout */
+  unsigned llgr_time;			/* Long-lived graceful restart stale time */
   unsigned connect_delay_time;		/* Minimum delay between connect attempts */
   unsigned connect_retry_time;		/* Timeout for connect attempts */
   unsigned hold_time, initial_hold_time;
@@ -62,8 +69,11 @@ struct bgp_config {
   unsigned error_delay_time_min;	/* Time to wait after an error is detected */
   unsigned error_delay_time_max;
   unsigned disable_after_error;		/* Disable the protocol when error is detected */
+  int replay;				/* Local session without TCP connection, see replay.c */
+  int statistics;			/* Collect session statistics (struct bgp_stats) */
 
   char *password;			/* Password used for MD5 authentication */
+  char *replay_file;			/* MRT dump to replay, NULL for replay sink */
   struct rtable_config *igp_table;	/* Table used for recursive next hop lookups */
   int check_link;			/* Use iface link state for liveness detection */
   int bfd;				/* Use BFD for liveness detection */
@@ -89,6 +99,20 @@ struct bgp_config {
 /* For peer_gr_aflags */
 #define BGP_GRF_FORWARDING 0x80
 
+#define BGP_LLGR_ABLE 1
+#define BGP_LLGR_AWARE 2
+
+/* For peer_llgr_aflags */
+#define BGP_LLGRF_FORWARDING 0x80
+
+/* For gr_active */
+#define BGP_GRS_NONE		0	/* No neighbor graceful restart */
+#define BGP_GRS_ACTIVE		1	/* Graceful restart per RFC 4724 */
+#define BGP_GRS_LLGR		2	/* Long-lived graceful restart phase */
+
+/* Route is LLGR stale (rte->pflags), see bgp_rte_better() */
+#define BGP_REF_STALE		1
+
 
 struct bgp_conn {
   struct bgp_proto *bgp;
@@ -112,6 +136,10 @@ struct bgp_conn {
   u16 peer_gr_time;
   u8 peer_gr_flags;
   u8 peer_gr_aflags;
+  u8 peer_llgr_aware;
+  u8 peer_llgr_able;
+  u8 peer_llgr_aflags;
+  uint peer_llgr_time;
   u8 peer_ext_messages_support;		/* Peer supports extended message length [draft] */
   unsigned hold_time, keepalive_time;	/* Times calculated from my and neighbor's requirements */
 };
@@ -132,7 +160,9 @@ struct bgp_proto {
   int rr_client;			/* Whether neighbor is RR client of me */
   int rs_client;			/* Whether neighbor is RS client of me */
   u8 gr_ready;				/* Neighbor could do graceful restart */
-  u8 gr_active;				/* Neighbor is doing graceful restart */
+  u8 gr_active;				/* Neighbor is doing graceful restart (BGP_GRS_*) */
+  u8 llgr_ready;			/* Neighbor could do long-lived graceful restart */
+  uint llgr_time;			/* Negotiated long-lived stale time */
   u8 feed_state;			/* Feed state (TX) for EoR, RR packets, see BFS_* */
   u8 load_state;			/* Load state (RX) for EoR, RR packets, see BFS_* */
   struct bgp_conn *conn;		/* Connection we have established */
@@ -146,11 +176,39 @@ struct bgp_proto {
   struct event *event;			/* Event for respawning and shutting process */
   struct timer *startup_timer;		/* Timer used to delay protocol startup due to previous errors (startup_delay) */
   struct timer *gr_timer;		/* Timer waiting for reestablishment after graceful restart */
-  struct bgp_bucket **bucket_hash;	/* Hash table of attribute buckets */
-  uint hash_size, hash_count, hash_limit;
-  HASH(struct bgp_prefix) prefix_hash;	/* Prefixes to be sent */
-  slab *prefix_slab;			/* Slab holding prefix nodes */
+  HASH(struct bgp_rx_route) rx_hash;	/* Routes received from the neighbor, for stale route tracking */
+  slab *rx_slab;			/* Slab holding rx_hash entries, NULL if not tracking */
+  struct event *rx_sweep_event;		/* Event for removing or marking stale routes */
+  u32 rx_gen;				/* Current refresh cycle of received routes */
+  u32 rx_sweep_gen;			/* Routes older than this cycle are removed by sweep */
+  u32 rx_llgr_gen;			/* Routes older than this cycle are marked LLGR stale by sweep */
+  uint rx_sweep_pos;			/* Next hash chain to be swept, ~0 if no sweep is active */
+  struct bgp_replay *replay;		/* Replay state, NULL if not in replay mode */
+  OA_HASH(struct bgp_bucket) bucket_hash;	/* Hash table of attribute buckets */
+  struct bgp_prefix *prefix_table;	/* Prefixes to be sent, indexed by prefix ID */
+  u32 *prefix_hash;			/* Hash table of prefix IDs, chained by next */
+  uint prefix_hash_order;
+  u32 prefix_count;			/* Number of prefixes to be sent */
+  u32 prefix_used;			/* Number of used entries in prefix_table */
+  u32 prefix_size;			/* Allocated entries in prefix_table */
+  u32 prefix_free;			/* First free entry in prefix_table, chained by next */
+  struct bgp_bucket **bucket_map;	/* Buckets indexed by bucket ID */
+  u32 *bucket_free;			/* Stack of free bucket IDs */
+  u32 bucket_used, bucket_size, bucket_free_count;
   list bucket_queue;			/* Queue of buckets to send */
+  uint bucket_queue_len;		/* Number of buckets in bucket_queue */
+  struct bgp_stats *stats;		/* Session statistics, NULL if not enabled */
+  HASH(struct bgp_adj_in) adj_in_hash;	/* Adj-RIB-In, received routes before import filters (import table) */
+  slab *adj_in_slab;			/* Slab holding Adj-RIB-In entries, NULL if disabled */
+  struct event *adj_in_reload_event;	/* Event for reloading routes from Adj-RIB-In */
+  uint adj_in_reload_pos;		/* Next hash chain to be reloaded, ~0 if no reload is active */
+  uint adj_in_reload_count;		/* Number of routes reloaded so far */
+  struct bgp_reval *adj_in_reval;	/* Revalidation of Adj-RIB-In after ROA changes */
+  HASH(struct bgp_adj_out) adj_out_hash; /* Adj-RIB-Out, last announced routes (export table) */
+  slab *adj_out_slab;			/* Slab holding Adj-RIB-Out entries, NULL if disabled */
+  u32 adj_out_gen;			/* Current refeed cycle of Adj-RIB-Out */
+  u8 adj_out_refeed;			/* Refeed active, stale Adj-RIB-Out entries withdrawn at its end */
+  u8 adj_out_resend;			/* Route refresh requested during feed, resend at its end */
   struct bgp_bucket *withdraw_bucket;	/* Withdrawn routes */
   unsigned startup_delay;		/* Time to delay protocol startup by due to errors */
   bird_clock_t last_proto_error;	/* Time of last error that leads to protocol stop */
@@ -164,24 +222,125 @@ struct bgp_proto {
 #endif
 };
 
+/*
+ *	Session statistics are collected in histograms with logarithmic bins,
+ *	bin 0 counts zero values and bin i counts values from 2^(i-1) to
+ *	2^i - 1. Larger values are counted in the last bin. The same histograms
+ *	are used for filter latencies in benchmarks (see bench.c).
+ */
+
+#define BGP_HIST_BINS		24
+
+struct bgp_hist {
+  u32 count;				/* Number of samples */
+  u32 max;				/* Maximal sample */
+  u64 sum;				/* Sum of samples */
+  u32 bins[BGP_HIST_BINS];
+};
+
+struct bgp_stats {
+  struct bgp_hist rx_parse;		/* UPDATE processing time without import [us] */
+  struct bgp_hist rx_filter;		/* Import filter time per UPDATE [us] */
+  struct bgp_hist rx_table;		/* Routing table update time per UPDATE [us] */
+  struct bgp_hist tx_queue;		/* Prefixes waiting to be sent, sampled per UPDATE */
+  struct bgp_hist tx_buckets;		/* Buckets waiting to be sent, sampled per UPDATE */
+  struct bgp_hist tx_backlog;		/* Unsent bytes when socket is blocked */
+};
+
+static inline void
+bgp_hist_add(struct bgp_hist *h, u32 val)
+{
+  uint bin = val ? u32_log2(val) + 1 : 0;
+
+  h->count++;
+  h->sum += val;
+  if (val > h->max)
+    h->max = val;
+  h->bins[(bin < BGP_HIST_BINS) ? bin : BGP_HIST_BINS - 1]++;
+}
+
+u32 bgp_hist_percentile(struct bgp_hist *h, uint per_mille);
+
+/*
+ *	Prefixes to be sent are referenced by 32-bit IDs, which are indices to
+ *	p->prefix_table. ID 0 is never used, so it is used as a terminator of
+ *	hash chains and 'not queued' value. Similarly, buckets have IDs that
+ *	are indices to p->bucket_map.
+ */
+
 struct bgp_prefix {
-  struct {
-    ip_addr prefix;
-    int pxlen;
-  } n;
+  ip_addr prefix;
+  u32 path_id;
+  u32 next;				/* Next prefix ID in hash chain or free list */
+  u32 bucket;				/* ID of bucket the prefix is queued in */
+  u32 pos;				/* Position in the array of bucket prefixes */
+  u8 pxlen;
+};
+
+struct bgp_adj_in {
+  ip_addr prefix;
+  int pxlen;
+  u32 path_id;
+  struct bgp_adj_in *next;
+  rta *attrs;				/* Received cached attributes, shared with other routes */
+  u8 stale;				/* Route is retained as LLGR stale, see bgp_rx_llgr_stale() */
+};
+
+struct bgp_reval_px {
+  ip_addr prefix;
+  uint pxlen;
+};
+
+struct bgp_reval {
+  struct event *event;			/* Event for reimporting routes in steps */
+  linpool *lp;				/* Linpool for trie and prefix array */
+  struct f_trie *trie;			/* Affected prefixes, NULL if no revalidation is active */
+  struct bgp_reval_px *px;		/* Affected prefixes, not covered by other ones */
+  uint px_count;
+  uint walk;				/* Walk whole Adj-RIB-In instead of looking up subprefixes */
+  uint pos;				/* Next hash chain (walk) or affected prefix (lookup) */
+  uint pxlen;				/* Length of subprefixes being looked up */
+  u32 val;				/* Next subprefix, bits below affected prefix length */
+  uint count;				/* Number of routes reimported so far */
+  u32 pxlens[MAX_PREFIX_LENGTH + 1];	/* Number of Adj-RIB-In entries of each prefix length */
+  u8 lookup[MAX_PREFIX_LENGTH + 1];	/* Prefix lengths to be looked up */
+};
+
+struct bgp_rx_route {
+  ip_addr prefix;
+  u32 path_id;
+  u32 gen;				/* Refresh cycle in which the route was last received */
+  struct bgp_rx_route *next;
+  u8 pxlen;
+};
+
+struct bgp_adj_out {
+  ip_addr prefix;
+  int pxlen;
   u32 path_id;
-  struct bgp_prefix *next;
-  node bucket_node;			/* Node in per-bucket list */
+  u32 gen;				/* Refeed cycle in which the entry was last updated */
+  struct bgp_adj_out *next;
+  struct bgp_bucket *bucket;		/* Bucket with last announced attributes, NULL if unknown */
 };
 
+#define BGP_BUCKET_INLINE	3
+
 struct bgp_bucket {
-  node send_node;			/* Node in send queue */
-  struct bgp_bucket *hash_next, *hash_prev;	/* Node in bucket hash table */
-  unsigned hash;			/* Hash over extended attributes */
-  list prefixes;			/* Prefixes in this buckets */
+  node send_node;			/* Node in send queue, next is NULL when not queued */
+  u32 hash;				/* Hash over extended attributes */
+  u32 id;				/* Index in p->bucket_map */
+  uint uc;				/* Number of Adj-RIB-Out entries using the bucket */
+  u32 px_count;				/* Number of prefixes in this bucket */
+  u32 px_size;				/* Allocated size of prefixes array */
+  u32 px_inline[BGP_BUCKET_INLINE];	/* Storage for a few prefixes, avoids allocation */
+  u32 *prefixes;			/* Array of prefix IDs, sent from the end */
   ea_list eattrs[0];			/* Per-bucket extended attributes */
 };
 
+static inline struct bgp_prefix *
+bgp_last_prefix(struct bgp_proto *p, struct bgp_bucket *b)
+{ return &p->prefix_table[b->prefixes[b->px_count - 1]]; }
+
 #define BGP_PORT		179
 #define BGP_VERSION		4
 #define BGP_HEADER_LENGTH	19
@@ -211,8 +370,12 @@ void bgp_handle_graceful_restart(struct bgp_proto *p);
 void bgp_graceful_restart_done(struct bgp_proto *p);
 void bgp_refresh_begin(struct bgp_proto *p);
 void bgp_refresh_end(struct bgp_proto *p);
+void bgp_resend_routes(struct bgp_proto *p);
 void bgp_store_error(struct bgp_proto *p, struct bgp_conn *c, u8 class, u32 code);
 void bgp_stop(struct bgp_proto *p, uint subcode, byte *data, uint len);
+void bgp_setup_conn(struct bgp_proto *p, struct bgp_conn *conn);
+void bgp_setup_sk(struct bgp_conn *conn, struct birdsock *s);
+void bgp_show_stats(struct proto *P, uintptr_t arg, int cnt);
 
 struct rte_source *bgp_find_source(struct bgp_proto *p, u32 path_id);
 struct rte_source *bgp_get_source(struct bgp_proto *p, u32 path_id);
@@ -250,21 +413,64 @@ struct rta *bgp_decode_attrs(struct bgp_conn *conn, byte *a, uint len, struct li
 int bgp_get_attr(struct eattr *e, byte *buf, int buflen);
 int bgp_rte_better(struct rte *, struct rte *);
 int bgp_rte_mergable(rte *pri, rte *sec);
+u32 bgp_rte_group(rte *r);
 int bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best);
 void bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UNUSED, ea_list *attrs);
 int bgp_import_control(struct proto *, struct rte **, struct ea_list **, struct linpool *);
 void bgp_init_bucket_table(struct bgp_proto *);
+struct bgp_bucket *bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate);
 void bgp_free_bucket_table(struct bgp_proto *p);
 void bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck);
-void bgp_init_prefix_table(struct bgp_proto *p, u32 order);
+void bgp_init_prefix_table(struct bgp_proto *p);
 void bgp_free_prefix_table(struct bgp_proto *p);
-void bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp);
+void bgp_dequeue_prefix(struct bgp_proto *p, struct bgp_bucket *buck);
+void bgp_init_adj_in(struct bgp_proto *p);
+void bgp_free_adj_in(struct bgp_proto *p);
+void bgp_adj_in_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, rta *a);
+void bgp_adj_in_reload(struct bgp_proto *p);
+void bgp_adj_in_reload_prefixes(struct bgp_proto *p, struct f_trie *t);
+uint bgp_adj_in_memsize(struct bgp_proto *p);
+void bgp_init_rx_routes(struct bgp_proto *p);
+void bgp_rx_route_update(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, int announce);
+void bgp_rx_refresh_begin(struct bgp_proto *p);
+void bgp_rx_refresh_end(struct bgp_proto *p);
+void bgp_rx_llgr_begin(struct bgp_proto *p);
+byte bgp_rte_pflags(rta *a);
+void bgp_init_adj_out(struct bgp_proto *p);
+void bgp_free_adj_out(struct bgp_proto *p);
+void bgp_adj_out_begin_refeed(struct bgp_proto *p);
+void bgp_adj_out_end_refeed(struct bgp_proto *p);
+void bgp_adj_out_resend(struct bgp_proto *p);
+void bgp_adj_out_skip(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id, struct bgp_bucket *buck);
 uint bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains);
 void bgp_get_route_info(struct rte *, byte *buf, struct ea_list *attrs);
 
 inline static void bgp_attach_attr_ip(struct ea_list **to, struct linpool *pool, unsigned attr, ip_addr a)
 { *(ip_addr *) bgp_attach_attr_wa(to, pool, attr, sizeof(ip_addr)) = a; }
 
+/* replay.c */
+
+void bgp_replay_start(struct bgp_proto *p);
+int bgp_replay_sent(struct bgp_conn *conn, uint len);
+void bgp_replay_show(struct bgp_proto *p);
+
+/* bench.c */
+
+#define BGP_BENCH_FILTER	0	/* Run filter on each route */
+#define BGP_BENCH_MATCH		1	/* Match each prefix with prefix set */
+#define BGP_BENCH_ROA		2	/* Validate each route with ROA table */
+#define BGP_BENCH_BUCKETS	3	/* Group routes to attribute buckets */
+
+struct bgp_bench_args {
+  int mode;				/* What is measured, BGP_BENCH_* */
+  int export;				/* Routes are read-only, as in export */
+  struct filter *filter;		/* Filter to run, NULL for the protocol filter */
+  struct f_trie *trie;			/* Prefix set to match */
+  struct roa_table *roa;		/* ROA table to validate with */
+};
+
+void bgp_bench(struct proto *P, char *file, struct bgp_bench_args *args);
+
 /* packets.c */
 
 void mrt_dump_bgp_state_change(struct bgp_conn *conn, unsigned old, unsigned new);
@@ -272,6 +478,7 @@ void bgp_schedule_packet(struct bgp_conn *conn, int type);
 void bgp_kick_tx(void *vconn);
 void bgp_tx(struct birdsock *sk);
 int bgp_rx(struct birdsock *sk, uint size);
+void bgp_rx_packet(struct bgp_conn *conn, byte *pkt, uint len);
 const char * bgp_error_dsc(unsigned code, unsigned subcode);
 void bgp_log_error(struct bgp_proto *p, u8 class, char *msg, unsigned code, unsigned subcode, byte *data, unsigned len);
 
@@ -386,6 +593,7 @@ void bgp_log_error(struct bgp_proto *p, u8 class, char *msg, unsigned code, unsi
 #define BEM_LINK_DOWN		5
 #define BEM_BFD_DOWN		6
 #define BEM_GRACEFUL_RESTART	7
+#define BEM_REPLAY_FILE		8
 
 /* Automatic shutdown error codes */
 
@@ -396,6 +604,8 @@ void bgp_log_error(struct bgp_proto *p, u8 class, char *msg, unsigned code, unsi
 #define BGP_COMM_NO_EXPORT		0xffffff01	/* Don't export outside local AS / confed. */
 #define BGP_COMM_NO_ADVERTISE		0xffffff02	/* Don't export at all */
 #define BGP_COMM_NO_EXPORT_SUBCONFED	0xffffff03	/* NO_EXPORT even in local confederation */
+#define BGP_COMM_LLGR_STALE		0xffff0006	/* Route is LLGR stale, RFC 9494 */
+#define BGP_COMM_NO_LLGR		0xffff0007	/* Don't retain the route as LLGR stale */
 
 /* Origins */
 
@@ -199,6 +199,29 @@ bgp_put_cap_gr2(struct bgp_proto *p UNUSED, byte *buf)
   return buf + 2;
 }
 
+static byte *
+bgp_put_cap_llgr1(struct bgp_proto *p, byte *buf)
+{
+  *buf++ = 71;		/* Capability 71: Support for long-lived graceful restart */
+  *buf++ = 7;		/* Capability data length */
+
+  *buf++ = 0;		/* Appropriate AF */
+  *buf++ = BGP_AF;
+  *buf++ = 1;		/* and SAFI 1 */
+  *buf++ = p->p.gr_recovery ? BGP_LLGRF_FORWARDING : 0;
+  put_u24(buf, p->cf->llgr_time);
+
+  return buf + 3;
+}
+
+static byte *
+bgp_put_cap_llgr2(struct bgp_proto *p UNUSED, byte *buf)
+{
+  *buf++ = 71;		/* Capability 71: Support for long-lived graceful restart */
+  *buf++ = 0;		/* Capability data length */
+  return buf;
+}
+
 static byte *
 bgp_put_cap_as4(struct bgp_proto *p, byte *buf)
 {
@@ -273,6 +296,11 @@ bgp_create_open(struct bgp_conn *conn, byte *buf)
   else if (p->cf->gr_mode == BGP_GR_AWARE)
     cap = bgp_put_cap_gr2(p, cap);
 
+  if (p->cf->llgr_mode == BGP_LLGR_ABLE)
+    cap = bgp_put_cap_llgr1(p, cap);
+  else if (p->cf->llgr_mode == BGP_LLGR_AWARE)
+    cap = bgp_put_cap_llgr2(p, cap);
+
   if (p->cf->enable_as4)
     cap = bgp_put_cap_as4(p, cap);
 
@@ -307,10 +335,10 @@ bgp_encode_prefixes(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, uint
   ip_addr a;
   int bytes;
 
-  while (!EMPTY_LIST(buck->prefixes) && (remains >= (5+sizeof(ip_addr))))
+  while (buck->px_count && (remains >= (5+sizeof(ip_addr))))
     {
-      struct bgp_prefix *px = SKIP_BACK(struct bgp_prefix, bucket_node, HEAD(buck->prefixes));
-      DBG("\tDequeued route %I/%d\n", px->n.prefix, px->n.pxlen);
+      struct bgp_prefix *px = bgp_last_prefix(p, buck);
+      DBG("\tDequeued route %I/%d\n", px->prefix, px->pxlen);
 
       if (p->add_path_tx)
 	{
@@ -319,16 +347,14 @@ bgp_encode_prefixes(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, uint
 	  remains -= 4;
 	}
 
-      *w++ = px->n.pxlen;
-      bytes = (px->n.pxlen + 7) / 8;
-      a = px->n.prefix;
+      *w++ = px->pxlen;
+      bytes = (px->pxlen + 7) / 8;
+      a = px->prefix;
       ipa_hton(a);
       memcpy(w, &a, bytes);
       w += bytes;
       remains -= bytes + 1;
-      rem_node(&px->bucket_node);
-      bgp_free_prefix(p, px);
-      // fib_delete(&p->prefix_fib, px);
+      bgp_dequeue_prefix(p, buck);
     }
   return w - start;
 }
@@ -336,13 +362,15 @@ bgp_encode_prefixes(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, uint
 static void
 bgp_flush_prefixes(struct bgp_proto *p, struct bgp_bucket *buck)
 {
-  while (!EMPTY_LIST(buck->prefixes))
+  while (buck->px_count)
     {
-      struct bgp_prefix *px = SKIP_BACK(struct bgp_prefix, bucket_node, HEAD(buck->prefixes));
-      log(L_ERR "%s: - route %I/%d skipped", p->p.name, px->n.prefix, px->n.pxlen);
-      rem_node(&px->bucket_node);
-      bgp_free_prefix(p, px);
-      // fib_delete(&p->prefix_fib, px);
+      struct bgp_prefix *px = bgp_last_prefix(p, buck);
+      log(L_ERR "%s: - route %I/%d skipped", p->p.name, px->prefix, px->pxlen);
+
+      if (p->adj_out_slab)
+	bgp_adj_out_skip(p, px->prefix, px->pxlen, px->path_id, buck);
+
+      bgp_dequeue_prefix(p, buck);
     }
 }
 
@@ -360,7 +388,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
   int a_size = 0;
 
   w = buf+2;
-  if ((buck = p->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
+  if ((buck = p->withdraw_bucket) && buck->px_count)
     {
       DBG("Withdrawn routes:\n");
       wd_size = bgp_encode_prefixes(p, w, buck, remains);
@@ -373,10 +401,11 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
     {
       while ((buck = (struct bgp_bucket *) HEAD(p->bucket_queue))->send_node.next)
 	{
-	  if (EMPTY_LIST(buck->prefixes))
+	  if (!buck->px_count)
 	    {
 	      DBG("Deleting empty bucket %p\n", buck);
 	      rem_node(&buck->send_node);
+	      p->bucket_queue_len--;
 	      bgp_free_bucket(p, buck);
 	      continue;
 	    }
@@ -389,6 +418,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
 	      bgp_flush_prefixes(p, buck);
 	      rem_node(&buck->send_node);
+	      p->bucket_queue_len--;
 	      bgp_free_bucket(p, buck);
 	      continue;
 	    }
@@ -448,7 +478,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
   put_u16(buf, 0);
   w = buf+4;
 
-  if ((buck = p->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
+  if ((buck = p->withdraw_bucket) && buck->px_count)
     {
       DBG("Withdrawn routes:\n");
       tmp = bgp_attach_attr_wa(&ea, bgp_linpool, BA_MP_UNREACH_NLRI, remains-8);
@@ -465,10 +495,11 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
     {
       while ((buck = (struct bgp_bucket *) HEAD(p->bucket_queue))->send_node.next)
 	{
-	  if (EMPTY_LIST(buck->prefixes))
+	  if (!buck->px_count)
 	    {
 	      DBG("Deleting empty bucket %p\n", buck);
 	      rem_node(&buck->send_node);
+	      p->bucket_queue_len--;
 	      bgp_free_bucket(p, buck);
 	      continue;
 	    }
@@ -483,6 +514,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
 	      bgp_flush_prefixes(p, buck);
 	      rem_node(&buck->send_node);
+	      p->bucket_queue_len--;
 	      bgp_free_bucket(p, buck);
 	      continue;
 	    }
@@ -536,6 +568,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 			  remains = rem_stored;
 			  bgp_flush_prefixes(p, buck);
 			  rem_node(&buck->send_node);
+			  p->bucket_queue_len--;
 			  bgp_free_bucket(p, buck);
 			  continue;
 			case MLL_IGNORE:
@@ -732,6 +765,12 @@ bgp_fire_tx(struct bgp_conn *conn)
     }
   else if (s & (1 << PKT_UPDATE))
     {
+      if (p->stats)
+	{
+	  bgp_hist_add(&p->stats->tx_queue, p->prefix_count);
+	  bgp_hist_add(&p->stats->tx_buckets, p->bucket_queue_len);
+	}
+
       type = PKT_UPDATE;
       end = bgp_create_update(conn, pkt);
 
@@ -764,7 +803,18 @@ bgp_fire_tx(struct bgp_conn *conn)
 
   conn->packets_to_send = s;
   bgp_create_header(buf, end - buf, type);
-  return sk_send(sk, end - buf);
+
+  /* Replay sessions have no TCP connection, packets are just discarded */
+  if (p->replay)
+    return bgp_replay_sent(conn, end - buf);
+
+  int rv = sk_send(sk, end - buf);
+
+  /* Packet was not sent completely, the rest waits for the TX hook */
+  if (!rv && p->stats)
+    bgp_hist_add(&p->stats->tx_backlog, sk->tpos - sk->ttx);
+
+  return rv;
 }
 
 /**
@@ -872,6 +922,22 @@ bgp_parse_capabilities(struct bgp_conn *conn, byte *opt, int len)
 	  conn->peer_enhanced_refresh_support = 1;
 	  break;
 
+	case 71: /* Long-lived graceful restart capability, RFC 9494 */
+	  if (cl % 7)
+	    goto err;
+	  conn->peer_llgr_aware = 1;
+	  conn->peer_llgr_able = 0;
+	  conn->peer_llgr_time = 0;
+	  conn->peer_llgr_aflags = 0;
+	  for (i = 0; i < cl; i += 7)
+	    if (opt[2+i+0] == 0 && opt[2+i+1] == BGP_AF && opt[2+i+2] == 1) /* Match AFI/SAFI */
+	      {
+		conn->peer_llgr_able = 1;
+		conn->peer_llgr_aflags = opt[2+i+3];
+		conn->peer_llgr_time = get_u24(opt + 2+i+4);
+	      }
+	  break;
+
 	  /* We can safely ignore all other capabilities */
 	}
       len -= 2 + cl;
@@ -1035,6 +1101,8 @@ bgp_rx_open(struct bgp_conn *conn, byte *pkt, uint len)
   p->add_path_rx = (p->cf->add_path & ADD_PATH_RX) && (conn->peer_add_path & ADD_PATH_TX);
   p->add_path_tx = (p->cf->add_path & ADD_PATH_TX) && (conn->peer_add_path & ADD_PATH_RX);
   p->gr_ready = p->cf->gr_mode && conn->peer_gr_able;
+  p->llgr_time = MIN(conn->peer_llgr_time, p->cf->llgr_time);
+  p->llgr_ready = p->gr_ready && p->cf->llgr_mode && conn->peer_llgr_able && p->llgr_time;
   p->ext_messages = p->cf->enable_extended_messages && conn->peer_ext_messages_support;
 
   /* Update RA mode */
@@ -1120,26 +1188,77 @@ bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
       a0->eattrs = ea;
     }
 
+  if (p->adj_in_slab)
+    bgp_adj_in_update(p, prefix, pxlen, path_id, *a);
+
+  if (p->rx_slab)
+    bgp_rx_route_update(p, prefix, pxlen, path_id, 1);
+
   net *n = net_get(p->p.table, prefix, pxlen);
   rte *e = rte_get_temp(rta_clone(*a));
   e->net = n;
-  e->pflags = 0;
+  e->pflags = bgp_rte_pflags(*a);
   e->u.bgp.suppressed = 0;
   rte_update2(p->p.main_ahook, n, e, *src);
 }
 
+/*
+ *	Withdrawals are collected and passed to the routing table in batches.
+ *	FIB buckets are prefetched when a prefix is added to the batch, so
+ *	lookups in bgp_withdraw_flush() usually hit the cache.
+ */
+
+#define BGP_WITHDRAW_BATCH 64
+
+struct bgp_withdraw_batch {
+  struct rte_src *src;			/* Common source of all batched routes */
+  uint count;
+  ip_addr prefix[BGP_WITHDRAW_BATCH];
+  u8 pxlen[BGP_WITHDRAW_BATCH];
+  net *nets[BGP_WITHDRAW_BATCH];
+};
+
+static void
+bgp_withdraw_flush(struct bgp_proto *p, struct bgp_withdraw_batch *wb)
+{
+  uint i;
+
+  if (!wb->count)
+    return;
+
+  for (i = 0; i < wb->count; i++)
+    wb->nets[i] = net_find(p->p.table, wb->prefix[i], wb->pxlen[i]);
+
+  rte_withdraw_batch(p->p.main_ahook, wb->nets, wb->count, wb->src);
+  wb->count = 0;
+}
+
 static inline void
 bgp_rte_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen,
-		 u32 path_id, u32 *last_id, struct rte_src **src)
+		 u32 path_id, u32 *last_id, struct rte_src **src,
+		 struct bgp_withdraw_batch *wb)
 {
   if (path_id != *last_id)
     {
+      bgp_withdraw_flush(p, wb);
       *src = rt_find_source(&p->p, path_id);
       *last_id = path_id;
     }
 
-  net *n = net_find(p->p.table, prefix, pxlen);
-  rte_update2( p->p.main_ahook, n, NULL, *src);
+  if (p->adj_in_slab)
+    bgp_adj_in_update(p, prefix, pxlen, path_id, NULL);
+
+  if (p->rx_slab)
+    bgp_rx_route_update(p, prefix, pxlen, path_id, 0);
+
+  if (wb->count == BGP_WITHDRAW_BATCH)
+    bgp_withdraw_flush(p, wb);
+
+  fib_prefetch(&p->p.table->fib, &prefix);
+  wb->src = *src;
+  wb->prefix[wb->count] = prefix;
+  wb->pxlen[wb->count] = pxlen;
+  wb->count++;
 }
 
 static inline int
@@ -1206,6 +1325,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
   int pxlen, err = 0;
   u32 path_id = 0;
   u32 last_id = 0;
+  struct bgp_withdraw_batch wb = { .count = 0 };
 
   /* Check for End-of-RIB marker */
   if (!withdrawn_len && !attr_len && !nlri_len)
@@ -1220,9 +1340,11 @@ bgp_do_rx_update(struct bgp_conn *conn,
       DECODE_PREFIX(withdrawn, withdrawn_len);
       DBG("Withdraw %I/%d\n", prefix, pxlen);
 
-      bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+      bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src, &wb);
     }
 
+  bgp_withdraw_flush(p, &wb);
+
   if (!attr_len && !nlri_len)		/* shortcut */
     return;
 
@@ -1245,10 +1367,12 @@ bgp_do_rx_update(struct bgp_conn *conn,
       if (a0)
 	bgp_rte_update(p, prefix, pxlen, path_id, &last_id, &src, a0, &a);
       else /* Forced withdraw as a result of soft error */
-	bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src, &wb);
     }
 
  done:
+  bgp_withdraw_flush(p, &wb);
+
   if (a)
     rta_free(a);
 
@@ -1309,6 +1433,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
   int pxlen, err = 0;
   u32 path_id = 0;
   u32 last_id = 0;
+  struct bgp_withdraw_batch wb = { .count = 0 };
 
   p->mp_reach_len = 0;
   p->mp_unreach_len = 0;
@@ -1331,8 +1456,10 @@ bgp_do_rx_update(struct bgp_conn *conn,
 	{
 	  DECODE_PREFIX(x, len);
 	  DBG("Withdraw %I/%d\n", prefix, pxlen);
-	  bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	  bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src, &wb);
 	}
+
+      bgp_withdraw_flush(p, &wb);
     }
 
   DO_NLRI(mp_reach)
@@ -1362,11 +1489,13 @@ bgp_do_rx_update(struct bgp_conn *conn,
 	  if (a0)
 	    bgp_rte_update(p, prefix, pxlen, path_id, &last_id, &src, a0, &a);
 	  else /* Forced withdraw as a result of soft error */
-	    bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	    bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src, &wb);
 	}
     }
 
  done:
+  bgp_withdraw_flush(p, &wb);
+
   if (a)
     rta_free(a);
 
@@ -1656,7 +1785,7 @@ bgp_rx_route_refresh(struct bgp_conn *conn, byte *pkt, uint len)
   {
   case BGP_RR_REQUEST:
     BGP_TRACE(D_PACKETS, "Got ROUTE-REFRESH");
-    proto_request_feeding(&p->p);
+    bgp_resend_routes(p);
     break;
 
   case BGP_RR_BEGIN:
@@ -1677,6 +1806,31 @@ bgp_rx_route_refresh(struct bgp_conn *conn, byte *pkt, uint len)
 }
 
 
+/*
+ * Import filters and routing table updates are measured by the nest (see
+ * rte_update2() and rte_withdraw_batch()), the rest of UPDATE processing is
+ * accounted as parsing.
+ */
+static void
+bgp_rx_update_stats(struct bgp_conn *conn, byte *pkt, uint len)
+{
+  struct bgp_proto *p = conn->bgp;
+  struct bgp_stats *s = p->stats;
+  btime filter_time = p->p.imp_filter_time;
+  btime table_time = p->p.imp_table_time;
+  btime t0 = precise_time();
+
+  bgp_rx_update(conn, pkt, len);
+
+  btime total = precise_time() - t0;
+  filter_time = p->p.imp_filter_time - filter_time;
+  table_time = p->p.imp_table_time - table_time;
+
+  bgp_hist_add(&s->rx_parse, MAX(total - filter_time - table_time, 0));
+  bgp_hist_add(&s->rx_filter, filter_time);
+  bgp_hist_add(&s->rx_table, table_time);
+}
+
 /**
  * bgp_rx_packet - handle a received packet
  * @conn: BGP connection
@@ -1686,8 +1840,8 @@ bgp_rx_route_refresh(struct bgp_conn *conn, byte *pkt, uint len)
  * bgp_rx_packet() takes a newly received packet and calls the corresponding
  * packet handler according to the packet type.
  */
-static void
-bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
+void
+bgp_rx_packet(struct bgp_conn *conn, byte *pkt, uint len)
 {
   byte type = pkt[18];
 
@@ -1699,7 +1853,9 @@ bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
   switch (type)
     {
     case PKT_OPEN:		return bgp_rx_open(conn, pkt, len);
-    case PKT_UPDATE:		return bgp_rx_update(conn, pkt, len);
+    case PKT_UPDATE:		return conn->bgp->stats ?
+				  bgp_rx_update_stats(conn, pkt, len) :
+				  bgp_rx_update(conn, pkt, len);
     case PKT_NOTIFICATION:      return bgp_rx_notification(conn, pkt, len);
     case PKT_KEEPALIVE:		return bgp_rx_keepalive(conn);
     case PKT_ROUTE_REFRESH:	return bgp_rx_route_refresh(conn, pkt, len);
@@ -0,0 +1,407 @@
+/*
+ *	BIRD -- BGP Replay of MRT Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Replay of MRT dumps
+ *
+ * A BGP instance with the replay option does not open any TCP connection.
+ * Instead, its session is established locally right after the protocol
+ * start, as if the neighbor has accepted all capabilities we offer.
+ *
+ * A replay source reads BGP messages recorded in an MRT dump (BGP4MP
+ * MESSAGE records, as written by the mrtdump option) and passes UPDATE
+ * messages received from the configured neighbor address to bgp_rx_packet().
+ * Other records, messages of other peers and messages sent by the local
+ * side are skipped. The dump is processed from an event in bounded steps,
+ * so other protocols (and the CLI) keep running during the replay.
+ *
+ * A replay sink has no input. Packets generated for both sources and sinks
+ * are built as usual by bgp_fire_tx(), but then just counted and discarded.
+ *
+ * When the whole dump is processed, the source logs a summary with the
+ * import rate, peak memory usage and time spent reading the dump, in
+ * bgp_rx_packet() (decoding, import filters, route table update and
+ * synchronous notification of other protocols) and in building UPDATE
+ * messages for all replay instances. That allows to benchmark route
+ * processing with recorded traffic and without any live sessions.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "nest/bird.h"
+#include "nest/iface.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/mrtdump.h"
+#include "nest/cli.h"
+#include "conf/conf.h"
+#include "lib/event.h"
+#include "lib/resource.h"
+#include "lib/socket.h"
+#include "lib/timer.h"
+#include "lib/unaligned.h"
+
+#include "bgp.h"
+
+#define BGP4MP_ET			17	/* BGP4MP with microsecond timestamp */
+#define BGP4MP_MESSAGE_LOCAL		6
+#define BGP4MP_MESSAGE_AS4_LOCAL	7
+
+#define BGP_REPLAY_STEP			64	/* Messages processed in one event run */
+#define BGP_REPLAY_BUFFER_SIZE		(BGP_MAX_EXT_MSG_LENGTH + 64)
+
+struct bgp_replay {
+  resource r;
+  struct bgp_proto *bgp;
+  FILE *file;				/* Replayed MRT dump, NULL for replay sink */
+  event *event;				/* Event processing next step of the dump */
+  byte *buf;				/* Buffer for one MRT record */
+  byte *msg;				/* BGP message in buf */
+  u8 eof;				/* Whole dump processed, summary pending */
+  u8 done;				/* Summary logged */
+  u32 rx_msgs;				/* UPDATE messages replayed */
+  u32 skipped;				/* MRT records skipped */
+  u32 base_routes;			/* Imported routes counter at start */
+  btime start_time, end_time;
+  btime read_time;			/* Time spent reading the dump */
+  btime rx_time;			/* Time spent in bgp_rx_packet() */
+  u32 tx_msgs;				/* Discarded outgoing packets */
+  u64 tx_bytes;
+  btime tx_time;			/* Time spent building outgoing packets */
+};
+
+static void
+bgp_replay_free(resource *r)
+{
+  struct bgp_replay *rp = (struct bgp_replay *) r;
+
+  if (rp->file)
+    fclose(rp->file);
+}
+
+static void
+bgp_replay_dump(resource *r)
+{
+  struct bgp_replay *rp = (struct bgp_replay *) r;
+
+  debug("(%s, %u messages, %u sent)\n", rp->file ? "source" : "sink",
+	rp->rx_msgs, rp->tx_msgs);
+}
+
+static struct resclass bgp_replay_class = {
+  "BGP replay",
+  sizeof(struct bgp_replay),
+  bgp_replay_free,
+  bgp_replay_dump,
+  NULL,
+  NULL
+};
+
+static inline u32
+bgp_replay_routes(struct bgp_proto *p)
+{
+  return p->p.stats.imp_updates_received + p->p.stats.imp_withdraws_received;
+}
+
+/*
+ * Read MRT records until one with a BGP UPDATE message received from our
+ * neighbor is found. Returns length of the message (stored in r->msg), 0 at
+ * the end of the dump or -1 for a malformed dump.
+ */
+static int
+bgp_replay_read(struct bgp_replay *r)
+{
+  struct bgp_proto *p = r->bgp;
+  byte hdr[MRTDUMP_HDR_LENGTH];
+  size_t n;
+
+  while (1)
+    {
+      n = fread(hdr, 1, MRTDUMP_HDR_LENGTH, r->file);
+      if (!n)
+	return ferror(r->file) ? -1 : 0;
+      if (n < MRTDUMP_HDR_LENGTH)
+	return -1;
+
+      uint type = get_u16(hdr+4);
+      uint subtype = get_u16(hdr+6);
+      uint len = get_u32(hdr+8);
+
+      if (len > BGP_REPLAY_BUFFER_SIZE)
+	return -1;
+      if (fread(r->buf, 1, len, r->file) != len)
+	return -1;
+
+      byte *pos = r->buf;
+      byte *end = r->buf + len;
+
+      if (type == BGP4MP_ET)
+	pos += 4;
+      else if (type != BGP4MP)
+	goto skip;
+
+      if ((subtype != BGP4MP_MESSAGE) && (subtype != BGP4MP_MESSAGE_AS4))
+	goto skip;
+
+      /* Peer AS, local AS, interface index, address family, peer IP, local IP */
+      int as4 = (subtype == BGP4MP_MESSAGE_AS4);
+      pos += as4 ? 8 : 4;
+      if ((pos + 4 > end) || (get_u16(pos+2) != BGP_AF))
+	goto skip;
+      pos += 4;
+
+      if (pos + 2 * sizeof(ip_addr) + BGP_HEADER_LENGTH > end)
+	return -1;
+      if (!ipa_equal(get_ipa(pos), p->cf->remote_ip))
+	goto skip;
+      pos += 2 * sizeof(ip_addr);
+
+      if ((get_u16(pos+16) != (uint) (end - pos)) || (pos[18] != PKT_UPDATE))
+	goto skip;
+
+      /* We write AS4 variant for messages exactly when AS4 session is used */
+      p->as4_session = as4 && p->cf->enable_as4;
+      r->msg = pos;
+      return end - pos;
+
+    skip:
+      r->skipped++;
+    }
+}
+
+static void
+bgp_replay_summary(struct bgp_replay *r)
+{
+  struct bgp_proto *p = r->bgp;
+  struct rusage ru;
+  struct proto *P;
+  u32 tx_msgs = 0, sinks = 0;
+  u64 tx_bytes = 0;
+  btime tx_time = 0;
+
+  /* Packets for all replay instances are accounted, as they are built for routes we import */
+  WALK_LIST(P, active_proto_list)
+    if (P->proto == &proto_bgp)
+      {
+	struct bgp_replay *q = ((struct bgp_proto *) P)->replay;
+	if (!q)
+	  continue;
+
+	tx_msgs += q->tx_msgs;
+	tx_bytes += q->tx_bytes;
+	tx_time += q->tx_time;
+	sinks++;
+      }
+
+  btime total = MAX(r->end_time - r->start_time, 1);
+  u32 routes = bgp_replay_routes(p) - r->base_routes;
+  u64 rate = (u64) routes * (1 S) / total;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  log(L_INFO "%s: Replay done: %u messages, %u routes in %u ms (%u routes/s), peak RSS %u kB",
+      p->p.name, r->rx_msgs, routes, (uint) (total TO_MS), (uint) rate, (uint) ru.ru_maxrss);
+  log(L_INFO "%s: Replay stages: read %u ms, receive %u ms, transmit %u ms (%u packets, %u kB by %u instances)",
+      p->p.name, (uint) (r->read_time TO_MS), (uint) (r->rx_time TO_MS), (uint) (tx_time TO_MS),
+      tx_msgs, (uint) (tx_bytes >> 10), sinks);
+
+  r->done = 1;
+}
+
+static void
+bgp_replay_step(void *data)
+{
+  struct bgp_replay *r = data;
+  struct bgp_proto *p = r->bgp;
+  struct bgp_conn *conn = p->conn;
+  btime t0, t1;
+  int i, len;
+
+  /* Session closed due to an error in replayed messages */
+  if (!conn || (conn->state != BS_ESTABLISHED))
+    return;
+
+  /* Outgoing packets of the last step were built before this event run */
+  if (r->eof)
+    {
+      bgp_replay_summary(r);
+      return;
+    }
+
+  for (i = 0; i < BGP_REPLAY_STEP; i++)
+    {
+      t0 = precise_time();
+      len = bgp_replay_read(r);
+      t1 = precise_time();
+      r->read_time += t1 - t0;
+
+      if (len <= 0)
+	{
+	  if (len < 0)
+	    log(L_ERR "%s: Malformed MRT dump %s", p->p.name, p->cf->replay_file);
+
+	  BGP_TRACE(D_EVENTS, "Replay finished, %u records skipped", r->skipped);
+	  r->end_time = t1;
+	  r->eof = 1;
+	  ev_schedule(r->event);
+	  return;
+	}
+
+      bgp_rx_packet(conn, r->msg, len);
+      r->rx_time += precise_time() - t1;
+      r->rx_msgs++;
+
+      if (conn->state != BS_ESTABLISHED)
+	return;
+    }
+
+  ev_schedule(r->event);
+}
+
+static void
+bgp_replay_kick_tx(void *vconn)
+{
+  struct bgp_conn *conn = vconn;
+  struct bgp_replay *r = conn->bgp->replay;
+  btime t0 = precise_time();
+
+  bgp_kick_tx(conn);
+  r->tx_time += precise_time() - t0;
+}
+
+/**
+ * bgp_replay_sent - account a packet sent to replay session
+ * @conn: connection
+ * @len: packet length
+ *
+ * Called from bgp_fire_tx() instead of sk_send() for replay sessions.
+ * Returns 1, as the packet is always 'sent' immediately.
+ */
+int
+bgp_replay_sent(struct bgp_conn *conn, uint len)
+{
+  struct bgp_replay *r = conn->bgp->replay;
+
+  r->tx_msgs++;
+  r->tx_bytes += len;
+  return 1;
+}
+
+/**
+ * bgp_replay_start - start a replay session
+ * @p: BGP instance
+ *
+ * This function is called instead of initiating a TCP connection for BGP
+ * instances in replay mode. It opens the MRT dump (if any), sets up the
+ * outgoing connection without a real socket and enters the established state
+ * with session parameters based on the local configuration.
+ */
+void
+bgp_replay_start(struct bgp_proto *p)
+{
+  struct bgp_conn *conn = &p->outgoing_conn;
+  struct bgp_replay *r;
+  sock *s;
+
+  r = ralloc(p->p.pool, &bgp_replay_class);
+  r->bgp = p;
+  p->replay = r;
+
+  if (p->cf->replay_file)
+    {
+      r->file = fopen(p->cf->replay_file, "r");
+      if (!r->file)
+	{
+	  log(L_ERR "%s: Cannot open replay file %s: %m", p->p.name, p->cf->replay_file);
+	  p->p.disabled = 1;
+	  bgp_store_error(p, NULL, BE_MISC, BEM_REPLAY_FILE);
+	  bgp_stop(p, 0, NULL, 0);
+	  return;
+	}
+
+      r->buf = mb_alloc(p->p.pool, BGP_REPLAY_BUFFER_SIZE);
+      r->event = ev_new(p->p.pool);
+      r->event->hook = bgp_replay_step;
+      r->event->data = r;
+    }
+
+  BGP_TRACE(D_EVENTS, "Starting replay %s%s", r->file ? "of " : "sink",
+	    r->file ? p->cf->replay_file : "");
+
+  /* Socket is never opened, it just provides buffer and addresses */
+  s = sk_new(p->p.pool);
+  s->saddr = p->source_addr;
+  s->daddr = p->cf->remote_ip;
+  s->dport = p->cf->remote_port;
+  s->tbsize = BGP_TX_BUFFER_EXT_SIZE;
+  s->tbuf = s->tpos = s->ttx = mb_alloc(p->p.pool, s->tbsize);
+
+  bgp_setup_conn(p, conn);
+  bgp_setup_sk(conn, s);
+  conn->tx_ev->hook = bgp_replay_kick_tx;
+  conn->start_state = p->start_state;
+
+  /* Neighbor supports what we do, but no route refresh as it has nothing to resend */
+  conn->advertised_as = p->remote_as;
+  conn->peer_refresh_support = 0;
+  conn->peer_enhanced_refresh_support = 0;
+  conn->peer_as4_support = p->cf->enable_as4;
+  conn->peer_add_path = ADD_PATH_FULL;
+  conn->peer_gr_aware = 0;
+  conn->peer_gr_able = 0;
+  conn->peer_llgr_aware = 0;
+  conn->peer_llgr_able = 0;
+  conn->peer_ext_messages_support = p->cf->enable_extended_messages;
+
+  /* No keepalives or hold timer */
+  conn->hold_time = 0;
+  conn->keepalive_time = 0;
+
+  p->remote_id = ipa_to_u32(p->cf->remote_ip);
+  p->as4_session = p->cf->enable_as4;
+  p->add_path_rx = !!(p->cf->add_path & ADD_PATH_RX);
+  p->add_path_tx = !!(p->cf->add_path & ADD_PATH_TX);
+  p->gr_ready = 0;
+  p->llgr_ready = 0;
+  p->ext_messages = p->cf->enable_extended_messages;
+
+  if (p->add_path_tx)
+    p->p.accept_ra_types = RA_ANY;
+  else if (p->cf->secondary)
+    p->p.accept_ra_types = RA_ACCEPTED;
+  else
+    p->p.accept_ra_types = RA_OPTIMAL;
+
+  bgp_conn_enter_established_state(conn);
+
+  if (r->file)
+    {
+      r->base_routes = bgp_replay_routes(p);
+      r->start_time = precise_time();
+      ev_schedule(r->event);
+    }
+}
+
+/**
+ * bgp_replay_show - show replay status
+ * @p: BGP instance
+ *
+ * Adds replay progress to the output of show protocols all command.
+ */
+void
+bgp_replay_show(struct bgp_proto *p)
+{
+  struct bgp_replay *r = p->replay;
+
+  if (r->file)
+    cli_msg(-1006, "    Replay:           %u messages received%s, %u packets sent",
+	    r->rx_msgs, r->done ? " (done)" : "", r->tx_msgs);
+  else
+    cli_msg(-1006, "    Replay sink:      %u packets sent", r->tx_msgs);
+}
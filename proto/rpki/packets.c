@@ -0,0 +1,533 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "rpki.h"
+#include "lib/string.h"
+#include "lib/unaligned.h"
+
+static const char *rpki_err_names[] = {
+  [RPKI_ERR_CORRUPT_DATA] = "Corrupt data",
+  [RPKI_ERR_INTERNAL] = "Internal error",
+  [RPKI_ERR_NO_DATA_AVAIL] = "No data available",
+  [RPKI_ERR_INVALID_REQUEST] = "Invalid request",
+  [RPKI_ERR_UNSUP_PROTO_VER] = "Unsupported protocol version",
+  [RPKI_ERR_UNSUP_PDU_TYPE] = "Unsupported PDU type",
+  [RPKI_ERR_UNKNOWN_WITHDRAW] = "Withdrawal of unknown record",
+  [RPKI_ERR_DUPLICATE_ANNOUNCE] = "Duplicate announcement",
+  [RPKI_ERR_UNEXPECTED_PROTO_VER] = "Unexpected protocol version"
+};
+
+static inline const char *
+rpki_err_name(uint code)
+{
+  return (code < ARRAY_SIZE(rpki_err_names)) ? rpki_err_names[code] : "Unknown error";
+}
+
+static inline byte *
+rpki_put_header(byte *buf, uint version, uint type, uint session, uint len)
+{
+  buf[0] = version;
+  buf[1] = type;
+  put_u16(buf + 2, session);
+  put_u32(buf + 4, len);
+  return buf + RPKI_HEADER_LENGTH;
+}
+
+
+/*
+ *	Sending
+ */
+
+/**
+ * rpki_send_query - ask the cache for data
+ * @p: RPKI instance
+ *
+ * Send Serial Query if we have a valid session, Reset Query otherwise.
+ * If the TX buffer is busy, the query is postponed until it is flushed.
+ */
+void
+rpki_send_query(struct rpki_proto *p)
+{
+  sock *sk = p->sk;
+  byte *buf;
+
+  if (!sk)
+    return;
+
+  if (!sk_send_buffer_empty(sk))
+  {
+    p->query_pending = 1;
+    return;
+  }
+
+  p->query_pending = 0;
+  buf = sk->tbuf;
+
+  if (p->session_valid)
+  {
+    RPKI_TRACE(D_PACKETS, "Sending Serial Query (session %u, serial %u)", p->session_id, p->serial);
+    buf = rpki_put_header(buf, p->version, RPKI_PDU_SERIAL_QUERY, p->session_id, 12);
+    put_u32(buf, p->serial);
+    sk_send(sk, 12);
+  }
+  else
+  {
+    RPKI_TRACE(D_PACKETS, "Sending Reset Query");
+    rpki_put_header(buf, p->version, RPKI_PDU_RESET_QUERY, 0, RPKI_HEADER_LENGTH);
+    sk_send(sk, RPKI_HEADER_LENGTH);
+  }
+}
+
+/**
+ * rpki_send_error - send Error Report PDU
+ * @p: RPKI instance
+ * @code: error code (RPKI_ERR_*)
+ * @pdu: erroneous PDU or %NULL
+ * @pdu_len: length of @pdu
+ * @msg: error text
+ *
+ * The error is also logged. The caller is expected to close the connection
+ * afterwards, so the report is sent on a best effort basis.
+ */
+void
+rpki_send_error(struct rpki_proto *p, uint code, byte *pdu, uint pdu_len, const char *msg)
+{
+  sock *sk = p->sk;
+  uint msg_len = strlen(msg);
+  uint len;
+  byte *buf;
+
+  log(L_ERR "%s: Error: %s", p->p.name, msg);
+
+  if (!sk || !sk_send_buffer_empty(sk))
+    return;
+
+  /* Truncate parts that would not fit */
+  pdu_len = MIN(pdu_len, RPKI_TX_BUFFER_SIZE / 2);
+  msg_len = MIN(msg_len, RPKI_TX_BUFFER_SIZE / 4);
+  len = RPKI_HEADER_LENGTH + 4 + pdu_len + 4 + msg_len;
+
+  buf = rpki_put_header(sk->tbuf, p->version, RPKI_PDU_ERROR_REPORT, code, len);
+  put_u32(buf, pdu_len);
+  memcpy(buf + 4, pdu, pdu_len);
+  buf += 4 + pdu_len;
+  put_u32(buf, msg_len);
+  memcpy(buf + 4, msg, msg_len);
+
+  RPKI_TRACE(D_PACKETS, "Sending Error Report (%s)", rpki_err_name(code));
+  sk_send(sk, len);
+}
+
+static void
+rpki_tx(sock *sk)
+{
+  struct rpki_proto *p = sk->data;
+
+  if (p->query_pending)
+    rpki_send_query(p);
+}
+
+/**
+ * rpki_connected - TCP connection to the cache established
+ * @sk: socket
+ *
+ * Start the initial transfer. Full transfer is requested unless we still
+ * have valid data from a previous connection.
+ */
+void
+rpki_connected(sock *sk)
+{
+  struct rpki_proto *p = sk->data;
+
+  RPKI_TRACE(D_EVENTS, "Connected");
+  sk->tx_hook = rpki_tx;
+
+  rpki_set_state(p, p->session_valid ? RPKI_CS_SYNC : RPKI_CS_RESET);
+  rpki_send_query(p);
+
+  /* Response timeout */
+  if (p->sk == sk)
+    tm_start(p->retry_timer, p->retry_time);
+}
+
+
+/*
+ *	Receiving
+ */
+
+static void
+rpki_rx_serial_notify(struct rpki_proto *p, byte *pkt)
+{
+  uint session = get_u16(pkt + 2);
+  u32 serial = get_u32(pkt + 8);
+
+  RPKI_TRACE(D_PACKETS, "Got Serial Notify (session %u, serial %u)", session, serial);
+
+  /* Ignore notifications during transfer, refresh will catch up later */
+  if (p->state != RPKI_CS_ESTABLISHED)
+    return;
+
+  if (p->session_valid && (session == p->session_id) && (serial == p->serial))
+    return;
+
+  /* The cache restarted with a new session, our serial is meaningless there */
+  if (p->session_valid && (session != p->session_id))
+  {
+    RPKI_TRACE(D_EVENTS, "Session ID changed, resetting");
+    p->session_valid = 0;
+  }
+
+  rpki_set_state(p, p->session_valid ? RPKI_CS_SYNC : RPKI_CS_RESET);
+  tm_stop(p->refresh_timer);
+  rpki_send_query(p);
+
+  if (p->sk)
+    tm_start(p->retry_timer, p->retry_time);
+}
+
+static int
+rpki_rx_cache_response(struct rpki_proto *p, byte *pkt)
+{
+  uint session = get_u16(pkt + 2);
+
+  RPKI_TRACE(D_PACKETS, "Got Cache Response (session %u)", session);
+
+  if (((p->state != RPKI_CS_RESET) && (p->state != RPKI_CS_SYNC)) || p->transfer)
+    return 0;
+
+  if (p->state == RPKI_CS_SYNC)
+  {
+    if (session != p->session_id)
+      return 0;
+  }
+  else
+  {
+    /* Start a new generation for full transfer */
+    p->session_id = session;
+    p->gen++;
+  }
+
+  p->transfer = 1;
+  return 1;
+}
+
+static int
+rpki_rx_prefix(struct rpki_proto *p, byte *pkt, uint type)
+{
+  uint flags = pkt[8];
+  uint pxlen = pkt[9];
+  uint maxlen = pkt[10];
+  int announce = flags & 1;
+  uint max_pxlen;
+  ip_addr prefix;
+  u32 asn;
+
+  if (!p->transfer)
+  {
+    rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, get_u32(pkt + 4), "Prefix PDU outside of transfer");
+    return 0;
+  }
+
+  if (type == RPKI_PDU_IPV4_PREFIX)
+  {
+    max_pxlen = 32;
+    asn = get_u32(pkt + 16);
+  }
+  else
+  {
+    max_pxlen = 128;
+    asn = get_u32(pkt + 28);
+  }
+
+  if ((pxlen > maxlen) || (maxlen > max_pxlen))
+  {
+    rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, get_u32(pkt + 4), "Invalid prefix length");
+    return 0;
+  }
+
+#ifdef IPV6
+  if (type != RPKI_PDU_IPV6_PREFIX)
+#else
+  if (type != RPKI_PDU_IPV4_PREFIX)
+#endif
+  {
+    /* Records for the other address family are not relevant to us */
+    p->stats_ignored++;
+    return 1;
+  }
+
+  prefix = get_ipa(pkt + 12);
+  prefix = ipa_and(prefix, ipa_mkmask(pxlen));
+
+  RPKI_TRACE(D_ROUTES, "%s %I/%u max %u as %u", announce ? "Announce" : "Withdraw",
+	     prefix, pxlen, maxlen, asn);
+
+  if (!rpki_vrp_update(p, announce, prefix, pxlen, maxlen, asn))
+  {
+    if (announce)
+      rpki_send_error(p, RPKI_ERR_DUPLICATE_ANNOUNCE, pkt, get_u32(pkt + 4), "Duplicate announcement");
+    else
+      rpki_send_error(p, RPKI_ERR_UNKNOWN_WITHDRAW, pkt, get_u32(pkt + 4), "Withdrawal of unknown record");
+    return 0;
+  }
+
+  return 1;
+}
+
+static inline int
+rpki_check_interval(u32 val, u32 min, u32 max)
+{
+  return (val >= min) && (val <= max);
+}
+
+static int
+rpki_rx_end_of_data(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint session = get_u16(pkt + 2);
+  u32 serial = get_u32(pkt + 8);
+  int reset = (p->state == RPKI_CS_RESET);
+
+  RPKI_TRACE(D_PACKETS, "Got End of Data (session %u, serial %u)", session, serial);
+
+  if (!p->transfer || (session != p->session_id))
+    return 0;
+
+  /* Version 1 contains intervals suggested by the cache */
+  if (len == 24)
+  {
+    u32 refresh = get_u32(pkt + 12);
+    u32 retry = get_u32(pkt + 16);
+    u32 expire = get_u32(pkt + 20);
+
+    if (!p->cf->keep_refresh && rpki_check_interval(refresh, RPKI_MIN_REFRESH, RPKI_MAX_REFRESH))
+      p->refresh_time = refresh;
+
+    if (!p->cf->keep_retry && rpki_check_interval(retry, RPKI_MIN_RETRY, RPKI_MAX_RETRY))
+      p->retry_time = retry;
+
+    if (!p->cf->keep_expire && rpki_check_interval(expire, RPKI_MIN_EXPIRE, RPKI_MAX_EXPIRE))
+      p->expire_time = expire;
+  }
+
+  p->serial = serial;
+  p->session_valid = 1;
+  p->transfer = 0;
+
+  rpki_transfer_done(p, reset);
+  rpki_cache_established(p);
+
+  RPKI_TRACE(D_EVENTS, "%s transfer done, %u records",
+	     reset ? "Full" : "Incremental", p->vrp_hash.count);
+
+  return 1;
+}
+
+static void
+rpki_rx_error_report(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint code = get_u16(pkt + 2);
+  uint pdu_len, msg_len;
+  byte *pos, *end = pkt + len;
+  char msg[256] = "";
+
+  /* Error Report PDUs are never answered by another Error Report */
+  pos = pkt + RPKI_HEADER_LENGTH;
+  pdu_len = get_u32(pos);
+  pos += 4;
+
+  if (pdu_len <= (uint) (end - pos - 4))
+  {
+    pos += pdu_len;
+    msg_len = get_u32(pos);
+    pos += 4;
+
+    if (msg_len <= (uint) (end - pos))
+      bsnprintf(msg, sizeof(msg), ": %.*s", MIN(msg_len, sizeof(msg) - 3), pos);
+  }
+
+  log(L_ERR "%s: Received error %u (%s)%s", p->p.name, code, rpki_err_name(code), msg);
+  p->last_error = code;
+
+  /* Version downgraded in rpki_rx_pdu(), reconnect immediately */
+  if ((code == RPKI_ERR_UNSUP_PROTO_VER) && !p->version_fixed && (p->version < RPKI_MAX_VERSION))
+  {
+    rpki_cache_error(p, 0);
+    tm_start(p->retry_timer, 0);
+    return;
+  }
+
+  rpki_cache_error(p, code != RPKI_ERR_NO_DATA_AVAIL);
+}
+
+static uint
+rpki_pdu_min_length(uint version, uint type)
+{
+  switch (type)
+  {
+  case RPKI_PDU_SERIAL_NOTIFY:	return 12;
+  case RPKI_PDU_CACHE_RESPONSE:	return 8;
+  case RPKI_PDU_IPV4_PREFIX:	return 20;
+  case RPKI_PDU_IPV6_PREFIX:	return 32;
+  case RPKI_PDU_END_OF_DATA:	return version ? 24 : 12;
+  case RPKI_PDU_CACHE_RESET:	return 8;
+  case RPKI_PDU_ROUTER_KEY:	return 8;
+  case RPKI_PDU_ERROR_REPORT:	return 16;
+  default:			return 0;
+  }
+}
+
+static void
+rpki_rx_pdu(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint version = pkt[0];
+  uint type = pkt[1];
+  uint min_len;
+
+  if (version != p->version)
+  {
+    /*
+     * The cache may answer our first query with a lower version it supports
+     * (RFC 8210 7), after that the version must not change.
+     */
+    if (!p->version_fixed && (version < p->version))
+    {
+      RPKI_TRACE(D_EVENTS, "Downgrading to version %u", version);
+      p->version = version;
+    }
+    else if (type == RPKI_PDU_ERROR_REPORT)
+      goto fatal;
+    else
+    {
+      rpki_send_error(p, (version > RPKI_MAX_VERSION) ?
+		      RPKI_ERR_UNSUP_PROTO_VER : RPKI_ERR_UNEXPECTED_PROTO_VER,
+		      pkt, len, "Unexpected protocol version");
+      goto fatal;
+    }
+  }
+
+  min_len = rpki_pdu_min_length(version, type);
+
+  if (!min_len)
+  {
+    if (type == RPKI_PDU_ERROR_REPORT)
+      goto fatal;
+
+    rpki_send_error(p, RPKI_ERR_UNSUP_PDU_TYPE, pkt, len, "Unsupported PDU type");
+    goto fatal;
+  }
+
+  if ((len < min_len) || ((len != min_len) && (type != RPKI_PDU_ROUTER_KEY) &&
+			  (type != RPKI_PDU_ERROR_REPORT)))
+  {
+    if (type == RPKI_PDU_ERROR_REPORT)
+      goto fatal;
+
+    rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Invalid PDU length");
+    goto fatal;
+  }
+
+  if (type != RPKI_PDU_ERROR_REPORT)
+    p->version_fixed = 1;
+
+  switch (type)
+  {
+  case RPKI_PDU_SERIAL_NOTIFY:
+    rpki_rx_serial_notify(p, pkt);
+    return;
+
+  case RPKI_PDU_CACHE_RESPONSE:
+    if (!rpki_rx_cache_response(p, pkt))
+    {
+      rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Unexpected Cache Response");
+      goto fatal;
+    }
+    return;
+
+  case RPKI_PDU_IPV4_PREFIX:
+  case RPKI_PDU_IPV6_PREFIX:
+    if (!rpki_rx_prefix(p, pkt, type))
+      goto fatal;
+    return;
+
+  case RPKI_PDU_END_OF_DATA:
+    if (!rpki_rx_end_of_data(p, pkt, len))
+    {
+      rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Unexpected End of Data");
+      goto fatal;
+    }
+    return;
+
+  case RPKI_PDU_CACHE_RESET:
+    RPKI_TRACE(D_PACKETS, "Got Cache Reset");
+    if (p->transfer)
+    {
+      rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, len, "Unexpected Cache Reset");
+      goto fatal;
+    }
+    rpki_cache_reset(p);
+    return;
+
+  case RPKI_PDU_ROUTER_KEY:
+    /* BGPsec router keys are not used */
+    p->stats_ignored++;
+    return;
+
+  case RPKI_PDU_ERROR_REPORT:
+    rpki_rx_error_report(p, pkt, len);
+    return;
+  }
+
+fatal:
+  rpki_cache_error(p, 1);
+}
+
+/**
+ * rpki_rx - RPKI socket receive hook
+ * @sk: socket
+ * @size: amount of data in the receive buffer
+ *
+ * Process all complete PDUs in the buffer and keep the rest for the
+ * next call.
+ */
+int
+rpki_rx(sock *sk, uint size)
+{
+  struct rpki_proto *p = sk->data;
+  byte *pkt = sk->rbuf;
+  byte *end = pkt + size;
+  uint len;
+
+  while (end >= pkt + RPKI_HEADER_LENGTH)
+  {
+    len = get_u32(pkt + 4);
+    if ((len < RPKI_HEADER_LENGTH) || (len > RPKI_RX_BUFFER_SIZE))
+    {
+      rpki_send_error(p, RPKI_ERR_CORRUPT_DATA, pkt, RPKI_HEADER_LENGTH, "Invalid PDU length");
+      rpki_cache_error(p, 1);
+      return 0;
+    }
+
+    if (end < pkt + len)
+      break;
+
+    rpki_rx_pdu(p, pkt, len);
+    pkt += len;
+
+    /* Socket may be closed during processing */
+    if (p->sk != sk)
+      return 0;
+  }
+
+  if (pkt != sk->rbuf)
+  {
+    memmove(sk->rbuf, pkt, end - pkt);
+    sk->rpos = sk->rbuf + (end - pkt);
+  }
+
+  return 0;
+}
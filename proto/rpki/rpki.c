@@ -0,0 +1,528 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: RPKI to Router Protocol
+ *
+ * The RPKI-to-Router protocol (RFC 6810, RFC 8210) is used to download
+ * validated ROA payloads (VRPs) from a trusted local cache and to keep
+ * them synchronized. The protocol instance connects to one cache over
+ * plain TCP and feeds one ROA table. The first transfer after connect
+ * is a full one (Reset Query), later the client just asks for changes
+ * since the last known serial number (Serial Query), either periodically
+ * when the refresh timer fires, or immediately after the cache sends
+ * Serial Notify. The changes are applied directly to the ROA table with
+ * roa_add_item() and roa_delete_item(), so an update of a few VRPs costs
+ * just a few table operations regardless of the table size.
+ *
+ * Received VRPs are also kept in a local hash table (@vrp_hash) to detect
+ * duplicate announcements and withdrawals of unknown records, and to be
+ * able to compute the difference after a full transfer. Each full
+ * transfer gets a new generation number; VRPs not refreshed by it are
+ * removed at End of Data. Therefore the ROA table never becomes
+ * temporarily empty when the cache resets the session.
+ *
+ * When the connection fails, the data are kept and the client tries to
+ * reconnect after the retry interval, continuing with the old session
+ * if possible. If no successful update happens during the expire
+ * interval, all data from the cache are removed from the ROA table.
+ *
+ * All entries are added to the ROA table with source %ROA_SRC_RPKI,
+ * therefore a ROA table may be fed by at most one RPKI protocol.
+ *
+ * A minimal cache serving VRPs from a text file is in tools/rtr-cache. It
+ * can be used to test the protocol locally, including incremental updates,
+ * Serial Notify and a cache restart with a new session ID.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "rpki.h"
+
+#define VRP_KEY(n)		n->prefix, n->pxlen, n->maxlen, n->asn
+#define VRP_NEXT(n)		n->next
+#define VRP_EQ(p1,l1,m1,a1,p2,l2,m2,a2) \
+  ipa_equal(p1, p2) && l1 == l2 && m1 == m2 && a1 == a2
+#define VRP_FN(p,l,m,a)		ipa_hash32(p) ^ u32_hash((l << 24) ^ (m << 16) ^ a)
+
+#define VRP_REHASH		rpki_vrp_rehash
+#define VRP_PARAMS		/8, *2, 2, 2, 8, 24
+
+HASH_DEFINE_REHASH_FN(VRP, struct rpki_vrp)
+
+static const char *rpki_state_names[] = {
+  [RPKI_CS_IDLE] = "Idle",
+  [RPKI_CS_CONNECT] = "Connect",
+  [RPKI_CS_ESTABLISHED] = "Established",
+  [RPKI_CS_RESET] = "Reset",
+  [RPKI_CS_SYNC] = "Sync"
+};
+
+static void rpki_connect(struct rpki_proto *p);
+
+static inline struct roa_table *
+rpki_table(struct rpki_proto *p)
+{
+  return p->cf->roa->table;
+}
+
+
+/*
+ *	VRP handling
+ */
+
+/**
+ * rpki_vrp_update - apply one VRP from the cache
+ * @p: RPKI instance
+ * @announce: whether the record is announced or withdrawn
+ * @prefix: VRP prefix
+ * @pxlen: VRP prefix length
+ * @maxlen: VRP maximal prefix length
+ * @asn: VRP origin AS
+ *
+ * Update local VRP hash and ROA table according to the received prefix
+ * PDU. Returns 1 on success, 0 if the update is a duplicate announcement
+ * or withdraws an unknown record.
+ */
+int
+rpki_vrp_update(struct rpki_proto *p, int announce, ip_addr prefix, byte pxlen, byte maxlen, u32 asn)
+{
+  struct roa_table *t = rpki_table(p);
+  struct rpki_vrp *v = HASH_FIND(p->vrp_hash, VRP, prefix, pxlen, maxlen, asn);
+
+  if (announce)
+  {
+    if (v)
+    {
+      /* Records from previous generation are refreshed by full transfer */
+      if ((p->state != RPKI_CS_RESET) || (v->gen == p->gen))
+	return 0;
+
+      v->gen = p->gen;
+      return 1;
+    }
+
+    v = sl_alloc(p->vrp_slab);
+    v->prefix = prefix;
+    v->pxlen = pxlen;
+    v->maxlen = maxlen;
+    v->asn = asn;
+    v->gen = p->gen;
+    HASH_INSERT2(p->vrp_hash, VRP, p->p.pool, v);
+
+    if (t)
+      roa_add_item(t, prefix, pxlen, maxlen, asn, ROA_SRC_RPKI);
+
+    p->stats_announces++;
+  }
+  else
+  {
+    if (!v)
+      return 0;
+
+    HASH_REMOVE2(p->vrp_hash, VRP, p->p.pool, v);
+    sl_free(p->vrp_slab, v);
+
+    if (t)
+      roa_delete_item(t, prefix, pxlen, maxlen, asn, ROA_SRC_RPKI);
+
+    p->stats_withdraws++;
+  }
+
+  return 1;
+}
+
+/**
+ * rpki_transfer_done - finish a data transfer
+ * @p: RPKI instance
+ * @reset: whether it was a full transfer
+ *
+ * After a full transfer, remove all VRPs that were not announced in it.
+ */
+void
+rpki_transfer_done(struct rpki_proto *p, int reset)
+{
+  struct roa_table *t = rpki_table(p);
+  uint removed = 0;
+
+  if (!reset)
+    return;
+
+  HASH_WALK_DELSAFE(p->vrp_hash, next, v)
+  {
+    if (v->gen == p->gen)
+      continue;
+
+    if (t)
+      roa_delete_item(t, v->prefix, v->pxlen, v->maxlen, v->asn, ROA_SRC_RPKI);
+
+    HASH_REMOVE(p->vrp_hash, VRP, v);
+    sl_free(p->vrp_slab, v);
+    removed++;
+  }
+  HASH_WALK_DELSAFE_END;
+
+  HASH_MAY_RESIZE_DOWN(p->vrp_hash, VRP, p->p.pool);
+
+  if (removed)
+    RPKI_TRACE(D_ROUTES, "Removed %u stale records", removed);
+}
+
+static void
+rpki_flush(struct rpki_proto *p)
+{
+  struct roa_table *t = rpki_table(p);
+
+  if (t)
+    roa_flush(t, ROA_SRC_RPKI);
+
+  HASH_WALK_DELSAFE(p->vrp_hash, next, v)
+  {
+    HASH_REMOVE(p->vrp_hash, VRP, v);
+    sl_free(p->vrp_slab, v);
+  }
+  HASH_WALK_DELSAFE_END;
+
+  HASH_MAY_RESIZE_DOWN(p->vrp_hash, VRP, p->p.pool);
+
+  p->session_valid = 0;
+  p->last_update = 0;
+}
+
+
+/*
+ *	Cache connection state machine
+ */
+
+static void
+rpki_close_sk(struct rpki_proto *p)
+{
+  rfree(p->sk);
+  p->sk = NULL;
+  p->transfer = 0;
+  p->query_pending = 0;
+}
+
+void
+rpki_set_state(struct rpki_proto *p, uint state)
+{
+  if (p->state == state)
+    return;
+
+  RPKI_TRACE(D_EVENTS, "Changing state from %s to %s",
+	     rpki_state_names[p->state], rpki_state_names[state]);
+  p->state = state;
+}
+
+/**
+ * rpki_cache_error - handle failure of the cache connection
+ * @p: RPKI instance
+ * @drop: whether the session state is no longer usable
+ *
+ * Close the connection and schedule a reconnect after the retry interval.
+ * Received data are kept until the expire timer fires. If @drop is set,
+ * the next connection starts with a full transfer.
+ */
+void
+rpki_cache_error(struct rpki_proto *p, int drop)
+{
+  rpki_close_sk(p);
+
+  if (drop)
+    p->session_valid = 0;
+
+  rpki_set_state(p, RPKI_CS_IDLE);
+  tm_stop(p->refresh_timer);
+  tm_start(p->retry_timer, p->retry_time);
+}
+
+/**
+ * rpki_cache_reset - request a full transfer
+ * @p: RPKI instance
+ *
+ * Called when the cache sends Cache Reset, i.e. it cannot provide
+ * incremental updates from our serial number.
+ */
+void
+rpki_cache_reset(struct rpki_proto *p)
+{
+  p->session_valid = 0;
+  rpki_set_state(p, RPKI_CS_RESET);
+  rpki_send_query(p);
+  tm_start(p->retry_timer, p->retry_time);
+}
+
+/**
+ * rpki_cache_established - successful end of a data transfer
+ * @p: RPKI instance
+ *
+ * Called after a valid End of Data PDU; schedules the next refresh and
+ * restarts the expire timer.
+ */
+void
+rpki_cache_established(struct rpki_proto *p)
+{
+  rpki_set_state(p, RPKI_CS_ESTABLISHED);
+  p->last_update = now;
+
+  tm_stop(p->retry_timer);
+  tm_start(p->refresh_timer, p->refresh_time);
+  tm_start(p->expire_timer, p->expire_time);
+}
+
+static void
+rpki_sock_err(sock *sk, int err)
+{
+  struct rpki_proto *p = sk->data;
+
+  if (err)
+    RPKI_TRACE(D_EVENTS, "Connection lost (%M)", err);
+  else
+    RPKI_TRACE(D_EVENTS, "Connection closed");
+
+  rpki_cache_error(p, 0);
+}
+
+static void
+rpki_connect(struct rpki_proto *p)
+{
+  sock *s = sk_new(p->p.pool);
+
+  s->type = SK_TCP_ACTIVE;
+  s->daddr = p->cf->remote_ip;
+  s->dport = p->cf->remote_port;
+  s->vrf = p->p.vrf;
+  s->rbsize = RPKI_RX_BUFFER_SIZE;
+  s->tbsize = RPKI_TX_BUFFER_SIZE;
+  s->tos = IP_PREC_INTERNET_CONTROL;
+  s->tx_hook = rpki_connected;
+  s->rx_hook = rpki_rx;
+  s->err_hook = rpki_sock_err;
+  s->data = p;
+
+  p->sk = s;
+  rpki_set_state(p, RPKI_CS_CONNECT);
+  RPKI_TRACE(D_EVENTS, "Connecting to %I port %u", s->daddr, s->dport);
+
+  if (sk_open(s) < 0)
+  {
+    sk_log_error(s, p->p.name);
+    rpki_cache_error(p, 0);
+    return;
+  }
+
+  /* Connect timeout */
+  tm_start(p->retry_timer, p->retry_time);
+}
+
+static void
+rpki_retry_timeout(timer *t)
+{
+  struct rpki_proto *p = t->data;
+
+  if (p->state == RPKI_CS_IDLE)
+  {
+    rpki_connect(p);
+    return;
+  }
+
+  /* Connect or transfer takes too long */
+  log(L_WARN "%s: Cache %s timeout", p->p.name,
+      (p->state == RPKI_CS_CONNECT) ? "connect" : "response");
+  rpki_cache_error(p, 0);
+}
+
+static void
+rpki_refresh_timeout(timer *t)
+{
+  struct rpki_proto *p = t->data;
+
+  if (p->state != RPKI_CS_ESTABLISHED)
+    return;
+
+  rpki_set_state(p, p->session_valid ? RPKI_CS_SYNC : RPKI_CS_RESET);
+  rpki_send_query(p);
+  tm_start(p->retry_timer, p->retry_time);
+}
+
+static void
+rpki_expire_timeout(timer *t)
+{
+  struct rpki_proto *p = t->data;
+
+  log(L_WARN "%s: Cache data expired", p->p.name);
+  rpki_flush(p);
+}
+
+
+/*
+ *	Protocol hooks
+ */
+
+static struct proto *
+rpki_init(struct proto_config *c)
+{
+  struct proto *P = proto_new(c, sizeof(struct rpki_proto));
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  p->cf = (struct rpki_config *) c;
+
+  return P;
+}
+
+static int
+rpki_start(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+  struct rpki_config *cf = (struct rpki_config *) (P->cf);
+
+  p->cf = cf;
+  p->sk = NULL;
+  p->refresh_timer = tm_new_set(P->pool, rpki_refresh_timeout, p, 0, 0);
+  p->retry_timer = tm_new_set(P->pool, rpki_retry_timeout, p, 0, 0);
+  p->expire_timer = tm_new_set(P->pool, rpki_expire_timeout, p, 0, 0);
+
+  p->vrp_slab = sl_new(P->pool, sizeof(struct rpki_vrp));
+  HASH_INIT(p->vrp_hash, P->pool, 10);
+  p->gen = 0;
+
+  p->state = RPKI_CS_IDLE;
+  p->version = RPKI_MAX_VERSION;
+  p->version_fixed = 0;
+  p->session_valid = 0;
+  p->transfer = 0;
+  p->query_pending = 0;
+  p->last_update = 0;
+  p->last_error = 0xff;
+  p->stats_announces = p->stats_withdraws = p->stats_ignored = 0;
+
+  p->refresh_time = cf->refresh_time;
+  p->retry_time = cf->retry_time;
+  p->expire_time = cf->expire_time;
+
+  rpki_connect(p);
+
+  return PS_UP;
+}
+
+static int
+rpki_shutdown(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  rpki_close_sk(p);
+  rpki_flush(p);
+
+  return PS_DOWN;
+}
+
+static int
+rpki_reconfigure(struct proto *P, struct proto_config *c)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+  struct rpki_config *new = (struct rpki_config *) c;
+  struct rpki_config *old = p->cf;
+
+  if (!ipa_equal(old->remote_ip, new->remote_ip) ||
+      (old->remote_port != new->remote_port) ||
+      strcmp(old->roa->name, new->roa->name))
+    return 0;
+
+  p->cf = new;
+
+  /* Configured intervals replace the current ones only if they changed */
+  if (old->refresh_time != new->refresh_time)
+    p->refresh_time = new->refresh_time;
+  if (old->retry_time != new->retry_time)
+    p->retry_time = new->retry_time;
+  if (old->expire_time != new->expire_time)
+    p->expire_time = new->expire_time;
+
+  return 1;
+}
+
+static void
+rpki_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy, not many items here */
+  proto_copy_rest(dest, src, sizeof(struct rpki_config));
+}
+
+void
+rpki_check_config(struct rpki_config *cf)
+{
+  struct proto_config *pc;
+
+  if (cf->c.class == SYM_TEMPLATE)
+    return;
+
+  if (ipa_zero(cf->remote_ip))
+    cf_error("Cache server address not specified");
+
+  if (!cf->roa)
+    cf_error("ROA table not specified");
+
+  if ((cf->expire_time < cf->refresh_time) || (cf->expire_time < cf->retry_time))
+    cf_error("Expire interval must be longer than refresh and retry intervals");
+
+  WALK_LIST(pc, new_config->protos)
+    if ((pc != &cf->c) && (pc->protocol == &proto_rpki) &&
+	(((struct rpki_config *) pc)->roa == cf->roa))
+      cf_error("ROA table %s is already fed by protocol %s", cf->roa->name, pc->name);
+}
+
+static void
+rpki_get_status(struct proto *P, byte *buf)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  if (P->proto_state == PS_DOWN)
+    return;
+
+  bsprintf(buf, "%s", rpki_state_names[p->state]);
+}
+
+static void
+rpki_show_proto_info(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  proto_show_basic_info(P);
+
+  cli_msg(-1006, "  Cache state:      %s", rpki_state_names[p->state]);
+  cli_msg(-1006, "    Cache address:  %I port %u", p->cf->remote_ip, p->cf->remote_port);
+  cli_msg(-1006, "    ROA table:      %s", p->cf->roa->name);
+  cli_msg(-1006, "    Version:        %u", p->version);
+
+  if (p->session_valid)
+    cli_msg(-1006, "    Session:        %u, serial %u", p->session_id, p->serial);
+
+  if (p->last_update)
+    cli_msg(-1006, "    Last update:    %d s ago", (int) (now - p->last_update));
+
+  cli_msg(-1006, "    Records:        %u", p->vrp_hash.count);
+  cli_msg(-1006, "    Received:       %u announces, %u withdraws, %u ignored",
+	  p->stats_announces, p->stats_withdraws, p->stats_ignored);
+  cli_msg(-1006, "    Timers:         refresh %u, retry %u, expire %u",
+	  p->refresh_time, p->retry_time, p->expire_time);
+
+  if (p->last_error != 0xff)
+    cli_msg(-1006, "    Last error:     %u", p->last_error);
+}
+
+
+struct protocol proto_rpki = {
+  .name =		"RPKI",
+  .template =		"rpki%d",
+  .config_size =	sizeof(struct rpki_config),
+  .init =		rpki_init,
+  .start =		rpki_start,
+  .shutdown =		rpki_shutdown,
+  .reconfigure =	rpki_reconfigure,
+  .copy_config =	rpki_copy_config,
+  .get_status =		rpki_get_status,
+  .show_proto_info =	rpki_show_proto_info
+};
@@ -0,0 +1,136 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_RPKI_H_
+#define _BIRD_RPKI_H_
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "lib/hash.h"
+#include "lib/resource.h"
+#include "lib/socket.h"
+#include "lib/timer.h"
+
+#define RPKI_PORT		323
+#define RPKI_VERSION_0		0	/* RFC 6810 */
+#define RPKI_VERSION_1		1	/* RFC 8210 */
+#define RPKI_MAX_VERSION	RPKI_VERSION_1
+
+#define RPKI_HEADER_LENGTH	8
+#define RPKI_RX_BUFFER_SIZE	65536	/* Also maximal accepted PDU length */
+#define RPKI_TX_BUFFER_SIZE	1024
+
+#define RPKI_DEFAULT_REFRESH	3600	/* Default intervals in seconds (RFC 8210 6) */
+#define RPKI_DEFAULT_RETRY	600
+#define RPKI_DEFAULT_EXPIRE	7200
+
+#define RPKI_MIN_REFRESH	1
+#define RPKI_MAX_REFRESH	86400
+#define RPKI_MIN_RETRY		1
+#define RPKI_MAX_RETRY		7200
+#define RPKI_MIN_EXPIRE		600
+#define RPKI_MAX_EXPIRE		172800
+
+/* PDU types */
+#define RPKI_PDU_SERIAL_NOTIFY	0
+#define RPKI_PDU_SERIAL_QUERY	1
+#define RPKI_PDU_RESET_QUERY	2
+#define RPKI_PDU_CACHE_RESPONSE	3
+#define RPKI_PDU_IPV4_PREFIX	4
+#define RPKI_PDU_IPV6_PREFIX	6
+#define RPKI_PDU_END_OF_DATA	7
+#define RPKI_PDU_CACHE_RESET	8
+#define RPKI_PDU_ROUTER_KEY	9
+#define RPKI_PDU_ERROR_REPORT	10
+
+/* Error codes */
+#define RPKI_ERR_CORRUPT_DATA		0
+#define RPKI_ERR_INTERNAL		1
+#define RPKI_ERR_NO_DATA_AVAIL		2
+#define RPKI_ERR_INVALID_REQUEST	3
+#define RPKI_ERR_UNSUP_PROTO_VER	4
+#define RPKI_ERR_UNSUP_PDU_TYPE		5
+#define RPKI_ERR_UNKNOWN_WITHDRAW	6
+#define RPKI_ERR_DUPLICATE_ANNOUNCE	7
+#define RPKI_ERR_UNEXPECTED_PROTO_VER	8
+
+/* Cache states */
+#define RPKI_CS_IDLE		0	/* Waiting for retry timer */
+#define RPKI_CS_CONNECT		1	/* Connecting to the cache */
+#define RPKI_CS_ESTABLISHED	2	/* Synchronized, waiting for refresh or notify */
+#define RPKI_CS_RESET		3	/* Reset Query sent, full transfer expected */
+#define RPKI_CS_SYNC		4	/* Serial Query sent, incremental transfer expected */
+
+
+struct rpki_config {
+  struct proto_config c;
+  ip_addr remote_ip;			/* Address of the cache server */
+  uint remote_port;
+  struct roa_table_config *roa;		/* ROA table to feed */
+  uint refresh_time, retry_time, expire_time;	/* Initial intervals, may be changed by the cache */
+  u8 keep_refresh, keep_retry, keep_expire;	/* Ignore intervals sent by the cache */
+};
+
+struct rpki_vrp {
+  struct rpki_vrp *next;		/* Next in vrp_hash */
+  ip_addr prefix;
+  byte pxlen;
+  byte maxlen;
+  u32 asn;
+  u32 gen;				/* Generation of last full transfer seen in */
+};
+
+struct rpki_proto {
+  struct proto p;
+  struct rpki_config *cf;
+  sock *sk;
+  timer *refresh_timer;			/* Send Serial Query */
+  timer *retry_timer;			/* Reconnect after failure */
+  timer *expire_timer;			/* Drop data received from the cache */
+
+  HASH(struct rpki_vrp) vrp_hash;	/* VRPs received from the cache */
+  slab *vrp_slab;
+  u32 gen;				/* Current full transfer generation */
+
+  u8 state;				/* RPKI_CS_* */
+  u8 version;				/* Negotiated protocol version */
+  u8 version_fixed;			/* Version was confirmed by the cache */
+  u8 session_valid;			/* We have session_id and serial */
+  u8 transfer;				/* Cache Response received, data PDUs accepted */
+  u8 query_pending;			/* Query postponed until TX buffer is free */
+  u16 session_id;
+  u32 serial;
+
+  uint refresh_time, retry_time, expire_time;
+  bird_clock_t last_update;		/* Time of last successful End of Data */
+
+  u32 stats_announces, stats_withdraws, stats_ignored;
+  u8 last_error;			/* Error code from last Error Report, 0xff if none */
+};
+
+
+#define RPKI_TRACE(flags, msg, args...) \
+  do { if (p->p.debug & flags) log(L_TRACE "%s: " msg, p->p.name , ## args ); } while(0)
+
+
+/* rpki.c */
+void rpki_check_config(struct rpki_config *cf);
+void rpki_set_state(struct rpki_proto *p, uint state);
+void rpki_cache_reset(struct rpki_proto *p);
+void rpki_cache_established(struct rpki_proto *p);
+void rpki_cache_error(struct rpki_proto *p, int drop);
+int rpki_vrp_update(struct rpki_proto *p, int announce, ip_addr prefix, byte pxlen, byte maxlen, u32 asn);
+void rpki_transfer_done(struct rpki_proto *p, int reset);
+
+/* packets.c */
+void rpki_connected(sock *sk);
+int rpki_rx(sock *sk, uint size);
+void rpki_send_query(struct rpki_proto *p);
+void rpki_send_error(struct rpki_proto *p, uint code, byte *pdu, uint pdu_len, const char *msg);
+
+#endif
@@ -115,7 +115,7 @@ static_install(struct proto *p, struct static_route *r, struct iface *ifa)
   e->pflags = 0;
 
   if (r->cmds)
-    f_eval_rte(r->cmds, &e, static_lp);
+    f_eval_rte(r->code, &e, static_lp);
 
   rte_update(p, n, e);
   r->installed = 1;
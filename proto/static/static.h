@@ -35,6 +35,7 @@ struct static_route {
   byte *if_name;			/* Name for RTD_DEVICE routes */
   struct static_route *mp_next;		/* Nexthops for RTD_MULTIPATH routes */
   struct f_inst *cmds;			/* List of commands for setting attributes */
+  struct f_code *code;			/* Compiled cmds */
   int installed;			/* Installed in rt table, -1 for reinstall */
   int use_bfd;				/* Configured to use BFD */
   struct bfd_request *bfd_req;		/* BFD request, if BFD is used */
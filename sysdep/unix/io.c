@@ -182,6 +182,27 @@ init_times(void)
    log(L_WARN "Monotonic timer is missing");
 }
 
+/**
+ * precise_time - read current time with microsecond precision
+ *
+ * Unlike @now, the value is read from the clock on each call and not
+ * cached for the iteration of the main loop, therefore it is suitable
+ * for measuring durations of processing within one event. Only
+ * differences between returned values are meaningful.
+ */
+btime
+precise_time(void)
+{
+  struct timespec ts;
+  struct timeval tv;
+
+  if (clock_monotonic_available && !clock_gettime(CLOCK_MONOTONIC, &ts))
+    return ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
+
+  gettimeofday(&tv, NULL);
+  return ((s64) tv.tv_sec S) + tv.tv_usec;
+}
+
 
 static void
 tm_free(resource *r)